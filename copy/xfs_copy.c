@@ -13,6 +13,7 @@
 #include "xfs_copy.h"
 #include "libxlog.h"
 #include "libfrog/platform.h"
+#include "libfrog/workqueue.h"
 
 #define	rounddown(x, y)	(((x)/(y))*(y))
 #define uuid_equal(s,d) (platform_uuid_compare((s),(d)) == 0)
@@ -41,11 +42,9 @@ static wbuf		btree_buf;
 
 static unsigned int	kids;
 
-static thread_control	glob_masks;
+static wbuf_ring	ring;
 static thread_args	*targ;
 
-static pthread_mutex_t	mainwait;
-
 #define ACTIVE		1
 #define INACTIVE	2
 
@@ -192,61 +191,57 @@ do_write(
 	thread_args	*args,
 	wbuf		*buf)
 {
-	int		res;
-	int		error = 0;
+	ssize_t		res;
 
 	if (!buf)
 		buf = &w_buf;
 
-	if (target[args->id].position != buf->position)  {
-		if (lseek(args->fd, buf->position, SEEK_SET) < 0)  {
-			error = target[args->id].err_type = 1;
-		} else  {
-			target[args->id].position = buf->position;
-		}
-	}
-
-	if ((res = write(target[args->id].fd, buf->data,
-				buf->length)) == buf->length)  {
-		target[args->id].position += res;
-	} else  {
-		error = 2;
+	res = pwrite(args->fd, buf->data, buf->length, buf->position);
+	if (res == buf->length)  {
+		target[args->id].position = buf->position + res;
+		return 0;
 	}
 
-	if (error) {
-		target[args->id].error = errno;
-		target[args->id].position = buf->position;
-	}
-	return error;
+	target[args->id].error = res < 0 ? errno : EIO;
+	target[args->id].err_type = 0;
+	target[args->id].position = buf->position;
+	return 1;
 }
 
+/*
+ * Each target thread writes the ring buffers out in order, at whatever pace
+ * its device allows, until the reader says there's nothing more to come.
+ */
 static void *
 begin_reader(void *arg)
 {
 	thread_args	*args = arg;
+	wbuf		*buf;
 
 	rcu_register_thread();
+	pthread_mutex_lock(&ring.lock);
 	for (;;) {
-		pthread_mutex_lock(&args->wait);
-		if (do_write(args, NULL))
-			goto handle_error;
-	        pthread_mutex_lock(&glob_masks.mutex);
-		if (--glob_masks.num_working == 0)
-			pthread_mutex_unlock(&mainwait);
-		pthread_mutex_unlock(&glob_masks.mutex);
-	}
-	/* NOTREACHED */
-
-handle_error:
-	/* error will be logged by primary thread */
+		while (args->done == ring.filled && !ring.finished)
+			pthread_cond_wait(&ring.filled_cv, &ring.lock);
+		if (args->done == ring.filled)
+			break;
+		buf = &ring.bufs[args->done % WBUF_RING_SIZE];
+		pthread_mutex_unlock(&ring.lock);
+
+		if (do_write(args, buf)) {
+			/* error will be logged by primary thread */
+			pthread_mutex_lock(&ring.lock);
+			target[args->id].state = INACTIVE;
+			pthread_cond_broadcast(&ring.done_cv);
+			break;
+		}
 
-	pthread_mutex_lock(&glob_masks.mutex);
-	target[args->id].state = INACTIVE;
-	if (--glob_masks.num_working == 0)
-		pthread_mutex_unlock(&mainwait);
-	pthread_mutex_unlock(&glob_masks.mutex);
+		pthread_mutex_lock(&ring.lock);
+		args->done++;
+		pthread_cond_broadcast(&ring.done_cv);
+	}
+	pthread_mutex_unlock(&ring.lock);
 	rcu_unregister_thread();
-	pthread_exit(NULL);
 	return NULL;
 }
 
@@ -316,7 +311,7 @@ static void
 usage(void)
 {
 	fprintf(stderr,
-		_("Usage: %s [-bdV] [-L logfile] source target [target ...]\n"),
+		_("Usage: %s [-bdsV] [-L logfile] source target [target ...]\n"),
 		progname);
 	exit(1);
 }
@@ -360,8 +355,6 @@ bump_bar(int tenths, uint64_t numblocks)
 	return tenths;
 }
 
-static xfs_off_t source_position = -1;
-
 static wbuf *
 wbuf_init(wbuf *buf, int data_size, int data_align, int min_io_size, int id)
 {
@@ -383,7 +376,6 @@ static void
 read_wbuf(int fd, wbuf *buf, xfs_mount_t *mp)
 {
 	int		res = 0;
-	xfs_off_t	lres = 0;
 	xfs_off_t	newpos;
 	size_t		diff;
 
@@ -396,17 +388,7 @@ read_wbuf(int fd, wbuf *buf, xfs_mount_t *mp)
 		buf->length += diff;
 	}
 
-	if (source_position != buf->position)  {
-		lres = lseek(fd, buf->position, SEEK_SET);
-		if (lres < 0LL)  {
-			do_warn(_("%s:  lseek failure at offset %lld\n"),
-				progname, source_position);
-			die_perror();
-		}
-		source_position = buf->position;
-	}
-
-	ASSERT(source_position % source_sectorsize == 0);
+	ASSERT(buf->position % source_sectorsize == 0);
 
 	/* round up length for direct I/O if necessary */
 
@@ -419,18 +401,17 @@ read_wbuf(int fd, wbuf *buf, xfs_mount_t *mp)
 		exit(1);
 	}
 
-	if ((res = read(fd, buf->data, buf->length)) < 0)  {
+	if ((res = pread(fd, buf->data, buf->length, buf->position)) < 0)  {
 		do_warn(_("%s:  read failure at offset %lld\n"),
-				progname, source_position);
+				progname, buf->position);
 		die_perror();
 	}
 
 	if (res < buf->length &&
-	    source_position + res == mp->m_sb.sb_dblocks * source_blocksize)
+	    buf->position + res == mp->m_sb.sb_dblocks * source_blocksize)
 		res = buf->length;
 	else
 		ASSERT(res == buf->length);
-	source_position += res;
 	buf->length = res;
 }
 
@@ -481,36 +462,427 @@ read_ag_header(int fd, xfs_agnumber_t agno, wbuf *buf, ag_header_t *ag,
 }
 
 
+/*
+ * Wait until every active target has written at least @seq ring buffers.
+ * If all the targets have failed there is nobody left to write anything,
+ * so bail out.
+ */
 static void
-write_wbuf(void)
+ring_wait(
+	uint64_t	seq)
 {
 	int		i;
-	int		badness = 0;
 
-	/* verify target threads */
-	for (i = 0; i < num_targets; i++)
-		if (target[i].state != INACTIVE)
-			glob_masks.num_working++;
+	pthread_mutex_lock(&ring.lock);
+	for (;;) {
+		int	active = 0;
+		int	behind = 0;
+
+		for (i = 0; i < num_targets; i++)  {
+			if (target[i].state == INACTIVE)
+				continue;
+			active++;
+			if (targ[i].done < seq)
+				behind++;
+		}
+		if (active == 0)  {
+			pthread_mutex_unlock(&ring.lock);
+			check_errors();
+			exit(1);
+		}
+		if (behind == 0)
+			break;
+		pthread_cond_wait(&ring.done_cv, &ring.lock);
+	}
+	pthread_mutex_unlock(&ring.lock);
+}
+
+/*
+ * Grab the next ring buffer for the reader to fill, waiting for the slowest
+ * target to finish writing out what was in it last time around.
+ */
+static wbuf *
+ring_get_wbuf(void)
+{
+	if (ring.filled >= WBUF_RING_SIZE)
+		ring_wait(ring.filled - WBUF_RING_SIZE + 1);
+	return &ring.bufs[ring.filled % WBUF_RING_SIZE];
+}
+
+/* Hand the buffer from ring_get_wbuf to the target threads. */
+static void
+ring_put_wbuf(void)
+{
+	pthread_mutex_lock(&ring.lock);
+	ring.filled++;
+	pthread_cond_broadcast(&ring.filled_cv);
+	pthread_mutex_unlock(&ring.lock);
+}
+
+/* Wait for all queued buffers to be written and stop the target threads. */
+static void
+ring_finish(void)
+{
+	int		i;
+
+	ring_wait(ring.filled);
+
+	pthread_mutex_lock(&ring.lock);
+	ring.finished = 1;
+	pthread_cond_broadcast(&ring.filled_cv);
+	pthread_mutex_unlock(&ring.lock);
 
-	/* release target threads */
 	for (i = 0; i < num_targets; i++)
-		if (target[i].state != INACTIVE)
-			pthread_mutex_unlock(&targ[i].wait);	/* wake up */
-		else
-			badness++;
+		pthread_join(target[i].pid, NULL);
+}
 
-	/*
-	 * If all the targets are inactive then there won't be any io
-	 * threads left to release mainwait.  We're screwed, so bail out.
-	 */
-	if (badness == num_targets) {
-		check_errors();
+/*
+ * Allocated-extents-only copy.  The free space btree of every AG is walked
+ * first to build a map of all the allocated space in the filesystem, then
+ * the AGs are copied in parallel, each worker reading the allocated extents
+ * of one AG in large chunks and writing them straight to every target.  Free
+ * space is discarded on block device targets so that thin provisioned storage
+ * doesn't have to back it; regular file targets start out empty and so stay
+ * sparse.
+ */
+#define COPY_AG_THREADS		8		/* AGs copied at once */
+#define COPY_MERGE_GAP		128		/* bridge holes up to this many BBs */
+#define COPY_IOSIZE		(8 * 1024 * 1024)
+
+static used_map		*used_maps;		/* one per AG */
+static int		copy_iosize = COPY_IOSIZE;
+static xfs_daddr_t	copy_hdr_end;		/* end of AG 0's header */
+static pthread_mutex_t	copy_lock;		/* target state and progress */
+static uint64_t		copy_blocks;
+static int		copy_howfar;
+
+static void
+used_map_add(
+	used_map	*map,
+	xfs_daddr_t	start,
+	xfs_daddr_t	end)
+{
+	xfs_daddr_t	align = w_buf.min_io_size >> BBSHIFT;
+	used_extent	*last;
+
+	start = rounddown(start, align);
+	end = roundup(end, align);
+	if (start < copy_hdr_end)
+		start = copy_hdr_end;
+	if (start >= end)
+		return;
+
+	if (map->nr > 0)  {
+		last = &map->exts[map->nr - 1];
+		if (start <= last->start + last->len + COPY_MERGE_GAP)  {
+			last->len = max(last->len, end - last->start);
+			return;
+		}
+	}
+
+	if (map->nr == map->max)  {
+		map->max = max(map->max * 2, 64U);
+		map->exts = realloc(map->exts, map->max * sizeof(used_extent));
+		if (!map->exts)  {
+			do_log(_("Couldn't allocate extent map\n"));
+			die_perror();
+		}
+	}
+	map->exts[map->nr].start = start;
+	map->exts[map->nr].len = end - start;
+	map->nr++;
+}
+
+/* Read the free space btree block at @bno into @buf. */
+static struct xfs_btree_block *
+read_bno_block(
+	struct xfs_mount	*mp,
+	xfs_agnumber_t		agno,
+	xfs_agblock_t		bno,
+	wbuf			*buf)
+{
+	struct xfs_btree_block	*block;
+	xfs_off_t		pos;
+
+	buf->position = pos = (xfs_off_t)XFS_AGB_TO_DADDR(mp, agno, bno)
+				<< BBSHIFT;
+	buf->length = source_blocksize;
+	read_wbuf(source_fd, buf, mp);
+
+	block = (struct xfs_btree_block *)(buf->data + pos - buf->position);
+	if (be32_to_cpu(block->bb_magic) !=
+	    (xfs_has_crc(mp) ? XFS_ABTB_CRC_MAGIC : XFS_ABTB_MAGIC))  {
+		do_log(_("Bad btree magic 0x%x\n"),
+			be32_to_cpu(block->bb_magic));
 		exit(1);
 	}
+	return block;
+}
 
-	signal_maskfunc(SIGCHLD, SIG_UNBLOCK);
-	pthread_mutex_lock(&mainwait);
-	signal_maskfunc(SIGCHLD, SIG_BLOCK);
+/* Build the used extent map of an AG from the gaps in its bno btree. */
+static void
+scan_ag_worker(
+	struct workqueue	*wq,
+	uint32_t		agno,
+	void			*arg)
+{
+	struct xfs_mount	*mp = wq->wq_ctx;
+	used_map		*map = &used_maps[agno];
+	struct xfs_btree_block	*block;
+	xfs_alloc_rec_t		*rec;
+	ag_header_t		ag_hdr;
+	wbuf			hdr_buf;
+	wbuf			bt_buf;
+	xfs_agblock_t		bno;
+	xfs_daddr_t		next;
+	unsigned int		level, levels;
+	int			i;
+
+	if (!wbuf_init(&hdr_buf, roundup(first_agbno * source_blocksize,
+				w_buf.min_io_size) + w_buf.min_io_size,
+			w_buf.data_align, w_buf.min_io_size, agno) ||
+	    !wbuf_init(&bt_buf, max(source_blocksize, w_buf.min_io_size),
+			w_buf.data_align, w_buf.min_io_size, agno))  {
+		do_log(_("Error initializing btree buf for AG %u\n"), agno);
+		die_perror();
+	}
+
+	read_ag_header(source_fd, agno, &hdr_buf, &ag_hdr, mp,
+			source_blocksize, source_sectorsize);
+
+	/* traverse btree until we get to the leftmost leaf node */
+	bno = be32_to_cpu(ag_hdr.xfs_agf->agf_roots[XFS_BTNUM_BNOi]);
+	levels = be32_to_cpu(ag_hdr.xfs_agf->agf_levels[XFS_BTNUM_BNOi]);
+	for (level = 0;; level++)  {
+		if (level >= levels)  {
+			do_log(
+			_("Error: current level %d >= btree levels %d\n"),
+				level, levels);
+			exit(1);
+		}
+		block = read_bno_block(mp, agno, bno, &bt_buf);
+		if (be16_to_cpu(block->bb_level) == 0)
+			break;
+		bno = be32_to_cpu(*XFS_ALLOC_PTR_ADDR(mp, block, 1,
+					mp->m_alloc_mxr[1]));
+	}
+
+	/* everything that isn't free space is allocated */
+	next = XFS_AGB_TO_DADDR(mp, agno, 0);
+	for (;;)  {
+		if (be16_to_cpu(block->bb_level) != 0)  {
+			do_log(
+			_("WARNING:  source filesystem inconsistent.\n"));
+			do_log(
+			_("  A leaf btree rec isn't a leaf.  Aborting now.\n"));
+			exit(1);
+		}
+
+		rec = XFS_ALLOC_REC_ADDR(mp, block, 1);
+		for (i = 0; i < be16_to_cpu(block->bb_numrecs); i++, rec++)  {
+			xfs_agblock_t	fbno = be32_to_cpu(rec->ar_startblock);
+			xfs_extlen_t	flen = be32_to_cpu(rec->ar_blockcount);
+
+			used_map_add(map, next,
+					XFS_AGB_TO_DADDR(mp, agno, fbno));
+			next = max(next, XFS_AGB_TO_DADDR(mp, agno, fbno + flen));
+		}
+
+		bno = be32_to_cpu(block->bb_u.s.bb_rightsib);
+		if (bno == NULLAGBLOCK)
+			break;
+		block = read_bno_block(mp, agno, bno, &bt_buf);
+	}
+	used_map_add(map, next, XFS_AGB_TO_DADDR(mp, agno,
+				be32_to_cpu(ag_hdr.xfs_agf->agf_length)));
+
+	free(hdr_buf.data);
+	free(bt_buf.data);
+}
+
+/* Write @buf to every active target; returns the number still active. */
+static int
+copy_write(
+	wbuf		*buf)
+{
+	ssize_t		res;
+	int		active = 0;
+	int		i;
+
+	for (i = 0; i < num_targets; i++)  {
+		pthread_mutex_lock(&copy_lock);
+		if (target[i].state == INACTIVE)  {
+			pthread_mutex_unlock(&copy_lock);
+			continue;
+		}
+		pthread_mutex_unlock(&copy_lock);
+
+		res = pwrite(target[i].fd, buf->data, buf->length,
+				buf->position);
+		if (res == buf->length)  {
+			active++;
+			continue;
+		}
+
+		/* error will be logged by primary thread */
+		pthread_mutex_lock(&copy_lock);
+		if (target[i].state != INACTIVE)  {
+			target[i].state = INACTIVE;
+			target[i].error = res < 0 ? errno : EIO;
+			target[i].err_type = 0;
+			target[i].position = buf->position;
+		}
+		pthread_mutex_unlock(&copy_lock);
+	}
+	return active;
+}
+
+/* Discard a range of free space on the targets that can do that. */
+static void
+copy_discard(
+	xfs_daddr_t	start,
+	xfs_daddr_t	end)
+{
+	int		discard;
+	int		i;
+
+	end = rounddown(end, (xfs_daddr_t)(w_buf.min_io_size >> BBSHIFT));
+	if (start >= end)
+		return;
+
+	for (i = 0; i < num_targets; i++)  {
+		pthread_mutex_lock(&copy_lock);
+		discard = target[i].discard && target[i].state != INACTIVE;
+		pthread_mutex_unlock(&copy_lock);
+		if (!discard)
+			continue;
+
+		/* discard is only advisory, give up on any error */
+		if (platform_discard_blocks(target[i].fd, BBTOB(start),
+				BBTOB(end - start)))  {
+			pthread_mutex_lock(&copy_lock);
+			target[i].discard = 0;
+			pthread_mutex_unlock(&copy_lock);
+		}
+	}
+}
+
+/* Copy the allocated extents of an AG and discard the holes between them. */
+static void
+copy_ag_worker(
+	struct workqueue	*wq,
+	uint32_t		agno,
+	void			*arg)
+{
+	struct xfs_mount	*mp = wq->wq_ctx;
+	used_map		*map = &used_maps[agno];
+	xfs_daddr_t		hole;
+	xfs_daddr_t		ag_end;
+	xfs_off_t		pos, end;
+	wbuf			buf;
+	unsigned int		i;
+
+	if (!wbuf_init(&buf, copy_iosize, w_buf.data_align,
+			w_buf.min_io_size, agno))  {
+		do_log(_("Error initializing copy buf for AG %u\n"), agno);
+		die_perror();
+	}
+
+	hole = agno == 0 ? copy_hdr_end : XFS_AGB_TO_DADDR(mp, agno, 0);
+	ag_end = min(XFS_AGB_TO_DADDR(mp, agno, mp->m_sb.sb_agblocks),
+		     XFS_FSB_TO_BB(mp, mp->m_sb.sb_dblocks));
+
+	for (i = 0; i < map->nr; i++)  {
+		used_extent	*ext = &map->exts[i];
+
+		copy_discard(hole, ext->start);
+		hole = ext->start + ext->len;
+
+		pos = BBTOB(ext->start);
+		end = BBTOB(ext->start + ext->len);
+		while (pos < end)  {
+			buf.position = pos;
+			buf.length = min(end - pos, (xfs_off_t)buf.size);
+			read_wbuf(source_fd, &buf, mp);
+			if (copy_write(&buf) == 0)
+				goto out;
+			pos = buf.position + buf.length;
+
+			pthread_mutex_lock(&copy_lock);
+			copy_blocks += buf.length >> BBSHIFT;
+			copy_howfar = bump_bar(copy_howfar, copy_blocks);
+			pthread_mutex_unlock(&copy_lock);
+		}
+	}
+	copy_discard(hole, ag_end);
+out:
+	free(buf.data);
+}
+
+static void
+copy_run_ags(
+	struct xfs_mount	*mp,
+	void			(*fn)(struct workqueue *, uint32_t, void *))
+{
+	struct workqueue	wq;
+	xfs_agnumber_t		agno;
+	int			error;
+
+	error = -workqueue_create(&wq, mp,
+			min(mp->m_sb.sb_agcount, COPY_AG_THREADS));
+	for (agno = 0; !error && agno < mp->m_sb.sb_agcount; agno++)
+		error = -workqueue_add(&wq, fn, agno, NULL);
+	if (!error)
+		error = -workqueue_terminate(&wq);
+	if (error)  {
+		errno = error;
+		do_log(_("Couldn't run AG copy threads\n"));
+		die_perror();
+	}
+	workqueue_destroy(&wq);
+}
+
+static void
+copy_allocated(
+	struct xfs_mount	*mp)
+{
+	ag_header_t		ag_hdr;
+	uint64_t		total = 0;
+	xfs_agnumber_t		agno;
+	unsigned int		i;
+
+	used_maps = calloc(mp->m_sb.sb_agcount, sizeof(used_map));
+	if (!used_maps || pthread_mutex_init(&copy_lock, NULL) != 0)  {
+		do_log(_("Couldn't allocate extent map\n"));
+		die_perror();
+	}
+	copy_iosize = max(rounddown(copy_iosize, (int)w_buf.min_io_size),
+			  (int)w_buf.min_io_size);
+
+	/*
+	 * Write AG 0's header first with the in-progress bit set, like the
+	 * normal copy, so a target can't be mounted until the copy is done.
+	 */
+	read_ag_header(source_fd, 0, &w_buf, &ag_hdr, mp,
+			source_blocksize, source_sectorsize);
+	ag_hdr.xfs_sb->sb_inprogress = 1;
+	copy_hdr_end = (w_buf.position + w_buf.length) >> BBSHIFT;
+	for (i = 0; i < num_targets; i++)
+		if (do_write(&targ[i], NULL))
+			target[i].state = INACTIVE;
+
+	copy_run_ags(mp, scan_ag_worker);
+
+	for (agno = 0; agno < mp->m_sb.sb_agcount; agno++)
+		for (i = 0; i < used_maps[agno].nr; i++)
+			total += used_maps[agno].exts[i].len;
+	init_bar(total);
+
+	copy_run_ags(mp, copy_ag_worker);
+
+	for (agno = 0; agno < mp->m_sb.sb_agcount; agno++)
+		free(used_maps[agno].exts);
+	free(used_maps);
 }
 
 static void
@@ -554,6 +926,7 @@ main(int argc, char **argv)
 	int		howfar = 0;
 	int		open_flags;
 	xfs_off_t	pos;
+	xfs_off_t	copy_pos;
 	size_t		length;
 	int		c;
 	uint64_t	size, sizeb;
@@ -567,8 +940,10 @@ main(int argc, char **argv)
 	int		source_is_file = 0;
 	int		buffered_output = 0;
 	int		duplicate = 0;
+	int		sparse_copy = 0;
 	uint		btree_levels, current_level;
 	ag_header_t	ag_hdr;
+	wbuf		*buf;
 	xfs_mount_t	*mp;
 	xfs_mount_t	mbuf;
 	struct xlog	xlog;
@@ -593,7 +968,7 @@ main(int argc, char **argv)
 	bindtextdomain(PACKAGE, LOCALEDIR);
 	textdomain(PACKAGE);
 
-	while ((c = getopt(argc, argv, "bdL:V")) != EOF)  {
+	while ((c = getopt(argc, argv, "bdL:sV")) != EOF)  {
 		switch (c) {
 		case 'b':
 			buffered_output = 1;
@@ -604,6 +979,9 @@ main(int argc, char **argv)
 		case 'L':
 			logfile_name = optarg;
 			break;
+		case 's':
+			sparse_copy = 1;
+			break;
 		case 'V':
 			printf(_("%s version %s\n"), progname, VERSION);
 			exit(0);
@@ -652,6 +1030,7 @@ main(int argc, char **argv)
 		target[i].state = INACTIVE;
 		target[i].error = 0;
 		target[i].err_type = 0;
+		target[i].discard = 0;
 	}
 
 	/* open up source -- is it a file? */
@@ -687,6 +1066,7 @@ main(int argc, char **argv)
 
 		wbuf_align = d.d_mem;
 		wbuf_size = min(d.d_maxiosz, 1 * 1024 * 1024);
+		copy_iosize = min(d.d_maxiosz, copy_iosize);
 		wbuf_miniosize = d.d_miniosz;
 	} else  {
 		/* set arbitrary I/O params, miniosize at least 1 disk block */
@@ -854,6 +1234,8 @@ main(int argc, char **argv)
 					progname, target[i].name, progname);
 				exit(1);
 			}
+			target[i].discard = sparse_copy &&
+					    S_ISBLK(statbuf.st_mode);
 		}
 
 		target[i].fd = open(target[i].name, open_flags, 0644);
@@ -882,6 +1264,8 @@ main(int argc, char **argv)
 				} else {
 					wbuf_align = max(wbuf_align, d.d_mem);
 					wbuf_size = min(d.d_maxiosz, wbuf_size);
+					copy_iosize = min(d.d_maxiosz,
+							  copy_iosize);
 					wbuf_miniosize = max(d.d_miniosz,
 								wbuf_miniosize);
 				}
@@ -906,11 +1290,12 @@ main(int argc, char **argv)
 
 	/* initialize locks and bufs */
 
-	if (pthread_mutex_init(&glob_masks.mutex, NULL) != 0)  {
-		do_log(_("Couldn't initialize global thread mask\n"));
+	if (pthread_mutex_init(&ring.lock, NULL) != 0 ||
+	    pthread_cond_init(&ring.filled_cv, NULL) != 0 ||
+	    pthread_cond_init(&ring.done_cv, NULL) != 0)  {
+		do_log(_("Couldn't initialize buffer ring\n"));
 		die_perror();
 	}
-	glob_masks.num_working = 0;
 
 	if (wbuf_init(&w_buf, wbuf_size, wbuf_align,
 					wbuf_miniosize, 0) == NULL)  {
@@ -918,7 +1303,16 @@ main(int argc, char **argv)
 		die_perror();
 	}
 
-	wblocks = wbuf_size / BBSIZE;
+	for (i = 0; i < WBUF_RING_SIZE; i++)  {
+		if (wbuf_init(&ring.bufs[i], w_buf.size, wbuf_align,
+				wbuf_miniosize, 0) == NULL ||
+		    ring.bufs[i].size != w_buf.size)  {
+			do_log(_("Error initializing ring buffer %d\n"), i);
+			die_perror();
+		}
+	}
+
+	wblocks = w_buf.size / BBSIZE;
 
 	if (wbuf_init(&btree_buf, max(source_blocksize, wbuf_miniosize),
 				wbuf_align, wbuf_miniosize, 1) == NULL)  {
@@ -926,14 +1320,6 @@ main(int argc, char **argv)
 		die_perror();
 	}
 
-	if (pthread_mutex_init(&mainwait,NULL) != 0)  {
-		do_log(_("Error creating first semaphore.\n"));
-		die_perror();
-		exit(1);
-	}
-	/* need to start out blocking */
-	pthread_mutex_lock(&mainwait);
-
 	/* set up sigchild signal handler */
 
 	signal(SIGCHLD, handler);
@@ -952,19 +1338,12 @@ main(int argc, char **argv)
 			platform_uuid_generate(&tcarg->uuid);
 		else
 			platform_uuid_copy(&tcarg->uuid, &mp->m_sb.sb_uuid);
-
-		if (pthread_mutex_init(&tcarg->wait, NULL) != 0)  {
-			do_log(_("Error creating thread mutex %d\n"), i);
-			die_perror();
-			exit(1);
-		}
-		/* need to start out blocking */
-		pthread_mutex_lock(&tcarg->wait);
 	}
 
 	for (i = 0, tcarg = targ; i < num_targets; i++, tcarg++)  {
 		tcarg->id = i;
 		tcarg->fd = target[i].fd;
+		tcarg->done = 0;
 
 		target[i].state = ACTIVE;
 		num_threads++;
@@ -988,10 +1367,16 @@ main(int argc, char **argv)
 
 	kids = num_targets;
 
+	if (sparse_copy)  {
+		copy_allocated(mp);
+		goto copy_done;
+	}
+
 	for (agno = 0; agno < num_ags && kids > 0; agno++)  {
 		/* read in first blocks of the ag */
 
-		read_ag_header(source_fd, agno, &w_buf, &ag_hdr, mp,
+		buf = ring_get_wbuf();
+		read_ag_header(source_fd, agno, buf, &ag_hdr, mp,
 			source_blocksize, source_sectorsize);
 
 		/* set the in_progress bit for the first AG */
@@ -1007,7 +1392,7 @@ main(int argc, char **argv)
 
 		/* write the ag header out */
 
-		write_wbuf();
+		ring_put_wbuf();
 
 		/* traverse btree until we get to the leftmost leaf node */
 
@@ -1021,7 +1406,7 @@ main(int argc, char **argv)
 				+ source_blocksize / BBSIZE;
 
 		for (;;) {
-			/* none of this touches the w_buf buffer */
+			/* none of this touches the ring buffers */
 
 			if (current_level >= btree_levels) {
 				do_log(
@@ -1059,13 +1444,13 @@ main(int argc, char **argv)
 
 		/* align first data copy but don't overwrite ag header */
 
-		pos = w_buf.position >> BBSHIFT;
-		length = w_buf.length >> BBSHIFT;
+		ASSERT(buf->position % source_sectorsize == 0);
+
+		pos = buf->position >> BBSHIFT;
+		length = buf->length >> BBSHIFT;
 		next_begin = pos + length;
 		ag_begin = next_begin;
 
-		ASSERT(w_buf.position % source_sectorsize == 0);
-
 		/* handle the rest of the ag */
 
 		for (;;) {
@@ -1105,28 +1490,32 @@ main(int argc, char **argv)
 				if (size > 0)  {
 					/* copy extent */
 
-					w_buf.position = (xfs_off_t)
+					copy_pos = (xfs_off_t)
 						begin << BBSHIFT;
 
 					while (size > 0)  {
+						buf = ring_get_wbuf();
+						buf->position = copy_pos;
+
 						/*
 						 * let lower layer do alignment
 						 */
-						if (size > w_buf.size)  {
-							w_buf.length = w_buf.size;
-							size -= w_buf.size;
+						if (size > buf->size)  {
+							buf->length = buf->size;
+							size -= buf->size;
 							sizeb -= wblocks;
 							numblocks += wblocks;
 						} else  {
-							w_buf.length = size;
+							buf->length = size;
 							numblocks += sizeb;
 							size = 0;
 						}
 
-						read_wbuf(source_fd, &w_buf, mp);
-						write_wbuf();
+						read_wbuf(source_fd, buf, mp);
+						ring_put_wbuf();
 
-						w_buf.position += w_buf.length;
+						copy_pos = buf->position +
+							   buf->length;
 
 						howfar = bump_bar(
 							howfar, numblocks);
@@ -1177,27 +1566,30 @@ main(int argc, char **argv)
 			if (size > 0)  {
 				/* copy extent */
 
-				w_buf.position = (xfs_off_t) begin << BBSHIFT;
+				copy_pos = (xfs_off_t) begin << BBSHIFT;
 
 				while (size > 0)  {
+					buf = ring_get_wbuf();
+					buf->position = copy_pos;
+
 					/*
 					 * let lower layer do alignment
 					 */
-					if (size > w_buf.size)  {
-						w_buf.length = w_buf.size;
-						size -= w_buf.size;
+					if (size > buf->size)  {
+						buf->length = buf->size;
+						size -= buf->size;
 						sizeb -= wblocks;
 						numblocks += wblocks;
 					} else  {
-						w_buf.length = size;
+						buf->length = size;
 						numblocks += sizeb;
 						size = 0;
 					}
 
-					read_wbuf(source_fd, &w_buf, mp);
-					write_wbuf();
+					read_wbuf(source_fd, buf, mp);
+					ring_put_wbuf();
 
-					w_buf.position += w_buf.length;
+					copy_pos = buf->position + buf->length;
 
 					howfar = bump_bar(howfar, numblocks);
 				}
@@ -1205,6 +1597,10 @@ main(int argc, char **argv)
 		}
 	}
 
+copy_done:
+	/* everything below writes to the targets from this thread */
+	ring_finish();
+
 	if (kids > 0)  {
 		if (!duplicate)
 			/* write a clean log using the specified UUID */
@@ -1224,8 +1620,10 @@ main(int argc, char **argv)
 			/* do each thread in turn, each has its own UUID */
 
 			for (j = 0, tcarg = targ; j < num_targets; j++)  {
-				sb_update_uuid(mp, &ag_hdr, tcarg);
-				do_write(tcarg, NULL);
+				if (target[j].state != INACTIVE)  {
+					sb_update_uuid(mp, &ag_hdr, tcarg);
+					do_write(tcarg, NULL);
+				}
 				tcarg++;
 			}
 		}
@@ -1396,10 +1794,12 @@ format_logs(
 	}
 
 	for (i = 0, tcarg = targ; i < num_targets; i++)  {
-		if (xfs_has_crc(mp))
-			format_log(mp, tcarg, &logbuf);
-		else
-			clear_log(mp, tcarg);
+		if (target[i].state != INACTIVE)  {
+			if (xfs_has_crc(mp))
+				format_log(mp, tcarg, &logbuf);
+			else
+				clear_log(mp, tcarg);
+		}
 		tcarg++;
 	}
 
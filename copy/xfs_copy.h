@@ -52,15 +52,26 @@ typedef struct {
 typedef struct t_args {
 	int		id;
 	uuid_t		uuid;
-	pthread_mutex_t	wait;
 	int		fd;
+	uint64_t	done;		/* ring buffers written so far */
 } thread_args;
 
+/*
+ * The reader fills a ring of buffers in order while every target thread
+ * writes them out in the same order at its own pace.  A buffer can only be
+ * refilled once every active target has written it, so the slowest target
+ * sets the pace but the others can run up to a ring's worth ahead of it.
+ */
+#define WBUF_RING_SIZE	8
+
 typedef struct {
-	pthread_mutex_t mutex;
-	int		num_working;
-	wbuf		*buffer;
-} thread_control;
+	pthread_mutex_t	lock;
+	pthread_cond_t	filled_cv;	/* reader published a buffer */
+	pthread_cond_t	done_cv;	/* a target finished a buffer */
+	wbuf		bufs[WBUF_RING_SIZE];
+	uint64_t	filled;		/* buffers published so far */
+	int		finished;	/* no more buffers are coming */
+} wbuf_ring;
 
 typedef int thread_id;
 typedef int tm_index;			/* index into thread mask array */
@@ -74,4 +85,21 @@ typedef struct {
 	int		state;
 	int		error;
 	int		err_type;
+	int		discard;	/* discard free space (-s) */
 } target_control;
+
+/*
+ * Map of the allocated space in one AG for an allocated-extents-only copy.
+ * Extents are in daddrs, sorted, aligned to the minimum I/O size, and small
+ * holes between them have been bridged.
+ */
+typedef struct {
+	xfs_daddr_t	start;
+	xfs_daddr_t	len;
+} used_extent;
+
+typedef struct {
+	used_extent	*exts;
+	unsigned int	nr;
+	unsigned int	max;
+} used_map;
@@ -24,6 +24,7 @@ int			blkbb;
 int			exitcode;
 int			expert_mode;
 static int		force;
+static int		metadump_image;
 static struct xfs_mount	xmount;
 struct xfs_mount	*mp;
 static struct xlog	xlog;
@@ -33,7 +34,7 @@ static void
 usage(void)
 {
 	fprintf(stderr, _(
-		"Usage: %s [-ifFrxV] [-p prog] [-l logdev] [-c cmd]... device\n"
+		"Usage: %s [-ifFmrxV] [-p prog] [-l logdev] [-c cmd]... device\n"
 		), progname);
 	exit(1);
 }
@@ -54,7 +55,7 @@ init(
 	textdomain(PACKAGE);
 
 	progname = basename(argv[0]);
-	while ((c = getopt(argc, argv, "c:fFip:rxVl:")) != EOF) {
+	while ((c = getopt(argc, argv, "c:fFimp:rxVl:")) != EOF) {
 		switch (c) {
 		case 'c':
 			cmdline = xrealloc(cmdline, (ncmdline+1)*sizeof(char*));
@@ -69,6 +70,11 @@ init(
 		case 'i':
 			x.isreadonly = (LIBXFS_ISREADONLY|LIBXFS_ISINACTIVE);
 			break;
+		case 'm':
+			metadump_image = 1;
+			x.disfile = 1;
+			x.isreadonly = LIBXFS_ISREADONLY;
+			break;
 		case 'p':
 			progname = optarg;
 			break;
@@ -104,6 +110,11 @@ init(
 			stderr);
 		exit(1);
 	}
+	if (metadump_image && !libxfs_device_to_mdimage(x.ddev)) {
+		fprintf(stderr, _("%s: %s is not a metadump\n"),
+			progname, fsdevice);
+		exit(1);
+	}
 
 	/*
 	 * Read the superblock, but don't validate it - we are a diagnostic
@@ -51,10 +51,11 @@ static const cmdinfo_t  ring_cmd =
 	{ "ring", NULL, ring_f, 0, 1, 0, NULL,
 	  N_("show position ring or move to a specific entry"), ring_help };
 
-iocur_t	*iocur_base;
-iocur_t	*iocur_top;
-int	iocur_sp = -1;
-int	iocur_len;
+__thread iocur_t	*iocur_base;
+__thread iocur_t	*iocur_top;
+__thread int		iocur_sp = -1;
+__thread int		iocur_len;
+__thread bool		iocur_copy_bufs;
 
 #define RING_ENTRIES 20
 static iocur_t iocur_ring[RING_ENTRIES];
@@ -214,6 +215,21 @@ push_cur(void)
 	cur_typ = NULL;
 }
 
+/* Tear down the calling thread's location stack. */
+void
+free_cur_stack(void)
+{
+	while (iocur_sp > 0)
+		pop_cur();
+	if (iocur_sp == 0)
+		pop_cur();
+	free(iocur_base);
+	iocur_base = NULL;
+	iocur_top = NULL;
+	iocur_sp = -1;
+	iocur_len = 0;
+}
+
 void
 push_cur_and_set_type(void)
 {
@@ -508,6 +524,30 @@ write_cur(void)
 
 }
 
+/* Copy a cached buffer into an uncached one, and release the cached one. */
+static int
+copy_cur_buf(
+	struct xfs_buf	**bpp)
+{
+	struct xfs_buf	*bp = *bpp;
+	struct xfs_buf	*cbp;
+	int		error;
+
+	error = -libxfs_buf_get_uncached(bp->b_target, bp->b_length, 0, &cbp);
+	if (error) {
+		libxfs_buf_relse(bp);
+		return error;
+	}
+	xfs_buf_set_daddr(cbp, xfs_buf_daddr(bp));
+	memcpy(cbp->b_addr, bp->b_addr, BBTOB(bp->b_length));
+	cbp->b_ops = bp->b_ops;
+	cbp->b_error = bp->b_error;
+	cbp->b_flags |= bp->b_flags & LIBXFS_B_UNCHECKED;
+	libxfs_buf_relse(bp);
+	*bpp = cbp;
+	return 0;
+}
+
 void
 set_cur(
 	const typ_t	*type,
@@ -564,12 +604,14 @@ set_cur(
 	 */
 	if (error)
 		return;
-	iocur_top->buf = bp->b_addr;
-	iocur_top->bp = bp;
 	if (!ops) {
 		bp->b_ops = NULL;
 		bp->b_flags |= LIBXFS_B_UNCHECKED;
 	}
+	if (iocur_copy_bufs && copy_cur_buf(&bp))
+		return;
+	iocur_top->buf = bp->b_addr;
+	iocur_top->bp = bp;
 
 	iocur_top->bb = blknum;
 	iocur_top->blen = len;
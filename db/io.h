@@ -35,10 +35,23 @@ typedef struct iocur {
 #define DB_RING_ADD 1                   /* add to ring on set_cur */
 #define DB_RING_IGN 0                   /* do not add to ring on set_cur */
 
-extern iocur_t	*iocur_base;		/* base of stack */
-extern iocur_t	*iocur_top;		/* top element of stack */
-extern int	iocur_sp;		/* current top of stack */
-extern int	iocur_len;		/* length of stack array */
+/*
+ * Each thread has its own location stack so that commands such as metadump
+ * can walk the filesystem from several threads at once.
+ */
+extern __thread iocur_t	*iocur_base;	/* base of stack */
+extern __thread iocur_t	*iocur_top;	/* top element of stack */
+extern __thread int	iocur_sp;	/* current top of stack */
+extern __thread int	iocur_len;	/* length of stack array */
+
+/*
+ * If set, set_cur gives this thread a private copy of each block and lets go
+ * of the cached buffer straight away, so that the thread never holds a
+ * buffer lock while it reads another block.  Threads walking a crosslinked
+ * filesystem at the same time would otherwise lock the same buffers in
+ * different orders.
+ */
+extern __thread bool	iocur_copy_bufs;
 
 extern void	io_init(void);
 extern void	off_cur(int off, int len);
@@ -46,6 +59,7 @@ extern void	pop_cur(void);
 extern void	print_iocur(char *tag, iocur_t *ioc);
 extern void	push_cur(void);
 extern void	push_cur_and_set_type(void);
+extern void	free_cur_stack(void);
 extern void	write_cur(void);
 extern void	set_cur(const struct typ *type, xfs_daddr_t blknum,
 			int len, int ring_add, bbmap_t *bbmap);
@@ -20,6 +20,9 @@
 #include "field.h"
 #include "dir2.h"
 #include "obfuscate.h"
+#include "libfrog/workqueue.h"
+#include "libfrog/compress.h"
+#include "libfrog/crc32c.h"
 
 #define DEFAULT_MAX_EXT_SIZE	XFS_MAX_BMBT_EXTLEN
 
@@ -38,7 +41,7 @@ static void	metadump_help(void);
 
 static const cmdinfo_t	metadump_cmd =
 	{ "metadump", NULL, metadump_f, 0, -1, 0,
-		N_("[-a] [-e] [-g] [-m max_extent] [-w] [-o] filename"),
+		N_("[-a] [-e] [-g] [-m max_extent] [-t threads] [-v version] [-w] [-o] filename"),
 		N_("dump metadata to a file"), metadump_help };
 
 static FILE		*outf;		/* metadump file */
@@ -50,7 +53,28 @@ static char		*block_buffer;
 static int		num_indices;
 static int		cur_index;
 
-static xfs_ino_t	cur_ino;
+/*
+ * Version 3 dumps gather the blocks into frames of up to MD3_FRAME_SIZE bytes
+ * of data, coalescing blocks that are adjacent on disk into a single extent.
+ * Each full frame is compressed and written out, and we remember where each
+ * extent went so that the index can be written at the end of the dump.
+ */
+#define MD3_FRAME_SIZE		(1U << 20)
+#define MD3_MAX_EXTENTS		(MD3_FRAME_SIZE / BBSIZE)
+
+static int		md_version = 1;
+static enum compress_alg md3_alg;
+static struct xfs_md3_extent *md3_extents;
+static unsigned int	md3_nr_extents;
+static char		*md3_data;	/* extent data of the current frame */
+static unsigned int	md3_data_len;
+static char		*md3_ubuf;	/* assembled frame payload */
+static char		*md3_cbuf;	/* compressed frame payload */
+static size_t		md3_cbuf_len;
+static uint64_t		md3_pos;	/* current offset in the dump file */
+static struct xfs_md3_index *md3_index;
+static uint64_t		md3_nr_index;
+static uint64_t		md3_max_index;
 
 static int		show_progress = 0;
 static int		stop_on_read_error = 0;
@@ -60,6 +84,73 @@ static int		zero_stale_data = 1;
 static int		show_warnings = 0;
 static int		progress_since_warning = 0;
 static bool		stdout_metadump;
+static pthread_mutex_t	print_lock = PTHREAD_MUTEX_INITIALIZER;
+
+struct name_ent {
+	struct name_ent		*next;
+	xfs_dahash_t		hash;
+	int			namelen;
+	unsigned char		name[1];
+};
+
+#define NAME_TABLE_SIZE		4096
+
+#define MAX_REMOTE_VALS		4095
+
+struct attr_data_s {
+	int			remote_val_count;
+	xfs_dablk_t		remote_vals[MAX_REMOTE_VALS];
+};
+
+/*
+ * AGs can be scanned in parallel by a pool of worker threads.  Each worker
+ * copies the blocks it dumps into a chain of segments, and the main thread
+ * streams the segments of each AG in turn into the dump file.  The dump is
+ * therefore laid out exactly as if the AGs had been scanned one after
+ * another, no matter how the workers get scheduled.
+ */
+struct metadump_seg {
+	struct list_head	list;
+	int			count;
+	__be64			*index;
+	char			*data;
+};
+
+struct metadump_ag {
+	struct list_head	segs;		/* full segments, oldest first */
+	bool			done;
+	bool			error;
+};
+
+/* Maximum number of segments queued for AGs the writer hasn't reached. */
+#define MAX_QUEUED_SEGS		1024
+
+static struct metadump_ag	*md_ags;
+static pthread_mutex_t	md_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t	md_ready = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t	md_space = PTHREAD_COND_INITIALIZER;
+static xfs_agnumber_t	md_write_agno;	/* AG being written out */
+static unsigned int	md_nr_segs;	/* segments allocated */
+static bool		md_abort;
+
+/*
+ * State of whoever is dumping metadata in this thread.  Workers have agno set
+ * to the AG they're scanning and queue their output; the main thread has it
+ * set to NULLAGNUMBER and writes straight to the dump file.
+ */
+struct metadump_ctx {
+	xfs_agnumber_t		agno;
+	xfs_ino_t		cur_ino;
+	struct metadump_seg	*seg;		/* segment being filled */
+	struct name_ent		*nametable[NAME_TABLE_SIZE];
+	struct attr_data_s	attr_data;
+
+	/* map to aggregate multiple extents into a single directory block */
+	struct bbmap		mfsb_map;
+	int			mfsb_length;
+};
+
+static __thread struct metadump_ctx	*mctx;
 
 void
 metadump_init(void)
@@ -81,6 +172,8 @@ metadump_help(void)
 "   -g -- Display dump progress\n"
 "   -m -- Specify max extent size in blocks to copy (default = %d blocks)\n"
 "   -o -- Don't obfuscate names and extended attributes\n"
+"   -t -- Number of threads scanning AGs (default = number of CPUs)\n"
+"   -v -- Metadump version: 1 (default) or 3 (compressed and indexed)\n"
 "   -w -- Show warnings of bad metadata information\n"
 "\n"), DEFAULT_MAX_EXT_SIZE);
 }
@@ -99,9 +192,11 @@ print_warning(const char *fmt, ...)
 	va_end(ap);
 	buf[sizeof(buf)-1] = '\0';
 
+	pthread_mutex_lock(&print_lock);
 	fprintf(stderr, "%s%s: %s\n", progress_since_warning ? "\n" : "",
 			progname, buf);
 	progress_since_warning = 0;
+	pthread_mutex_unlock(&print_lock);
 }
 
 static void
@@ -120,9 +215,11 @@ print_progress(const char *fmt, ...)
 	buf[sizeof(buf)-1] = '\0';
 
 	f = stdout_metadump ? stderr : stdout;
+	pthread_mutex_lock(&print_lock);
 	fprintf(f, "\r%-59s", buf);
 	fflush(f);
 	progress_since_warning = 1;
+	pthread_mutex_unlock(&print_lock);
 }
 
 /*
@@ -151,6 +248,352 @@ write_index(void)
 	return 0;
 }
 
+static int
+md3_write(
+	const void		*buf,
+	size_t			len)
+{
+	if (len && fwrite(buf, len, 1, outf) != 1) {
+		print_warning("error writing to target file");
+		return -1;
+	}
+	md3_pos += len;
+	return 0;
+}
+
+static int
+md3_start(
+	uint32_t		info)
+{
+	struct xfs_md3_header	hdr = {
+		.mh_magic	= cpu_to_be32(XFS_MD_MAGIC_V3),
+		.mh_info	= cpu_to_be32(info),
+		.mh_frame_size	= cpu_to_be32(MD3_FRAME_SIZE +
+				MD3_MAX_EXTENTS * sizeof(struct xfs_md3_extent)),
+	};
+
+	md3_alg = compress_default_alg();
+	md3_cbuf_len = compress_bound(md3_alg, MD3_FRAME_SIZE +
+			MD3_MAX_EXTENTS * sizeof(struct xfs_md3_extent));
+	md3_extents = calloc(MD3_MAX_EXTENTS, sizeof(struct xfs_md3_extent));
+	md3_data = malloc(MD3_FRAME_SIZE);
+	md3_ubuf = malloc(MD3_FRAME_SIZE +
+			MD3_MAX_EXTENTS * sizeof(struct xfs_md3_extent));
+	md3_cbuf = malloc(md3_cbuf_len);
+	if (!md3_extents || !md3_data || !md3_ubuf || !md3_cbuf) {
+		print_warning("memory allocation failure");
+		return -1;
+	}
+	md3_nr_extents = 0;
+	md3_data_len = 0;
+	md3_pos = 0;
+	md3_index = NULL;
+	md3_nr_index = 0;
+	md3_max_index = 0;
+
+	hdr.mh_crc = cpu_to_be32(crc32c_le(~0U, (unsigned char *)&hdr,
+				sizeof(hdr)));
+	return md3_write(&hdr, sizeof(hdr));
+}
+
+static void
+md3_free(void)
+{
+	free(md3_extents);
+	free(md3_data);
+	free(md3_ubuf);
+	free(md3_cbuf);
+	free(md3_index);
+	md3_extents = NULL;
+	md3_data = md3_ubuf = md3_cbuf = NULL;
+	md3_index = NULL;
+}
+
+/* Remember where the extents of the frame at @frame_pos ended up. */
+static int
+md3_add_index(
+	uint64_t		frame_pos)
+{
+	uint32_t		offset;
+	unsigned int		i;
+
+	if (md3_nr_index + md3_nr_extents > md3_max_index) {
+		uint64_t	nr = max(md3_max_index * 2,
+					md3_nr_index + md3_nr_extents);
+		void		*p;
+
+		p = realloc(md3_index, nr * sizeof(struct xfs_md3_index));
+		if (!p) {
+			print_warning("memory allocation failure");
+			return -1;
+		}
+		md3_index = p;
+		md3_max_index = nr;
+	}
+
+	offset = md3_nr_extents * sizeof(struct xfs_md3_extent);
+	for (i = 0; i < md3_nr_extents; i++) {
+		struct xfs_md3_index	*mi = &md3_index[md3_nr_index++];
+		uint32_t		len = be32_to_cpu(md3_extents[i].me_len);
+
+		mi->mi_daddr = md3_extents[i].me_daddr;
+		mi->mi_frame = cpu_to_be64(frame_pos);
+		mi->mi_len = cpu_to_be32(len);
+		mi->mi_offset = cpu_to_be32(offset);
+		offset += len << BBSHIFT;
+	}
+	return 0;
+}
+
+/*
+ * Compress and write out the current frame.  Frames that don't shrink are
+ * stored as they are.  Return 0 for success, -1 for failure.
+ */
+static int
+md3_write_frame(void)
+{
+	struct xfs_md3_frame	hdr = {
+		.mf_magic	= cpu_to_be32(XFS_MD3_FRAME_MAGIC),
+	};
+	size_t			ulen = 0;
+	ssize_t			clen = 0;
+	const char		*payload = NULL;
+	uint32_t		crc;
+
+	if (md3_nr_extents) {
+		ulen = md3_nr_extents * sizeof(struct xfs_md3_extent);
+		memcpy(md3_ubuf, md3_extents, ulen);
+		memcpy(md3_ubuf + ulen, md3_data, md3_data_len);
+		ulen += md3_data_len;
+
+		hdr.mf_alg = md3_alg;
+		payload = md3_cbuf;
+		clen = compress_buf(md3_alg, md3_ubuf, ulen, md3_cbuf,
+				md3_cbuf_len);
+		if (clen < 0 && clen != -ENOSPC) {
+			print_warning("cannot compress frame: %s",
+					strerror(-clen));
+			return -1;
+		}
+		if (clen < 0 || clen >= ulen) {
+			hdr.mf_alg = COMPRESS_NONE;
+			payload = md3_ubuf;
+			clen = ulen;
+		}
+		if (md3_add_index(md3_pos))
+			return -1;
+	}
+
+	hdr.mf_nr_extents = cpu_to_be32(md3_nr_extents);
+	hdr.mf_ulen = cpu_to_be32(ulen);
+	hdr.mf_clen = cpu_to_be32(clen);
+	crc = crc32c_le(~0U, (unsigned char *)&hdr, sizeof(hdr));
+	crc = crc32c_le(crc, (const unsigned char *)payload, clen);
+	hdr.mf_crc = cpu_to_be32(crc);
+
+	if (md3_write(&hdr, sizeof(hdr)) || md3_write(payload, clen))
+		return -1;
+
+	md3_nr_extents = 0;
+	md3_data_len = 0;
+	return 0;
+}
+
+/* Return 0 for success, -errno for failure. */
+static int
+md3_add(
+	char			*data,
+	int64_t			off,
+	int			len)
+{
+	while (len > 0) {
+		struct xfs_md3_extent	*ext = NULL;
+		unsigned int		count;
+
+		if (md3_nr_extents) {
+			ext = &md3_extents[md3_nr_extents - 1];
+			if (be64_to_cpu(ext->me_daddr) +
+			    be32_to_cpu(ext->me_len) != off)
+				ext = NULL;
+		}
+
+		if (md3_data_len == MD3_FRAME_SIZE ||
+		    (!ext && md3_nr_extents == MD3_MAX_EXTENTS)) {
+			if (md3_write_frame())
+				return -EIO;
+			ext = NULL;
+		}
+
+		if (!ext) {
+			ext = &md3_extents[md3_nr_extents++];
+			ext->me_daddr = cpu_to_be64(off);
+			ext->me_len = 0;
+		}
+
+		count = min((unsigned int)len,
+				(MD3_FRAME_SIZE - md3_data_len) >> BBSHIFT);
+		memcpy(md3_data + md3_data_len, data, count << BBSHIFT);
+		md3_data_len += count << BBSHIFT;
+		be32_add_cpu(&ext->me_len, count);
+		data += count << BBSHIFT;
+		off += count;
+		len -= count;
+	}
+	return 0;
+}
+
+static int
+md3_index_cmp(
+	const void		*a,
+	const void		*b)
+{
+	const struct xfs_md3_index *ia = a;
+	const struct xfs_md3_index *ib = b;
+	uint64_t		da = be64_to_cpu(ia->mi_daddr);
+	uint64_t		db = be64_to_cpu(ib->mi_daddr);
+	uint64_t		fa = be64_to_cpu(ia->mi_frame);
+	uint64_t		fb = be64_to_cpu(ib->mi_frame);
+
+	if (da != db)
+		return da < db ? -1 : 1;
+	/* keep dump order for blocks that were dumped more than once */
+	if (fa != fb)
+		return fa < fb ? -1 : 1;
+	return be32_to_cpu(ia->mi_offset) < be32_to_cpu(ib->mi_offset) ? -1 :
+	       be32_to_cpu(ia->mi_offset) > be32_to_cpu(ib->mi_offset);
+}
+
+/*
+ * Write out the last frame, the end marker, and the index and footer that
+ * make the dump seekable.  Return 0 for success, -1 for failure.
+ */
+static int
+md3_finish(void)
+{
+	struct xfs_md3_footer	ftr = {
+		.mt_magic	= cpu_to_be32(XFS_MD3_INDEX_MAGIC),
+	};
+	size_t			len;
+	uint32_t		crc;
+
+	if (md3_nr_extents && md3_write_frame())
+		return -1;
+	if (md3_write_frame())
+		return -1;
+
+	len = md3_nr_index * sizeof(struct xfs_md3_index);
+
+	qsort(md3_index, md3_nr_index, sizeof(struct xfs_md3_index),
+			md3_index_cmp);
+	ftr.mt_index = cpu_to_be64(md3_pos);
+	ftr.mt_nr_entries = cpu_to_be64(md3_nr_index);
+	crc = crc32c_le(~0U, (unsigned char *)md3_index, len);
+	crc = crc32c_le(crc, (unsigned char *)&ftr, sizeof(ftr));
+	ftr.mt_crc = cpu_to_be32(crc);
+
+	if (md3_write(md3_index, len) || md3_write(&ftr, sizeof(ftr)))
+		return -1;
+	return 0;
+}
+
+static struct metadump_seg *
+alloc_seg(void)
+{
+	struct metadump_seg	*seg;
+
+	seg = malloc(sizeof(*seg) + num_indices * (sizeof(__be64) + BBSIZE));
+	if (!seg)
+		return NULL;
+	seg->count = 0;
+	seg->index = (__be64 *)(seg + 1);
+	seg->data = (char *)(seg->index + num_indices);
+	return seg;
+}
+
+/*
+ * Get a new segment for a worker.  Workers scanning AGs ahead of the writer
+ * wait for queued segments to drain once too many are queued; the worker
+ * scanning the AG being written out never waits.  Workers pick up AGs in
+ * order, so that AG is always being scanned by someone and we can't deadlock.
+ */
+static struct metadump_seg *
+get_seg(
+	xfs_agnumber_t		agno)
+{
+	struct metadump_seg	*seg;
+
+	pthread_mutex_lock(&md_lock);
+	while (!md_abort && agno != md_write_agno &&
+	       md_nr_segs >= MAX_QUEUED_SEGS)
+		pthread_cond_wait(&md_space, &md_lock);
+	if (md_abort) {
+		pthread_mutex_unlock(&md_lock);
+		return NULL;
+	}
+	md_nr_segs++;
+	pthread_mutex_unlock(&md_lock);
+
+	seg = alloc_seg();
+	if (!seg) {
+		print_warning("memory allocation failure");
+		pthread_mutex_lock(&md_lock);
+		md_nr_segs--;
+		pthread_mutex_unlock(&md_lock);
+	}
+	return seg;
+}
+
+/* Hand this thread's current segment over to the writer. */
+static void
+queue_seg(void)
+{
+	struct metadump_ag	*ag = &md_ags[mctx->agno];
+
+	pthread_mutex_lock(&md_lock);
+	list_add_tail(&mctx->seg->list, &ag->segs);
+	pthread_cond_signal(&md_ready);
+	pthread_mutex_unlock(&md_lock);
+	mctx->seg = NULL;
+}
+
+static void
+put_seg(
+	struct metadump_seg	*seg)
+{
+	free(seg);
+	pthread_mutex_lock(&md_lock);
+	md_nr_segs--;
+	pthread_cond_broadcast(&md_space);
+	pthread_mutex_unlock(&md_lock);
+}
+
+/*
+ * Return 0 for success, -errno for failure.
+ */
+static int
+queue_buf_segment(
+	char			*data,
+	int64_t			off,
+	int			len)
+{
+	struct metadump_seg	*seg;
+	int			i;
+
+	for (i = 0; i < len; i++, off++, data += BBSIZE) {
+		if (!mctx->seg) {
+			mctx->seg = get_seg(mctx->agno);
+			if (!mctx->seg)
+				return -ECANCELED;
+		}
+		seg = mctx->seg;
+		seg->index[seg->count] = cpu_to_be64(off);
+		memcpy(&seg->data[seg->count << BBSHIFT], data, BBSIZE);
+		if (++seg->count == num_indices)
+			queue_seg();
+	}
+	return 0;
+}
+
 /*
  * Return 0 for success, -errno for failure.
  */
@@ -163,6 +606,11 @@ write_buf_segment(
 	int		i;
 	int		ret;
 
+	if (mctx->agno != NULLAGNUMBER)
+		return queue_buf_segment(data, off, len);
+	if (md_version == 3)
+		return md3_add(data, off, len);
+
 	for (i = 0; i < len; i++, off++, data += BBSIZE) {
 		block_index[cur_index] = cpu_to_be64(off);
 		memcpy(&block_buffer[cur_index << BBSHIFT], data, BBSIZE);
@@ -672,17 +1120,6 @@ copy_refcount_btree(
 
 /* filename and extended attribute obfuscation routines */
 
-struct name_ent {
-	struct name_ent		*next;
-	xfs_dahash_t		hash;
-	int			namelen;
-	unsigned char		name[1];
-};
-
-#define NAME_TABLE_SIZE		4096
-
-static struct name_ent		*nametable[NAME_TABLE_SIZE];
-
 static void
 nametable_clear(void)
 {
@@ -690,8 +1127,8 @@ nametable_clear(void)
 	struct name_ent	*ent;
 
 	for (i = 0; i < NAME_TABLE_SIZE; i++) {
-		while ((ent = nametable[i])) {
-			nametable[i] = ent->next;
+		while ((ent = mctx->nametable[i])) {
+			mctx->nametable[i] = ent->next;
 			free(ent);
 		}
 	}
@@ -706,7 +1143,7 @@ nametable_find(xfs_dahash_t hash, int namelen, unsigned char *name)
 {
 	struct name_ent	*ent;
 
-	for (ent = nametable[hash % NAME_TABLE_SIZE]; ent; ent = ent->next) {
+	for (ent = mctx->nametable[hash % NAME_TABLE_SIZE]; ent; ent = ent->next) {
 		if (ent->hash == hash && ent->namelen == namelen &&
 				!memcmp(ent->name, name, namelen))
 			return ent;
@@ -730,9 +1167,9 @@ nametable_add(xfs_dahash_t hash, int namelen, unsigned char *name)
 	ent->namelen = namelen;
 	memcpy(ent->name, name, namelen);
 	ent->hash = hash;
-	ent->next = nametable[hash % NAME_TABLE_SIZE];
+	ent->next = mctx->nametable[hash % NAME_TABLE_SIZE];
 
-	nametable[hash % NAME_TABLE_SIZE] = ent;
+	mctx->nametable[hash % NAME_TABLE_SIZE] = ent;
 
 	return ent;
 }
@@ -740,6 +1177,14 @@ nametable_add(xfs_dahash_t hash, int namelen, unsigned char *name)
 #define	ORPHANAGE	"lost+found"
 #define	ORPHANAGE_LEN	(sizeof (ORPHANAGE) - 1)
 
+/*
+ * find_orphanage sets orphanage_ino before any workers start.  If that fails,
+ * whoever dumps the root directory fills it in, so then it needs the lock.
+ */
+static xfs_ino_t	orphanage_ino;
+static bool		orphanage_found;
+static pthread_mutex_t	orphanage_lock = PTHREAD_MUTEX_INITIALIZER;
+
 static inline int
 is_orphanage_dir(
 	struct xfs_mount	*mp,
@@ -752,6 +1197,35 @@ is_orphanage_dir(
 			!memcmp(name, ORPHANAGE, ORPHANAGE_LEN);
 }
 
+/*
+ * Look up "lost+found" before we start dumping.  Orphans are recognised by
+ * their parent, so we need to know the orphanage before we see its contents,
+ * which may be dumped by another thread before the root directory is.  If
+ * the lookup fails we'll still pick it up when we come across it in the root.
+ */
+static void
+find_orphanage(void)
+{
+	struct xfs_name		xname = {
+		.name		= (unsigned char *)ORPHANAGE,
+		.len		= ORPHANAGE_LEN,
+	};
+	struct xfs_inode	*dp;
+	xfs_ino_t		ino;
+
+	orphanage_ino = 0;
+	orphanage_found = false;
+	if (libxfs_iget(mp, NULL, mp->m_sb.sb_rootino, 0, &dp))
+		return;
+	if (S_ISDIR(VFS_I(dp)->i_mode) &&
+	    !libxfs_dir_lookup(NULL, dp, &xname, &ino, NULL) &&
+	    libxfs_verify_ino(mp, ino)) {
+		orphanage_ino = ino;
+		orphanage_found = true;
+	}
+	libxfs_irele(dp);
+}
+
 /*
  * Determine whether a name is one we shouldn't obfuscate because
  * it's an orphan (or the "lost+found" directory itself).  Note
@@ -766,24 +1240,32 @@ in_lost_found(
 	int			namelen,
 	unsigned char		*name)
 {
-	static xfs_ino_t	orphanage_ino = 0;
 	char			s[24];	/* 21 is enough (64 bits in decimal) */
 	int			slen;
+	xfs_ino_t		orphanage;
 
 	/* Record the "lost+found" inode if we haven't done so already */
 
 	ASSERT(ino != 0);
-	if (!orphanage_ino && is_orphanage_dir(mp, cur_ino, namelen, name))
-		orphanage_ino = ino;
+	if (orphanage_found) {
+		orphanage = orphanage_ino;
+	} else {
+		pthread_mutex_lock(&orphanage_lock);
+		if (!orphanage_ino &&
+		    is_orphanage_dir(mp, mctx->cur_ino, namelen, name))
+			orphanage_ino = ino;
+		orphanage = orphanage_ino;
+		pthread_mutex_unlock(&orphanage_lock);
+	}
 
 	/* We don't obfuscate the "lost+found" directory itself */
 
-	if (ino == orphanage_ino)
+	if (ino == orphanage)
 		return 1;
 
 	/* Most files aren't in "lost+found" at all */
 
-	if (cur_ino != orphanage_ino)
+	if (mctx->cur_ino != orphanage)
 		return 0;
 
 	/*
@@ -897,7 +1379,7 @@ generate_obfuscated_name(
 		print_warning("duplicate name for inode %llu "
 				"in dir inode %llu\n",
 			(unsigned long long) ino,
-			(unsigned long long) cur_ino);
+			(unsigned long long) mctx->cur_ino);
 		return;
 	}
 
@@ -907,7 +1389,7 @@ generate_obfuscated_name(
 		print_warning("unable to record name for inode %llu "
 				"in dir inode %llu\n",
 			(unsigned long long) ino,
-			(unsigned long long) cur_ino);
+			(unsigned long long) mctx->cur_ino);
 }
 
 static void
@@ -925,7 +1407,7 @@ process_sf_dir(
 		ino_dir_size = XFS_DFORK_DSIZE(dip, mp);
 		if (show_warnings)
 			print_warning("invalid size in dir inode %llu",
-					(long long)cur_ino);
+					(long long)mctx->cur_ino);
 	}
 
 	sfep = xfs_dir2_sf_firstentry(sfp);
@@ -941,7 +1423,7 @@ process_sf_dir(
 		if (namelen == 0) {
 			if (show_warnings)
 				print_warning("zero length entry in dir inode "
-						"%llu", (long long)cur_ino);
+						"%llu", (long long)mctx->cur_ino);
 			if (i != sfp->count - 1)
 				break;
 			namelen = ino_dir_size - ((char *)&sfep->name[0] -
@@ -951,7 +1433,7 @@ process_sf_dir(
 				ino_dir_size) {
 			if (show_warnings)
 				print_warning("entry length in dir inode %llu "
-					"overflows space", (long long)cur_ino);
+					"overflows space", (long long)mctx->cur_ino);
 			if (i != sfp->count - 1)
 				break;
 			namelen = ino_dir_size - ((char *)&sfep->name[0] -
@@ -1028,7 +1510,7 @@ process_sf_symlink(
 	if (len > XFS_DFORK_DSIZE(dip, mp)) {
 		if (show_warnings)
 			print_warning("invalid size (%d) in symlink inode %llu",
-					len, (long long)cur_ino);
+					len, (long long)mctx->cur_ino);
 		len = XFS_DFORK_DSIZE(dip, mp);
 	}
 
@@ -1064,7 +1546,7 @@ process_sf_attr(
 		ino_attr_size = XFS_DFORK_ASIZE(dip, mp);
 		if (show_warnings)
 			print_warning("invalid attr size in inode %llu",
-					(long long)cur_ino);
+					(long long)mctx->cur_ino);
 	}
 
 	asfep = &asfp->list[0];
@@ -1076,13 +1558,13 @@ process_sf_attr(
 		if (namelen == 0) {
 			if (show_warnings)
 				print_warning("zero length attr entry in inode "
-						"%llu", (long long)cur_ino);
+						"%llu", (long long)mctx->cur_ino);
 			break;
 		} else if ((char *)asfep - (char *)asfp +
 				xfs_attr_sf_entsize(asfep) > ino_attr_size) {
 			if (show_warnings)
 				print_warning("attr entry length in inode %llu "
-					"overflows space", (long long)cur_ino);
+					"overflows space", (long long)mctx->cur_ino);
 			break;
 		}
 
@@ -1134,7 +1616,7 @@ process_dir_free_block(
 		if (show_warnings)
 			print_warning("invalid magic in dir inode %llu "
 				      "free block",
-				      (unsigned long long)cur_ino);
+				      (unsigned long long)mctx->cur_ino);
 		break;
 	}
 }
@@ -1232,7 +1714,7 @@ process_dir_data_block(
 		if (show_warnings)
 			print_warning(
 		"invalid magic in dir inode %llu block %ld",
-					(unsigned long long)cur_ino, (long)offset);
+					(unsigned long long)mctx->cur_ino, (long)offset);
 		return;
 	}
 
@@ -1255,7 +1737,7 @@ process_dir_data_block(
 				if (show_warnings)
 					print_warning(
 			"invalid length for dir free space in inode %llu",
-						(long long)cur_ino);
+						(long long)mctx->cur_ino);
 				return;
 			}
 			if (be16_to_cpu(*xfs_dir2_data_unused_tag_p(dup)) !=
@@ -1289,7 +1771,7 @@ process_dir_data_block(
 			if (show_warnings)
 				print_warning(
 			"invalid length for dir entry name in inode %llu",
-					(long long)cur_ino);
+					(long long)mctx->cur_ino);
 			return;
 		}
 		if (be16_to_cpu(*libxfs_dir2_data_entry_tag_p(mp, dep)) !=
@@ -1368,26 +1850,19 @@ out_pop:
 	return rval;
 }
 
-#define MAX_REMOTE_VALS		4095
-
-static struct attr_data_s {
-	int			remote_val_count;
-	xfs_dablk_t		remote_vals[MAX_REMOTE_VALS];
-} attr_data;
-
 static inline void
 add_remote_vals(
 	xfs_dablk_t 		blockidx,
 	int			length)
 {
-	while (length > 0 && attr_data.remote_val_count < MAX_REMOTE_VALS) {
-		attr_data.remote_vals[attr_data.remote_val_count] = blockidx;
-		attr_data.remote_val_count++;
+	while (length > 0 && mctx->attr_data.remote_val_count < MAX_REMOTE_VALS) {
+		mctx->attr_data.remote_vals[mctx->attr_data.remote_val_count] = blockidx;
+		mctx->attr_data.remote_val_count++;
 		blockidx++;
 		length -= XFS_ATTR3_RMT_BUF_SPACE(mp, mp->m_sb.sb_blocksize);
 	}
 
-	if (attr_data.remote_val_count >= MAX_REMOTE_VALS) {
+	if (mctx->attr_data.remote_val_count >= MAX_REMOTE_VALS) {
 		print_warning(
 "Overflowed attr obfuscation array. No longer obfuscating remote attrs.");
 	}
@@ -1415,8 +1890,8 @@ process_attr_block(
 	/* Remote attributes - attr3 has XFS_ATTR3_RMT_MAGIC, attr has none */
 	if ((be16_to_cpu(leaf->hdr.info.magic) != XFS_ATTR_LEAF_MAGIC) &&
 	    (be16_to_cpu(leaf->hdr.info.magic) != XFS_ATTR3_LEAF_MAGIC)) {
-		for (i = 0; i < attr_data.remote_val_count; i++) {
-			if (obfuscate && attr_data.remote_vals[i] == offset)
+		for (i = 0; i < mctx->attr_data.remote_val_count; i++) {
+			if (obfuscate && mctx->attr_data.remote_vals[i] == offset)
 				/* Macros to handle both attr and attr3 */
 				memset(block +
 					(bs - XFS_ATTR3_RMT_BUF_SPACE(mp, bs)),
@@ -1435,7 +1910,7 @@ process_attr_block(
 				XFS_ATTR3_RMT_BUF_SPACE(mp, bs)) {
 		if (show_warnings)
 			print_warning("invalid attr count in inode %llu",
-					(long long)cur_ino);
+					(long long)mctx->cur_ino);
 		return;
 	}
 
@@ -1453,7 +1928,7 @@ process_attr_block(
 			if (show_warnings)
 				print_warning(
 				"invalid attr nameidx in inode %llu",
-						(long long)cur_ino);
+						(long long)mctx->cur_ino);
 			break;
 		}
 		if (entry->flags & XFS_ATTR_LOCAL) {
@@ -1462,7 +1937,7 @@ process_attr_block(
 				if (show_warnings)
 					print_warning(
 				"zero length for attr name in inode %llu",
-						(long long)cur_ino);
+						(long long)mctx->cur_ino);
 				break;
 			}
 			if (obfuscate) {
@@ -1485,7 +1960,7 @@ process_attr_block(
 				if (show_warnings)
 					print_warning(
 				"invalid attr entry in inode %llu",
-						(long long)cur_ino);
+						(long long)mctx->cur_ino);
 				break;
 			}
 			if (obfuscate) {
@@ -1617,12 +2092,6 @@ out_pop:
 	return rval;
 }
 
-/*
- * Static map to aggregate multiple extents into a single directory block.
- */
-static struct bbmap mfsb_map;
-static int mfsb_length;
-
 static int
 process_multi_fsb_dir(
 	xfs_fileoff_t	o,
@@ -1637,21 +2106,21 @@ process_multi_fsb_dir(
 	while (c > 0) {
 		unsigned int	bm_len;
 
-		if (mfsb_length + c >= mp->m_dir_geo->fsbcount) {
-			bm_len = mp->m_dir_geo->fsbcount - mfsb_length;
-			mfsb_length = 0;
+		if (mctx->mfsb_length + c >= mp->m_dir_geo->fsbcount) {
+			bm_len = mp->m_dir_geo->fsbcount - mctx->mfsb_length;
+			mctx->mfsb_length = 0;
 		} else {
-			mfsb_length += c;
+			mctx->mfsb_length += c;
 			bm_len = c;
 		}
 
-		mfsb_map.b[mfsb_map.nmaps].bm_bn = XFS_FSB_TO_DADDR(mp, s);
-		mfsb_map.b[mfsb_map.nmaps].bm_len = XFS_FSB_TO_BB(mp, bm_len);
-		mfsb_map.nmaps++;
+		mctx->mfsb_map.b[mctx->mfsb_map.nmaps].bm_bn = XFS_FSB_TO_DADDR(mp, s);
+		mctx->mfsb_map.b[mctx->mfsb_map.nmaps].bm_len = XFS_FSB_TO_BB(mp, bm_len);
+		mctx->mfsb_map.nmaps++;
 
-		if (mfsb_length == 0) {
+		if (mctx->mfsb_length == 0) {
 			push_cur();
-			set_cur(&typtab[btype], 0, 0, DB_RING_IGN, &mfsb_map);
+			set_cur(&typtab[btype], 0, 0, DB_RING_IGN, &mctx->mfsb_map);
 			if (!iocur_top->data) {
 				xfs_agnumber_t	agno = XFS_FSB_TO_AGNO(mp, s);
 				xfs_agblock_t	agbno = XFS_FSB_TO_AGBNO(mp, s);
@@ -1681,7 +2150,7 @@ write:
 				rval = 0;
 out_pop:
 			pop_cur();
-			mfsb_map.nmaps = 0;
+			mctx->mfsb_map.nmaps = 0;
 			if (!rval)
 				break;
 		}
@@ -1759,7 +2228,7 @@ process_bmbt_reclist(
 				print_warning("bmap extent %d in %s ino %llu "
 					"starts at %llu, previous extent "
 					"ended at %llu", i,
-					typtab[btype].name, (long long)cur_ino,
+					typtab[btype].name, (long long)mctx->cur_ino,
 					o, op + cp - 1);
 			break;
 		}
@@ -1773,7 +2242,7 @@ process_bmbt_reclist(
 			if (show_warnings)
 				print_warning("suspicious count %u in bmap "
 					"extent %d in %s ino %llu", c, i,
-					typtab[btype].name, (long long)cur_ino);
+					typtab[btype].name, (long long)mctx->cur_ino);
 			break;
 		}
 
@@ -1788,7 +2257,7 @@ process_bmbt_reclist(
 				print_warning("invalid block number %u/%u "
 					"(%llu) in bmap extent %d in %s ino "
 					"%llu", agno, agbno, s, i,
-					typtab[btype].name, (long long)cur_ino);
+					typtab[btype].name, (long long)mctx->cur_ino);
 			break;
 		}
 
@@ -1796,7 +2265,7 @@ process_bmbt_reclist(
 			if (show_warnings)
 				print_warning("bmap extent %i in %s inode %llu "
 					"overflows AG (end is %u/%u)", i,
-					typtab[btype].name, (long long)cur_ino,
+					typtab[btype].name, (long long)mctx->cur_ino,
 					agno, agbno + c - 1);
 			break;
 		}
@@ -1895,7 +2364,7 @@ process_btinode(
 	if (level > XFS_BM_MAXLEVELS(mp, whichfork)) {
 		if (show_warnings)
 			print_warning("invalid level (%u) in inode %lld %s "
-					"root", level, (long long)cur_ino,
+					"root", level, (long long)mctx->cur_ino,
 					typtab[btype].name);
 		return 1;
 	}
@@ -1909,7 +2378,7 @@ process_btinode(
 	if (nrecs > maxrecs) {
 		if (show_warnings)
 			print_warning("invalid numrecs (%u) in inode %lld %s "
-					"root", nrecs, (long long)cur_ino,
+					"root", nrecs, (long long)mctx->cur_ino,
 					typtab[btype].name);
 		return 1;
 	}
@@ -1940,7 +2409,7 @@ process_btinode(
 			if (show_warnings)
 				print_warning("invalid block number (%u/%u) "
 						"in inode %llu %s root", ag,
-						bno, (long long)cur_ino,
+						bno, (long long)mctx->cur_ino,
 						typtab[btype].name);
 			continue;
 		}
@@ -1970,7 +2439,7 @@ process_exinode(
 	if (nex > max_nex || used > XFS_DFORK_SIZE(dip, mp, whichfork)) {
 		if (show_warnings)
 			print_warning("bad number of extents %llu in inode %lld",
-				(unsigned long long)nex, (long long)cur_ino);
+				(unsigned long long)nex, (long long)mctx->cur_ino);
 		return 1;
 	}
 
@@ -2003,7 +2472,7 @@ process_inode_data(
 				print_warning(
 "Invalid data fork size (%d) in inode %llu, preserving contents!",
 						XFS_DFORK_DSIZE(dip, mp),
-						(long long)cur_ino);
+						(long long)mctx->cur_ino);
 				break;
 			}
 
@@ -2037,7 +2506,7 @@ process_dev_inode(
 	if (xfs_dfork_data_extents(dip)) {
 		if (show_warnings)
 			print_warning("inode %llu has unexpected extents",
-				      (unsigned long long)cur_ino);
+				      (unsigned long long)mctx->cur_ino);
 		return;
 	}
 
@@ -2049,7 +2518,7 @@ process_dev_inode(
 	if (XFS_DFORK_DSIZE(dip, mp) > XFS_LITINO(mp)) {
 		print_warning(
 "Invalid data fork size (%d) in inode %llu, preserving contents!",
-				XFS_DFORK_DSIZE(dip, mp), (long long)cur_ino);
+				XFS_DFORK_DSIZE(dip, mp), (long long)mctx->cur_ino);
 		return;
 	}
 
@@ -2079,7 +2548,8 @@ process_inode(
 	bool			crc_was_ok = false; /* no recalc by default */
 	bool			need_new_crc = false;
 
-	cur_ino = XFS_AGINO_TO_INO(mp, agno, agino);
+	mctx->cur_ino = XFS_AGINO_TO_INO(mp, agno, agino);
+	obfuscate_seed(mctx->cur_ino);
 
 	/* we only care about crc recalculation if we will modify the inode. */
 	if (obfuscate || zero_stale_data) {
@@ -2127,7 +2597,7 @@ process_inode(
 
 	/* copy extended attributes if they exist and forkoff is valid */
 	if (XFS_DFORK_DSIZE(dip, mp) < XFS_LITINO(mp)) {
-		attr_data.remote_val_count = 0;
+		mctx->attr_data.remote_val_count = 0;
 		switch (dip->di_aformat) {
 			case XFS_DINODE_FMT_LOCAL:
 				need_new_crc = 1;
@@ -2256,7 +2726,7 @@ copy_inode_chunk(
 					XFS_INOBT_IS_FREE_DISK(rp, ioff + i)))
 				goto pop_out;
 
-			inodes_copied++;
+			uatomic_inc(&inodes_copied);
 		}
 
 		if (write_buf(iocur_top))
@@ -2269,7 +2739,8 @@ next_bp:
 
 	if (show_progress)
 		print_progress("Copied %u of %u inodes (%u of %u AGs)",
-				inodes_copied, mp->m_sb.sb_icount, agno,
+				uatomic_read(&inodes_copied),
+				mp->m_sb.sb_icount, agno,
 				mp->m_sb.sb_agcount);
 	rval = 1;
 pop_out:
@@ -2518,6 +2989,178 @@ pop_out:
 	return rval;
 }
 
+static void
+scan_ag_worker(
+	struct workqueue	*wq,
+	xfs_agnumber_t		agno,
+	void			*arg)
+{
+	struct metadump_ag	*ag = &md_ags[agno];
+	struct metadump_ctx	*ctx;
+	int			rval = 0;
+
+	ctx = calloc(1, sizeof(struct metadump_ctx));
+	if (!ctx) {
+		print_warning("memory allocation failure");
+		goto done;
+	}
+	ctx->agno = agno;
+	mctx = ctx;
+	iocur_copy_bufs = true;
+
+	rval = scan_ag(agno);
+
+	/* flush whatever is left in the last segment */
+	if (ctx->seg) {
+		if (ctx->seg->count > 0)
+			queue_seg();
+		else
+			put_seg(ctx->seg);
+	}
+	free_cur_stack();
+	iocur_copy_bufs = false;
+	mctx = NULL;
+	free(ctx);
+done:
+	pthread_mutex_lock(&md_lock);
+	ag->done = true;
+	ag->error = !rval;
+	pthread_cond_signal(&md_ready);
+	pthread_mutex_unlock(&md_lock);
+}
+
+/* Stream a worker's segment into the dump file. */
+static int
+write_seg(
+	struct metadump_seg	*seg)
+{
+	int			i;
+	int			ret;
+
+	for (i = 0; i < seg->count; i++) {
+		ret = write_buf_segment(&seg->data[i << BBSHIFT],
+				be64_to_cpu(seg->index[i]), 1);
+		if (ret)
+			return ret;
+	}
+	return 0;
+}
+
+/*
+ * Scan all the AGs with a pool of @nr_threads workers and write out what they
+ * find in AG order.  Returns 1 for success, 0 for failure.
+ */
+static int
+scan_ags(
+	unsigned int		nr_threads)
+{
+	struct workqueue	wq;
+	struct metadump_seg	*seg;
+	struct metadump_ag	*ag;
+	xfs_agnumber_t		agno;
+	int			old_buf_lock = use_xfs_buf_lock;
+	bool			failed = false;
+	int			ret;
+
+	if (nr_threads <= 1) {
+		for (agno = 0; agno < mp->m_sb.sb_agcount; agno++) {
+			if (!scan_ag(agno))
+				return 0;
+		}
+		return 1;
+	}
+
+	md_ags = calloc(mp->m_sb.sb_agcount, sizeof(struct metadump_ag));
+	if (!md_ags) {
+		print_warning("memory allocation failure");
+		return 0;
+	}
+	for (agno = 0; agno < mp->m_sb.sb_agcount; agno++)
+		INIT_LIST_HEAD(&md_ags[agno].segs);
+	md_write_agno = 0;
+	md_nr_segs = 0;
+	md_abort = false;
+
+	/*
+	 * Workers may end up reading the same blocks if the filesystem is
+	 * crosslinked.  They only hold a buffer lock while they copy the block
+	 * (see iocur_copy_bufs), so they can't deadlock on each other.
+	 */
+	use_xfs_buf_lock = 1;
+
+	ret = -workqueue_create(&wq, NULL, nr_threads);
+	if (ret) {
+		print_warning("cannot create worker threads: %s", strerror(ret));
+		failed = true;
+		goto out_free;
+	}
+	for (agno = 0; agno < mp->m_sb.sb_agcount; agno++) {
+		ret = -workqueue_add(&wq, scan_ag_worker, agno, NULL);
+		if (ret) {
+			print_warning("cannot queue AG %u: %s", agno,
+					strerror(ret));
+			failed = true;
+			break;
+		}
+	}
+	if (failed) {
+		/* let the writer loop below reap the AGs that did get queued */
+		pthread_mutex_lock(&md_lock);
+		md_abort = true;
+		for (; agno < mp->m_sb.sb_agcount; agno++)
+			md_ags[agno].done = md_ags[agno].error = true;
+		pthread_mutex_unlock(&md_lock);
+	}
+
+	/*
+	 * Write out each AG in turn.  Once something has gone wrong we tell
+	 * the workers to give up and throw away whatever they queue.
+	 */
+	pthread_mutex_lock(&md_lock);
+	for (agno = 0; agno < mp->m_sb.sb_agcount; agno++) {
+		ag = &md_ags[agno];
+		md_write_agno = agno;
+		pthread_cond_broadcast(&md_space);
+
+		for (;;) {
+			while (list_empty(&ag->segs) && !ag->done)
+				pthread_cond_wait(&md_ready, &md_lock);
+			if (list_empty(&ag->segs))
+				break;
+
+			seg = list_first_entry(&ag->segs, struct metadump_seg,
+					list);
+			list_del(&seg->list);
+			pthread_mutex_unlock(&md_lock);
+
+			if (!failed && write_seg(seg))
+				failed = true;
+			put_seg(seg);
+
+			pthread_mutex_lock(&md_lock);
+			if (failed && !md_abort) {
+				md_abort = true;
+				pthread_cond_broadcast(&md_space);
+			}
+		}
+
+		if (ag->error && !failed) {
+			failed = true;
+			md_abort = true;
+			pthread_cond_broadcast(&md_space);
+		}
+	}
+	pthread_mutex_unlock(&md_lock);
+
+	workqueue_terminate(&wq);
+	workqueue_destroy(&wq);
+out_free:
+	use_xfs_buf_lock = old_buf_lock;
+	free(md_ags);
+	md_ags = NULL;
+	return !failed;
+}
+
 static int
 copy_ino(
 	xfs_ino_t		ino,
@@ -2556,7 +3199,8 @@ copy_ino(
 	}
 	off_cur(offset << mp->m_sb.sb_inodelog, mp->m_sb.sb_inodesize);
 
-	cur_ino = ino;
+	mctx->cur_ino = ino;
+	obfuscate_seed(ino);
 	rval = process_inode_data(iocur_top->data, itype);
 pop_out:
 	pop_cur();
@@ -2651,7 +3295,8 @@ metadump_f(
 	int 		argc,
 	char 		**argv)
 {
-	xfs_agnumber_t	agno;
+	struct metadump_ctx	*ctx = NULL;
+	unsigned int	nr_threads = platform_nproc();
 	int		c;
 	int		start_iocur_sp;
 	int		outfd = -1;
@@ -2679,7 +3324,8 @@ metadump_f(
 		return 0;
 	}
 
-	while ((c = getopt(argc, argv, "aegm:ow")) != EOF) {
+	md_version = 1;
+	while ((c = getopt(argc, argv, "aegm:ot:v:w")) != EOF) {
 		switch (c) {
 			case 'a':
 				zero_stale_data = 0;
@@ -2701,6 +3347,23 @@ metadump_f(
 			case 'o':
 				obfuscate = 0;
 				break;
+			case 't':
+				nr_threads = (unsigned int)strtoul(optarg, &p, 0);
+				if (*p != '\0' || nr_threads == 0) {
+					print_warning("bad thread count %s",
+							optarg);
+					return 0;
+				}
+				break;
+			case 'v':
+				md_version = (int)strtol(optarg, &p, 0);
+				if (*p != '\0' ||
+				    (md_version != 1 && md_version != 3)) {
+					print_warning("bad metadump version %s",
+							optarg);
+					return 0;
+				}
+				break;
 			case 'w':
 				show_warnings = 1;
 				break;
@@ -2715,11 +3378,16 @@ metadump_f(
 		return 0;
 	}
 
+	ctx = calloc(1, sizeof(struct metadump_ctx));
 	metablock = (xfs_metablock_t *)calloc(BBSIZE + 1, BBSIZE);
-	if (metablock == NULL) {
+	if (ctx == NULL || metablock == NULL) {
 		print_warning("memory allocation failure");
+		free(ctx);
+		free(metablock);
 		return 0;
 	}
+	ctx->agno = NULLAGNUMBER;
+	mctx = ctx;
 	metablock->mb_blocklog = BBSHIFT;
 	metablock->mb_magic = cpu_to_be32(XFS_MD_MAGIC);
 
@@ -2757,8 +3425,7 @@ metadump_f(
 	if (mp->m_sb.sb_sectsize > num_indices * BBSIZE) {
 		print_warning("Cannot dump filesystem with sector size %u",
 			      mp->m_sb.sb_sectsize);
-		free(metablock);
-		return 0;
+		goto out;
 	}
 
 	cur_index = 0;
@@ -2767,8 +3434,7 @@ metadump_f(
 	if (strcmp(argv[optind], "-") == 0) {
 		if (isatty(fileno(stdout))) {
 			print_warning("cannot write to a terminal");
-			free(metablock);
-			return 0;
+			goto out;
 		}
 		/*
 		 * Redirect stdout to stderr for the duration of the
@@ -2809,13 +3475,15 @@ metadump_f(
 
 	exitcode = 0;
 
-	for (agno = 0; agno < mp->m_sb.sb_agcount; agno++) {
-		if (!scan_ag(agno)) {
-			exitcode = 1;
-			break;
-		}
+	if (md_version == 3 && md3_start(metablock->mb_info)) {
+		exitcode = 1;
+		goto out_close;
 	}
 
+	if (obfuscate)
+		find_orphanage();
+	exitcode = !scan_ags(min(nr_threads, mp->m_sb.sb_agcount));
+
 	/* copy realtime and quota inode contents */
 	if (!exitcode)
 		exitcode = !copy_sb_inodes();
@@ -2826,8 +3494,9 @@ metadump_f(
 
 	/* write the remaining index */
 	if (!exitcode)
-		exitcode = write_index() < 0;
+		exitcode = (md_version == 3 ? md3_finish() : write_index()) < 0;
 
+out_close:
 	if (progress_since_warning)
 		fputc('\n', stdout_metadump ? stderr : stdout);
 
@@ -2845,7 +3514,10 @@ metadump_f(
 	while (iocur_sp > start_iocur_sp)
 		pop_cur();
 out:
+	md3_free();
 	free(metablock);
+	mctx = NULL;
+	free(ctx);
 
 	return 0;
 }
@@ -7,6 +7,21 @@
 #include "init.h"
 #include "obfuscate.h"
 
+/*
+ * Obfuscated names are generated from a per-thread random sequence so that
+ * names dumped by different threads don't depend on how the threads happened
+ * to interleave.
+ */
+static __thread unsigned int	obfuscate_rand_state = 1;
+
+/* Restart the random sequence, e.g. for each inode whose names we change. */
+void
+obfuscate_seed(
+	uint64_t	seed)
+{
+	obfuscate_rand_state = (unsigned int)(seed ^ (seed >> 32));
+}
+
 static inline unsigned char
 random_filename_char(void)
 {
@@ -14,7 +29,8 @@ random_filename_char(void)
 						"abcdefghijklmnopqrstuvwxyz"
 						"0123456789-_";
 
-	return filename_alphabet[random() % (sizeof filename_alphabet - 1)];
+	return filename_alphabet[rand_r(&obfuscate_rand_state) %
+				 (sizeof filename_alphabet - 1)];
 }
 
 #define rol32(x,y)		(((x) << (y)) | ((x) >> (32 - (y))))
@@ -13,6 +13,7 @@
 #include "libfrog/paths.h"
 #include "libfrog/fsgeom.h"
 #include "libfrog/bulkstat.h"
+#include "libfrog/workqueue.h"
 
 #include <fcntl.h>
 #include <errno.h>
@@ -40,9 +41,10 @@ static int argv_blksz_dio;
 extern int max_ext_size;
 static int npasses = 10;
 static int startpass = 0;
+static int nr_jobs = 1;		/* files defragmented at once */
 
-static struct getbmap  *outmap = NULL;
-static int		outmap_size = 0;
+static __thread struct getbmap	*outmap = NULL;
+static __thread int		outmap_size = 0;
 static int		RealUid;
 static int		tmp_agi;
 static int64_t		minimumfree = 2048;
@@ -83,6 +85,7 @@ int fsrprintf(const char *fmt, ...);
 int read_fd_bmap(int, struct xfs_bstat *, int *);
 static void tmp_init(char *mnt);
 static char * tmp_next(char *mnt);
+static void tmp_name(char *mnt, int agno, char *buf);
 static void tmp_close(char *mnt);
 
 static struct xfs_fsop_geom fsgeom;	/* geometry of active mounted system */
@@ -139,7 +142,7 @@ main(int argc, char **argv)
 
 	gflag = ! isatty(0);
 
-	while ((c = getopt(argc, argv, "C:p:e:MgsdnvTt:f:m:b:N:FV")) != -1) {
+	while ((c = getopt(argc, argv, "C:p:e:MgsdnvTt:f:m:b:N:FVj:")) != -1) {
 		switch (c) {
 		case 'M':
 			Mflag = 1;
@@ -178,6 +181,15 @@ main(int argc, char **argv)
 		case 'p':
 			npasses = atoi(optarg);
 			break;
+		case 'j':
+			nr_jobs = atoi(optarg);
+			if (nr_jobs < 1) {
+				fprintf(stderr,
+					_("%s: bad number of jobs: %s\n"),
+					progname, optarg);
+				usage(1);
+			}
+			break;
 		case 'C':
 			/* Testing opt: coerses frag count in result */
 			if (getenv("FSRXFSTEST") != NULL) {
@@ -276,7 +288,8 @@ usage(int ret)
 {
 	fprintf(stderr, _(
 "Usage: %s [-d] [-v] [-g] [-t time] [-p passes] [-f leftf] [-m mtab]\n"
-"       %s [-d] [-v] [-g] xfsdev | dir | file ...\n"
+"                [-j jobs]\n"
+"       %s [-d] [-v] [-g] [-j jobs] xfsdev | dir | file ...\n"
 "       %s -V\n\n"
 "Options:\n"
 "       -g              Print to syslog (default if stdout not a tty).\n"
@@ -284,6 +297,7 @@ usage(int ret)
 "       -p passes       Number of passes before terminating global re-org.\n"
 "       -f leftoff      Use this instead of %s.\n"
 "       -m mtab         Use something other than /etc/mtab.\n"
+"       -j jobs         Defragment this many files at once.\n"
 "       -d              Debug, print even more.\n"
 "       -v              Verbose, more -v's more verbose.\n"
 "       -V              Print version number and exit.\n"
@@ -577,20 +591,164 @@ fsrall_cleanup(int timeout)
 }
 
 /*
- * To compare bstat structs for qsort.
+ * How much defragmenting a file is worth: the number of extents it could
+ * lose for every byte that has to be copied to get rid of them.
+ */
+static double
+fsr_score(const struct xfs_bulkstat *bs)
+{
+	if (bs->bs_extents64 < 2 || bs->bs_blocks == 0)
+		return 0;
+	return (double)(bs->bs_extents64 - 1) /
+	       ((double)bs->bs_blocks * bs->bs_blksize);
+}
+
+/*
+ * To compare bstat structs for qsort, best fragmentation win per byte
+ * copied first.
  */
 static int
 cmp(const void *s1, const void *s2)
 {
 	const struct xfs_bulkstat	*bs1 = s1;
 	const struct xfs_bulkstat	*bs2 = s2;
+	double				score1, score2;
 
 	ASSERT((bs1->bs_version == XFS_BULKSTAT_VERSION_V1 &&
 		bs2->bs_version == XFS_BULKSTAT_VERSION_V1) ||
 		(bs1->bs_version == XFS_BULKSTAT_VERSION_V5 &&
 		bs2->bs_version == XFS_BULKSTAT_VERSION_V5));
 
-	return (bs2->bs_extents64 - bs1->bs_extents64);
+	score1 = fsr_score(bs1);
+	score2 = fsr_score(bs2);
+	if (score1 > score2)
+		return -1;
+	return score1 < score2;
+}
+
+/*
+ * Defragment one file from a bulkstat batch, using tmp file tname.
+ * Returns the fsrfile_common result, or -1 if the file was skipped.
+ */
+static int
+fsrfs_file(
+	struct xfs_fd		*fsxfd,
+	jdm_fshandle_t		*fshandlep,
+	char			*mntdir,
+	struct xfs_bulkstat	*p,
+	char			*tname)
+{
+	struct xfs_bstat	bs1;
+	char			fname[64];
+	int			fd;
+	int			ret;
+
+	/* Do some obvious checks now */
+	if (((p->bs_mode & S_IFMT) != S_IFREG) || (p->bs_extents64 < 2))
+		return -1;
+
+	ret = -xfrog_bulkstat_v5_to_v1(fsxfd, &bs1, p);
+	if (ret) {
+		fsrprintf(_("bstat conversion error: %s\n"), strerror(ret));
+		return -1;
+	}
+
+	fd = jdm_open(fshandlep, &bs1, O_RDWR | O_DIRECT);
+	if (fd < 0) {
+		/* This probably means the file was
+		 * removed while in progress of handling
+		 * it.  Just quietly ignore this file.
+		 */
+		if (dflag)
+			fsrprintf(_("could not open: inode %llu\n"),
+					p->bs_ino);
+		return -1;
+	}
+
+	/* Don't know the pathname, so make up something */
+	sprintf(fname, "ino=%lld", (long long)p->bs_ino);
+
+	ret = fsrfile_common(fname, tname, mntdir, fd, &bs1);
+	close(fd);
+	return ret;
+}
+
+/*
+ * With -j, several files from each bulkstat batch are defragmented at once.
+ * Each job puts its tmp file in an AG directory that no other job is using
+ * at the time, so that the new copies are allocated in different AGs and
+ * don't compete for the same free space.
+ */
+struct fsr_jobs {
+	struct xfs_fd		*fsxfd;
+	jdm_fshandle_t		*fshandlep;
+	char			*mntdir;
+	pthread_mutex_t		lock;
+	int			count;		/* files left to defrag */
+	bool			*ag_busy;	/* tmp dirs in use */
+};
+
+static void
+fsrfs_job(
+	struct workqueue	*wq,
+	uint32_t		index,
+	void			*arg)
+{
+	struct fsr_jobs		*jobs = wq->wq_ctx;
+	struct xfs_bulkstat	*p = arg;
+	char			tname[SMBUFSZ];
+	int			agno;
+	int			ret;
+
+	pthread_mutex_lock(&jobs->lock);
+	if (jobs->count <= 0) {
+		pthread_mutex_unlock(&jobs->lock);
+		return;
+	}
+	/* there are never more jobs than AGs */
+	while (jobs->ag_busy[tmp_agi]) {
+		if (++tmp_agi == fsgeom.agcount)
+			tmp_agi = 0;
+	}
+	agno = tmp_agi;
+	jobs->ag_busy[agno] = true;
+	pthread_mutex_unlock(&jobs->lock);
+
+	tmp_name(jobs->mntdir, agno, tname);
+	ret = fsrfs_file(jobs->fsxfd, jobs->fshandlep, jobs->mntdir, p, tname);
+
+	pthread_mutex_lock(&jobs->lock);
+	jobs->ag_busy[agno] = false;
+	if (ret == 0)
+		jobs->count--;
+	if (p->bs_ino > leftoffino)
+		leftoffino = p->bs_ino;
+	pthread_mutex_unlock(&jobs->lock);
+}
+
+static void
+fsrfs_batch(
+	struct fsr_jobs		*jobs,
+	struct xfs_bulkstat	*buf,
+	uint32_t		nr)
+{
+	struct workqueue	wq;
+	uint32_t		i;
+	int			ret;
+
+	ret = -workqueue_create(&wq, jobs, min(nr_jobs, fsgeom.agcount));
+	if (ret) {
+		fsrprintf(_("could not start jobs: %s\n"), strerror(ret));
+		exit(1);
+	}
+	for (i = 0; i < nr && !ret; i++)
+		ret = -workqueue_add(&wq, fsrfs_job, i, &buf[i]);
+	if (ret)
+		fsrprintf(_("could not queue job: %s\n"), strerror(ret));
+	ret = -workqueue_terminate(&wq);
+	if (ret)
+		fsrprintf(_("could not finish jobs: %s\n"), strerror(ret));
+	workqueue_destroy(&wq);
 }
 
 /*
@@ -600,13 +758,11 @@ static int
 fsrfs(char *mntdir, xfs_ino_t startino, int targetrange)
 {
 	struct xfs_fd	fsxfd = XFS_FD_INIT_EMPTY;
-	int	fd;
 	int	count = 0;
 	int	ret;
-	char	fname[64];
-	char	*tname;
 	jdm_fshandle_t	*fshandlep;
 	struct xfs_bulkstat_req	*breq;
+	struct fsr_jobs	jobs = { };
 
 	fsrprintf(_("%s start inode=%llu\n"), mntdir,
 		(unsigned long long)startino);
@@ -629,16 +785,35 @@ fsrfs(char *mntdir, xfs_ino_t startino, int targetrange)
 
 	tmp_init(mntdir);
 
-	ret = -xfrog_bulkstat_alloc_req(GRABSZ, startino, &breq);
+	/* the -C test option needs files done strictly in order */
+	if (nfrags)
+		nr_jobs = 1;
+	if (nr_jobs > 1) {
+		jobs.fsxfd = &fsxfd;
+		jobs.fshandlep = fshandlep;
+		jobs.mntdir = mntdir;
+		jobs.ag_busy = calloc(fsgeom.agcount, sizeof(bool));
+		if (!jobs.ag_busy) {
+			fsrprintf(_("Skipping %s: %s\n"), mntdir,
+					strerror(errno));
+			xfd_close(&fsxfd);
+			free(fshandlep);
+			return -1;
+		}
+		pthread_mutex_init(&jobs.lock, NULL);
+	}
+
+	/* give each job a few files to choose from */
+	ret = -xfrog_bulkstat_alloc_req(GRABSZ * nr_jobs, startino, &breq);
 	if (ret) {
 		fsrprintf(_("Skipping %s: %s\n"), mntdir, strerror(ret));
+		free(jobs.ag_busy);
 		xfd_close(&fsxfd);
 		free(fshandlep);
 		return -1;
 	}
 
 	while ((ret = -xfrog_bulkstat(&fsxfd, breq) == 0)) {
-		struct xfs_bstat	bs1;
 		struct xfs_bulkstat	*buf = breq->bulkstat;
 		struct xfs_bulkstat	*p;
 		struct xfs_bulkstat	*endp;
@@ -652,46 +827,21 @@ fsrfs(char *mntdir, xfs_ino_t startino, int targetrange)
 
 		qsort((char *)buf, buflenout, sizeof(struct xfs_bulkstat), cmp);
 
-		for (p = buf, endp = (buf + buflenout); p < endp ; p++) {
-			/* Do some obvious checks now */
-			if (((p->bs_mode & S_IFMT) != S_IFREG) ||
-			     (p->bs_extents64 < 2))
-				continue;
-
-			ret = -xfrog_bulkstat_v5_to_v1(&fsxfd, &bs1, p);
-			if (ret) {
-				fsrprintf(_("bstat conversion error: %s\n"),
-						strerror(ret));
-				continue;
-			}
-
-			fd = jdm_open(fshandlep, &bs1, O_RDWR | O_DIRECT);
-			if (fd < 0) {
-				/* This probably means the file was
-				 * removed while in progress of handling
-				 * it.  Just quietly ignore this file.
-				 */
-				if (dflag)
-					fsrprintf(_("could not open: "
-						"inode %llu\n"), p->bs_ino);
-				continue;
-			}
-
-			/* Don't know the pathname, so make up something */
-			sprintf(fname, "ino=%lld", (long long)p->bs_ino);
-
-			/* Get a tmp file name */
-			tname = tmp_next(mntdir);
-
-			ret = fsrfile_common(fname, tname, mntdir, fd, &bs1);
-
-			leftoffino = p->bs_ino;
+		if (nr_jobs > 1) {
+			jobs.count = count;
+			fsrfs_batch(&jobs, buf, buflenout);
+		} else {
+			for (p = buf, endp = (buf + buflenout); p < endp; p++) {
+				/* Get a tmp file name */
+				ret = fsrfs_file(&fsxfd, fshandlep, mntdir, p,
+						tmp_next(mntdir));
 
-			close(fd);
+				leftoffino = p->bs_ino;
 
-			if (ret == 0) {
-				if (--count <= 0)
-					break;
+				if (ret == 0) {
+					if (--count <= 0)
+						break;
+				}
 			}
 		}
 		if (endtime && endtime < time(NULL)) {
@@ -705,6 +855,7 @@ fsrfs(char *mntdir, xfs_ino_t startino, int targetrange)
 	if (ret)
 		fsrprintf(_("%s: bulkstat: %s\n"), progname, strerror(ret));
 out0:
+	free(jobs.ag_busy);
 	free(breq);
 	tmp_close(mntdir);
 	xfd_close(&fsxfd);
@@ -1146,7 +1297,7 @@ packfile(char *fname, char *tname, int fd,
 	unsigned	blksz_dio;
 	unsigned	dio_min;
 	struct dioattr	dio;
-	static xfs_swapext_t   sx;
+	xfs_swapext_t	sx;
 	struct xfs_flock64  space;
 	off64_t 	cnt, pos;
 	void 		*fbuf = NULL;
@@ -1710,15 +1861,21 @@ tmp_init(char *mnt)
 	return;
 }
 
+static void
+tmp_name(char *mnt, int agno, char *buf)
+{
+	sprintf(buf, "%s/.fsr/ag%d/tmp%d",
+	        ( (strcmp(mnt, "/") == 0) ? "" : mnt),
+	        agno,
+	        getpid());
+}
+
 static char *
 tmp_next(char *mnt)
 {
 	static char	buf[SMBUFSZ];
 
-	sprintf(buf, "%s/.fsr/ag%d/tmp%d",
-	        ( (strcmp(mnt, "/") == 0) ? "" : mnt),
-	        tmp_agi,
-	        getpid());
+	tmp_name(mnt, tmp_agi, buf);
 
 	if (++tmp_agi == fsgeom.agcount)
 		tmp_agi = 0;
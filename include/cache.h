@@ -16,6 +16,18 @@
  */
 #define CACHE_MISCOMPARE_PURGE	(1 << 0)
 
+/*
+ * Use the sharded cache engine.  Hash chains are searched under RCU instead
+ * of the chain mutex, hit/miss statistics are kept in per-cpu counters, and
+ * the reclaim MRU lists are split into per-shard lists so that threads working
+ * on unrelated buffers do not all serialise on the same locks.
+ *
+ * Nodes removed from the hash are only handed back to ->relse/->bulkrelse
+ * after an RCU grace period, so every thread calling into a cache created
+ * with this flag must be registered with liburcu.
+ */
+#define CACHE_SHARDED		(1 << 1)
+
 /*
  * cache object campare return values
  */
@@ -93,9 +105,16 @@ struct cache_node {
 	unsigned int		cn_hashidx;	/* hash chain index */
 	int			cn_priority;	/* priority, -1 = free list */
 	int			cn_old_priority;/* saved pre-dirty prio */
+	bool			cn_unhashed;	/* removed from hash chain */
 	pthread_mutex_t		cn_mutex;	/* node mutex */
 };
 
+/* per-cpu statistics for CACHE_SHARDED caches */
+struct cache_pcpu_stats {
+	unsigned long		cs_hits;	/* cache hits */
+	unsigned long		cs_misses;	/* cache misses */
+} __attribute__((aligned(64)));
+
 struct cache {
 	int			c_flags;	/* behavioural flags */
 	unsigned int		c_maxcount;	/* max cache nodes */
@@ -110,9 +129,13 @@ struct cache {
 	unsigned int		c_hashsize;	/* hash bucket count */
 	unsigned int		c_hashshift;	/* hash key shift */
 	struct cache_hash	*c_hash;	/* hash table buckets */
-	struct cache_mru	c_mrus[CACHE_DIRTY_PRIORITY + 1];
+	unsigned int		c_nr_shards;	/* number of MRU shards */
+	unsigned int		c_shake_shard;	/* next shard to shake */
+	struct cache_mru	*c_mrus;	/* per-shard MRU lists */
 	unsigned long long	c_misses;	/* cache misses */
 	unsigned long long	c_hits;		/* cache hits */
+	unsigned int		c_nr_stats;	/* number of per-cpu stats */
+	struct cache_pcpu_stats	*c_stats;	/* per-cpu hit/miss counts */
 	unsigned int 		c_max;		/* max nodes ever used */
 };
 
@@ -128,6 +151,8 @@ void cache_node_set_priority(struct cache *, struct cache_node *, int);
 int cache_node_get_priority(struct cache_node *);
 int cache_node_purge(struct cache *, cache_key_t, struct cache_node *);
 void cache_report(FILE *fp, const char *, struct cache *);
+void cache_get_stats(struct cache *, unsigned long long *hits,
+		unsigned long long *misses);
 int cache_overflowed(struct cache *);
 
 #endif	/* __CACHE_H__ */
@@ -139,6 +139,9 @@ extern xfs_lsn_t libxfs_max_lsn;
 extern int	libxfs_init (libxfs_init_t *);
 void		libxfs_destroy(struct libxfs_xinit *li);
 extern int	libxfs_device_to_fd (dev_t);
+struct xfs_mdimage *libxfs_device_to_mdimage(dev_t dev);
+ssize_t		libxfs_device_pread(dev_t dev, void *buf, size_t len,
+				off64_t offset);
 extern dev_t	libxfs_device_open (char *, int, int, int);
 extern void	libxfs_device_close (dev_t);
 extern int	libxfs_device_alignment (void);
@@ -23,4 +23,61 @@ typedef struct xfs_metablock {
 #define XFS_METADUMP_FULLBLOCKS	(1 << 2)
 #define XFS_METADUMP_DIRTYLOG	(1 << 3)
 
+/*
+ * Version 3 metadumps are a container of independently compressed frames:
+ *
+ *	header
+ *	frame header, compressed payload
+ *	...
+ *	end frame (a frame header with no extents and no payload)
+ *	index entries, sorted by daddr
+ *	footer
+ *
+ * The uncompressed payload of a frame is an array of extents followed by
+ * the contents of each extent in turn.  The frames can be restored in a
+ * single pass over the file, and the trailing index lets a reader seek
+ * straight to the frame holding any given disk address.  All fields are
+ * big endian and all checksums are crc32c.
+ */
+#define XFS_MD_MAGIC_V3		0x584d4433	/* 'XMD3' */
+#define XFS_MD3_FRAME_MAGIC	0x584d4446	/* 'XMDF' */
+#define XFS_MD3_INDEX_MAGIC	0x584d4449	/* 'XMDI' */
+
+struct xfs_md3_header {
+	__be32		mh_magic;	/* XFS_MD_MAGIC_V3 */
+	__be32		mh_info;	/* XFS_METADUMP_* flags */
+	__be32		mh_frame_size;	/* max uncompressed frame payload */
+	__be32		mh_crc;		/* crc of this header */
+};
+
+struct xfs_md3_frame {
+	__be32		mf_magic;	/* XFS_MD3_FRAME_MAGIC */
+	uint8_t		mf_alg;		/* compression algorithm */
+	uint8_t		mf_pad[3];
+	__be32		mf_nr_extents;
+	__be32		mf_ulen;	/* uncompressed payload length */
+	__be32		mf_clen;	/* compressed payload length */
+	__be32		mf_crc;		/* crc of frame header and payload */
+};
+
+struct xfs_md3_extent {
+	__be64		me_daddr;
+	__be32		me_len;		/* length in basic blocks */
+	__be32		me_pad;
+};
+
+struct xfs_md3_index {
+	__be64		mi_daddr;
+	__be64		mi_frame;	/* file offset of the frame header */
+	__be32		mi_len;		/* length in basic blocks */
+	__be32		mi_offset;	/* offset of the data in the payload */
+};
+
+struct xfs_md3_footer {
+	__be32		mt_magic;	/* XFS_MD3_INDEX_MAGIC */
+	__be32		mt_crc;		/* crc of the index and this footer */
+	__be64		mt_index;	/* file offset of the first index entry */
+	__be64		mt_nr_entries;
+};
+
 #endif /* _XFS_METADUMP_H_ */
@@ -0,0 +1,364 @@
+// SPDX-License-Identifier: GPL-2.0+
+/*
+ * Copyright (C) 2026 Oracle.  All Rights Reserved.
+ */
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "compress.h"
+
+#ifdef HAVE_LIBZSTD
+#include <zstd.h>
+
+#define COMPRESS_ZSTD_LEVEL	3
+#endif
+
+/*
+ * The built-in compressor produces a series of sequences, each of which is:
+ *
+ *   token	high nibble: number of literals, low nibble: match length - 4
+ *		(a nibble of 15 means more length bytes follow: each byte is
+ *		added to the length, and a byte less than 255 ends the length)
+ *   literals
+ *   offset	two bytes, little endian, distance back to the match
+ *   match length bytes, if the match nibble was 15
+ *
+ * The last sequence has only literals and ends the input.
+ */
+#define LZ_MINMATCH		4
+#define LZ_MAX_OFFSET		65535
+#define LZ_HASH_BITS		14
+#define LZ_NIBBLE_MAX		15
+
+static inline uint32_t
+lz_read32(
+	const uint8_t		*p)
+{
+	uint32_t		v;
+
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static inline uint32_t
+lz_hash(
+	uint32_t		v)
+{
+	return (v * 2654435761U) >> (32 - LZ_HASH_BITS);
+}
+
+static inline uint8_t
+lz_nibble(
+	size_t			len)
+{
+	return len < LZ_NIBBLE_MAX ? len : LZ_NIBBLE_MAX;
+}
+
+/* Encode the part of a length that didn't fit in the token. */
+static uint8_t *
+lz_put_len(
+	uint8_t			*op,
+	uint8_t			*oend,
+	size_t			len)
+{
+	while (len >= 255) {
+		if (op >= oend)
+			return NULL;
+		*op++ = 255;
+		len -= 255;
+	}
+	if (op >= oend)
+		return NULL;
+	*op++ = len;
+	return op;
+}
+
+static uint8_t *
+lz_put_seq(
+	uint8_t			*op,
+	uint8_t			*oend,
+	const uint8_t		*lit,
+	size_t			nr_lit,
+	size_t			offset,
+	size_t			mlen)
+{
+	uint8_t			*token;
+	size_t			mcode = mlen ? mlen - LZ_MINMATCH : 0;
+
+	if (op >= oend)
+		return NULL;
+	token = op++;
+	*token = (lz_nibble(nr_lit) << 4) | (mlen ? lz_nibble(mcode) : 0);
+
+	if (nr_lit >= LZ_NIBBLE_MAX) {
+		op = lz_put_len(op, oend, nr_lit - LZ_NIBBLE_MAX);
+		if (!op)
+			return NULL;
+	}
+	if (nr_lit > (size_t)(oend - op))
+		return NULL;
+	memcpy(op, lit, nr_lit);
+	op += nr_lit;
+
+	if (!mlen)
+		return op;
+
+	if (oend - op < 2)
+		return NULL;
+	*op++ = offset & 0xff;
+	*op++ = offset >> 8;
+	if (mcode >= LZ_NIBBLE_MAX)
+		op = lz_put_len(op, oend, mcode - LZ_NIBBLE_MAX);
+	return op;
+}
+
+static ssize_t
+lz_compress(
+	const uint8_t		*src,
+	size_t			len,
+	uint8_t			*dst,
+	size_t			dst_len)
+{
+	uint32_t		*htab;
+	uint8_t			*op = dst;
+	uint8_t			*oend = dst + dst_len;
+	size_t			anchor = 0;
+	size_t			ip = 0;
+
+	htab = calloc(1U << LZ_HASH_BITS, sizeof(uint32_t));
+	if (!htab)
+		return -ENOMEM;
+
+	while (ip + LZ_MINMATCH <= len) {
+		uint32_t	seq = lz_read32(src + ip);
+		uint32_t	h = lz_hash(seq);
+		size_t		cand = htab[h];
+		size_t		mlen;
+
+		htab[h] = ip;
+		if (cand >= ip || ip - cand > LZ_MAX_OFFSET ||
+		    lz_read32(src + cand) != seq) {
+			ip++;
+			continue;
+		}
+
+		mlen = LZ_MINMATCH;
+		while (ip + mlen < len && src[cand + mlen] == src[ip + mlen])
+			mlen++;
+
+		op = lz_put_seq(op, oend, src + anchor, ip - anchor, ip - cand,
+				mlen);
+		if (!op)
+			goto out_nospc;
+		ip += mlen;
+		anchor = ip;
+	}
+
+	op = lz_put_seq(op, oend, src + anchor, len - anchor, 0, 0);
+	if (!op)
+		goto out_nospc;
+	free(htab);
+	return op - dst;
+out_nospc:
+	free(htab);
+	return -ENOSPC;
+}
+
+/* Decode the part of a length that didn't fit in the token. */
+static const uint8_t *
+lz_get_len(
+	const uint8_t		*ip,
+	const uint8_t		*iend,
+	size_t			limit,
+	size_t			*len)
+{
+	uint8_t			b;
+
+	do {
+		if (ip >= iend)
+			return NULL;
+		b = *ip++;
+		*len += b;
+		if (*len > limit)
+			return NULL;
+	} while (b == 255);
+	return ip;
+}
+
+static int
+lz_decompress(
+	const uint8_t		*src,
+	size_t			len,
+	uint8_t			*dst,
+	size_t			dst_len)
+{
+	const uint8_t		*ip = src;
+	const uint8_t		*iend = src + len;
+	uint8_t			*op = dst;
+	uint8_t			*oend = dst + dst_len;
+
+	while (ip < iend) {
+		uint8_t		token = *ip++;
+		size_t		nr_lit = token >> 4;
+		size_t		mlen = token & LZ_NIBBLE_MAX;
+		size_t		offset;
+
+		if (nr_lit == LZ_NIBBLE_MAX) {
+			ip = lz_get_len(ip, iend, dst_len, &nr_lit);
+			if (!ip)
+				return -EBADMSG;
+		}
+		if (nr_lit > (size_t)(iend - ip) ||
+		    nr_lit > (size_t)(oend - op))
+			return -EBADMSG;
+		memcpy(op, ip, nr_lit);
+		ip += nr_lit;
+		op += nr_lit;
+
+		if (ip == iend)
+			break;
+
+		if (iend - ip < 2)
+			return -EBADMSG;
+		offset = ip[0] | (ip[1] << 8);
+		ip += 2;
+		if (offset == 0 || offset > (size_t)(op - dst))
+			return -EBADMSG;
+
+		if (mlen == LZ_NIBBLE_MAX) {
+			ip = lz_get_len(ip, iend, dst_len, &mlen);
+			if (!ip)
+				return -EBADMSG;
+		}
+		mlen += LZ_MINMATCH;
+		if (mlen > (size_t)(oend - op))
+			return -EBADMSG;
+
+		/* matches can overlap their own output */
+		while (mlen-- > 0) {
+			*op = *(op - offset);
+			op++;
+		}
+	}
+
+	return op == oend ? 0 : -EBADMSG;
+}
+
+/* Best compression algorithm this build supports. */
+enum compress_alg
+compress_default_alg(void)
+{
+#ifdef HAVE_LIBZSTD
+	return COMPRESS_ZSTD;
+#else
+	return COMPRESS_LZ;
+#endif
+}
+
+bool
+compress_alg_supported(
+	enum compress_alg	alg)
+{
+	switch (alg) {
+	case COMPRESS_NONE:
+	case COMPRESS_LZ:
+		return true;
+	case COMPRESS_ZSTD:
+#ifdef HAVE_LIBZSTD
+		return true;
+#else
+		return false;
+#endif
+	}
+	return false;
+}
+
+/* Worst case compressed size of @len bytes. */
+size_t
+compress_bound(
+	enum compress_alg	alg,
+	size_t			len)
+{
+	switch (alg) {
+	case COMPRESS_LZ:
+		return len + len / 255 + 16;
+#ifdef HAVE_LIBZSTD
+	case COMPRESS_ZSTD:
+		return ZSTD_compressBound(len);
+#endif
+	default:
+		return len;
+	}
+}
+
+/*
+ * Compress @len bytes from @src into @dst.  Returns the compressed length,
+ * -ENOSPC if it doesn't fit in @dst_len bytes, or another negative errno.
+ */
+ssize_t
+compress_buf(
+	enum compress_alg	alg,
+	const void		*src,
+	size_t			len,
+	void			*dst,
+	size_t			dst_len)
+{
+	switch (alg) {
+	case COMPRESS_NONE:
+		if (len > dst_len)
+			return -ENOSPC;
+		memcpy(dst, src, len);
+		return len;
+	case COMPRESS_LZ:
+		return lz_compress(src, len, dst, dst_len);
+#ifdef HAVE_LIBZSTD
+	case COMPRESS_ZSTD: {
+		size_t		ret;
+
+		ret = ZSTD_compress(dst, dst_len, src, len,
+				COMPRESS_ZSTD_LEVEL);
+		if (ZSTD_isError(ret))
+			return -ENOSPC;
+		return ret;
+	}
+#endif
+	default:
+		return -EOPNOTSUPP;
+	}
+}
+
+/*
+ * Decompress @len bytes from @src into exactly @dst_len bytes at @dst.
+ * Returns zero, -EBADMSG if the input is corrupt, or another negative errno.
+ */
+int
+decompress_buf(
+	enum compress_alg	alg,
+	const void		*src,
+	size_t			len,
+	void			*dst,
+	size_t			dst_len)
+{
+	switch (alg) {
+	case COMPRESS_NONE:
+		if (len != dst_len)
+			return -EBADMSG;
+		memcpy(dst, src, len);
+		return 0;
+	case COMPRESS_LZ:
+		return lz_decompress(src, len, dst, dst_len);
+#ifdef HAVE_LIBZSTD
+	case COMPRESS_ZSTD: {
+		size_t		ret;
+
+		ret = ZSTD_decompress(dst, dst_len, src, len);
+		if (ZSTD_isError(ret) || ret != dst_len)
+			return -EBADMSG;
+		return 0;
+	}
+#endif
+	default:
+		return -EOPNOTSUPP;
+	}
+}
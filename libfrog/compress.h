@@ -0,0 +1,34 @@
+// SPDX-License-Identifier: GPL-2.0+
+/*
+ * Copyright (C) 2026 Oracle.  All Rights Reserved.
+ */
+#ifndef __LIBFROG_COMPRESS_H__
+#define __LIBFROG_COMPRESS_H__
+
+#include <stdbool.h>
+#include <sys/types.h>
+
+/*
+ * Buffer compression.  zstd is used when xfsprogs was built against libzstd;
+ * otherwise there is a simple built-in LZ77 compressor which is fast and
+ * good enough for the highly redundant contents of metadata blocks.
+ *
+ * These values are stored on disk (e.g. in metadump files), so never
+ * renumber them.
+ */
+enum compress_alg {
+	COMPRESS_NONE		= 0,	/* stored uncompressed */
+	COMPRESS_LZ		= 1,	/* built-in LZ77 */
+	COMPRESS_ZSTD		= 2,	/* libzstd */
+};
+
+enum compress_alg compress_default_alg(void);
+bool compress_alg_supported(enum compress_alg alg);
+size_t compress_bound(enum compress_alg alg, size_t len);
+
+ssize_t compress_buf(enum compress_alg alg, const void *src, size_t len,
+		void *dst, size_t dst_len);
+int decompress_buf(enum compress_alg alg, const void *src, size_t len,
+		void *dst, size_t dst_len);
+
+#endif	/* __LIBFROG_COMPRESS_H__ */
@@ -0,0 +1,415 @@
+// SPDX-License-Identifier: GPL-2.0+
+/*
+ * Copyright (C) 2026 Oracle.  All Rights Reserved.
+ */
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/uio.h>
+#include "iouring.h"
+
+#ifdef HAVE_IO_URING
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include <urcu.h>
+
+struct iouring {
+	int			fd;
+	unsigned int		entries;
+
+	/* submission queue */
+	void			*sq_ring;
+	size_t			sq_ring_sz;
+	unsigned int		*sq_head;
+	unsigned int		*sq_tail;
+	unsigned int		*sq_mask;
+	unsigned int		*sq_array;
+	struct io_uring_sqe	*sqes;
+	size_t			sqes_sz;
+	unsigned int		sqe_tail;	/* prepared, not yet visible */
+
+	/* completion queue */
+	void			*cq_ring;
+	size_t			cq_ring_sz;
+	unsigned int		*cq_head;
+	unsigned int		*cq_tail;
+	unsigned int		*cq_mask;
+	struct io_uring_cqe	*cqes;
+
+	unsigned int		queued;		/* prepared, not submitted */
+	unsigned int		inflight;	/* prepared, not reaped */
+};
+
+static inline int
+sys_io_uring_setup(
+	unsigned int		entries,
+	struct io_uring_params	*p)
+{
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static inline int
+sys_io_uring_enter(
+	int			fd,
+	unsigned int		to_submit,
+	unsigned int		min_complete,
+	unsigned int		flags)
+{
+	return syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+			flags, NULL, 0);
+}
+
+/*
+ * Set up an io_uring with @entries submission slots.  Returns zero or a
+ * negative errno; -EOPNOTSUPP means the kernel doesn't do io_uring and the
+ * caller should fall back to synchronous I/O.
+ */
+int
+iouring_alloc(
+	unsigned int		entries,
+	struct iouring		**ringp)
+{
+	struct io_uring_params	p;
+	struct iouring		*ring;
+	int			error;
+
+	ring = calloc(1, sizeof(struct iouring));
+	if (!ring)
+		return -errno;
+
+	memset(&p, 0, sizeof(p));
+	ring->fd = sys_io_uring_setup(entries, &p);
+	if (ring->fd < 0) {
+		error = errno == ENOSYS ? -EOPNOTSUPP : -errno;
+		goto out_free;
+	}
+	ring->entries = p.sq_entries;
+
+	ring->sq_ring_sz = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	ring->sq_ring = mmap(NULL, ring->sq_ring_sz, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, ring->fd,
+			IORING_OFF_SQ_RING);
+	if (ring->sq_ring == MAP_FAILED) {
+		error = -errno;
+		goto out_close;
+	}
+	ring->sq_head = ring->sq_ring + p.sq_off.head;
+	ring->sq_tail = ring->sq_ring + p.sq_off.tail;
+	ring->sq_mask = ring->sq_ring + p.sq_off.ring_mask;
+	ring->sq_array = ring->sq_ring + p.sq_off.array;
+	ring->sqe_tail = *ring->sq_tail;
+
+	ring->sqes_sz = p.sq_entries * sizeof(struct io_uring_sqe);
+	ring->sqes = mmap(NULL, ring->sqes_sz, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, ring->fd,
+			IORING_OFF_SQES);
+	if (ring->sqes == MAP_FAILED) {
+		error = -errno;
+		goto out_sq;
+	}
+
+	ring->cq_ring_sz = p.cq_off.cqes +
+			p.cq_entries * sizeof(struct io_uring_cqe);
+	ring->cq_ring = mmap(NULL, ring->cq_ring_sz, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, ring->fd,
+			IORING_OFF_CQ_RING);
+	if (ring->cq_ring == MAP_FAILED) {
+		error = -errno;
+		goto out_sqes;
+	}
+	ring->cq_head = ring->cq_ring + p.cq_off.head;
+	ring->cq_tail = ring->cq_ring + p.cq_off.tail;
+	ring->cq_mask = ring->cq_ring + p.cq_off.ring_mask;
+	ring->cqes = ring->cq_ring + p.cq_off.cqes;
+
+	*ringp = ring;
+	return 0;
+
+out_sqes:
+	munmap(ring->sqes, ring->sqes_sz);
+out_sq:
+	munmap(ring->sq_ring, ring->sq_ring_sz);
+out_close:
+	close(ring->fd);
+out_free:
+	free(ring);
+	return error;
+}
+
+void
+iouring_free(
+	struct iouring		*ring)
+{
+	if (!ring)
+		return;
+
+	munmap(ring->cq_ring, ring->cq_ring_sz);
+	munmap(ring->sqes, ring->sqes_sz);
+	munmap(ring->sq_ring, ring->sq_ring_sz);
+	close(ring->fd);
+	free(ring);
+}
+
+/* Number of I/Os that can be prepared before some have to be reaped. */
+unsigned int
+iouring_space(
+	struct iouring		*ring)
+{
+	return ring->entries - ring->inflight;
+}
+
+/* Number of I/Os that have been prepared but not yet reaped. */
+unsigned int
+iouring_inflight(
+	struct iouring		*ring)
+{
+	return ring->inflight;
+}
+
+static struct io_uring_sqe *
+iouring_get_sqe(
+	struct iouring		*ring)
+{
+	struct io_uring_sqe	*sqe;
+	unsigned int		idx;
+
+	if (ring->inflight >= ring->entries)
+		return NULL;
+
+	idx = ring->sqe_tail & *ring->sq_mask;
+	sqe = &ring->sqes[idx];
+	memset(sqe, 0, sizeof(*sqe));
+	ring->sq_array[idx] = idx;
+	ring->sqe_tail++;
+	ring->queued++;
+	ring->inflight++;
+	return sqe;
+}
+
+static int
+iouring_prep_rw(
+	struct iouring		*ring,
+	int			op,
+	int			fd,
+	const void		*addr,
+	unsigned int		len,
+	off_t			pos,
+	void			*data)
+{
+	struct io_uring_sqe	*sqe;
+
+	sqe = iouring_get_sqe(ring);
+	if (!sqe)
+		return -EAGAIN;
+
+	sqe->opcode = op;
+	sqe->fd = fd;
+	sqe->addr = (unsigned long)addr;
+	sqe->len = len;
+	sqe->off = pos;
+	sqe->user_data = (unsigned long)data;
+	return 0;
+}
+
+int
+iouring_prep_read(
+	struct iouring		*ring,
+	int			fd,
+	void			*buf,
+	size_t			len,
+	off_t			pos,
+	void			*data)
+{
+	return iouring_prep_rw(ring, IORING_OP_READ, fd, buf, len, pos, data);
+}
+
+int
+iouring_prep_write(
+	struct iouring		*ring,
+	int			fd,
+	const void		*buf,
+	size_t			len,
+	off_t			pos,
+	void			*data)
+{
+	return iouring_prep_rw(ring, IORING_OP_WRITE, fd, buf, len, pos, data);
+}
+
+int
+iouring_prep_readv(
+	struct iouring		*ring,
+	int			fd,
+	const struct iovec	*iov,
+	unsigned int		nr,
+	off_t			pos,
+	void			*data)
+{
+	return iouring_prep_rw(ring, IORING_OP_READV, fd, iov, nr, pos, data);
+}
+
+int
+iouring_prep_writev(
+	struct iouring		*ring,
+	int			fd,
+	const struct iovec	*iov,
+	unsigned int		nr,
+	off_t			pos,
+	void			*data)
+{
+	return iouring_prep_rw(ring, IORING_OP_WRITEV, fd, iov, nr, pos, data);
+}
+
+/*
+ * Push all prepared I/Os to the kernel and optionally wait for @wait_nr
+ * completions.  Returns zero or a negative errno.
+ */
+int
+iouring_submit(
+	struct iouring		*ring,
+	unsigned int		wait_nr)
+{
+	unsigned int		flags = wait_nr ? IORING_ENTER_GETEVENTS : 0;
+	int			ret;
+
+	/* make the sqe contents visible before the new tail */
+	cmm_smp_wmb();
+	uatomic_set(ring->sq_tail, ring->sqe_tail);
+
+	while (ring->queued || wait_nr) {
+		ret = sys_io_uring_enter(ring->fd, ring->queued, wait_nr,
+				flags);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+		ring->queued -= ret;
+		break;
+	}
+	return 0;
+}
+
+/*
+ * Take back the most recently prepared I/O if the kernel hasn't picked it up
+ * yet.  Returns 1 and fills out @datap, or 0 if the kernel has picked up
+ * everything.  We don't use a kernel submission thread, so the kernel only
+ * looks at the submission queue while we're in iouring_submit.
+ */
+int
+iouring_unprep(
+	struct iouring		*ring,
+	void			**datap)
+{
+	unsigned int		idx;
+
+	if (ring->sqe_tail == uatomic_read(ring->sq_head))
+		return 0;
+
+	ring->sqe_tail--;
+	idx = ring->sqe_tail & *ring->sq_mask;
+	*datap = (void *)(unsigned long)ring->sqes[idx].user_data;
+	uatomic_set(ring->sq_tail, ring->sqe_tail);
+	if (ring->queued)
+		ring->queued--;
+	ring->inflight--;
+	return 1;
+}
+
+/*
+ * Reap one completed I/O.  Returns 1 and fills out @datap and @resp if an I/O
+ * completed, 0 if nothing has completed and @wait is false (or nothing is in
+ * flight), or a negative errno.
+ */
+int
+iouring_reap(
+	struct iouring		*ring,
+	bool			wait,
+	void			**datap,
+	int			*resp)
+{
+	struct io_uring_cqe	*cqe;
+	unsigned int		head;
+	int			error;
+
+	for (;;) {
+		head = *ring->cq_head;
+		if (head != uatomic_read(ring->cq_tail))
+			break;
+		if (!wait || ring->inflight == 0)
+			return 0;
+		error = iouring_submit(ring, 1);
+		if (error)
+			return error;
+	}
+
+	/* read the cqe contents only after we've seen the new tail */
+	cmm_smp_rmb();
+	cqe = &ring->cqes[head & *ring->cq_mask];
+	*datap = (void *)(unsigned long)cqe->user_data;
+	*resp = cqe->res;
+	cmm_smp_mb();
+	uatomic_set(ring->cq_head, head + 1);
+	ring->inflight--;
+	return 1;
+}
+
+#else /* !HAVE_IO_URING */
+
+int
+iouring_alloc(
+	unsigned int		entries,
+	struct iouring		**ringp)
+{
+	return -EOPNOTSUPP;
+}
+
+void iouring_free(struct iouring *ring) { }
+unsigned int iouring_space(struct iouring *ring) { return 0; }
+unsigned int iouring_inflight(struct iouring *ring) { return 0; }
+
+int
+iouring_prep_read(struct iouring *ring, int fd, void *buf, size_t len,
+		off_t pos, void *data)
+{
+	return -EOPNOTSUPP;
+}
+
+int
+iouring_prep_write(struct iouring *ring, int fd, const void *buf, size_t len,
+		off_t pos, void *data)
+{
+	return -EOPNOTSUPP;
+}
+
+int
+iouring_prep_readv(struct iouring *ring, int fd, const struct iovec *iov,
+		unsigned int nr, off_t pos, void *data)
+{
+	return -EOPNOTSUPP;
+}
+
+int
+iouring_prep_writev(struct iouring *ring, int fd, const struct iovec *iov,
+		unsigned int nr, off_t pos, void *data)
+{
+	return -EOPNOTSUPP;
+}
+
+int iouring_submit(struct iouring *ring, unsigned int wait_nr)
+{
+	return -EOPNOTSUPP;
+}
+
+int
+iouring_reap(struct iouring *ring, bool wait, void **datap, int *resp)
+{
+	return -EOPNOTSUPP;
+}
+
+int iouring_unprep(struct iouring *ring, void **datap) { return 0; }
+
+#endif /* HAVE_IO_URING */
@@ -0,0 +1,44 @@
+// SPDX-License-Identifier: GPL-2.0+
+/*
+ * Copyright (C) 2026 Oracle.  All Rights Reserved.
+ */
+#ifndef __LIBFROG_IOURING_H__
+#define __LIBFROG_IOURING_H__
+
+#include <stdbool.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+/*
+ * Minimal io_uring wrapper built directly on top of the system calls so that
+ * we don't need liburing.  A ring is not thread safe; callers sharing a ring
+ * between threads must provide their own locking.
+ *
+ * Each prepared I/O carries an opaque data pointer which is handed back by
+ * iouring_reap() along with the result of the I/O.  The number of I/Os that
+ * can be prepared but not yet reaped is limited to the size of the ring so
+ * that the completion queue can never overflow.
+ */
+struct iouring;
+
+int iouring_alloc(unsigned int entries, struct iouring **ringp);
+void iouring_free(struct iouring *ring);
+
+unsigned int iouring_space(struct iouring *ring);
+unsigned int iouring_inflight(struct iouring *ring);
+
+int iouring_prep_read(struct iouring *ring, int fd, void *buf, size_t len,
+		off_t pos, void *data);
+int iouring_prep_write(struct iouring *ring, int fd, const void *buf,
+		size_t len, off_t pos, void *data);
+int iouring_prep_readv(struct iouring *ring, int fd, const struct iovec *iov,
+		unsigned int nr, off_t pos, void *data);
+int iouring_prep_writev(struct iouring *ring, int fd,
+		const struct iovec *iov, unsigned int nr, off_t pos,
+		void *data);
+
+int iouring_submit(struct iouring *ring, unsigned int wait_nr);
+int iouring_reap(struct iouring *ring, bool wait, void **datap, int *resp);
+int iouring_unprep(struct iouring *ring, void **datap);
+
+#endif	/* __LIBFROG_IOURING_H__ */
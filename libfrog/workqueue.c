@@ -14,6 +14,219 @@
 #include <urcu.h>
 #include "workqueue.h"
 
+/*
+ * Work stealing mode.  Each thread has its own deque of work items, which it
+ * works through in order.  Work queued from outside the workqueue is spread
+ * over the deques in turn, and work queued by a workqueue thread goes on its
+ * own deque.  A thread that runs out of work takes half of the items queued
+ * on the next busy deque it finds, and only goes to sleep when there's
+ * nothing queued anywhere.  Finished work items go back to a per-deque pool
+ * to be reused rather than being freed.
+ */
+struct workqueue_deque {
+	struct workqueue	*wq;
+	pthread_mutex_t		lock;
+	struct workqueue_item	*head;
+	struct workqueue_item	*tail;
+	struct workqueue_item	*pool;		/* free work items */
+	unsigned int		nr;		/* items queued */
+};
+
+/* Deque of the work stealing thread we're running in, if any. */
+static __thread struct workqueue_deque	*wq_this_deque;
+
+/* Append a chain of @nr items to a deque; caller holds the lock. */
+static void
+wq_deque_append(
+	struct workqueue_deque	*wd,
+	struct workqueue_item	*first,
+	struct workqueue_item	*last,
+	unsigned int		nr)
+{
+	last->next = NULL;
+	if (wd->tail)
+		wd->tail->next = first;
+	else
+		wd->head = first;
+	wd->tail = last;
+	uatomic_set(&wd->nr, wd->nr + nr);
+}
+
+/* Take the first item off a deque; caller holds the lock. */
+static struct workqueue_item *
+wq_deque_pop(
+	struct workqueue_deque	*wd)
+{
+	struct workqueue_item	*wi = wd->head;
+
+	if (!wi)
+		return NULL;
+	wd->head = wi->next;
+	if (!wd->head)
+		wd->tail = NULL;
+	uatomic_set(&wd->nr, wd->nr - 1);
+	return wi;
+}
+
+/*
+ * Move half the items queued on some other deque to ours.  Returns true if
+ * we found any work.
+ */
+static bool
+wq_steal(
+	struct workqueue_deque	*self)
+{
+	struct workqueue	*wq = self->wq;
+	unsigned int		nr_deques = wq->thread_count;
+	unsigned int		i;
+
+	for (i = 1; i < nr_deques; i++) {
+		struct workqueue_deque	*victim;
+		struct workqueue_item	*first, *last;
+		unsigned int		nr, n;
+
+		victim = &wq->deques[(self - wq->deques + i) % nr_deques];
+		if (uatomic_read(&victim->nr) == 0)
+			continue;
+
+		pthread_mutex_lock(&victim->lock);
+		nr = (victim->nr + 1) / 2;
+		if (nr == 0) {
+			pthread_mutex_unlock(&victim->lock);
+			continue;
+		}
+		first = last = victim->head;
+		for (n = 1; n < nr; n++)
+			last = last->next;
+		victim->head = last->next;
+		if (!victim->head)
+			victim->tail = NULL;
+		uatomic_set(&victim->nr, victim->nr - nr);
+		pthread_mutex_unlock(&victim->lock);
+
+		pthread_mutex_lock(&self->lock);
+		wq_deque_append(self, first, last, nr);
+		pthread_mutex_unlock(&self->lock);
+		return true;
+	}
+	return false;
+}
+
+/* Work stealing processing thread */
+static void *
+workqueue_steal_thread(
+	void			*arg)
+{
+	struct workqueue_deque	*self = arg;
+	struct workqueue	*wq = self->wq;
+	struct workqueue_item	*wi = NULL;
+
+	rcu_register_thread();
+	wq_this_deque = self;
+	while (1) {
+		/* Recycle the last item and grab the next one. */
+		pthread_mutex_lock(&self->lock);
+		if (wi) {
+			wi->next = self->pool;
+			self->pool = wi;
+		}
+		wi = wq_deque_pop(self);
+		pthread_mutex_unlock(&self->lock);
+
+		if (wi) {
+			uatomic_dec(&wq->pending);
+			(wi->function)(wi->queue, wi->index, wi->arg);
+			continue;
+		}
+		if (wq_steal(self))
+			continue;
+
+		/*
+		 * Sleep until something is queued.  Items that are being
+		 * moved between deques still count as pending, so if we get
+		 * here while a steal is in progress we just go around again.
+		 */
+		pthread_mutex_lock(&wq->lock);
+		uatomic_inc(&wq->idle_threads);
+		cmm_smp_mb();
+		while (uatomic_read(&wq->pending) == 0 && !wq->terminate)
+			pthread_cond_wait(&wq->wakeup, &wq->lock);
+		uatomic_dec(&wq->idle_threads);
+		if (uatomic_read(&wq->pending) == 0 && wq->terminate) {
+			pthread_mutex_unlock(&wq->lock);
+			break;
+		}
+		pthread_mutex_unlock(&wq->lock);
+	}
+	wq_this_deque = NULL;
+	rcu_unregister_thread();
+
+	return NULL;
+}
+
+/*
+ * Queue @nr work items in work stealing mode, all on the same deque.
+ * Returns zero or a negative error code.
+ */
+static int
+wq_steal_add(
+	struct workqueue	*wq,
+	workqueue_func_t	func,
+	uint32_t		index,
+	void			**args,
+	unsigned int		nr)
+{
+	struct workqueue_deque	*wd = wq_this_deque;
+	struct workqueue_item	*first = NULL;
+	struct workqueue_item	*last = NULL;
+	unsigned int		i;
+	int			ret = 0;
+
+	if (!wd || wd->wq != wq)
+		wd = &wq->deques[uatomic_add_return(&wq->next_deque, 1) %
+				 wq->thread_count];
+
+	pthread_mutex_lock(&wd->lock);
+	for (i = 0; i < nr; i++) {
+		struct workqueue_item	*wi = wd->pool;
+
+		if (wi) {
+			wd->pool = wi->next;
+		} else {
+			wi = malloc(sizeof(struct workqueue_item));
+			if (!wi) {
+				ret = -errno;
+				break;
+			}
+		}
+		wi->function = func;
+		wi->index = index;
+		wi->arg = args[i];
+		wi->queue = wq;
+		wi->next = NULL;
+		if (last)
+			last->next = wi;
+		else
+			first = wi;
+		last = wi;
+	}
+	if (i > 0)
+		wq_deque_append(wd, first, last, i);
+	pthread_mutex_unlock(&wd->lock);
+
+	uatomic_add(&wq->pending, i);
+	cmm_smp_mb();
+	if (i > 0 && uatomic_read(&wq->idle_threads) > 0) {
+		pthread_mutex_lock(&wq->lock);
+		if (i == 1)
+			pthread_cond_signal(&wq->wakeup);
+		else
+			pthread_cond_broadcast(&wq->wakeup);
+		pthread_mutex_unlock(&wq->lock);
+	}
+	return ret;
+}
+
 /* Main processing thread */
 static void *
 workqueue_thread(void *arg)
@@ -70,13 +283,13 @@ workqueue_thread(void *arg)
 	return NULL;
 }
 
-/* Allocate a work queue and threads.  Returns zero or negative error code. */
-int
-workqueue_create_bound(
+static int
+__workqueue_create(
 	struct workqueue	*wq,
 	void			*wq_ctx,
 	unsigned int		nr_workers,
-	unsigned int		max_queue)
+	unsigned int		max_queue,
+	bool			stealing)
 {
 	unsigned int		i;
 	int			err = 0;
@@ -103,9 +316,26 @@ workqueue_create_bound(
 	wq->terminate = false;
 	wq->terminated = false;
 
+	if (stealing && nr_workers > 0) {
+		wq->deques = calloc(nr_workers, sizeof(struct workqueue_deque));
+		if (!wq->deques) {
+			err = -errno;
+			free(wq->threads);
+			goto out_mutex;
+		}
+		for (i = 0; i < nr_workers; i++) {
+			wq->deques[i].wq = wq;
+			pthread_mutex_init(&wq->deques[i].lock, NULL);
+		}
+	}
+
 	for (i = 0; i < nr_workers; i++) {
-		err = -pthread_create(&wq->threads[i], NULL, workqueue_thread,
-				wq);
+		if (wq->deques)
+			err = -pthread_create(&wq->threads[i], NULL,
+					workqueue_steal_thread, &wq->deques[i]);
+		else
+			err = -pthread_create(&wq->threads[i], NULL,
+					workqueue_thread, wq);
 		if (err)
 			break;
 	}
@@ -127,6 +357,17 @@ out_wake:
 	return err;
 }
 
+/* Allocate a work queue and threads.  Returns zero or negative error code. */
+int
+workqueue_create_bound(
+	struct workqueue	*wq,
+	void			*wq_ctx,
+	unsigned int		nr_workers,
+	unsigned int		max_queue)
+{
+	return __workqueue_create(wq, wq_ctx, nr_workers, max_queue, false);
+}
+
 int
 workqueue_create(
 	struct workqueue	*wq,
@@ -136,6 +377,20 @@ workqueue_create(
 	return workqueue_create_bound(wq, wq_ctx, nr_workers, 0);
 }
 
+/*
+ * Allocate a work stealing work queue and threads.  Work items are not run
+ * in the order they were queued, and the queue length is not bounded.
+ * Returns zero or negative error code.
+ */
+int
+workqueue_create_stealing(
+	struct workqueue	*wq,
+	void			*wq_ctx,
+	unsigned int		nr_workers)
+{
+	return __workqueue_create(wq, wq_ctx, nr_workers, 0, true);
+}
+
 /*
  * Create a work item consisting of a function and some arguments and schedule
  * the work item to be run via the thread pool.  Returns zero or a negative
@@ -158,6 +413,9 @@ workqueue_add(
 		return 0;
 	}
 
+	if (wq->deques)
+		return wq_steal_add(wq, func, index, &arg, 1);
+
 	wi = malloc(sizeof(struct workqueue_item));
 	if (!wi)
 		return -errno;
@@ -211,6 +469,35 @@ restart:
 	return 0;
 }
 
+/*
+ * Schedule @nr work items that share a function and index, one for each of
+ * @args.  In work stealing mode they are all queued in one go.  Returns zero
+ * or a negative error code; on error some of the items may have been queued.
+ */
+int
+workqueue_add_batch(
+	struct workqueue	*wq,
+	workqueue_func_t	func,
+	uint32_t		index,
+	void			**args,
+	unsigned int		nr)
+{
+	unsigned int		i;
+	int			ret;
+
+	assert(!wq->terminated);
+
+	if (wq->deques && wq->thread_count > 0)
+		return wq_steal_add(wq, func, index, args, nr);
+
+	for (i = 0; i < nr; i++) {
+		ret = workqueue_add(wq, func, index, args[i]);
+		if (ret)
+			return ret;
+	}
+	return 0;
+}
+
 /*
  * Wait for all pending work items to be processed and tear down the
  * workqueue thread pool.  Returns zero or a negative error code.
@@ -248,8 +535,21 @@ void
 workqueue_destroy(
 	struct workqueue	*wq)
 {
+	unsigned int		i;
+
 	assert(wq->terminated);
 
+	for (i = 0; wq->deques && i < wq->thread_count; i++) {
+		struct workqueue_deque	*wd = &wq->deques[i];
+		struct workqueue_item	*wi;
+
+		while ((wi = wd->pool) != NULL) {
+			wd->pool = wi->next;
+			free(wi);
+		}
+		pthread_mutex_destroy(&wd->lock);
+	}
+	free(wq->deques);
 	free(wq->threads);
 	pthread_mutex_destroy(&wq->lock);
 	pthread_cond_destroy(&wq->wakeup);
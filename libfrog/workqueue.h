@@ -9,6 +9,7 @@
 #include <pthread.h>
 
 struct workqueue;
+struct workqueue_deque;
 
 typedef void workqueue_func_t(struct workqueue *wq, uint32_t index, void *arg);
 
@@ -34,14 +35,24 @@ struct workqueue {
 	bool			terminated;
 	int			max_queued;
 	pthread_cond_t		queue_full;
+
+	/* work stealing mode */
+	struct workqueue_deque	*deques;	/* one per thread */
+	unsigned int		next_deque;	/* for outside producers */
+	unsigned long		pending;	/* items sitting in deques */
+	unsigned int		idle_threads;	/* threads asleep */
 };
 
 int workqueue_create(struct workqueue *wq, void *wq_ctx,
 		unsigned int nr_workers);
 int workqueue_create_bound(struct workqueue *wq, void *wq_ctx,
 		unsigned int nr_workers, unsigned int max_queue);
+int workqueue_create_stealing(struct workqueue *wq, void *wq_ctx,
+		unsigned int nr_workers);
 int workqueue_add(struct workqueue *wq, workqueue_func_t fn,
 		uint32_t index, void *arg);
+int workqueue_add_batch(struct workqueue *wq, workqueue_func_t fn,
+		uint32_t index, void **args, unsigned int nr);
 int workqueue_terminate(struct workqueue *wq);
 void workqueue_destroy(struct workqueue *wq);
 
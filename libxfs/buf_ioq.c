@@ -0,0 +1,664 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Copyright (c) 2026 Oracle.  All Rights Reserved.
+ */
+
+#include "libxfs_priv.h"
+#include "init.h"
+#include "xfs_fs.h"
+#include "xfs_shared.h"
+#include "xfs_format.h"
+#include "xfs_log_format.h"
+#include "xfs_trans_resv.h"
+#include "xfs_mount.h"
+#include "libfrog/iouring.h"
+#include "libfrog/workqueue.h"
+
+#include "libxfs.h"
+
+/*
+ * Asynchronous buffer reads.
+ *
+ * A buffer I/O queue lets a caller keep many buffer reads in flight against a
+ * buftarg.  Buffers are submitted with libxfs_buf_ioq_submit(), and come back
+ * from libxfs_buf_ioq_reap() once all of their maps have been read, at which
+ * point the read verifier (if any) is run in the context of the reaping
+ * thread.  A queue belongs to whoever created it; buffers submitted to a queue
+ * can only be reaped from that queue.
+ *
+ * Reads are issued through io_uring where the kernel supports it.  Otherwise
+ * we fall back to a small pool of threads issuing synchronous preads, which
+ * still gets us more than one I/O in flight.  If the ring stops working, the
+ * queue waits for the reads the kernel already has and does everything else
+ * with synchronous preads.  Metadump images always use the
+ * thread pool because their reads are served from memory or the dump file.
+ * Callers that already have their own pread threads can pass
+ * LIBXFS_BUF_IOQ_RING_ONLY to get -EOPNOTSUPP instead of the thread pool.
+ */
+
+/* cap on the number of pread threads in the fallback pool */
+#define XFS_BUF_IOQ_MAX_THREADS	16
+
+struct xfs_buf_ioreq;
+
+struct xfs_buf_ioreq_map {
+	struct xfs_buf_ioreq	*req;
+	int			len;
+};
+
+struct xfs_buf_ioreq {
+	struct list_head	list;
+	struct xfs_buf		*bp;
+	const struct xfs_buf_ops *ops;
+	struct xfs_buf_ioq	*ioq;
+	unsigned int		pending;	/* maps still being read */
+	int			error;
+	struct xfs_buf_ioreq_map maps[];
+};
+
+struct xfs_buf_ioq {
+	struct xfs_buftarg	*btp;
+	int			fd;
+	unsigned int		depth;		/* max buffers in flight */
+	unsigned int		inflight;	/* submitted, not reaped */
+
+	/* io_uring backend */
+	struct iouring		*ring;
+	bool			ring_broken;	/* don't submit any more */
+
+	/* thread pool backend */
+	struct workqueue	wq;
+	pthread_mutex_t		lock;
+	pthread_cond_t		wait;
+	struct list_head	done;
+};
+
+/* Allocate an I/O queue that can have @depth buffer reads in flight. */
+int
+libxfs_buf_ioq_alloc(
+	struct xfs_buftarg	*btp,
+	unsigned int		depth,
+	unsigned int		flags,
+	struct xfs_buf_ioq	**ioqp)
+{
+	struct xfs_buf_ioq	*ioq;
+	int			error;
+
+	ioq = calloc(1, sizeof(struct xfs_buf_ioq));
+	if (!ioq)
+		return -ENOMEM;
+
+	ioq->btp = btp;
+	ioq->fd = libxfs_device_to_fd(btp->bt_bdev);
+	ioq->depth = max(depth, 1U);
+	INIT_LIST_HEAD(&ioq->done);
+	pthread_mutex_init(&ioq->lock, NULL);
+	pthread_cond_init(&ioq->wait, NULL);
+
+	if (!libxfs_device_to_mdimage(btp->bt_bdev)) {
+		error = iouring_alloc(ioq->depth, &ioq->ring);
+		if (!error)
+			goto out;
+	}
+
+	ioq->ring = NULL;
+	if (flags & LIBXFS_BUF_IOQ_RING_ONLY) {
+		error = -EOPNOTSUPP;
+		goto out_free;
+	}
+	error = -workqueue_create(&ioq->wq, ioq,
+			min(ioq->depth, XFS_BUF_IOQ_MAX_THREADS));
+	if (error)
+		goto out_free;
+out:
+	*ioqp = ioq;
+	return 0;
+out_free:
+	pthread_cond_destroy(&ioq->wait);
+	pthread_mutex_destroy(&ioq->lock);
+	free(ioq);
+	return error;
+}
+
+/*
+ * Tear down an I/O queue.  All submitted buffers must have been reaped.
+ */
+void
+libxfs_buf_ioq_free(
+	struct xfs_buf_ioq	*ioq)
+{
+	ASSERT(ioq->inflight == 0);
+
+	if (ioq->ring) {
+		iouring_free(ioq->ring);
+	} else {
+		workqueue_terminate(&ioq->wq);
+		workqueue_destroy(&ioq->wq);
+	}
+	pthread_cond_destroy(&ioq->wait);
+	pthread_mutex_destroy(&ioq->lock);
+	free(ioq);
+}
+
+/* Can we accept another buffer without reaping one first? */
+bool
+libxfs_buf_ioq_full(
+	struct xfs_buf_ioq	*ioq)
+{
+	return ioq->inflight >= ioq->depth;
+}
+
+unsigned int
+libxfs_buf_ioq_inflight(
+	struct xfs_buf_ioq	*ioq)
+{
+	return ioq->inflight;
+}
+
+static struct xfs_buf_ioreq *
+xfs_buf_ioreq_alloc(
+	struct xfs_buf_ioq	*ioq,
+	struct xfs_buf		*bp,
+	const struct xfs_buf_ops *ops)
+{
+	struct xfs_buf_ioreq	*req;
+	int			i;
+
+	req = malloc(struct_size(req, maps, bp->b_nmaps));
+	if (!req)
+		return NULL;
+
+	INIT_LIST_HEAD(&req->list);
+	req->bp = bp;
+	req->ops = ops;
+	req->ioq = ioq;
+	req->error = 0;
+	req->pending = bp->b_nmaps;
+	for (i = 0; i < bp->b_nmaps; i++) {
+		req->maps[i].req = req;
+		req->maps[i].len = BBTOB(bp->b_maps[i].bm_len);
+	}
+	return req;
+}
+
+/* Read all the maps of a buffer with synchronous preads. */
+static int
+xfs_buf_ioreq_pread(
+	struct xfs_buf_ioreq	*req)
+{
+	struct xfs_buf		*bp = req->bp;
+	char			*buf = bp->b_addr;
+	ssize_t			ret;
+	int			i;
+
+	for (i = 0; i < bp->b_nmaps; i++) {
+		ret = libxfs_device_pread(req->ioq->btp->bt_bdev, buf,
+				req->maps[i].len,
+				LIBXFS_BBTOOFF64(bp->b_maps[i].bm_bn));
+		if (ret < 0)
+			return -errno;
+		if (ret != req->maps[i].len)
+			return -EIO;
+		buf += req->maps[i].len;
+	}
+
+	return 0;
+}
+
+/* Read one map of a buffer with pread, returning what io_uring would. */
+static int
+xfs_buf_ioreq_map_pread(
+	struct xfs_buf_ioreq_map *map)
+{
+	struct xfs_buf_ioreq	*req = map->req;
+	struct xfs_buf		*bp = req->bp;
+	char			*buf = bp->b_addr;
+	int			idx = map - req->maps;
+	ssize_t			ret;
+	int			i;
+
+	for (i = 0; i < idx; i++)
+		buf += req->maps[i].len;
+	ret = libxfs_device_pread(req->ioq->btp->bt_bdev, buf, map->len,
+			LIBXFS_BBTOOFF64(bp->b_maps[idx].bm_bn));
+	if (ret < 0)
+		return -errno;
+	return ret;
+}
+
+/* Record the result of one map; returns the request if it was the last. */
+static struct xfs_buf_ioreq *
+xfs_buf_ioreq_map_done(
+	struct xfs_buf_ioreq_map *map,
+	int			res)
+{
+	struct xfs_buf_ioreq	*req = map->req;
+
+	if (res < 0)
+		req->error = res;
+	else if (res != map->len && !req->error)
+		req->error = -EIO;
+	if (--req->pending == 0)
+		return req;
+	return NULL;
+}
+
+/*
+ * Reap one completion from a ring, waiting for it if @wait is set.  If we
+ * can't wait on the ring any more, set *@brokenp, take back whatever the
+ * kernel hasn't picked up yet (handed back with -ECANCELED) and poll for the
+ * rest.  Reads the kernel already has may still be writing to buffer memory,
+ * so the caller must not let go of any buffer until they have all come back.
+ * Returns 1 for a completion, or 0 if nothing is in flight (or, if @wait is
+ * false, nothing has completed yet).
+ */
+static int
+xfs_buf_ring_reap(
+	struct iouring		*ring,
+	bool			wait,
+	bool			*brokenp,
+	void			**datap,
+	int			*resp)
+{
+	int			ret;
+
+	for (;;) {
+		if (*brokenp) {
+			if (iouring_unprep(ring, datap)) {
+				*resp = -ECANCELED;
+				return 1;
+			}
+			ret = iouring_reap(ring, false, datap, resp);
+			if (ret || !wait || !iouring_inflight(ring))
+				return ret;
+			/* completions get posted when we next leave the kernel */
+			usleep(1000);
+			continue;
+		}
+
+		ret = iouring_reap(ring, wait, datap, resp);
+		if (ret >= 0)
+			return ret;
+		if (ret == -EAGAIN || ret == -EBUSY)
+			continue;
+		fprintf(stderr, _("%s: io_uring wait failed: %s\n"),
+				progname, strerror(-ret));
+		*brokenp = true;
+	}
+}
+
+static void
+xfs_buf_ioreq_work(
+	struct workqueue	*wq,
+	uint32_t		index,
+	void			*arg)
+{
+	struct xfs_buf_ioreq	*req = arg;
+	struct xfs_buf_ioq	*ioq = req->ioq;
+
+	req->error = xfs_buf_ioreq_pread(req);
+	req->pending = 0;
+
+	pthread_mutex_lock(&ioq->lock);
+	list_add_tail(&req->list, &ioq->done);
+	pthread_cond_signal(&ioq->wait);
+	pthread_mutex_unlock(&ioq->lock);
+}
+
+/*
+ * Queue every map of the buffer on the ring and push them all to the kernel
+ * in a single submission.  Returns -EAGAIN if the ring doesn't have room for
+ * all the maps right now.  Once this returns zero the request belongs to the
+ * ring until it is reaped, even if the kernel wouldn't take it; the reap
+ * takes it back and reads it synchronously in that case.
+ */
+static int
+xfs_buf_ioreq_submit_ring(
+	struct xfs_buf_ioq	*ioq,
+	struct xfs_buf_ioreq	*req)
+{
+	struct xfs_buf		*bp = req->bp;
+	char			*buf = bp->b_addr;
+	void			*data;
+	int			error;
+	int			i;
+
+	if (iouring_space(ioq->ring) < bp->b_nmaps)
+		return -EAGAIN;
+
+	for (i = 0; i < bp->b_nmaps; i++) {
+		error = iouring_prep_read(ioq->ring, ioq->fd, buf,
+				req->maps[i].len,
+				LIBXFS_BBTOOFF64(bp->b_maps[i].bm_bn),
+				&req->maps[i]);
+		if (error)
+			goto out_unprep;
+		libxfs_io_account(ioq->btp->bt_bdev, bp->b_maps[i].bm_bn,
+				req->maps[i].len, LIBXFS_IO_READ);
+		buf += req->maps[i].len;
+	}
+
+	error = iouring_submit(ioq->ring, 0);
+	if (error && error != -EAGAIN && error != -EBUSY) {
+		fprintf(stderr, _("%s: io_uring submit failed: %s\n"),
+				progname, strerror(-error));
+		ioq->ring_broken = true;
+	}
+	return 0;
+
+out_unprep:
+	/* nothing has gone to the kernel yet, so take our maps back */
+	while (i-- > 0)
+		iouring_unprep(ioq->ring, &data);
+	return error;
+}
+
+/*
+ * Start reading a buffer.  The buffer must be referenced and locked by the
+ * caller, and is handed back by libxfs_buf_ioq_reap() with b_error set to the
+ * result of the read.  If @ops is supplied, the read verifier will be run when
+ * the buffer is reaped; otherwise the buffer is marked unchecked so that the
+ * verifier runs the next time someone reads the buffer with ops.
+ *
+ * Returns -EAGAIN if the queue is full and buffers must be reaped first.
+ */
+int
+libxfs_buf_ioq_submit(
+	struct xfs_buf_ioq	*ioq,
+	struct xfs_buf		*bp,
+	const struct xfs_buf_ops *ops)
+{
+	struct xfs_buf_ioreq	*req;
+	int			error;
+
+	if (libxfs_buf_ioq_full(ioq))
+		return -EAGAIN;
+
+	req = xfs_buf_ioreq_alloc(ioq, bp, ops);
+	if (!req)
+		return -ENOMEM;
+
+	if (ioq->ring) {
+		error = -EAGAIN;
+		if (!ioq->ring_broken)
+			error = xfs_buf_ioreq_submit_ring(ioq, req);
+		if (error == -EAGAIN &&
+		    (ioq->inflight == 0 || ioq->ring_broken)) {
+			/*
+			 * This buffer has more maps than the ring has slots,
+			 * or the ring doesn't work any more, so just read it
+			 * synchronously and queue it for reaping like
+			 * everything else.
+			 */
+			req->error = xfs_buf_ioreq_pread(req);
+			req->pending = 0;
+			list_add_tail(&req->list, &ioq->done);
+			error = 0;
+		}
+	} else {
+		error = workqueue_add(&ioq->wq, xfs_buf_ioreq_work, 0, req);
+	}
+	if (error) {
+		free(req);
+		return error;
+	}
+
+	ioq->inflight++;
+	return 0;
+}
+
+static struct xfs_buf *
+xfs_buf_ioreq_finish(
+	struct xfs_buf_ioreq	*req)
+{
+	struct xfs_buf		*bp = req->bp;
+
+	bp->b_error = req->error;
+	if (!req->error) {
+		bp->b_flags |= LIBXFS_B_UPTODATE;
+		if (req->ops)
+			libxfs_readbuf_verify(bp, req->ops);
+		else
+			bp->b_flags |= LIBXFS_B_UNCHECKED;
+	}
+	req->ioq->inflight--;
+	free(req);
+	return bp;
+}
+
+static struct xfs_buf_ioreq *
+xfs_buf_ioq_reap_ring(
+	struct xfs_buf_ioq	*ioq,
+	bool			wait)
+{
+	struct xfs_buf_ioreq_map *map;
+	struct xfs_buf_ioreq	*req;
+	void			*data;
+	int			res;
+
+	for (;;) {
+		if (!xfs_buf_ring_reap(ioq->ring, wait, &ioq->ring_broken,
+					&data, &res))
+			return NULL;
+
+		map = data;
+		if (res == -ECANCELED && ioq->ring_broken)
+			res = xfs_buf_ioreq_map_pread(map);
+		req = xfs_buf_ioreq_map_done(map, res);
+		if (req)
+			return req;
+	}
+}
+
+/*
+ * Return a buffer whose read has completed, or NULL if nothing is in flight
+ * (or, if @wait is false, nothing has completed yet).  The read verifier has
+ * been run if ops were supplied at submission time.
+ */
+struct xfs_buf *
+libxfs_buf_ioq_reap(
+	struct xfs_buf_ioq	*ioq,
+	bool			wait)
+{
+	struct xfs_buf_ioreq	*req = NULL;
+
+	if (ioq->inflight == 0)
+		return NULL;
+
+	pthread_mutex_lock(&ioq->lock);
+	while (list_empty(&ioq->done) && !ioq->ring && wait)
+		pthread_cond_wait(&ioq->wait, &ioq->lock);
+	if (!list_empty(&ioq->done)) {
+		req = list_first_entry(&ioq->done, struct xfs_buf_ioreq, list);
+		list_del_init(&req->list);
+	}
+	pthread_mutex_unlock(&ioq->lock);
+
+	if (!req && ioq->ring)
+		req = xfs_buf_ioq_reap_ring(ioq, wait);
+	if (!req)
+		return NULL;
+
+	return xfs_buf_ioreq_finish(req);
+}
+
+/*
+ * Synchronous vectored reads for discontiguous buffers.
+ *
+ * Each thread gets a small private ring the first time it reads a
+ * discontiguous buffer so that all the maps can be submitted to the kernel
+ * with a single system call and read in parallel.  The ring is torn down when
+ * the thread exits.
+ */
+#define XFS_BUF_MAPS_RING_SIZE	64
+
+static pthread_key_t	xfs_buf_maps_ring_key;
+static pthread_once_t	xfs_buf_maps_ring_once = PTHREAD_ONCE_INIT;
+static bool		xfs_buf_maps_ring_disabled;
+
+static void
+xfs_buf_maps_ring_destroy(
+	void			*ring)
+{
+	iouring_free(ring);
+}
+
+static void
+xfs_buf_maps_ring_init(void)
+{
+	if (pthread_key_create(&xfs_buf_maps_ring_key,
+				xfs_buf_maps_ring_destroy))
+		xfs_buf_maps_ring_disabled = true;
+}
+
+static struct iouring *
+xfs_buf_maps_ring(void)
+{
+	struct iouring		*ring;
+
+	pthread_once(&xfs_buf_maps_ring_once, xfs_buf_maps_ring_init);
+	if (xfs_buf_maps_ring_disabled)
+		return NULL;
+
+	ring = pthread_getspecific(xfs_buf_maps_ring_key);
+	if (ring)
+		return ring;
+
+	if (iouring_alloc(XFS_BUF_MAPS_RING_SIZE, &ring)) {
+		/* no io_uring support, don't try again */
+		xfs_buf_maps_ring_disabled = true;
+		return NULL;
+	}
+	pthread_setspecific(xfs_buf_maps_ring_key, ring);
+	return ring;
+}
+
+/*
+ * Throw away this thread's ring once nothing is in flight on it; the next
+ * read gets a fresh ring.
+ */
+static void
+xfs_buf_maps_ring_reset(
+	struct iouring		*ring)
+{
+	pthread_setspecific(xfs_buf_maps_ring_key, NULL);
+	iouring_free(ring);
+}
+
+/*
+ * Submit everything that has been prepared on the ring and wait for all of
+ * it to complete, so that nothing on the ring points at the caller's stack or
+ * buffer once we return.  Returns the first I/O error.  If the ring stops
+ * working, *@brokenp is set and the results can't be trusted, but nothing is
+ * in flight any more.
+ */
+static int
+xfs_buf_maps_ring_drain(
+	struct iouring		*ring,
+	bool			*brokenp)
+{
+	struct xfs_buf_ioreq_map *map;
+	void			*data;
+	int			error = 0;
+	int			res;
+	int			ret;
+
+	ret = iouring_submit(ring, 0);
+	if (ret && ret != -EAGAIN && ret != -EBUSY)
+		*brokenp = true;
+	while (xfs_buf_ring_reap(ring, true, brokenp, &data, &res)) {
+		map = data;
+		if (res < 0 && !error)
+			error = res;
+		else if (res != map->len && !error)
+			error = -EIO;
+	}
+	return error;
+}
+
+/*
+ * Read every map of a buffer into the buffer's memory.  Maps that are
+ * adjacent on disk are merged into a single I/O because the buffer memory is
+ * contiguous as well; whatever is left is submitted to the ring in one go and
+ * waited for.  If there's no io_uring support we issue one pread per merged
+ * extent.
+ */
+int
+libxfs_buf_read_maps(
+	struct xfs_buftarg	*btp,
+	struct xfs_buf		*bp)
+{
+	struct xfs_buf_ioreq_map iomaps[XFS_BUF_MAPS_RING_SIZE];
+	struct iouring		*ring = NULL;
+	int			fd = libxfs_device_to_fd(btp->bt_bdev);
+	bool			is_md = libxfs_device_to_mdimage(btp->bt_bdev);
+	char			*buf = bp->b_addr;
+	unsigned int		nr = 0;
+	bool			broken = false;
+	int			error = 0;
+	int			i = 0;
+
+	if (bp->b_nmaps > 1 && !is_md)
+		ring = xfs_buf_maps_ring();
+
+again:
+	while (i < bp->b_nmaps) {
+		xfs_daddr_t	daddr = bp->b_maps[i].bm_bn;
+		int		len = BBTOB(bp->b_maps[i].bm_len);
+		ssize_t		ret;
+
+		for (i++; i < bp->b_nmaps; i++) {
+			if (bp->b_maps[i].bm_bn != daddr + BTOBB(len))
+				break;
+			len += BBTOB(bp->b_maps[i].bm_len);
+		}
+
+		if (!ring) {
+			ret = libxfs_device_pread(btp->bt_bdev, buf, len,
+					LIBXFS_BBTOOFF64(daddr));
+			if (ret < 0)
+				return -errno;
+			if (ret != len)
+				return -EIO;
+			buf += len;
+			continue;
+		}
+
+		iomaps[nr].req = NULL;
+		iomaps[nr].len = len;
+		error = iouring_prep_read(ring, fd, buf, len,
+				LIBXFS_BBTOOFF64(daddr), &iomaps[nr]);
+		if (error) {
+			/* wait for whatever we already prepared */
+			xfs_buf_maps_ring_drain(ring, &broken);
+			goto out_sync;
+		}
+		libxfs_io_account(btp->bt_bdev, daddr, len, LIBXFS_IO_READ);
+		buf += len;
+
+		/* flush a full ring or the last batch of maps */
+		if (++nr < XFS_BUF_MAPS_RING_SIZE && i < bp->b_nmaps)
+			continue;
+
+		error = xfs_buf_maps_ring_drain(ring, &broken);
+		if (broken)
+			goto out_sync;
+		if (error)
+			return error;
+		nr = 0;
+	}
+
+	return 0;
+
+out_sync:
+	/*
+	 * Nothing is reading into the buffer any more, so read the whole thing
+	 * again without the ring.
+	 */
+	if (broken)
+		xfs_buf_maps_ring_reset(ring);
+	ring = NULL;
+	buf = bp->b_addr;
+	i = 0;
+	goto again;
+}
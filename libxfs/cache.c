@@ -9,6 +9,7 @@
 #include <string.h>
 #include <unistd.h>
 #include <pthread.h>
+#include <sched.h>
 
 #include "libxfs_priv.h"
 #include "xfs_fs.h"
@@ -17,6 +18,7 @@
 #include "xfs_trans_resv.h"
 #include "xfs_mount.h"
 #include "xfs_bit.h"
+#include "libfrog/platform.h"
 
 #define CACHE_DEBUG 1
 #undef CACHE_DEBUG
@@ -26,8 +28,179 @@
 
 #define CACHE_SHAKE_COUNT	64
 
+/* upper bound on the number of MRU shards in a CACHE_SHARDED cache */
+#define CACHE_MAX_SHARDS	64
+
 static unsigned int cache_generic_bulkrelse(struct cache *, struct list_head *);
 
+static inline struct cache_mru *
+cache_mru(
+	struct cache		*cache,
+	unsigned int		hashidx,
+	int			priority)
+{
+	unsigned int		shard = hashidx % cache->c_nr_shards;
+
+	return &cache->c_mrus[shard * (CACHE_DIRTY_PRIORITY + 1) + priority];
+}
+
+static inline struct cache_mru *
+cache_node_mru(
+	struct cache		*cache,
+	struct cache_node	*node)
+{
+	return cache_mru(cache, node->cn_hashidx, node->cn_priority);
+}
+
+/*
+ * Hit and miss accounting.  The sharded engine bumps a counter belonging to
+ * the cpu we're running on so that cache hits don't bounce a shared cacheline
+ * (or worse, a mutex) between every thread in the process.  Threads can migrate
+ * between reading the cpu number and the increment, so it still has to be an
+ * atomic add.
+ */
+static inline struct cache_pcpu_stats *
+cache_this_cpu_stats(
+	struct cache		*cache)
+{
+	int			cpu = sched_getcpu();
+
+	if (cpu < 0)
+		cpu = 0;
+	return &cache->c_stats[cpu % cache->c_nr_stats];
+}
+
+static inline void
+cache_count_hit(
+	struct cache		*cache)
+{
+	if (cache->c_stats) {
+		uatomic_inc(&cache_this_cpu_stats(cache)->cs_hits);
+		return;
+	}
+
+	pthread_mutex_lock(&cache->c_mutex);
+	cache->c_hits++;
+	pthread_mutex_unlock(&cache->c_mutex);
+}
+
+void
+cache_get_stats(
+	struct cache		*cache,
+	unsigned long long	*hits,
+	unsigned long long	*misses)
+{
+	unsigned int		i;
+
+	*hits = cache->c_hits;
+	*misses = cache->c_misses;
+	if (!cache->c_stats)
+		return;
+
+	for (i = 0; i < cache->c_nr_stats; i++) {
+		*hits += uatomic_read(&cache->c_stats[i].cs_hits);
+		*misses += uatomic_read(&cache->c_stats[i].cs_misses);
+	}
+}
+
+/*
+ * Hash chain manipulation.  Sharded caches walk the hash chains without holding
+ * the chain mutex, so insertions must publish a fully initialised node and
+ * removals must leave the removed node's forward pointer intact for any reader
+ * still standing on it.  The node is not reinitialised until it is released
+ * after the RCU grace period.
+ */
+static inline void
+cache_hash_add(
+	struct cache		*cache,
+	struct cache_hash	*hash,
+	struct cache_node	*node)
+{
+	struct list_head	*head = &hash->ch_list;
+
+	if (!(cache->c_flags & CACHE_SHARDED)) {
+		list_add(&node->cn_hash, head);
+		return;
+	}
+
+	node->cn_hash.next = head->next;
+	node->cn_hash.prev = head;
+	rcu_assign_pointer(head->next, &node->cn_hash);
+	node->cn_hash.next->prev = &node->cn_hash;
+}
+
+static inline void
+cache_hash_del(
+	struct cache		*cache,
+	struct cache_node	*node)
+{
+	if (!(cache->c_flags & CACHE_SHARDED)) {
+		list_del_init(&node->cn_hash);
+		return;
+	}
+
+	node->cn_hash.next->prev = node->cn_hash.prev;
+	CMM_STORE_SHARED(node->cn_hash.prev->next, node->cn_hash.next);
+}
+
+struct cache_rcu_release {
+	struct rcu_head		rcu;
+	struct cache		*cache;
+	struct list_head	list;
+};
+
+static void
+cache_release_rcu(
+	struct rcu_head		*head)
+{
+	struct cache_rcu_release *rel;
+	struct cache_node	*node;
+
+	rel = container_of(head, struct cache_rcu_release, rcu);
+	list_for_each_entry(node, &rel->list, cn_mru)
+		list_head_init(&node->cn_hash);
+	rel->cache->bulkrelse(rel->cache, &rel->list);
+	free(rel);
+}
+
+/*
+ * Hand a list of unhashed nodes back to the owner of the cache.  Lockless
+ * lookups may still be walking through these nodes, so sharded caches have to
+ * wait for an RCU grace period before the nodes can be recycled.  Must not be
+ * called with node or MRU locks held.
+ */
+static void
+cache_release_nodes(
+	struct cache		*cache,
+	struct list_head	*list)
+{
+	struct cache_rcu_release *rel;
+
+	if (list_empty(list))
+		return;
+
+	if (!(cache->c_flags & CACHE_SHARDED)) {
+		cache->bulkrelse(cache, list);
+		return;
+	}
+
+	rel = malloc(sizeof(*rel));
+	if (!rel) {
+		struct cache_node	*node;
+
+		synchronize_rcu();
+		list_for_each_entry(node, list, cn_mru)
+			list_head_init(&node->cn_hash);
+		cache->bulkrelse(cache, list);
+		return;
+	}
+
+	rel->cache = cache;
+	list_head_init(&rel->list);
+	list_splice_init(list, &rel->list);
+	call_rcu(&rel->rcu, cache_release_rcu);
+}
+
 struct cache *
 cache_init(
 	int			flags,
@@ -35,17 +208,36 @@ cache_init(
 	struct cache_operations	*cache_operations)
 {
 	struct cache *		cache;
-	unsigned int		i, maxcount;
+	unsigned int		i, maxcount, nr_mrus;
 
 	maxcount = hashsize * HASH_CACHE_RATIO;
 
-	if (!(cache = malloc(sizeof(struct cache))))
-		return NULL;
-	if (!(cache->c_hash = calloc(hashsize, sizeof(struct cache_hash)))) {
-		free(cache);
+	if (!(cache = calloc(1, sizeof(struct cache))))
 		return NULL;
+	if (!(cache->c_hash = calloc(hashsize, sizeof(struct cache_hash))))
+		goto out_free_cache;
+
+	cache->c_nr_shards = 1;
+	if (flags & CACHE_SHARDED) {
+		cache->c_nr_stats = platform_nproc();
+		cache->c_stats = aligned_alloc(sizeof(struct cache_pcpu_stats),
+				cache->c_nr_stats *
+				sizeof(struct cache_pcpu_stats));
+		if (!cache->c_stats)
+			goto out_free_hash;
+		memset(cache->c_stats, 0,
+			cache->c_nr_stats * sizeof(struct cache_pcpu_stats));
+
+		cache->c_nr_shards = min_t(unsigned int,
+				roundup_pow_of_two(cache->c_nr_stats),
+				CACHE_MAX_SHARDS);
+		cache->c_nr_shards = min(cache->c_nr_shards, hashsize);
 	}
 
+	nr_mrus = cache->c_nr_shards * (CACHE_DIRTY_PRIORITY + 1);
+	if (!(cache->c_mrus = calloc(nr_mrus, sizeof(struct cache_mru))))
+		goto out_free_stats;
+
 	cache->c_flags = flags;
 	cache->c_count = 0;
 	cache->c_max = 0;
@@ -69,12 +261,20 @@ cache_init(
 		pthread_mutex_init(&cache->c_hash[i].ch_mutex, NULL);
 	}
 
-	for (i = 0; i <= CACHE_DIRTY_PRIORITY; i++) {
+	for (i = 0; i < nr_mrus; i++) {
 		list_head_init(&cache->c_mrus[i].cm_list);
 		cache->c_mrus[i].cm_count = 0;
 		pthread_mutex_init(&cache->c_mrus[i].cm_mutex, NULL);
 	}
 	return cache;
+
+out_free_stats:
+	free(cache->c_stats);
+out_free_hash:
+	free(cache->c_hash);
+out_free_cache:
+	free(cache);
+	return NULL;
 }
 
 static void
@@ -137,16 +337,22 @@ cache_destroy(
 {
 	unsigned int		i;
 
+	/* wait for deferred node releases that still point at us */
+	if (cache->c_flags & CACHE_SHARDED)
+		rcu_barrier();
+
 	cache_destroy_check(cache);
 	for (i = 0; i < cache->c_hashsize; i++) {
 		list_head_destroy(&cache->c_hash[i].ch_list);
 		pthread_mutex_destroy(&cache->c_hash[i].ch_mutex);
 	}
-	for (i = 0; i <= CACHE_DIRTY_PRIORITY; i++) {
+	for (i = 0; i < cache->c_nr_shards * (CACHE_DIRTY_PRIORITY + 1); i++) {
 		list_head_destroy(&cache->c_mrus[i].cm_list);
 		pthread_mutex_destroy(&cache->c_mrus[i].cm_mutex);
 	}
 	pthread_mutex_destroy(&cache->c_mutex);
+	free(cache->c_mrus);
+	free(cache->c_stats);
 	free(cache->c_hash);
 	free(cache);
 }
@@ -180,8 +386,9 @@ cache_add_to_dirty_mru(
 	struct cache		*cache,
 	struct cache_node	*node)
 {
-	struct cache_mru	*mru = &cache->c_mrus[CACHE_DIRTY_PRIORITY];
+	struct cache_mru	*mru;
 
+	mru = cache_mru(cache, node->cn_hashidx, CACHE_DIRTY_PRIORITY);
 	pthread_mutex_lock(&mru->cm_mutex);
 	node->cn_old_priority = node->cn_priority;
 	node->cn_priority = CACHE_DIRTY_PRIORITY;
@@ -205,27 +412,20 @@ cache_add_to_dirty_mru(
  * all entries.
  */
 static unsigned int
-cache_shake(
+cache_shake_mru(
 	struct cache *		cache,
+	struct cache_mru *	mru,
 	unsigned int		priority,
-	bool			purge)
+	bool			purge,
+	unsigned int		count,
+	struct list_head *	temp)
 {
-	struct cache_mru	*mru;
 	struct cache_hash *	hash;
-	struct list_head	temp;
 	struct list_head *	head;
 	struct list_head *	pos;
 	struct list_head *	n;
 	struct cache_node *	node;
-	unsigned int		count;
-
-	ASSERT(priority <= CACHE_DIRTY_PRIORITY);
-	if (priority > CACHE_MAX_PRIORITY && !purge)
-		priority = 0;
 
-	mru = &cache->c_mrus[priority];
-	count = 0;
-	list_head_init(&temp);
 	head = &mru->cm_list;
 
 	pthread_mutex_lock(&mru->cm_mutex);
@@ -254,9 +454,10 @@ cache_shake(
 		ASSERT(node->cn_count == 0);
 		ASSERT(node->cn_priority == priority);
 		node->cn_priority = -1;
+		node->cn_unhashed = true;
 
-		list_move(&node->cn_mru, &temp);
-		list_del_init(&node->cn_hash);
+		list_move(&node->cn_mru, temp);
+		cache_hash_del(cache, node);
 		hash->ch_count--;
 		mru->cm_count--;
 		pthread_mutex_unlock(&hash->ch_mutex);
@@ -268,12 +469,48 @@ cache_shake(
 	}
 	pthread_mutex_unlock(&mru->cm_mutex);
 
-	if (count > 0) {
-		cache->bulkrelse(cache, &temp);
+	return count;
+}
+
+static unsigned int
+cache_shake(
+	struct cache *		cache,
+	unsigned int		priority,
+	bool			purge)
+{
+	struct list_head	temp;
+	unsigned int		count = 0;
+	unsigned int		shard, i;
+
+	ASSERT(priority <= CACHE_DIRTY_PRIORITY);
+	if (priority > CACHE_MAX_PRIORITY && !purge)
+		priority = 0;
+
+	list_head_init(&temp);
 
+	/*
+	 * Rotate the starting shard so that reclaim pressure is spread evenly
+	 * over the shards of a sharded cache.  The update is racy, but that
+	 * only affects fairness.
+	 */
+	shard = cache->c_shake_shard++ % cache->c_nr_shards;
+	for (i = 0; i < cache->c_nr_shards; i++) {
+		struct cache_mru	*mru;
+
+		mru = cache_mru(cache, (shard + i) % cache->c_nr_shards,
+				priority);
+		count = cache_shake_mru(cache, mru, priority, purge, count,
+				&temp);
+		if (!purge && count == CACHE_SHAKE_COUNT)
+			break;
+	}
+
+	if (count > 0) {
 		pthread_mutex_lock(&cache->c_mutex);
 		cache->c_count -= count;
 		pthread_mutex_unlock(&cache->c_mutex);
+
+		cache_release_nodes(cache, &temp);
 	}
 
 	return (count == CACHE_SHAKE_COUNT) ? priority : ++priority;
@@ -298,8 +535,11 @@ cache_node_allocate(
 		if (cache->c_count > cache->c_max)
 			cache->c_max = cache->c_count;
 	}
-	cache->c_misses++;
+	if (!cache->c_stats)
+		cache->c_misses++;
 	pthread_mutex_unlock(&cache->c_mutex);
+	if (cache->c_stats)
+		uatomic_inc(&cache_this_cpu_stats(cache)->cs_misses);
 	if (!nodesfree)
 		return NULL;
 	node = cache->alloc(key);
@@ -314,6 +554,7 @@ cache_node_allocate(
 	node->cn_count = 1;
 	node->cn_priority = 0;
 	node->cn_old_priority = -1;
+	node->cn_unhashed = false;
 	return node;
 }
 
@@ -346,12 +587,30 @@ __cache_node_purge(
 		return 1;
 	}
 
-	mru = &cache->c_mrus[node->cn_priority];
+	mru = cache_node_mru(cache, node);
 	pthread_mutex_lock(&mru->cm_mutex);
 	list_del_init(&node->cn_mru);
 	mru->cm_count--;
 	pthread_mutex_unlock(&mru->cm_mutex);
 
+	if (cache->c_flags & CACHE_SHARDED) {
+		struct list_head	temp;
+
+		/*
+		 * Lockless lookups can still find this node until the grace
+		 * period expires, so mark it dead under the node lock and let
+		 * the RCU callback hand it back to the owner.
+		 */
+		node->cn_unhashed = true;
+		cache_hash_del(cache, node);
+		pthread_mutex_unlock(&node->cn_mutex);
+
+		list_head_init(&temp);
+		list_add(&node->cn_mru, &temp);
+		cache_release_nodes(cache, &temp);
+		return 0;
+	}
+
 	pthread_mutex_unlock(&node->cn_mutex);
 	pthread_mutex_destroy(&node->cn_mutex);
 	list_del_init(&node->cn_hash);
@@ -359,6 +618,85 @@ __cache_node_purge(
 	return 0;
 }
 
+/*
+ * Take a reference to a node that we found in the hash.  Unreferenced nodes
+ * live on an MRU list for the shaker, so pull them off it.  Caller must hold
+ * the node mutex.
+ */
+static void
+cache_node_grab(
+	struct cache *		cache,
+	struct cache_node *	node)
+{
+	struct cache_mru *	mru;
+
+	if (node->cn_count == 0) {
+		ASSERT(node->cn_priority >= 0);
+		ASSERT(!list_empty(&node->cn_mru));
+		mru = cache_node_mru(cache, node);
+		pthread_mutex_lock(&mru->cm_mutex);
+		mru->cm_count--;
+		list_del_init(&node->cn_mru);
+		pthread_mutex_unlock(&mru->cm_mutex);
+		if (node->cn_old_priority != -1) {
+			ASSERT(node->cn_priority == CACHE_DIRTY_PRIORITY);
+			node->cn_priority = node->cn_old_priority;
+			node->cn_old_priority = -1;
+		}
+	}
+	node->cn_count++;
+}
+
+/*
+ * Lockless hash lookup for sharded caches.  Nodes are not recycled until an
+ * RCU grace period after they have been unhashed, so the chain can be walked
+ * and the keys compared without holding the chain mutex.  Once we have a
+ * match we lock the node and check that it hasn't been unhashed in the mean
+ * time; a node's key never changes while it is hashed.
+ *
+ * Returns NULL if the key wasn't found or if the caller needs to fall back to
+ * the locked lookup to purge a miscompared node.
+ */
+static struct cache_node *
+cache_node_lookup_rcu(
+	struct cache *		cache,
+	struct cache_hash *	hash,
+	cache_key_t		key)
+{
+	struct list_head *	head = &hash->ch_list;
+	struct list_head *	pos;
+	struct cache_node *	node;
+
+	rcu_read_lock();
+	for (pos = rcu_dereference(head->next); pos != head;
+	     pos = rcu_dereference(pos->next)) {
+		node = list_entry(pos, struct cache_node, cn_hash);
+		switch (cache->compare(node, key)) {
+		case CACHE_HIT:
+			break;
+		case CACHE_PURGE:
+			if (cache->c_flags & CACHE_MISCOMPARE_PURGE)
+				goto out_miss;
+			/* fall through */
+		case CACHE_MISS:
+			continue;
+		}
+
+		pthread_mutex_lock(&node->cn_mutex);
+		if (node->cn_unhashed) {
+			pthread_mutex_unlock(&node->cn_mutex);
+			goto out_miss;
+		}
+		cache_node_grab(cache, node);
+		pthread_mutex_unlock(&node->cn_mutex);
+		rcu_read_unlock();
+		return node;
+	}
+out_miss:
+	rcu_read_unlock();
+	return NULL;
+}
+
 /*
  * Lookup in the cache hash table.  With any luck we'll get a cache
  * hit, in which case this will all be over quickly and painlessly.
@@ -375,7 +713,6 @@ cache_node_get(
 {
 	struct cache_node *	node = NULL;
 	struct cache_hash *	hash;
-	struct cache_mru *	mru;
 	struct list_head *	head;
 	struct list_head *	pos;
 	struct list_head *	n;
@@ -387,6 +724,15 @@ cache_node_get(
 	hash = cache->c_hash + hashidx;
 	head = &hash->ch_list;
 
+	if (cache->c_flags & CACHE_SHARDED) {
+		node = cache_node_lookup_rcu(cache, hash, key);
+		if (node) {
+			cache_count_hit(cache);
+			*nodep = node;
+			return 0;
+		}
+	}
+
 	for (;;) {
 		pthread_mutex_lock(&hash->ch_mutex);
 		for (pos = head->next, n = pos->next; pos != head;
@@ -414,30 +760,11 @@ cache_node_get(
 			 * from its MRU list, and update stats.
 			 */
 			pthread_mutex_lock(&node->cn_mutex);
-
-			if (node->cn_count == 0) {
-				ASSERT(node->cn_priority >= 0);
-				ASSERT(!list_empty(&node->cn_mru));
-				mru = &cache->c_mrus[node->cn_priority];
-				pthread_mutex_lock(&mru->cm_mutex);
-				mru->cm_count--;
-				list_del_init(&node->cn_mru);
-				pthread_mutex_unlock(&mru->cm_mutex);
-				if (node->cn_old_priority != -1) {
-					ASSERT(node->cn_priority ==
-							CACHE_DIRTY_PRIORITY);
-					node->cn_priority = node->cn_old_priority;
-					node->cn_old_priority = -1;
-				}
-			}
-			node->cn_count++;
-
+			cache_node_grab(cache, node);
 			pthread_mutex_unlock(&node->cn_mutex);
 			pthread_mutex_unlock(&hash->ch_mutex);
 
-			pthread_mutex_lock(&cache->c_mutex);
-			cache->c_hits++;
-			pthread_mutex_unlock(&cache->c_mutex);
+			cache_count_hit(cache);
 
 			*nodep = node;
 			return 0;
@@ -468,7 +795,7 @@ next_object:
 	/* add new node to appropriate hash */
 	pthread_mutex_lock(&hash->ch_mutex);
 	hash->ch_count++;
-	list_add(&node->cn_hash, &hash->ch_list);
+	cache_hash_add(cache, hash, node);
 	pthread_mutex_unlock(&hash->ch_mutex);
 
 	if (purged) {
@@ -505,7 +832,7 @@ cache_node_put(
 
 	if (node->cn_count == 0) {
 		/* add unreferenced node to appropriate MRU for shaker */
-		mru = &cache->c_mrus[node->cn_priority];
+		mru = cache_node_mru(cache, node);
 		pthread_mutex_lock(&mru->cm_mutex);
 		mru->cm_count++;
 		list_add(&node->cn_mru, &mru->cm_list);
@@ -610,6 +937,10 @@ cache_purge(
 	for (i = 0; i <= CACHE_DIRTY_PRIORITY; i++)
 		cache_shake(cache, i, true);
 
+	/* make sure every purged node has been handed back to the owner */
+	if (cache->c_flags & CACHE_SHARDED)
+		rcu_barrier();
+
 #ifdef CACHE_DEBUG
 	if (cache->c_count != 0) {
 		/* flush referenced nodes to disk */
@@ -652,6 +983,19 @@ cache_flush(
 	}
 }
 
+static unsigned long
+cache_mru_count(
+	struct cache	*cache,
+	int		priority)
+{
+	unsigned long	count = 0;
+	unsigned int	shard;
+
+	for (shard = 0; shard < cache->c_nr_shards; shard++)
+		count += cache_mru(cache, shard, priority)->cm_count;
+	return count;
+}
+
 #define	HASH_REPORT	(3 * HASH_CACHE_RATIO)
 void
 cache_report(
@@ -662,8 +1006,10 @@ cache_report(
 	int		i;
 	unsigned long	count, index, total;
 	unsigned long	hash_bucket_lengths[HASH_REPORT + 2];
+	unsigned long long hits, misses;
 
-	if ((cache->c_hits + cache->c_misses) == 0)
+	cache_get_stats(cache, &hits, &misses);
+	if ((hits + misses) == 0)
 		return;
 
 	/* report cache summary */
@@ -672,6 +1018,7 @@ cache_report(
 			"Max utilized entries = %u\n"
 			"Active entries = %u\n"
 			"Hash table size = %u\n"
+			"MRU shards = %u\n"
 			"Hits = %llu\n"
 			"Misses = %llu\n"
 			"Hit ratio = %5.2f\n",
@@ -680,21 +1027,22 @@ cache_report(
 			cache->c_max,
 			cache->c_count,
 			cache->c_hashsize,
-			cache->c_hits,
-			cache->c_misses,
-			(double)cache->c_hits * 100 /
-				(cache->c_hits + cache->c_misses)
+			cache->c_nr_shards,
+			hits,
+			misses,
+			(double)hits * 100 / (hits + misses)
 	);
 
-	for (i = 0; i <= CACHE_MAX_PRIORITY; i++)
-		fprintf(fp, "MRU %d entries = %6u (%3u%%)\n",
-			i, cache->c_mrus[i].cm_count,
-			cache->c_mrus[i].cm_count * 100 / cache->c_count);
+	for (i = 0; i <= CACHE_MAX_PRIORITY; i++) {
+		count = cache_mru_count(cache, i);
+		fprintf(fp, "MRU %d entries = %6lu (%3lu%%)\n",
+			i, count, count * 100 / cache->c_count);
+	}
 
 	i = CACHE_DIRTY_PRIORITY;
-	fprintf(fp, "Dirty MRU %d entries = %6u (%3u%%)\n",
-		i, cache->c_mrus[i].cm_count,
-		cache->c_mrus[i].cm_count * 100 / cache->c_count);
+	count = cache_mru_count(cache, i);
+	fprintf(fp, "Dirty MRU %d entries = %6lu (%3lu%%)\n",
+		i, count, count * 100 / cache->c_count);
 
 	/* report hash bucket lengths */
 	bzero(hash_bucket_lengths, sizeof(hash_bucket_lengths));
@@ -37,13 +37,15 @@ int libxfs_bhash_size;		/* #buckets in bcache */
 int	use_xfs_buf_lock;	/* global flag: use xfs_buf locks for MT */
 
 /*
- * dev_map - map open devices to fd.
+ * dev_map - map open devices to fd, and to a metadump image if the device is
+ * really a metadump file.
  */
 #define MAX_DEVS 10	/* arbitary maximum */
 static int nextfakedev = -1;	/* device number to give to next fake device */
 static struct dev_to_fd {
 	dev_t	dev;
 	int	fd;
+	struct xfs_mdimage *md;
 } dev_map[MAX_DEVS]={{0}};
 
 /*
@@ -89,6 +91,53 @@ libxfs_device_to_fd(dev_t device)
 	/* NOTREACHED */
 }
 
+/* libxfs_device_to_mdimage:
+ *     return the metadump image behind a device, or NULL for a real device
+ */
+struct xfs_mdimage *
+libxfs_device_to_mdimage(dev_t device)
+{
+	int	d;
+
+	for (d = 0; d < MAX_DEVS; d++)
+		if (dev_map[d].dev == device)
+			return dev_map[d].md;
+	return NULL;
+}
+
+/* libxfs_device_pread:
+ *     pread() from a device, or from the metadump image standing in for it
+ */
+ssize_t
+libxfs_device_pread(dev_t device, void *buf, size_t len, off64_t offset)
+{
+	struct xfs_mdimage	*md = libxfs_device_to_mdimage(device);
+	off64_t			size;
+	ssize_t			ret;
+	int			error;
+
+	if (!md) {
+		ret = pread(libxfs_device_to_fd(device), buf, len, offset);
+		if (ret > 0)
+			libxfs_io_account(device, offset >> BBSHIFT, ret,
+					LIBXFS_IO_READ);
+		return ret;
+	}
+
+	/* behave like a file as big as the filesystem in the image */
+	size = BBTOB(libxfs_mdimage_size(md));
+	if (offset >= size)
+		return 0;
+	len = min_t(off64_t, len, size - offset);
+	error = libxfs_mdimage_pread(md, buf, len, offset);
+	if (error) {
+		errno = -error;
+		return -1;
+	}
+	libxfs_io_account(device, offset >> BBSHIFT, len, LIBXFS_IO_READ);
+	return len;
+}
+
 /* libxfs_device_open:
  *     open a device and return its device number
  */
@@ -99,6 +148,7 @@ libxfs_device_open(char *path, int creat, int xflags, int setblksize)
 	int		fd, d, flags;
 	int		readonly, dio, excl;
 	struct stat	statb;
+	struct xfs_mdimage *md = NULL;
 
 	readonly = (xflags & LIBXFS_ISREADONLY);
 	excl = (xflags & LIBXFS_EXCLUSIVELY) && !creat;
@@ -139,6 +189,21 @@ retry:
 		}
 	}
 
+	/*
+	 * Read-only users can be pointed at a metadump instead of a
+	 * filesystem image, in which case reads are served from the dump.
+	 */
+	if (readonly && !creat && S_ISREG(statb.st_mode) &&
+	    libxfs_mdimage_probe(path)) {
+		int	error = libxfs_mdimage_open(path, &md);
+
+		if (error) {
+			fprintf(stderr, _("%s: cannot load metadump %s: %s\n"),
+				progname, path, strerror(-error));
+			exit(1);
+		}
+	}
+
 	/*
 	 * Get the device number from the stat buf - unless
 	 * we're not opening a real device, in which case
@@ -157,6 +222,7 @@ retry:
 		if (!dev_map[d].dev) {
 			dev_map[d].dev = dev;
 			dev_map[d].fd = fd;
+			dev_map[d].md = md;
 
 			return dev;
 		}
@@ -177,7 +243,10 @@ libxfs_device_close(dev_t dev)
 			int	fd, ret;
 
 			fd = dev_map[d].fd;
+			if (dev_map[d].md)
+				libxfs_mdimage_close(dev_map[d].md);
 			dev_map[d].dev = dev_map[d].fd = 0;
+			dev_map[d].md = NULL;
 
 			ret = platform_flush_device(fd, dev);
 			if (ret) {
@@ -358,6 +427,8 @@ libxfs_init(libxfs_init_t *a)
 		}
 	} else
 		a->dsize = 0;
+	if (a->ddev && libxfs_device_to_mdimage(a->ddev))
+		a->dsize = libxfs_mdimage_size(libxfs_device_to_mdimage(a->ddev));
 	if (logname) {
 		if (a->lisfile) {
 			a->logdev = libxfs_device_open(logname,
@@ -188,10 +188,63 @@ extern void	libxfs_bcache_free(void);
 extern void	libxfs_bcache_flush(void);
 extern int	libxfs_bcache_overflowed(void);
 
+/*
+ * I/O accounting.  If a hook is set, it is called for every read and write
+ * issued to a device with the disk address and the length in bytes, and every
+ * time a thread has to wait for a buffer that another thread has locked (say,
+ * one that prefetch is reading) with the time it waited in nanoseconds.
+ */
+enum libxfs_io_type {
+	LIBXFS_IO_READ,
+	LIBXFS_IO_WRITE,
+	LIBXFS_IO_WAIT,
+};
+
+typedef void (*libxfs_io_account_fn)(dev_t dev, xfs_daddr_t daddr,
+		uint64_t val, enum libxfs_io_type type);
+extern libxfs_io_account_fn libxfs_io_account_hook;
+
+static inline void
+libxfs_io_account(
+	dev_t			dev,
+	xfs_daddr_t		daddr,
+	uint64_t		val,
+	enum libxfs_io_type	type)
+{
+	if (libxfs_io_account_hook)
+		libxfs_io_account_hook(dev, daddr, val, type);
+}
+
 /* Buffer (Raw) Interfaces */
 int		libxfs_bwrite(struct xfs_buf *bp);
 extern int	libxfs_readbufr(struct xfs_buftarg *, xfs_daddr_t, struct xfs_buf *, int, int);
 extern int	libxfs_readbufr_map(struct xfs_buftarg *, struct xfs_buf *, int);
+int libxfs_buf_read_maps(struct xfs_buftarg *btp, struct xfs_buf *bp);
+
+/* Asynchronous buffer reads */
+struct xfs_buf_ioq;
+
+/* fail with -EOPNOTSUPP rather than fall back to pread threads */
+#define LIBXFS_BUF_IOQ_RING_ONLY	(1U << 0)
+
+int libxfs_buf_ioq_alloc(struct xfs_buftarg *btp, unsigned int depth,
+		unsigned int flags, struct xfs_buf_ioq **ioqp);
+void libxfs_buf_ioq_free(struct xfs_buf_ioq *ioq);
+bool libxfs_buf_ioq_full(struct xfs_buf_ioq *ioq);
+unsigned int libxfs_buf_ioq_inflight(struct xfs_buf_ioq *ioq);
+int libxfs_buf_ioq_submit(struct xfs_buf_ioq *ioq, struct xfs_buf *bp,
+		const struct xfs_buf_ops *ops);
+struct xfs_buf *libxfs_buf_ioq_reap(struct xfs_buf_ioq *ioq, bool wait);
+
+/* Metadump images served as a read-only data device */
+struct xfs_mdimage;
+
+bool libxfs_mdimage_probe(const char *path);
+int libxfs_mdimage_open(const char *path, struct xfs_mdimage **mdp);
+void libxfs_mdimage_close(struct xfs_mdimage *md);
+long long libxfs_mdimage_size(struct xfs_mdimage *md);
+int libxfs_mdimage_pread(struct xfs_mdimage *md, void *buf, size_t len,
+		off64_t offset);
 
 extern int	libxfs_device_zero(struct xfs_buftarg *, xfs_daddr_t, uint);
 
@@ -228,6 +281,9 @@ xfs_buf_hold(struct xfs_buf *bp)
 void xfs_buf_lock(struct xfs_buf *bp);
 void xfs_buf_unlock(struct xfs_buf *bp);
 
+/* Lock buffers for the duration of each hold; set for threaded users. */
+extern int use_xfs_buf_lock;
+
 int libxfs_buf_get_uncached(struct xfs_buftarg *targ, size_t bblen, int flags,
 		struct xfs_buf **bpp);
 int libxfs_buf_read_uncached(struct xfs_buftarg *targ, xfs_daddr_t daddr,
@@ -0,0 +1,671 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Copyright (c) 2026 Oracle.  All Rights Reserved.
+ */
+
+#include "libxfs_priv.h"
+#include "init.h"
+#include "xfs_fs.h"
+#include "xfs_shared.h"
+#include "xfs_format.h"
+#include "xfs_log_format.h"
+#include "xfs_trans_resv.h"
+#include "xfs_mount.h"
+#include "xfs_metadump.h"
+#include "libfrog/compress.h"
+#include "libfrog/crc32c.h"
+
+#include "libxfs.h"
+
+/*
+ * Metadump images.
+ *
+ * A metadump file can stand in for the data device of a read-only tool.  When
+ * the image is opened we build an in-memory map from disk address to where the
+ * block lives in the dump: a file offset for version 1 dumps, or a frame and
+ * an offset into the frame payload for version 3 dumps.  Reads are served from
+ * that map; anything that isn't in the dump reads back as zeroes, just as it
+ * would from a restored image.
+ *
+ * Blocks can appear more than once in a dump, in which case the last copy
+ * wins.  The map is resolved into non-overlapping extents when it is built so
+ * that a lookup is a simple binary search.  Decompressed v3 frames are kept in
+ * a small LRU cache because metadata reads tend to cluster.
+ */
+
+#define XFS_MDI_NOFRAME		(~0ULL)
+#define XFS_MDI_NR_FRAMES	32	/* decompressed frames to cache */
+#define XFS_MDI_MAX_FRAME_SIZE	(64U << 20)
+
+struct xfs_mdimage_ext {
+	xfs_daddr_t		daddr;
+	uint32_t		len;		/* basic blocks */
+	uint64_t		frame;		/* frame offset, or NOFRAME */
+	uint64_t		offset;		/* offset in frame payload/file */
+};
+
+struct xfs_mdimage_frame {
+	uint64_t		pos;		/* file offset of frame header */
+	char			*data;		/* decompressed payload */
+	uint32_t		len;
+	uint64_t		lru;
+};
+
+struct xfs_mdimage {
+	int			fd;
+	struct xfs_mdimage_ext	*exts;
+	uint64_t		nr_exts;
+	uint64_t		max_exts;
+	long long		size;		/* basic blocks */
+	uint32_t		frame_size;	/* max v3 frame payload */
+
+	pthread_mutex_t		lock;
+	struct xfs_mdimage_frame frames[XFS_MDI_NR_FRAMES];
+	uint64_t		lru_clock;
+};
+
+static int
+mdi_pread(
+	struct xfs_mdimage	*md,
+	void			*buf,
+	size_t			len,
+	off64_t			offset)
+{
+	ssize_t			ret;
+
+	ret = pread(md->fd, buf, len, offset);
+	if (ret < 0)
+		return -errno;
+	if (ret != (ssize_t)len)
+		return -EFSCORRUPTED;
+	return 0;
+}
+
+/* Add an extent in dump order, merging it with the last one if possible. */
+static int
+mdi_add_ext(
+	struct xfs_mdimage	*md,
+	xfs_daddr_t		daddr,
+	uint32_t		len,
+	uint64_t		frame,
+	uint64_t		offset)
+{
+	struct xfs_mdimage_ext	*ext;
+
+	if (md->nr_exts) {
+		ext = &md->exts[md->nr_exts - 1];
+		if (ext->frame == frame &&
+		    ext->daddr + ext->len == daddr &&
+		    ext->offset + BBTOB(ext->len) == offset) {
+			ext->len += len;
+			return 0;
+		}
+	}
+
+	if (md->nr_exts == md->max_exts) {
+		uint64_t	nr = max(md->max_exts * 2, 1024ULL);
+
+		ext = realloc(md->exts, nr * sizeof(*ext));
+		if (!ext)
+			return -ENOMEM;
+		md->exts = ext;
+		md->max_exts = nr;
+	}
+
+	ext = &md->exts[md->nr_exts++];
+	ext->daddr = daddr;
+	ext->len = len;
+	ext->frame = frame;
+	ext->offset = offset;
+	return 0;
+}
+
+/* Walk the metablocks of a version 1 dump. */
+static int
+mdi_load_v1(
+	struct xfs_mdimage	*md)
+{
+	struct xfs_metablock	*mb;
+	__be64			*block_index;
+	unsigned int		max_indices;
+	uint64_t		pos = 0;
+	int			error = 0;
+
+	mb = malloc(BBSIZE);
+	if (!mb)
+		return -ENOMEM;
+	block_index = (__be64 *)(mb + 1);
+	max_indices = (BBSIZE - sizeof(struct xfs_metablock)) / sizeof(__be64);
+
+	for (;;) {
+		unsigned int	count;
+		unsigned int	i;
+
+		error = mdi_pread(md, mb, BBSIZE, pos);
+		if (error)
+			break;
+		if (mb->mb_magic != cpu_to_be32(XFS_MD_MAGIC) ||
+		    mb->mb_blocklog != BBSHIFT) {
+			error = -EFSCORRUPTED;
+			break;
+		}
+
+		count = be16_to_cpu(mb->mb_count);
+		if (count > max_indices) {
+			error = -EFSCORRUPTED;
+			break;
+		}
+		for (i = 0; i < count; i++) {
+			error = mdi_add_ext(md, be64_to_cpu(block_index[i]), 1,
+					XFS_MDI_NOFRAME,
+					pos + BBSIZE + BBTOB(i));
+			if (error)
+				goto out;
+		}
+		if (count < max_indices)
+			break;
+		pos += BBSIZE + BBTOB(count);
+	}
+out:
+	free(mb);
+	return error;
+}
+
+/* Load the trailing index of a version 3 dump. */
+static int
+mdi_load_v3(
+	struct xfs_mdimage	*md)
+{
+	struct xfs_md3_header	hdr;
+	struct xfs_md3_footer	ftr;
+	struct xfs_md3_index	*index;
+	struct stat		st;
+	uint64_t		nr, pos, i;
+	uint32_t		crc;
+	int			error;
+
+	error = mdi_pread(md, &hdr, sizeof(hdr), 0);
+	if (error)
+		return error;
+	crc = be32_to_cpu(hdr.mh_crc);
+	hdr.mh_crc = 0;
+	if (crc32c_le(~0U, (unsigned char *)&hdr, sizeof(hdr)) != crc)
+		return -EFSBADCRC;
+	md->frame_size = be32_to_cpu(hdr.mh_frame_size);
+	if (md->frame_size == 0 || md->frame_size > XFS_MDI_MAX_FRAME_SIZE)
+		return -EFSCORRUPTED;
+
+	if (fstat(md->fd, &st) < 0)
+		return -errno;
+	if (st.st_size < sizeof(hdr) + sizeof(ftr))
+		return -EFSCORRUPTED;
+	error = mdi_pread(md, &ftr, sizeof(ftr), st.st_size - sizeof(ftr));
+	if (error)
+		return error;
+	if (ftr.mt_magic != cpu_to_be32(XFS_MD3_INDEX_MAGIC))
+		return -EFSCORRUPTED;
+
+	pos = be64_to_cpu(ftr.mt_index);
+	nr = be64_to_cpu(ftr.mt_nr_entries);
+	if (pos < sizeof(hdr) || pos > st.st_size - sizeof(ftr) ||
+	    (st.st_size - sizeof(ftr) - pos) / sizeof(*index) != nr ||
+	    (st.st_size - sizeof(ftr) - pos) % sizeof(*index) != 0)
+		return -EFSCORRUPTED;
+
+	index = malloc(nr * sizeof(*index));
+	if (nr && !index)
+		return -ENOMEM;
+	error = mdi_pread(md, index, nr * sizeof(*index), pos);
+	if (error)
+		goto out;
+
+	crc = be32_to_cpu(ftr.mt_crc);
+	ftr.mt_crc = 0;
+	if (crc32c_le(crc32c_le(~0U, (unsigned char *)index,
+				nr * sizeof(*index)),
+		      (unsigned char *)&ftr, sizeof(ftr)) != crc) {
+		error = -EFSBADCRC;
+		goto out;
+	}
+
+	for (i = 0; i < nr; i++) {
+		error = mdi_add_ext(md, be64_to_cpu(index[i].mi_daddr),
+				be32_to_cpu(index[i].mi_len),
+				be64_to_cpu(index[i].mi_frame),
+				be32_to_cpu(index[i].mi_offset));
+		if (error)
+			break;
+	}
+out:
+	free(index);
+	return error;
+}
+
+/* Was @a dumped after @b? */
+static inline bool
+mdi_ext_newer(
+	const struct xfs_mdimage_ext *a,
+	const struct xfs_mdimage_ext *b)
+{
+	if (a->frame != b->frame)
+		return a->frame > b->frame;
+	return a->offset > b->offset;
+}
+
+static int
+mdi_ext_cmp(
+	const void		*a,
+	const void		*b)
+{
+	const struct xfs_mdimage_ext *ea = a;
+	const struct xfs_mdimage_ext *eb = b;
+
+	if (ea->daddr != eb->daddr)
+		return ea->daddr < eb->daddr ? -1 : 1;
+	if (mdi_ext_newer(ea, eb))
+		return 1;
+	return mdi_ext_newer(eb, ea) ? -1 : 0;
+}
+
+/*
+ * Resolve a run of mutually overlapping extents, exts[first] to exts[last],
+ * which cover @len basic blocks.  The newest copy of each block wins, and the
+ * result is appended to @out.
+ */
+static int
+mdi_resolve_overlap(
+	struct xfs_mdimage_ext	*exts,
+	uint64_t		first,
+	uint64_t		last,
+	uint64_t		len,
+	struct xfs_mdimage_ext	*out,
+	uint64_t		*nr_out)
+{
+	xfs_daddr_t		start = exts[first].daddr;
+	uint64_t		*owner;
+	uint64_t		i, b;
+
+	owner = malloc(len * sizeof(uint64_t));
+	if (!owner)
+		return -ENOMEM;
+	for (b = 0; b < len; b++)
+		owner[b] = XFS_MDI_NOFRAME;
+
+	for (i = first; i <= last; i++) {
+		struct xfs_mdimage_ext	*ext = &exts[i];
+
+		for (b = ext->daddr - start; b < ext->daddr - start + ext->len;
+		     b++) {
+			if (owner[b] == XFS_MDI_NOFRAME ||
+			    mdi_ext_newer(ext, &exts[owner[b]]))
+				owner[b] = i;
+		}
+	}
+
+	for (b = 0; b < len; b++) {
+		struct xfs_mdimage_ext	*prev = *nr_out ? &out[*nr_out - 1] :
+							NULL;
+		struct xfs_mdimage_ext	*src;
+		xfs_daddr_t		daddr = start + b;
+		uint64_t		offset;
+
+		if (owner[b] == XFS_MDI_NOFRAME)
+			continue;
+		src = &exts[owner[b]];
+		offset = src->offset + BBTOB(daddr - src->daddr);
+		if (prev && prev->frame == src->frame &&
+		    prev->daddr + prev->len == daddr &&
+		    prev->offset + BBTOB(prev->len) == offset) {
+			prev->len++;
+			continue;
+		}
+		out[*nr_out].daddr = daddr;
+		out[*nr_out].len = 1;
+		out[*nr_out].frame = src->frame;
+		out[*nr_out].offset = offset;
+		(*nr_out)++;
+	}
+
+	free(owner);
+	return 0;
+}
+
+/*
+ * Find the run of overlapping extents starting at exts[first].  Returns the
+ * index just past the run and the disk address at which the run ends.
+ */
+static uint64_t
+mdi_overlap_run(
+	struct xfs_mdimage	*md,
+	uint64_t		first,
+	xfs_daddr_t		*endp)
+{
+	xfs_daddr_t		end = md->exts[first].daddr + md->exts[first].len;
+	uint64_t		i;
+
+	for (i = first + 1; i < md->nr_exts && md->exts[i].daddr < end; i++)
+		end = max_t(xfs_daddr_t, end,
+				md->exts[i].daddr + md->exts[i].len);
+	*endp = end;
+	return i;
+}
+
+/* Sort the map and make the extents in it disjoint. */
+static int
+mdi_resolve(
+	struct xfs_mdimage	*md)
+{
+	struct xfs_mdimage_ext	*out;
+	uint64_t		nr_out = 0;
+	uint64_t		max_out = 0;
+	uint64_t		i, next;
+	xfs_daddr_t		end;
+	int			error;
+
+	qsort(md->exts, md->nr_exts, sizeof(struct xfs_mdimage_ext),
+			mdi_ext_cmp);
+
+	/* work out how big the result can be; overlaps are rare */
+	for (i = 0; i < md->nr_exts; i = next) {
+		next = mdi_overlap_run(md, i, &end);
+		max_out += next == i + 1 ? 1 : end - md->exts[i].daddr;
+	}
+	if (max_out == md->nr_exts)
+		return 0;
+
+	out = malloc(max_out * sizeof(*out));
+	if (!out)
+		return -ENOMEM;
+	for (i = 0; i < md->nr_exts; i = next) {
+		next = mdi_overlap_run(md, i, &end);
+		if (next == i + 1) {
+			out[nr_out++] = md->exts[i];
+			continue;
+		}
+		error = mdi_resolve_overlap(md->exts, i, next - 1,
+				end - md->exts[i].daddr, out, &nr_out);
+		if (error) {
+			free(out);
+			return error;
+		}
+	}
+
+	free(md->exts);
+	md->exts = out;
+	md->nr_exts = md->max_exts = nr_out;
+	return 0;
+}
+
+/* Is the file at @path a metadump that we know how to serve reads from? */
+bool
+libxfs_mdimage_probe(
+	const char		*path)
+{
+	__be32			magic;
+	int			fd;
+	bool			ret;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return false;
+	ret = pread(fd, &magic, sizeof(magic), 0) == sizeof(magic) &&
+	      (magic == cpu_to_be32(XFS_MD_MAGIC) ||
+	       magic == cpu_to_be32(XFS_MD_MAGIC_V3));
+	close(fd);
+	return ret;
+}
+
+int
+libxfs_mdimage_open(
+	const char		*path,
+	struct xfs_mdimage	**mdp)
+{
+	struct xfs_mdimage	*md;
+	struct xfs_dsb		*dsb;
+	__be32			magic;
+	char			*sb;
+	int			error;
+
+	md = calloc(1, sizeof(struct xfs_mdimage));
+	if (!md)
+		return -ENOMEM;
+	pthread_mutex_init(&md->lock, NULL);
+	md->fd = open(path, O_RDONLY);
+	if (md->fd < 0) {
+		error = -errno;
+		goto out_free;
+	}
+
+	error = mdi_pread(md, &magic, sizeof(magic), 0);
+	if (error)
+		goto out_free;
+	if (magic == cpu_to_be32(XFS_MD_MAGIC))
+		error = mdi_load_v1(md);
+	else if (magic == cpu_to_be32(XFS_MD_MAGIC_V3))
+		error = mdi_load_v3(md);
+	else
+		error = -EFSCORRUPTED;
+	if (!error)
+		error = mdi_resolve(md);
+	if (error)
+		goto out_free;
+
+	/* size the device from the superblock, or failing that the dump */
+	if (md->nr_exts)
+		md->size = md->exts[md->nr_exts - 1].daddr +
+			   md->exts[md->nr_exts - 1].len;
+	sb = malloc(BBSIZE);
+	if (!sb) {
+		error = -ENOMEM;
+		goto out_free;
+	}
+	error = libxfs_mdimage_pread(md, sb, BBSIZE, 0);
+	dsb = (struct xfs_dsb *)sb;
+	if (!error && dsb->sb_magicnum == cpu_to_be32(XFS_SB_MAGIC))
+		md->size = max_t(long long, md->size,
+				(be64_to_cpu(dsb->sb_dblocks) *
+				 be32_to_cpu(dsb->sb_blocksize)) >> BBSHIFT);
+	free(sb);
+	if (error)
+		goto out_free;
+
+	*mdp = md;
+	return 0;
+out_free:
+	libxfs_mdimage_close(md);
+	return error;
+}
+
+void
+libxfs_mdimage_close(
+	struct xfs_mdimage	*md)
+{
+	int			i;
+
+	if (md->fd >= 0)
+		close(md->fd);
+	for (i = 0; i < XFS_MDI_NR_FRAMES; i++)
+		free(md->frames[i].data);
+	pthread_mutex_destroy(&md->lock);
+	free(md->exts);
+	free(md);
+}
+
+/* Size of the filesystem in the image, in basic blocks. */
+long long
+libxfs_mdimage_size(
+	struct xfs_mdimage	*md)
+{
+	return md->size;
+}
+
+/* Read, check and decompress the frame at @pos. */
+static int
+mdi_load_frame(
+	struct xfs_mdimage	*md,
+	uint64_t		pos,
+	char			**datap,
+	uint32_t		*lenp)
+{
+	struct xfs_md3_frame	hdr;
+	char			*cbuf = NULL;
+	char			*ubuf = NULL;
+	uint32_t		ulen, clen, crc;
+	int			error;
+
+	error = mdi_pread(md, &hdr, sizeof(hdr), pos);
+	if (error)
+		return error;
+	ulen = be32_to_cpu(hdr.mf_ulen);
+	clen = be32_to_cpu(hdr.mf_clen);
+	if (hdr.mf_magic != cpu_to_be32(XFS_MD3_FRAME_MAGIC) ||
+	    ulen > md->frame_size || clen > md->frame_size)
+		return -EFSCORRUPTED;
+	if (!compress_alg_supported(hdr.mf_alg))
+		return -EOPNOTSUPP;
+
+	cbuf = malloc(clen);
+	ubuf = malloc(ulen);
+	if (!cbuf || !ubuf) {
+		error = -ENOMEM;
+		goto out;
+	}
+	error = mdi_pread(md, cbuf, clen, pos + sizeof(hdr));
+	if (error)
+		goto out;
+
+	crc = be32_to_cpu(hdr.mf_crc);
+	hdr.mf_crc = 0;
+	if (crc32c_le(crc32c_le(~0U, (unsigned char *)&hdr, sizeof(hdr)),
+		      (unsigned char *)cbuf, clen) != crc) {
+		error = -EFSBADCRC;
+		goto out;
+	}
+	error = decompress_buf(hdr.mf_alg, cbuf, clen, ubuf, ulen);
+	if (error)
+		goto out;
+
+	*datap = ubuf;
+	*lenp = ulen;
+	ubuf = NULL;
+out:
+	free(ubuf);
+	free(cbuf);
+	return error;
+}
+
+static struct xfs_mdimage_frame *
+mdi_find_frame(
+	struct xfs_mdimage	*md,
+	uint64_t		pos)
+{
+	int			i;
+
+	for (i = 0; i < XFS_MDI_NR_FRAMES; i++) {
+		if (md->frames[i].data && md->frames[i].pos == pos)
+			return &md->frames[i];
+	}
+	return NULL;
+}
+
+/* Copy @len bytes at @offset in the payload of the frame at @pos. */
+static int
+mdi_read_frame(
+	struct xfs_mdimage	*md,
+	uint64_t		pos,
+	uint64_t		offset,
+	void			*buf,
+	size_t			len)
+{
+	struct xfs_mdimage_frame *frame;
+	char			*data;
+	uint32_t		data_len;
+	int			error = 0;
+	int			i;
+
+	pthread_mutex_lock(&md->lock);
+	frame = mdi_find_frame(md, pos);
+	if (frame)
+		goto copy;
+	pthread_mutex_unlock(&md->lock);
+
+	/* decompress without the lock so that other readers can proceed */
+	error = mdi_load_frame(md, pos, &data, &data_len);
+	if (error)
+		return error;
+
+	pthread_mutex_lock(&md->lock);
+	frame = mdi_find_frame(md, pos);
+	if (frame) {
+		free(data);
+		goto copy;
+	}
+	frame = &md->frames[0];
+	for (i = 1; i < XFS_MDI_NR_FRAMES; i++) {
+		if (md->frames[i].lru < frame->lru)
+			frame = &md->frames[i];
+	}
+	free(frame->data);
+	frame->pos = pos;
+	frame->data = data;
+	frame->len = data_len;
+copy:
+	frame->lru = ++md->lru_clock;
+	if (offset + len > frame->len)
+		error = -EFSCORRUPTED;
+	else
+		memcpy(buf, frame->data + offset, len);
+	pthread_mutex_unlock(&md->lock);
+	return error;
+}
+
+/*
+ * Read @len bytes at byte @offset of the filesystem image.  Returns zero or a
+ * negative errno.
+ */
+int
+libxfs_mdimage_pread(
+	struct xfs_mdimage	*md,
+	void			*buf,
+	size_t			len,
+	off64_t			offset)
+{
+	off64_t			end = offset + len;
+	uint64_t		lo = 0, hi = md->nr_exts;
+	int			error;
+
+	memset(buf, 0, len);
+
+	/* find the first extent that ends beyond @offset */
+	while (lo < hi) {
+		uint64_t	mid = lo + (hi - lo) / 2;
+		struct xfs_mdimage_ext *ext = &md->exts[mid];
+
+		if (BBTOB(ext->daddr + ext->len) <= offset)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	for (; lo < md->nr_exts; lo++) {
+		struct xfs_mdimage_ext *ext = &md->exts[lo];
+		off64_t		ext_start = BBTOB(ext->daddr);
+		off64_t		ext_end = BBTOB(ext->daddr + ext->len);
+		off64_t		start = max(offset, ext_start);
+		off64_t		stop = min(end, ext_end);
+		uint64_t	src = ext->offset + (start - ext_start);
+		char		*dst = (char *)buf + (start - offset);
+
+		if (ext_start >= end)
+			break;
+
+		if (ext->frame == XFS_MDI_NOFRAME)
+			error = mdi_pread(md, dst, stop - start, src);
+		else
+			error = mdi_read_frame(md, ext->frame, src, dst,
+					stop - start);
+		if (error)
+			return error;
+	}
+	return 0;
+}
@@ -58,6 +58,8 @@ static void libxfs_brelse(struct cache_node *node);
 
 #define IO_BCOMPARE_CHECK
 
+libxfs_io_account_fn	libxfs_io_account_hook;
+
 /* XXX: (dgc) Propagate errors, only exit if fail-on-error flag set */
 int
 libxfs_device_zero(struct xfs_buftarg *btp, xfs_daddr_t start, uint len)
@@ -75,6 +77,8 @@ libxfs_device_zero(struct xfs_buftarg *btp, xfs_daddr_t start, uint len)
 	len_bytes = LIBXFS_BBTOOFF64(len);
 	error = platform_zero_range(fd, start_offset, len_bytes);
 	if (!error) {
+		libxfs_io_account(btp->bt_bdev, start, len_bytes,
+				LIBXFS_IO_WRITE);
 		xfs_buftarg_trip_write(btp);
 		return 0;
 	}
@@ -107,6 +111,9 @@ libxfs_device_zero(struct xfs_buftarg *btp, xfs_daddr_t start, uint len)
 				progname, __FUNCTION__);
 			exit(1);
 		}
+		libxfs_io_account(btp->bt_bdev,
+				(start_offset + offset) >> BBSHIFT, bytes,
+				LIBXFS_IO_WRITE);
 		xfs_buftarg_trip_write(btp);
 		offset += bytes;
 	}
@@ -426,6 +433,18 @@ __cache_lookup(
 				bp->b_recur++;
 				*bpp = bp;
 				return 0;
+			} else if (libxfs_io_account_hook) {
+				struct timespec	start, end;
+
+				clock_gettime(CLOCK_MONOTONIC, &start);
+				pthread_mutex_lock(&bp->b_lock);
+				clock_gettime(CLOCK_MONOTONIC, &end);
+				libxfs_io_account(key->buftarg->bt_bdev,
+						key->blkno,
+						(end.tv_sec - start.tv_sec) *
+							NSEC_PER_SEC +
+						end.tv_nsec - start.tv_nsec,
+						LIBXFS_IO_WAIT);
 			} else {
 				pthread_mutex_lock(&bp->b_lock);
 			}
@@ -576,11 +595,11 @@ libxfs_balloc(
 
 
 static int
-__read_buf(int fd, void *buf, int len, off64_t offset, int flags)
+__read_buf(dev_t dev, void *buf, int len, off64_t offset, int flags)
 {
 	int	sts;
 
-	sts = pread(fd, buf, len, offset);
+	sts = libxfs_device_pread(dev, buf, len, offset);
 	if (sts < 0) {
 		int error = errno;
 		fprintf(stderr, _("%s: read failed: %s\n"),
@@ -598,13 +617,13 @@ int
 libxfs_readbufr(struct xfs_buftarg *btp, xfs_daddr_t blkno, struct xfs_buf *bp,
 		int len, int flags)
 {
-	int	fd = libxfs_device_to_fd(btp->bt_bdev);
 	int	bytes = BBTOB(len);
 	int	error;
 
 	ASSERT(len <= bp->b_length);
 
-	error = __read_buf(fd, bp->b_addr, bytes, LIBXFS_BBTOOFF64(blkno), flags);
+	error = __read_buf(btp->bt_bdev, bp->b_addr, bytes,
+			LIBXFS_BBTOOFF64(blkno), flags);
 	if (!error &&
 	    bp->b_target->bt_bdev == btp->bt_bdev &&
 	    bp->b_cache_key == blkno &&
@@ -631,28 +650,18 @@ libxfs_readbuf_verify(
 int
 libxfs_readbufr_map(struct xfs_buftarg *btp, struct xfs_buf *bp, int flags)
 {
-	int	fd;
-	int	error = 0;
-	void	*buf;
-	int	i;
+	int	error;
 
-	fd = libxfs_device_to_fd(btp->bt_bdev);
-	buf = bp->b_addr;
-	for (i = 0; i < bp->b_nmaps; i++) {
-		off64_t	offset = LIBXFS_BBTOOFF64(bp->b_maps[i].bm_bn);
-		int len = BBTOB(bp->b_maps[i].bm_len);
-
-		error = __read_buf(fd, buf, len, offset, flags);
-		if (error) {
-			bp->b_error = error;
-			break;
-		}
-		buf += len;
+	error = libxfs_buf_read_maps(btp, bp);
+	if (error) {
+		fprintf(stderr, _("%s: read failed: %s\n"),
+			progname, strerror(-error));
+		bp->b_error = error;
+		return error;
 	}
 
-	if (!error)
-		bp->b_flags |= LIBXFS_B_UPTODATE;
-	return error;
+	bp->b_flags |= LIBXFS_B_UPTODATE;
+	return 0;
 }
 
 int
@@ -743,6 +752,12 @@ libxfs_getbufr_uncached(
 
 	INIT_LIST_HEAD(&bp->b_node.cn_hash);
 	bp->b_node.cn_count = 1;
+
+	/* libxfs_buf_relse unlocks it, just like a cached buffer */
+	if (use_xfs_buf_lock) {
+		pthread_mutex_lock(&bp->b_lock);
+		bp->b_holder = pthread_self();
+	}
 	return bp;
 }
 
@@ -798,11 +813,11 @@ err:
 }
 
 static int
-__write_buf(int fd, void *buf, int len, off64_t offset, int flags)
+__write_buf(dev_t dev, void *buf, int len, off64_t offset, int flags)
 {
 	int	sts;
 
-	sts = pwrite(fd, buf, len, offset);
+	sts = pwrite(libxfs_device_to_fd(dev), buf, len, offset);
 	if (sts < 0) {
 		int error = errno;
 		fprintf(stderr, _("%s: pwrite failed: %s\n"),
@@ -813,6 +828,7 @@ __write_buf(int fd, void *buf, int len, off64_t offset, int flags)
 			progname, sts, len);
 		return -EIO;
 	}
+	libxfs_io_account(dev, offset >> BBSHIFT, len, LIBXFS_IO_WRITE);
 	return 0;
 }
 
@@ -820,7 +836,7 @@ int
 libxfs_bwrite(
 	struct xfs_buf	*bp)
 {
-	int		fd = libxfs_device_to_fd(bp->b_target->bt_bdev);
+	dev_t		dev = bp->b_target->bt_bdev;
 
 	/*
 	 * we never write buffers that are marked stale. This indicates they
@@ -856,7 +872,7 @@ libxfs_bwrite(
 	}
 
 	if (!(bp->b_flags & LIBXFS_B_DISCONTIG)) {
-		bp->b_error = __write_buf(fd, bp->b_addr, BBTOB(bp->b_length),
+		bp->b_error = __write_buf(dev, bp->b_addr, BBTOB(bp->b_length),
 				    LIBXFS_BBTOOFF64(xfs_buf_daddr(bp)),
 				    bp->b_flags);
 	} else {
@@ -867,7 +883,7 @@ libxfs_bwrite(
 			off64_t	offset = LIBXFS_BBTOOFF64(bp->b_maps[i].bm_bn);
 			int len = BBTOB(bp->b_maps[i].bm_len);
 
-			bp->b_error = __write_buf(fd, buf, len, offset,
+			bp->b_error = __write_buf(dev, buf, len, offset,
 						  bp->b_flags);
 			if (bp->b_error)
 				break;
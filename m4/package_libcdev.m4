@@ -165,6 +165,29 @@ pwritev2(0, 0, 0, 0, 0);
     AC_SUBST(have_pwritev2)
   ])
 
+#
+# Check if we have the io_uring uapi header and system calls (Linux)
+#
+AC_DEFUN([AC_HAVE_IO_URING],
+  [ AC_MSG_CHECKING([for io_uring])
+    AC_COMPILE_IFELSE(
+    [	AC_LANG_PROGRAM([[
+#define _GNU_SOURCE
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+	]], [[
+struct io_uring_params p = { 0 };
+syscall(__NR_io_uring_setup, 1, &p);
+syscall(__NR_io_uring_enter, 0, 0, 0, IORING_ENTER_GETEVENTS, NULL, 0);
+return IORING_OP_READ + IORING_OP_WRITE;
+	]])
+    ], have_io_uring=yes
+       AC_MSG_RESULT(yes),
+       AC_MSG_RESULT(no))
+    AC_SUBST(have_io_uring)
+  ])
+
 #
 # Check if we have a copy_file_range system call (Linux)
 #
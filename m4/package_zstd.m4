@@ -0,0 +1,16 @@
+#
+# See if libzstd is available on the system.  Only the tools that read or
+# write compressed metadumps link against it, so keep it out of LIBS.
+#
+AC_DEFUN([AC_HAVE_LIBZSTD],
+[ AC_CHECK_HEADERS([zstd.h],
+    [ libzstd_saved_LIBS="$LIBS"
+      AC_SEARCH_LIBS([ZSTD_compress], [zstd],
+        libzstd="-lzstd"
+        have_libzstd=yes,
+        have_libzstd=no,)
+      LIBS="$libzstd_saved_LIBS"
+    ], have_libzstd=no)
+    AC_SUBST(have_libzstd)
+    AC_SUBST(libzstd)
+])
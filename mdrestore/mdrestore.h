@@ -0,0 +1,28 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Copyright (c) 2007 Silicon Graphics, Inc.
+ * All Rights Reserved.
+ */
+#ifndef __MDRESTORE_H__
+#define __MDRESTORE_H__
+
+void fatal(const char *msg, ...) __attribute__((noreturn));
+
+/*
+ * Block writer.  Blocks from the metadump stream are gathered into large
+ * batches, which are sorted by disk address and written out as a few big
+ * vectored writes while the next batch is being read.
+ */
+struct mdr_writer;
+
+#define MDR_DEFAULT_MEM_MB	64	/* default writer memory, in MiB */
+
+struct mdr_writer *mdr_writer_alloc(int fd, unsigned int block_size,
+		size_t mem_bytes);
+void mdr_writer_add(struct mdr_writer *w, const __be64 *block_index,
+		const char *blocks, int count);
+void mdr_writer_add_range(struct mdr_writer *w, int64_t daddr,
+		const char *data, unsigned int count);
+void mdr_writer_free(struct mdr_writer *w);
+
+#endif /* __MDRESTORE_H__ */
@@ -0,0 +1,414 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Copyright (c) 2007 Silicon Graphics, Inc.
+ * All Rights Reserved.
+ */
+
+#include "libxfs.h"
+#include <sys/uio.h>
+#include "xfs_metadump.h"
+#include "libfrog/iouring.h"
+#include "libfrog/workqueue.h"
+#include "mdrestore.h"
+
+/*
+ * Metadumps store sectors in whatever order xfs_metadump walked the metadata,
+ * so writing each one out as it is read means millions of small random writes.
+ * Instead we collect blocks into a batch, sort the batch by disk address and
+ * write each run of adjacent blocks with a single vectored write.  There are
+ * two batches: one filled by the reader while a separate thread writes the
+ * other out, either through io_uring or with a pool of threads.  A batch is
+ * only written once the previous one has hit the disk, so blocks that appear
+ * more than once in the stream still end up with their last copy.
+ */
+
+#define MDR_RING_DEPTH		64	/* io_uring queue depth */
+#define MDR_NR_THREADS		8	/* writer threads without io_uring */
+
+struct mdr_ent {
+	int64_t			daddr;
+	uint32_t		idx;		/* position in the batch */
+};
+
+/* A run of blocks that are adjacent on disk. */
+struct mdr_run {
+	struct iovec		*iov;
+	int			nr_iov;
+	off64_t			pos;
+	size_t			len;
+};
+
+struct mdr_batch {
+	char			*data;
+	struct mdr_ent		*ents;
+	struct iovec		*iov;
+	struct mdr_run		*runs;
+	unsigned int		nr;		/* blocks in this batch */
+	unsigned int		nr_runs;
+	bool			full;		/* owned by the writer thread */
+};
+
+struct mdr_writer {
+	int			fd;
+	unsigned int		block_size;
+	unsigned int		max_blocks;	/* blocks per batch */
+	struct mdr_batch	batch[2];
+	int			cur;		/* batch being filled */
+	struct iouring		*ring;
+
+	pthread_t		thread;
+	pthread_mutex_t		lock;
+	pthread_cond_t		wait;
+	bool			done;
+};
+
+static int
+mdr_ent_cmp(
+	const void		*a,
+	const void		*b)
+{
+	const struct mdr_ent	*ea = a;
+	const struct mdr_ent	*eb = b;
+
+	if (ea->daddr < eb->daddr)
+		return -1;
+	if (ea->daddr > eb->daddr)
+		return 1;
+	/* keep stream order for duplicates so the last copy wins */
+	if (ea->idx < eb->idx)
+		return -1;
+	return ea->idx > eb->idx;
+}
+
+/* Sort a batch and build runs of disk-adjacent blocks. */
+static void
+mdr_build_runs(
+	struct mdr_writer	*w,
+	struct mdr_batch	*b)
+{
+	struct mdr_run		*run = NULL;
+	struct iovec		*iov = b->iov;
+	unsigned int		i;
+
+	qsort(b->ents, b->nr, sizeof(struct mdr_ent), mdr_ent_cmp);
+
+	b->nr_runs = 0;
+	for (i = 0; i < b->nr; i++) {
+		struct mdr_ent	*e = &b->ents[i];
+		char		*buf = b->data + (size_t)e->idx * w->block_size;
+		off64_t		pos = e->daddr << BBSHIFT;
+
+		if (i + 1 < b->nr && b->ents[i + 1].daddr == e->daddr)
+			continue;
+
+		if (run && run->pos + run->len == pos) {
+			struct iovec	*last = &run->iov[run->nr_iov - 1];
+
+			if ((char *)last->iov_base + last->iov_len == buf) {
+				last->iov_len += w->block_size;
+				run->len += w->block_size;
+				continue;
+			}
+			if (run->nr_iov < IOV_MAX) {
+				iov->iov_base = buf;
+				iov->iov_len = w->block_size;
+				iov++;
+				run->nr_iov++;
+				run->len += w->block_size;
+				continue;
+			}
+		}
+
+		run = &b->runs[b->nr_runs++];
+		run->iov = iov;
+		run->nr_iov = 1;
+		run->pos = pos;
+		run->len = w->block_size;
+		iov->iov_base = buf;
+		iov->iov_len = w->block_size;
+		iov++;
+	}
+}
+
+static void
+mdr_write_run_sync(
+	int			fd,
+	struct mdr_run		*run)
+{
+	off64_t			pos = run->pos;
+	ssize_t			ret;
+	int			i;
+
+	ret = pwritev(fd, run->iov, run->nr_iov, run->pos);
+	if (ret == (ssize_t)run->len)
+		return;
+
+	/* short or failed vectored write, do it the slow way */
+	for (i = 0; i < run->nr_iov; i++) {
+		ret = pwrite(fd, run->iov[i].iov_base, run->iov[i].iov_len,
+				pos);
+		if (ret != (ssize_t)run->iov[i].iov_len)
+			fatal("error writing block %llu: %s\n",
+				(unsigned long long)pos,
+				ret < 0 ? strerror(errno) : "short write");
+		pos += ret;
+	}
+}
+
+static void
+mdr_write_run_worker(
+	struct workqueue	*wq,
+	uint32_t		index,
+	void			*arg)
+{
+	struct mdr_writer	*w = wq->wq_ctx;
+	struct mdr_batch	*b = arg;
+
+	mdr_write_run_sync(w->fd, &b->runs[index]);
+}
+
+static void
+mdr_reap(
+	struct mdr_writer	*w)
+{
+	struct mdr_run		*run;
+	void			*data;
+	int			res;
+	int			ret;
+
+	ret = iouring_reap(w->ring, true, &data, &res);
+	if (ret < 0)
+		fatal("error waiting for writes: %s\n", strerror(-ret));
+	if (ret == 0)
+		return;
+
+	run = data;
+	if (res < 0)
+		fatal("error writing block %llu: %s\n",
+			(unsigned long long)run->pos, strerror(-res));
+	if (res != (ssize_t)run->len)
+		mdr_write_run_sync(w->fd, run);
+}
+
+static void
+mdr_write_batch(
+	struct mdr_writer	*w,
+	struct mdr_batch	*b)
+{
+	struct workqueue	wq;
+	unsigned int		i;
+	int			ret;
+
+	mdr_build_runs(w, b);
+
+	if (w->ring) {
+		for (i = 0; i < b->nr_runs; i++) {
+			struct mdr_run	*run = &b->runs[i];
+
+			while (iouring_space(w->ring) == 0)
+				mdr_reap(w);
+			ret = iouring_prep_writev(w->ring, w->fd, run->iov,
+					run->nr_iov, run->pos, run);
+			if (ret)
+				fatal("error queueing write: %s\n",
+					strerror(-ret));
+		}
+		ret = iouring_submit(w->ring, 0);
+		if (ret)
+			fatal("error submitting writes: %s\n", strerror(-ret));
+		while (iouring_inflight(w->ring) > 0)
+			mdr_reap(w);
+		return;
+	}
+
+	ret = -workqueue_create(&wq, w, min(MDR_NR_THREADS, b->nr_runs));
+	if (ret)
+		fatal("cannot create writer threads: %s\n", strerror(ret));
+	for (i = 0; i < b->nr_runs; i++) {
+		ret = -workqueue_add(&wq, mdr_write_run_worker, i, b);
+		if (ret)
+			fatal("cannot queue write: %s\n", strerror(ret));
+	}
+	ret = -workqueue_terminate(&wq);
+	if (ret)
+		fatal("cannot finish writes: %s\n", strerror(ret));
+	workqueue_destroy(&wq);
+}
+
+static void *
+mdr_writer_thread(
+	void			*arg)
+{
+	struct mdr_writer	*w = arg;
+	int			next = 0;
+
+	pthread_mutex_lock(&w->lock);
+	for (;;) {
+		struct mdr_batch *b = &w->batch[next];
+
+		while (!b->full && !w->done)
+			pthread_cond_wait(&w->wait, &w->lock);
+		if (!b->full)
+			break;
+		pthread_mutex_unlock(&w->lock);
+
+		mdr_write_batch(w, b);
+
+		pthread_mutex_lock(&w->lock);
+		b->nr = 0;
+		b->full = false;
+		pthread_cond_broadcast(&w->wait);
+		next ^= 1;
+	}
+	pthread_mutex_unlock(&w->lock);
+	return NULL;
+}
+
+/* Hand the current batch to the writer thread and wait for the other one. */
+static void
+mdr_queue_batch(
+	struct mdr_writer	*w)
+{
+	pthread_mutex_lock(&w->lock);
+	w->batch[w->cur].full = true;
+	pthread_cond_broadcast(&w->wait);
+	w->cur ^= 1;
+	while (w->batch[w->cur].full)
+		pthread_cond_wait(&w->wait, &w->lock);
+	pthread_mutex_unlock(&w->lock);
+}
+
+/*
+ * Set up a writer for @fd that uses at most about @mem_bytes of memory for
+ * buffering blocks of @block_size bytes.
+ */
+struct mdr_writer *
+mdr_writer_alloc(
+	int			fd,
+	unsigned int		block_size,
+	size_t			mem_bytes)
+{
+	struct mdr_writer	*w;
+	unsigned int		min_blocks;
+	size_t			per_block;
+	int			i;
+	int			ret;
+
+	w = calloc(1, sizeof(struct mdr_writer));
+	if (!w)
+		fatal("memory allocation failure\n");
+	w->fd = fd;
+	w->block_size = block_size;
+
+	/* each batch has to hold at least one full metablock */
+	per_block = block_size + sizeof(struct mdr_ent) +
+			sizeof(struct iovec) + sizeof(struct mdr_run);
+	min_blocks = (block_size - sizeof(struct xfs_metablock)) /
+			sizeof(__be64);
+	w->max_blocks = max(mem_bytes / 2 / per_block, (size_t)min_blocks);
+
+	for (i = 0; i < 2; i++) {
+		struct mdr_batch *b = &w->batch[i];
+
+		b->data = malloc((size_t)w->max_blocks * block_size);
+		b->ents = calloc(w->max_blocks, sizeof(struct mdr_ent));
+		b->iov = calloc(w->max_blocks, sizeof(struct iovec));
+		b->runs = calloc(w->max_blocks, sizeof(struct mdr_run));
+		if (!b->data || !b->ents || !b->iov || !b->runs)
+			fatal("memory allocation failure\n");
+	}
+
+	/* fall back to a thread pool if we can't have io_uring */
+	if (iouring_alloc(MDR_RING_DEPTH, &w->ring))
+		w->ring = NULL;
+
+	pthread_mutex_init(&w->lock, NULL);
+	pthread_cond_init(&w->wait, NULL);
+	ret = pthread_create(&w->thread, NULL, mdr_writer_thread, w);
+	if (ret)
+		fatal("cannot create writer thread: %s\n", strerror(ret));
+	return w;
+}
+
+/* Queue @count blocks from a metablock for writing. */
+void
+mdr_writer_add(
+	struct mdr_writer	*w,
+	const __be64		*block_index,
+	const char		*blocks,
+	int			count)
+{
+	struct mdr_batch	*b = &w->batch[w->cur];
+	int			i;
+
+	if (b->nr + count > w->max_blocks) {
+		mdr_queue_batch(w);
+		b = &w->batch[w->cur];
+	}
+
+	memcpy(b->data + (size_t)b->nr * w->block_size, blocks,
+			(size_t)count * w->block_size);
+	for (i = 0; i < count; i++) {
+		b->ents[b->nr].daddr = be64_to_cpu(block_index[i]);
+		b->ents[b->nr].idx = b->nr;
+		b->nr++;
+	}
+}
+
+/* Queue @count blocks that are contiguous on disk starting at @daddr. */
+void
+mdr_writer_add_range(
+	struct mdr_writer	*w,
+	int64_t			daddr,
+	const char		*data,
+	unsigned int		count)
+{
+	while (count > 0) {
+		struct mdr_batch *b = &w->batch[w->cur];
+		unsigned int	n;
+
+		if (b->nr == w->max_blocks) {
+			mdr_queue_batch(w);
+			b = &w->batch[w->cur];
+		}
+
+		n = min(count, w->max_blocks - b->nr);
+		memcpy(b->data + (size_t)b->nr * w->block_size, data,
+				(size_t)n * w->block_size);
+		data += (size_t)n * w->block_size;
+		count -= n;
+		while (n-- > 0) {
+			b->ents[b->nr].daddr = daddr++;
+			b->ents[b->nr].idx = b->nr;
+			b->nr++;
+		}
+	}
+}
+
+/* Write out everything still queued and tear down the writer. */
+void
+mdr_writer_free(
+	struct mdr_writer	*w)
+{
+	int			i;
+
+	if (w->batch[w->cur].nr > 0)
+		mdr_queue_batch(w);
+
+	pthread_mutex_lock(&w->lock);
+	w->done = true;
+	pthread_cond_broadcast(&w->wait);
+	pthread_mutex_unlock(&w->lock);
+	pthread_join(w->thread, NULL);
+
+	iouring_free(w->ring);
+	pthread_cond_destroy(&w->wait);
+	pthread_mutex_destroy(&w->lock);
+	for (i = 0; i < 2; i++) {
+		free(w->batch[i].data);
+		free(w->batch[i].ents);
+		free(w->batch[i].iov);
+		free(w->batch[i].runs);
+	}
+	free(w);
+}
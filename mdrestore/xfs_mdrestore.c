@@ -6,12 +6,17 @@
 
 #include "libxfs.h"
 #include "xfs_metadump.h"
+#include "libfrog/compress.h"
+#include "libfrog/crc32c.h"
+#include "libfrog/workqueue.h"
+#include "mdrestore.h"
 
 static int	show_progress = 0;
 static int	show_info = 0;
 static int	progress_since_warning = 0;
+static size_t	writer_mem = MDR_DEFAULT_MEM_MB << 20;
 
-static void
+void
 fatal(const char *msg, ...)
 {
 	va_list		args;
@@ -38,6 +43,81 @@ print_progress(const char *fmt, ...)
 	progress_since_warning = 1;
 }
 
+/*
+ * Check the primary superblock at the start of the dump and mark it as being
+ * restored, so that a partially restored image won't mount.  Sector sizes
+ * above @max_sectsize cannot be represented in the dump.
+ */
+static void
+check_primary_sb(
+	char			*buf,
+	unsigned int		max_sectsize,
+	struct xfs_sb		*sb)
+{
+	libxfs_sb_from_disk(sb, (struct xfs_dsb *)buf);
+
+	if (sb->sb_magicnum != XFS_SB_MAGIC)
+		fatal("bad magic number for primary superblock\n");
+
+	if (sb->sb_sectsize < XFS_MIN_SECTORSIZE ||
+	    sb->sb_sectsize > XFS_MAX_SECTORSIZE ||
+	    sb->sb_sectsize > max_sectsize)
+		fatal("bad sector size %u in metadump image\n", sb->sb_sectsize);
+
+	((struct xfs_dsb *)buf)->sb_inprogress = 1;
+}
+
+static void
+prepare_target(
+	int			dst_fd,
+	int			is_target_file,
+	struct xfs_sb		*sb)
+{
+	if (is_target_file)  {
+		/* ensure regular files are correctly sized */
+
+		if (ftruncate(dst_fd, sb->sb_dblocks * sb->sb_blocksize))
+			fatal("cannot set filesystem image size: %s\n",
+				strerror(errno));
+	} else  {
+		/* ensure device is sufficiently large enough */
+
+		char		*lb[XFS_MAX_SECTORSIZE] = { NULL };
+		off64_t		off;
+
+		off = sb->sb_dblocks * sb->sb_blocksize - sizeof(lb);
+		if (pwrite(dst_fd, lb, sizeof(lb), off) < 0)
+			fatal("failed to write last block, is target too "
+				"small? (error: %s)\n", strerror(errno));
+	}
+}
+
+/* Rewrite the primary superblock now that everything else is on disk. */
+static void
+finish_primary_sb(
+	int			dst_fd,
+	struct xfs_sb		*sb)
+{
+	char			*buf;
+
+	if (progress_since_warning)
+		putchar('\n');
+
+	buf = calloc(1, sb->sb_sectsize);
+	if (!buf)
+		fatal("memory allocation failure\n");
+	sb->sb_inprogress = 0;
+	libxfs_sb_to_disk((struct xfs_dsb *)buf, sb);
+	if (xfs_sb_version_hascrc(sb)) {
+		xfs_update_cksum(buf, sb->sb_sectsize,
+				 offsetof(struct xfs_sb, sb_crc));
+	}
+
+	if (pwrite(dst_fd, buf, sb->sb_sectsize, 0) < 0)
+		fatal("error writing primary superblock: %s\n", strerror(errno));
+	free(buf);
+}
+
 /*
  * perform_restore() -- do the actual work to restore the metadump
  *
@@ -47,6 +127,9 @@ print_progress(const char *fmt, ...)
  * @mbp: pointer to metadump's first xfs_metablock, read and verified by the caller
  *
  * src_f should be positioned just past a read the previously validated metablock
+ *
+ * Blocks are handed to the batching writer rather than written one at a time;
+ * the primary superblock is rewritten once everything else is on disk.
  */
 static void
 perform_restore(
@@ -56,11 +139,11 @@ perform_restore(
 	const struct xfs_metablock	*mbp)
 {
 	struct xfs_metablock	*metablock;	/* header + index + blocks */
+	struct mdr_writer	*writer;
 	__be64			*block_index;
 	char			*block_buffer;
 	int			block_size;
 	int			max_indices;
-	int			cur_index;
 	int			mb_count;
 	xfs_sb_t		sb;
 	int64_t			bytes_read;
@@ -89,56 +172,22 @@ perform_restore(
 	if (fread(block_buffer, mb_count << mbp->mb_blocklog, 1, src_f) != 1)
 		fatal("error reading from metadump file\n");
 
-	libxfs_sb_from_disk(&sb, (struct xfs_dsb *)block_buffer);
-
-	if (sb.sb_magicnum != XFS_SB_MAGIC)
-		fatal("bad magic number for primary superblock\n");
-
 	/*
 	 * Normally the upper bound would be simply XFS_MAX_SECTORSIZE
 	 * but the metadump format has a maximum number of BBSIZE blocks
 	 * it can store in a single metablock.
 	 */
-	if (sb.sb_sectsize < XFS_MIN_SECTORSIZE ||
-	    sb.sb_sectsize > XFS_MAX_SECTORSIZE ||
-	    sb.sb_sectsize > max_indices * block_size)
-		fatal("bad sector size %u in metadump image\n", sb.sb_sectsize);
-
-	((struct xfs_dsb*)block_buffer)->sb_inprogress = 1;
-
-	if (is_target_file)  {
-		/* ensure regular files are correctly sized */
-
-		if (ftruncate(dst_fd, sb.sb_dblocks * sb.sb_blocksize))
-			fatal("cannot set filesystem image size: %s\n",
-				strerror(errno));
-	} else  {
-		/* ensure device is sufficiently large enough */
-
-		char		*lb[XFS_MAX_SECTORSIZE] = { NULL };
-		off64_t		off;
-
-		off = sb.sb_dblocks * sb.sb_blocksize - sizeof(lb);
-		if (pwrite(dst_fd, lb, sizeof(lb), off) < 0)
-			fatal("failed to write last block, is target too "
-				"small? (error: %s)\n", strerror(errno));
-	}
+	check_primary_sb(block_buffer, max_indices * block_size, &sb);
+	prepare_target(dst_fd, is_target_file, &sb);
 
 	bytes_read = 0;
+	writer = mdr_writer_alloc(dst_fd, block_size, writer_mem);
 
 	for (;;) {
 		if (show_progress && (bytes_read & ((1 << 20) - 1)) == 0)
 			print_progress("%lld MB read", bytes_read >> 20);
 
-		for (cur_index = 0; cur_index < mb_count; cur_index++) {
-			if (pwrite(dst_fd, &block_buffer[cur_index <<
-					mbp->mb_blocklog], block_size,
-					be64_to_cpu(block_index[cur_index]) <<
-						BBSHIFT) < 0)
-				fatal("error writing block %llu: %s\n",
-					be64_to_cpu(block_index[cur_index]) << BBSHIFT,
-					strerror(errno));
-		}
+		mdr_writer_add(writer, block_index, block_buffer, mb_count);
 		if (mb_count < max_indices)
 			break;
 
@@ -158,27 +207,248 @@ perform_restore(
 		bytes_read += block_size + (mb_count << mbp->mb_blocklog);
 	}
 
-	if (progress_since_warning)
-		putchar('\n');
+	mdr_writer_free(writer);
+	finish_primary_sb(dst_fd, &sb);
 
-	memset(block_buffer, 0, sb.sb_sectsize);
-	sb.sb_inprogress = 0;
-	libxfs_sb_to_disk((struct xfs_dsb *)block_buffer, &sb);
-	if (xfs_sb_version_hascrc(&sb)) {
-		xfs_update_cksum(block_buffer, sb.sb_sectsize,
-				 offsetof(struct xfs_sb, sb_crc));
+	free(metablock);
+}
+
+/*
+ * Version 3 dumps are a series of independently compressed frames.  We read
+ * frames ahead into a window of slots, decompress and check them on a pool of
+ * threads, and hand the extents to the writer in dump order.
+ */
+#define MDR3_MAX_THREADS	16
+#define MDR3_MAX_FRAME_SIZE	(64U << 20)
+
+struct mdr3_slot {
+	struct xfs_md3_frame	hdr;
+	char			*cbuf;		/* payload as read */
+	char			*ubuf;		/* decompressed payload */
+	uint64_t		pos;		/* file offset of the frame */
+	int			error;
+	bool			done;
+};
+
+struct mdr3_ctx {
+	struct mdr3_slot	*slots;
+	unsigned int		nr_slots;
+	size_t			frame_size;
+	pthread_mutex_t		lock;
+	pthread_cond_t		wait;
+};
+
+static int
+mdr3_decode_frame(
+	struct mdr3_slot	*slot)
+{
+	struct xfs_md3_frame	hdr = slot->hdr;
+	struct xfs_md3_extent	*ext = (struct xfs_md3_extent *)slot->ubuf;
+	uint32_t		nr = be32_to_cpu(hdr.mf_nr_extents);
+	uint32_t		ulen = be32_to_cpu(hdr.mf_ulen);
+	uint32_t		clen = be32_to_cpu(hdr.mf_clen);
+	uint64_t		data_len = 0;
+	uint32_t		crc;
+	uint32_t		i;
+	int			error;
+
+	hdr.mf_crc = 0;
+	crc = crc32c_le(~0U, (unsigned char *)&hdr, sizeof(hdr));
+	crc = crc32c_le(crc, (unsigned char *)slot->cbuf, clen);
+	if (crc != be32_to_cpu(slot->hdr.mf_crc))
+		return -EFSBADCRC;
+
+	if (!compress_alg_supported(hdr.mf_alg))
+		return -EOPNOTSUPP;
+	error = decompress_buf(hdr.mf_alg, slot->cbuf, clen, slot->ubuf, ulen);
+	if (error)
+		return error;
+
+	if ((uint64_t)nr * sizeof(struct xfs_md3_extent) > ulen)
+		return -EFSCORRUPTED;
+	for (i = 0; i < nr; i++)
+		data_len += (uint64_t)be32_to_cpu(ext[i].me_len) << BBSHIFT;
+	if (nr * sizeof(struct xfs_md3_extent) + data_len != ulen)
+		return -EFSCORRUPTED;
+	return 0;
+}
+
+static void
+mdr3_decode_worker(
+	struct workqueue	*wq,
+	uint32_t		index,
+	void			*arg)
+{
+	struct mdr3_ctx		*ctx = wq->wq_ctx;
+	struct mdr3_slot	*slot = arg;
+	int			error;
+
+	error = mdr3_decode_frame(slot);
+
+	pthread_mutex_lock(&ctx->lock);
+	slot->error = error;
+	slot->done = true;
+	pthread_cond_broadcast(&ctx->wait);
+	pthread_mutex_unlock(&ctx->lock);
+}
+
+/* Read the next frame into @slot.  Returns false at the end marker. */
+static bool
+mdr3_read_frame(
+	struct mdr3_ctx		*ctx,
+	FILE			*src_f,
+	struct mdr3_slot	*slot,
+	uint64_t		*pos)
+{
+	uint32_t		ulen, clen;
+
+	if (fread(&slot->hdr, sizeof(slot->hdr), 1, src_f) != 1)
+		fatal("error reading from metadump file\n");
+	if (slot->hdr.mf_magic != cpu_to_be32(XFS_MD3_FRAME_MAGIC))
+		fatal("bad frame magic at offset %llu\n",
+				(unsigned long long)*pos);
+
+	ulen = be32_to_cpu(slot->hdr.mf_ulen);
+	clen = be32_to_cpu(slot->hdr.mf_clen);
+	if (ulen > ctx->frame_size || clen > ctx->frame_size)
+		fatal("bad frame size at offset %llu\n",
+				(unsigned long long)*pos);
+	if (clen && fread(slot->cbuf, clen, 1, src_f) != 1)
+		fatal("error reading from metadump file\n");
+
+	slot->pos = *pos;
+	slot->done = false;
+	slot->error = 0;
+	*pos += sizeof(slot->hdr) + clen;
+	return slot->hdr.mf_nr_extents != 0 || clen != 0;
+}
+
+static void
+perform_restore_v3(
+	FILE			*src_f,
+	int			dst_fd,
+	int			is_target_file,
+	const struct xfs_md3_header *hdr)
+{
+	struct mdr3_ctx		ctx = { };
+	struct workqueue	wq;
+	struct mdr_writer	*writer = NULL;
+	struct xfs_sb		sb;
+	unsigned int		nr_threads;
+	unsigned int		head = 0, nr_pending = 0;
+	unsigned int		i;
+	uint64_t		pos = sizeof(*hdr);
+	bool			eof = false;
+	int			ret;
+
+	ctx.frame_size = be32_to_cpu(hdr->mh_frame_size);
+	if (ctx.frame_size == 0 || ctx.frame_size > MDR3_MAX_FRAME_SIZE)
+		fatal("bad frame size %zu in metadump header\n",
+				ctx.frame_size);
+
+	nr_threads = min(platform_nproc(), MDR3_MAX_THREADS);
+	ctx.nr_slots = 2 * nr_threads;
+	ctx.slots = calloc(ctx.nr_slots, sizeof(struct mdr3_slot));
+	if (!ctx.slots)
+		fatal("memory allocation failure\n");
+	for (i = 0; i < ctx.nr_slots; i++) {
+		ctx.slots[i].cbuf = malloc(ctx.frame_size);
+		ctx.slots[i].ubuf = malloc(ctx.frame_size);
+		if (!ctx.slots[i].cbuf || !ctx.slots[i].ubuf)
+			fatal("memory allocation failure\n");
 	}
+	pthread_mutex_init(&ctx.lock, NULL);
+	pthread_cond_init(&ctx.wait, NULL);
+
+	ret = -workqueue_create(&wq, &ctx, nr_threads);
+	if (ret)
+		fatal("cannot create decompression threads: %s\n",
+				strerror(ret));
+
+	while (!eof || nr_pending > 0) {
+		struct mdr3_slot	*slot;
+		struct xfs_md3_extent	*ext;
+		char			*data;
+		uint32_t		nr;
+
+		/* keep the window full */
+		while (!eof && nr_pending < ctx.nr_slots) {
+			slot = &ctx.slots[(head + nr_pending) % ctx.nr_slots];
+			if (!mdr3_read_frame(&ctx, src_f, slot, &pos)) {
+				eof = true;
+				break;
+			}
+			ret = -workqueue_add(&wq, mdr3_decode_worker, 0, slot);
+			if (ret)
+				fatal("cannot queue frame: %s\n", strerror(ret));
+			nr_pending++;
+		}
+		if (nr_pending == 0)
+			break;
 
-	if (pwrite(dst_fd, block_buffer, sb.sb_sectsize, 0) < 0)
-		fatal("error writing primary superblock: %s\n", strerror(errno));
+		slot = &ctx.slots[head];
+		pthread_mutex_lock(&ctx.lock);
+		while (!slot->done)
+			pthread_cond_wait(&ctx.wait, &ctx.lock);
+		pthread_mutex_unlock(&ctx.lock);
+		if (slot->error)
+			fatal("bad frame at offset %llu: %s\n",
+				(unsigned long long)slot->pos,
+				strerror(-slot->error));
+
+		ext = (struct xfs_md3_extent *)slot->ubuf;
+		nr = be32_to_cpu(slot->hdr.mf_nr_extents);
+		data = slot->ubuf + nr * sizeof(struct xfs_md3_extent);
+
+		if (!writer) {
+			if (nr == 0 || ext[0].me_daddr != 0)
+				fatal("first block is not the primary superblock\n");
+			check_primary_sb(data,
+					be32_to_cpu(ext[0].me_len) << BBSHIFT,
+					&sb);
+			prepare_target(dst_fd, is_target_file, &sb);
+			writer = mdr_writer_alloc(dst_fd, BBSIZE, writer_mem);
+		}
 
-	free(metablock);
+		for (i = 0; i < nr; i++) {
+			uint32_t	len = be32_to_cpu(ext[i].me_len);
+
+			mdr_writer_add_range(writer,
+					be64_to_cpu(ext[i].me_daddr), data, len);
+			data += len << BBSHIFT;
+		}
+
+		if (show_progress)
+			print_progress("%llu MB read",
+					(unsigned long long)slot->pos >> 20);
+		head = (head + 1) % ctx.nr_slots;
+		nr_pending--;
+	}
+
+	ret = -workqueue_terminate(&wq);
+	if (ret)
+		fatal("cannot finish decompression: %s\n", strerror(ret));
+	workqueue_destroy(&wq);
+
+	if (!writer)
+		fatal("metadump file contains no blocks\n");
+	mdr_writer_free(writer);
+	finish_primary_sb(dst_fd, &sb);
+
+	pthread_cond_destroy(&ctx.wait);
+	pthread_mutex_destroy(&ctx.lock);
+	for (i = 0; i < ctx.nr_slots; i++) {
+		free(ctx.slots[i].cbuf);
+		free(ctx.slots[i].ubuf);
+	}
+	free(ctx.slots);
 }
 
 static void
 usage(void)
 {
-	fprintf(stderr, "Usage: %s [-V] [-g] [-i] source target\n", progname);
+	fprintf(stderr, "Usage: %s [-V] [-g] [-i] [-m memory_mb] source target\n",
+		progname);
 	exit(1);
 }
 
@@ -196,10 +466,14 @@ main(
 	struct stat	statbuf;
 	int		is_target_file;
 	struct xfs_metablock	mb;
+	struct xfs_md3_header	hdr;
+	uint32_t	info;
+	unsigned long	mem_mb;
+	char		*p;
 
 	progname = basename(argv[0]);
 
-	while ((c = getopt(argc, argv, "giV")) != EOF) {
+	while ((c = getopt(argc, argv, "gim:V")) != EOF) {
 		switch (c) {
 			case 'g':
 				show_progress = 1;
@@ -207,6 +481,12 @@ main(
 			case 'i':
 				show_info = 1;
 				break;
+			case 'm':
+				mem_mb = strtoul(optarg, &p, 0);
+				if (*p != '\0' || mem_mb == 0)
+					fatal("bad memory size %s\n", optarg);
+				writer_mem = (size_t)mem_mb << 20;
+				break;
 			case 'V':
 				printf("%s version %s\n", progname, VERSION);
 				exit(0);
@@ -240,16 +520,31 @@ main(
 
 	if (fread(&mb, sizeof(mb), 1, src_f) != 1)
 		fatal("error reading from metadump file\n");
-	if (mb.mb_magic != cpu_to_be32(XFS_MD_MAGIC))
+	if (mb.mb_magic == cpu_to_be32(XFS_MD_MAGIC_V3)) {
+		uint32_t	crc;
+
+		memcpy(&hdr, &mb, sizeof(mb));
+		if (fread((char *)&hdr + sizeof(mb), sizeof(hdr) - sizeof(mb),
+				1, src_f) != 1)
+			fatal("error reading from metadump file\n");
+		crc = be32_to_cpu(hdr.mh_crc);
+		hdr.mh_crc = 0;
+		if (crc32c_le(~0U, (unsigned char *)&hdr, sizeof(hdr)) != crc)
+			fatal("bad metadump header checksum\n");
+		info = be32_to_cpu(hdr.mh_info);
+	} else if (mb.mb_magic == cpu_to_be32(XFS_MD_MAGIC)) {
+		info = mb.mb_info;
+	} else {
 		fatal("specified file is not a metadata dump\n");
+	}
 
 	if (show_info) {
-		if (mb.mb_info & XFS_METADUMP_INFO_FLAGS) {
+		if (info & XFS_METADUMP_INFO_FLAGS) {
 			printf("%s: %sobfuscated, %s log, %s metadata blocks\n",
 			argv[optind],
-			mb.mb_info & XFS_METADUMP_OBFUSCATED ? "":"not ",
-			mb.mb_info & XFS_METADUMP_DIRTYLOG ? "dirty":"clean",
-			mb.mb_info & XFS_METADUMP_FULLBLOCKS ? "full":"zeroed");
+			info & XFS_METADUMP_OBFUSCATED ? "":"not ",
+			info & XFS_METADUMP_DIRTYLOG ? "dirty":"clean",
+			info & XFS_METADUMP_FULLBLOCKS ? "full":"zeroed");
 		} else {
 			printf("%s: no informational flags present\n",
 				argv[optind]);
@@ -285,7 +580,10 @@ main(
 	if (dst_fd < 0)
 		fatal("couldn't open target \"%s\"\n", argv[optind]);
 
-	perform_restore(src_f, dst_fd, is_target_file, &mb);
+	if (mb.mb_magic == cpu_to_be32(XFS_MD_MAGIC_V3))
+		perform_restore_v3(src_f, dst_fd, is_target_file, &hdr);
+	else
+		perform_restore(src_f, dst_fd, is_target_file, &mb);
 
 	close(dst_fd);
 	if (src_f != stdin)
@@ -26,44 +26,6 @@ init_rebuild(
 	bulkload_estimate_ag_slack(sc, &btr->bload, est_agfreeblocks);
 }
 
-/*
- * Update this free space record to reflect the blocks we stole from the
- * beginning of the record.
- */
-static void
-consume_freespace(
-	xfs_agnumber_t		agno,
-	struct extent_tree_node	*ext_ptr,
-	uint32_t		len)
-{
-	struct extent_tree_node	*bno_ext_ptr;
-	xfs_agblock_t		new_start = ext_ptr->ex_startblock + len;
-	xfs_extlen_t		new_len = ext_ptr->ex_blockcount - len;
-
-	/* Delete the used-up extent from both extent trees. */
-#ifdef XR_BLD_FREE_TRACE
-	fprintf(stderr, "releasing extent: %u [%u %u]\n", agno,
-			ext_ptr->ex_startblock, ext_ptr->ex_blockcount);
-#endif
-	bno_ext_ptr = find_bno_extent(agno, ext_ptr->ex_startblock);
-	ASSERT(bno_ext_ptr != NULL);
-	get_bno_extent(agno, bno_ext_ptr);
-	release_extent_tree_node(bno_ext_ptr);
-
-	ext_ptr = get_bcnt_extent(agno, ext_ptr->ex_startblock,
-			ext_ptr->ex_blockcount);
-	release_extent_tree_node(ext_ptr);
-
-	/*
-	 * If we only used part of this last extent, then we must reinsert the
-	 * extent to maintain proper sorting order.
-	 */
-	if (new_len > 0) {
-		add_bno_extent(agno, new_start, new_len);
-		add_bcnt_extent(agno, new_start, new_len);
-	}
-}
-
 /*
  * Reserve blocks for the new per-AG structures.  Returns true if all blocks
  * were allocated, and false if we ran out of space.
@@ -75,7 +37,7 @@ reserve_agblocks(
 	struct bt_rebuild	*btr,
 	uint32_t		nr_blocks)
 {
-	struct extent_tree_node	*ext_ptr;
+	struct free_extent	*ext_ptr;
 	uint32_t		blocks_allocated = 0;
 	uint32_t		len;
 	int			error;
@@ -87,7 +49,7 @@ reserve_agblocks(
 		 * Grab the smallest extent and use it up, then get the
 		 * next smallest.  This mimics the init_*_cursor code.
 		 */
-		ext_ptr = findfirst_bcnt_extent(agno);
+		ext_ptr = findfirst_bcnt_extent(agno, NULL);
 		if (!ext_ptr)
 			break;
 
@@ -105,7 +67,17 @@ reserve_agblocks(
 			do_error(_("could not set up btree rmaps: %s\n"),
 				strerror(-error));
 
-		consume_freespace(agno, ext_ptr, len);
+		/*
+		 * Trim what we used off the extent.  Whatever is left is
+		 * still the smallest free extent, so it stays in place in
+		 * both indices.
+		 */
+#ifdef XR_BLD_FREE_TRACE
+		fprintf(stderr, "using extent: %u [%u %u] len %u\n", agno,
+				ext_ptr->ex_startblock,
+				ext_ptr->ex_blockcount, len);
+#endif
+		trim_first_bcnt_extent(agno, len);
 		blocks_allocated += len;
 	}
 #ifdef XR_BLD_FREE_TRACE
@@ -188,23 +160,23 @@ _("Insufficient memory saving lost blocks, err=%d.\n"), error);
  * Return the next free space extent tree record from the previous value we
  * saw.
  */
-static inline struct extent_tree_node *
+static inline struct free_extent *
 get_bno_rec(
 	struct xfs_btree_cur	*cur,
-	struct extent_tree_node	*prev_value)
+	struct bt_rebuild	*btr)
 {
 	xfs_agnumber_t		agno = cur->bc_ag.pag->pag_agno;
 
 	if (cur->bc_btnum == XFS_BTNUM_BNO) {
-		if (!prev_value)
-			return findfirst_bno_extent(agno);
-		return findnext_bno_extent(prev_value);
+		if (!btr->bno_rec)
+			return findfirst_bno_extent(agno, &btr->bno_cursor);
+		return findnext_bno_extent(agno, &btr->bno_cursor);
 	}
 
 	/* cnt btree */
-	if (!prev_value)
-		return findfirst_bcnt_extent(agno);
-	return findnext_bcnt_extent(agno, prev_value);
+	if (!btr->bno_rec)
+		return findfirst_bcnt_extent(agno, &btr->bno_cursor);
+	return findnext_bcnt_extent(agno, &btr->bno_cursor);
 }
 
 /* Grab one bnobt record and put it in the btree cursor. */
@@ -216,7 +188,7 @@ get_bnobt_record(
 	struct bt_rebuild		*btr = priv;
 	struct xfs_alloc_rec_incore	*arec = &cur->bc_rec.a;
 
-	btr->bno_rec = get_bno_rec(cur, btr->bno_rec);
+	btr->bno_rec = get_bno_rec(cur, btr);
 	arec->ar_startblock = btr->bno_rec->ex_startblock;
 	arec->ar_blockcount = btr->bno_rec->ex_blockcount;
 	btr->freeblks += btr->bno_rec->ex_blockcount;
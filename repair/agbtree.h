@@ -21,7 +21,8 @@ struct bt_rebuild {
 	union {
 		struct xfs_slab_cursor	*slab_cursor;
 		struct {
-			struct extent_tree_node	*bno_rec;
+			struct free_extent	*bno_rec;
+			unsigned int		bno_cursor;
 			unsigned int		freeblks;
 		};
 		struct {
@@ -9,18 +9,42 @@
 
 /*
  * Maximum number of keys per node.  Must be greater than 2 for the code
- * to work.
+ * to work.  Nodes are cacheline aligned and sized so that the key count and
+ * the keys fill exactly two cachelines, so a search touches at most two lines
+ * per level plus the one holding the pointer it follows.
+ *
+ * BTREE_OLD_NODES builds the previous layout instead: 7 keys per node, each
+ * node allocated on its own and searched one compare at a time.  Only
+ * btree_bench uses it, to measure one layout against the other.
  */
+#ifdef BTREE_OLD_NODES
 #define BTREE_KEY_MAX		7
+#else
+#define BTREE_KEY_MAX		15
+#endif
 #define BTREE_KEY_MIN		(BTREE_KEY_MAX / 2)
 
 #define BTREE_PTR_MAX		(BTREE_KEY_MAX + 1)
 
+#ifdef BTREE_OLD_NODES
+#define BTREE_NODE_ALIGN	sizeof(unsigned long)
+#else
+#define BTREE_NODE_ALIGN	64
+#endif
+
+/*
+ * Nodes are carved out of chunks owned by the tree.  Chunks start small so
+ * that the many tiny trees repair creates stay cheap, and double in size as
+ * the tree grows.
+ */
+#define BTREE_CHUNK_MIN		4
+#define BTREE_CHUNK_MAX		256
+
 struct btree_node {
 	unsigned long		num_keys;
 	unsigned long		keys[BTREE_KEY_MAX];
 	struct btree_node	*ptrs[BTREE_PTR_MAX];
-};
+} __attribute__((__aligned__(BTREE_NODE_ALIGN)));
 
 struct btree_cursor {
 	struct btree_node	*node;
@@ -31,6 +55,12 @@ struct btree_root {
 	struct btree_node	*root_node;
 	struct btree_cursor	*cursor;	/* track path to end leaf */
 	int			height;
+	/* node allocator */
+	struct btree_node	*free_nodes;	/* linked through ptrs[0] */
+	struct btree_node	*chunk_next;	/* next unused node in chunk */
+	int			chunk_left;
+	struct btree_node	**chunks;
+	int			nr_chunks;
 	/* lookup cache */
 	int			keys_valid;	/* set if the cache is valid */
 	unsigned long		cur_key;
@@ -65,14 +95,17 @@ struct btree_root {
 };
 
 
+#ifdef BTREE_OLD_NODES
 static struct btree_node *
-btree_node_alloc(void)
+btree_node_alloc(
+	struct btree_root	*root)
 {
 	return calloc(1, sizeof(struct btree_node));
 }
 
 static void
 btree_node_free(
+	struct btree_root	*root,
 	struct btree_node 	*node)
 {
 	free(node);
@@ -88,8 +121,55 @@ btree_free_nodes(
 	if (level)
 		for (i = 0; i <= node->num_keys; i++)
 			btree_free_nodes(node->ptrs[i], level - 1);
-	btree_node_free(node);
+	free(node);
 }
+#else
+static struct btree_node *
+btree_node_alloc(
+	struct btree_root	*root)
+{
+	struct btree_node	*node;
+
+	if (root->free_nodes) {
+		node = root->free_nodes;
+		root->free_nodes = node->ptrs[0];
+	} else {
+		if (!root->chunk_left) {
+			struct btree_node	**chunks;
+			int			nr;
+
+			chunks = realloc(root->chunks, (root->nr_chunks + 1) *
+						sizeof(struct btree_node *));
+			if (!chunks)
+				return NULL;
+			root->chunks = chunks;
+
+			nr = min(BTREE_CHUNK_MIN << min(root->nr_chunks, 16),
+					BTREE_CHUNK_MAX);
+			node = memalign(BTREE_NODE_ALIGN,
+					nr * sizeof(struct btree_node));
+			if (!node)
+				return NULL;
+			root->chunks[root->nr_chunks++] = node;
+			root->chunk_next = node;
+			root->chunk_left = nr;
+		}
+		node = root->chunk_next++;
+		root->chunk_left--;
+	}
+	memset(node, 0, sizeof(struct btree_node));
+	return node;
+}
+
+static void
+btree_node_free(
+	struct btree_root	*root,
+	struct btree_node 	*node)
+{
+	node->ptrs[0] = root->free_nodes;
+	root->free_nodes = node;
+}
+#endif /* BTREE_OLD_NODES */
 
 static void
 __btree_init(
@@ -98,7 +178,7 @@ __btree_init(
 	memset(root, 0, sizeof(struct btree_root));
 	root->height = 1;
 	root->cursor = calloc(1, sizeof(struct btree_cursor));
-	root->root_node = btree_node_alloc();
+	root->root_node = btree_node_alloc(root);
 	ASSERT(root->root_node);
 #ifdef BTREE_STATS
 	root->stats.max_items = 1;
@@ -110,8 +190,20 @@ static void
 __btree_free(
 	struct btree_root	*root)
 {
+	int			i;
+
+#ifdef BTREE_OLD_NODES
 	btree_free_nodes(root->root_node, root->height - 1);
+#endif
+	/* all the nodes live in the chunks, no need to walk the tree */
+	for (i = 0; i < root->nr_chunks; i++)
+		free(root->chunks[i]);
+	free(root->chunks);
 	free(root->cursor);
+	root->chunks = NULL;
+	root->nr_chunks = 0;
+	root->chunk_left = 0;
+	root->free_nodes = NULL;
 	root->height = 0;
 	root->cursor = NULL;
 	root->root_node = NULL;
@@ -248,15 +340,33 @@ btree_do_search(
 	int			height = root->height;
 	int			key_found = 0;
 	int			i;
+#ifndef BTREE_OLD_NODES
+	int			n;
+#endif
 
 	while (--height >= 0) {
 		cur--;
+#ifdef BTREE_OLD_NODES
 		for (i = 0; i < node->num_keys; i++)
 			if (node->keys[i] >= key) {
 				k = node->keys[i];
 				key_found = 1;
 				break;
 			}
+#else
+		/*
+		 * The keys are sorted, so the index of the first key >= @key
+		 * is the number of keys less than @key.  Counting them is
+		 * branch free and lets the compiler vectorise the loop.
+		 */
+		i = 0;
+		for (n = 0; n < node->num_keys; n++)
+			i += node->keys[n] < key;
+		if (i < node->num_keys) {
+			k = node->keys[i];
+			key_found = 1;
+		}
+#endif
 		cur->node = node;
 		cur->index = i;
 		node = node->ptrs[i];
@@ -737,7 +847,7 @@ btree_increase_height(
 		return NULL;
 	root->cursor = new_cursor;
 
-	new_root = btree_node_alloc();
+	new_root = btree_node_alloc(root);
 	if (!new_root)
 		return NULL;
 
@@ -777,13 +887,13 @@ btree_split(
 	struct btree_node	*new_node;
 	int			i;
 
-	new_node = btree_node_alloc();
+	new_node = btree_node_alloc(root);
 	if (!new_node)
 		return NULL;
 
 	if (btree_insert_item(root, level + 1, node->keys[BTREE_KEY_MIN],
 							new_node) != 0) {
-		btree_node_free(new_node);
+		btree_node_free(root, new_node);
 		return NULL;
 	}
 
@@ -953,7 +1063,7 @@ btree_decrease_height(
 	root->stats.max_items /= BTREE_PTR_MAX;
 #endif
 	root->root_node = old_root->ptrs[0];
-	btree_node_free(old_root);
+	btree_node_free(root, old_root);
 	root->height--;
 }
 
@@ -1104,7 +1214,7 @@ btree_delete_node(
 #ifdef BTREE_STATS
 	root->stats.alloced -= 1;
 #endif
-	btree_node_free(root->cursor[level].node);
+	btree_node_free(root, root->cursor[level].node);
 
 	btree_delete_key(root, level + 1);
 }
@@ -0,0 +1,196 @@
+// SPDX-License-Identifier: GPL-2.0
+
+#include "libxfs.h"
+#include <sys/resource.h>
+#include "btree.h"
+
+/*
+ * Benchmark for the incore btree used by the repair block and inode maps.
+ *
+ * Fills trees with scattered 64 bit keys and then drives them the way repair
+ * does: insert every key, look each one up in a different scattered order,
+ * walk the whole tree in key order with btree_find and btree_lookup_next,
+ * delete half of the keys and tear the tree down.  Each step is timed
+ * separately.
+ *
+ * Build with "make -C repair btree_bench btree_bench_old"; neither is built
+ * or installed by default.  btree_bench uses the current node layout and
+ * btree_bench_old builds btree.c with BTREE_OLD_NODES, so running both with
+ * the same arguments compares the two:
+ *
+ *	repair/btree_bench -t 4 -n 10000000
+ *	repair/btree_bench_old -t 4 -n 10000000
+ */
+
+#ifdef BTREE_OLD_NODES
+#define BENCH_LAYOUT	"old (7 keys, one allocation per node)"
+#else
+#define BENCH_LAYOUT	"new (15 keys, cacheline aligned, chunk allocated)"
+#endif
+
+static void
+bench_error(char const *msg, ...)
+{
+	va_list		args;
+
+	fprintf(stderr, "%s: ", progname);
+	va_start(args, msg);
+	vfprintf(stderr, msg, args);
+	va_end(args);
+	exit(1);
+}
+
+static uint64_t
+bench_now_ns(void)
+{
+	struct timespec		ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+/* splitmix64 finaliser; a bijection, so distinct seeds give distinct keys */
+static unsigned long
+bench_key(
+	uint64_t		seed)
+{
+	uint64_t		x = seed + 0x9E3779B97F4A7C15ULL;
+
+	x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+	x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+	return x ^ (x >> 31);
+}
+
+/* Pick a stride that visits every key once, in scattered order. */
+static uint64_t
+bench_stride(
+	uint64_t		nr)
+{
+	uint64_t		a = 2654435761ULL % nr;
+	uint64_t		x, y;
+
+	for (;; a++) {
+		for (x = a, y = nr; y; ) {
+			uint64_t	t = x % y;
+
+			x = y;
+			y = t;
+		}
+		if (x == 1)
+			return a;
+	}
+}
+
+static void
+usage(void)
+{
+	fprintf(stderr, _("Usage: %s [-t trees] [-n keys per tree]\n"),
+		progname);
+	exit(1);
+}
+
+int
+main(
+	int			argc,
+	char			**argv)
+{
+	struct btree_root	*root;
+	struct rusage		ru;
+	uint64_t		nr_trees = 1;
+	uint64_t		nr_keys = 1000000;
+	uint64_t		insert_ns = 0, lookup_ns = 0, walk_ns = 0;
+	uint64_t		delete_ns = 0, destroy_ns = 0;
+	uint64_t		start, stride, seed;
+	uint64_t		t, i, j;
+	unsigned long		key, prev;
+	void			*value;
+	int			c;
+
+	progname = basename(argv[0]);
+	while ((c = getopt(argc, argv, "n:t:")) != EOF) {
+		switch (c) {
+		case 'n':
+			nr_keys = strtoull(optarg, NULL, 0);
+			break;
+		case 't':
+			nr_trees = strtoull(optarg, NULL, 0);
+			break;
+		default:
+			usage();
+		}
+	}
+	if (!nr_trees || nr_keys < 2)
+		usage();
+	if (sizeof(unsigned long) < sizeof(uint64_t))
+		bench_error(_("64 bit keys need a 64 bit unsigned long\n"));
+
+	stride = bench_stride(nr_keys);
+	for (t = 0; t < nr_trees; t++) {
+		seed = t * nr_keys;
+		btree_init(&root);
+
+		/* values are never NULL, that means "not found" */
+		start = bench_now_ns();
+		for (i = 0; i < nr_keys; i++)
+			if (btree_insert(root, bench_key(seed + i),
+					(void *)(uintptr_t)(i + 1)))
+				bench_error(_("insert failed in tree %llu\n"),
+						(unsigned long long)t);
+		insert_ns += bench_now_ns() - start;
+
+		start = bench_now_ns();
+		for (i = 0, j = 0; i < nr_keys; i++) {
+			value = btree_lookup(root, bench_key(seed + j));
+			if (value != (void *)(uintptr_t)(j + 1))
+				bench_error(_("lookup failed in tree %llu\n"),
+						(unsigned long long)t);
+			j = (j + stride) % nr_keys;
+		}
+		lookup_ns += bench_now_ns() - start;
+
+		start = bench_now_ns();
+		value = btree_find(root, 0, &key);
+		for (i = 0; value; i++) {
+			prev = key;
+			value = btree_lookup_next(root, &key);
+			if (value && key <= prev)
+				bench_error(_("walk out of order in tree %llu\n"),
+						(unsigned long long)t);
+		}
+		if (i != nr_keys)
+			bench_error(_("walk found %llu of %llu keys\n"),
+					(unsigned long long)i,
+					(unsigned long long)nr_keys);
+		walk_ns += bench_now_ns() - start;
+
+		start = bench_now_ns();
+		for (i = 0, j = 0; i < nr_keys / 2; i++) {
+			if (!btree_delete(root, bench_key(seed + j)))
+				bench_error(_("delete failed in tree %llu\n"),
+						(unsigned long long)t);
+			j = (j + stride) % nr_keys;
+		}
+		delete_ns += bench_now_ns() - start;
+
+		start = bench_now_ns();
+		btree_destroy(root);
+		destroy_ns += bench_now_ns() - start;
+	}
+
+	getrusage(RUSAGE_SELF, &ru);
+	printf(_("layout: %s\n"), BENCH_LAYOUT);
+	printf(_("%llu trees x %llu keys\n"), (unsigned long long)nr_trees,
+			(unsigned long long)nr_keys);
+	printf(_("insert:  %8.3fs  %6.1f ns/key\n"), insert_ns / 1e9,
+			(double)insert_ns / (nr_trees * nr_keys));
+	printf(_("lookup:  %8.3fs  %6.1f ns/key\n"), lookup_ns / 1e9,
+			(double)lookup_ns / (nr_trees * nr_keys));
+	printf(_("walk:    %8.3fs  %6.1f ns/key\n"), walk_ns / 1e9,
+			(double)walk_ns / (nr_trees * nr_keys));
+	printf(_("delete:  %8.3fs  %6.1f ns/key\n"), delete_ns / 1e9,
+			(double)delete_ns / (nr_trees * (nr_keys / 2)));
+	printf(_("destroy: %8.3fs  %6.1f ns/tree\n"), destroy_ns / 1e9,
+			(double)destroy_ns / nr_trees);
+	printf(_("maxrss: %ld KiB\n"), ru.ru_maxrss);
+	return 0;
+}
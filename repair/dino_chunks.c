@@ -132,7 +132,7 @@ verify_inode_chunk(xfs_mount_t		*mp,
 		if (check_aginode_block(mp, agno, agino) == 0)
 			return 0;
 
-		pthread_mutex_lock(&ag_locks[agno].lock);
+		lock_bmap_ext(agno, agbno, 1);
 
 		state = get_bmap(agno, agbno);
 		switch (state) {
@@ -157,7 +157,7 @@ verify_inode_chunk(xfs_mount_t		*mp,
 		_("inode block %d/%d multiply claimed, (state %d)\n"),
 				agno, agbno, state);
 			set_bmap(agno, agbno, XR_E_MULT);
-			pthread_mutex_unlock(&ag_locks[agno].lock);
+			unlock_bmap_ext(agno, agbno, 1);
 			return(0);
 		default:
 			do_warn(
@@ -167,7 +167,7 @@ verify_inode_chunk(xfs_mount_t		*mp,
 			break;
 		}
 
-		pthread_mutex_unlock(&ag_locks[agno].lock);
+		unlock_bmap_ext(agno, agbno, 1);
 
 		start_agino = XFS_AGB_TO_AGINO(mp, agbno);
 		*start_ino = XFS_AGINO_TO_INO(mp, agno, start_agino);
@@ -414,7 +414,8 @@ verify_inode_chunk(xfs_mount_t		*mp,
 	 * user data -- we're probably here as a result of a directory
 	 * entry or an iunlinked pointer
 	 */
-	pthread_mutex_lock(&ag_locks[agno].lock);
+	lock_bmap_ext(agno, chunk_start_agbno,
+			chunk_stop_agbno - chunk_start_agbno);
 	for (cur_agbno = chunk_start_agbno;
 	     cur_agbno < chunk_stop_agbno;
 	     cur_agbno += blen)  {
@@ -428,7 +429,8 @@ verify_inode_chunk(xfs_mount_t		*mp,
 	_("inode block %d/%d multiply claimed, (state %d)\n"),
 				agno, cur_agbno, state);
 			set_bmap_ext(agno, cur_agbno, blen, XR_E_MULT);
-			pthread_mutex_unlock(&ag_locks[agno].lock);
+			unlock_bmap_ext(agno, chunk_start_agbno,
+					chunk_stop_agbno - chunk_start_agbno);
 			return 0;
 		case XR_E_INO:
 			do_error(
@@ -439,7 +441,8 @@ verify_inode_chunk(xfs_mount_t		*mp,
 			break;
 		}
 	}
-	pthread_mutex_unlock(&ag_locks[agno].lock);
+	unlock_bmap_ext(agno, chunk_start_agbno,
+			chunk_stop_agbno - chunk_start_agbno);
 
 	/*
 	 * ok, chunk is good.  put the record into the tree if required,
@@ -462,7 +465,8 @@ verify_inode_chunk(xfs_mount_t		*mp,
 
 	set_inode_used(irec_p, agino - start_agino);
 
-	pthread_mutex_lock(&ag_locks[agno].lock);
+	lock_bmap_ext(agno, chunk_start_agbno,
+			chunk_stop_agbno - chunk_start_agbno);
 
 	for (cur_agbno = chunk_start_agbno;
 	     cur_agbno < chunk_stop_agbno;
@@ -495,7 +499,8 @@ verify_inode_chunk(xfs_mount_t		*mp,
 			break;
 		}
 	}
-	pthread_mutex_unlock(&ag_locks[agno].lock);
+	unlock_bmap_ext(agno, chunk_start_agbno,
+			chunk_stop_agbno - chunk_start_agbno);
 
 	return(ino_cnt);
 }
@@ -554,7 +559,7 @@ process_inode_agbno_state(
 {
 	int state;
 
-	pthread_mutex_lock(&ag_locks[agno].lock);
+	lock_bmap_ext(agno, agbno, 1);
 	state = get_bmap(agno, agbno);
 	switch (state) {
 	case XR_E_INO:	/* already marked */
@@ -574,7 +579,7 @@ process_inode_agbno_state(
 			XFS_AGB_TO_FSB(mp, agno, agbno), state);
 		break;
 	}
-	pthread_mutex_unlock(&ag_locks[agno].lock);
+	unlock_bmap_ext(agno, agbno, 1);
 }
 
 /*
@@ -376,6 +376,7 @@ process_bmbt_reclist_int(
 	xfs_agblock_t		ebno;
 	xfs_extlen_t		blen;
 	xfs_agnumber_t		locked_agno = -1;
+	xfs_agblock_t		locked_agbno = 0;
 	int			error = 1;
 	int			error2;
 
@@ -519,17 +520,16 @@ _("Fatal error: inode %" PRIu64 " - blkmap_set_ext(): %s\n"
 
 		/*
 		 * Profiling shows that the following loop takes the
-		 * most time in all of xfs_repair.
+		 * most time in all of xfs_repair.  Only lock the part of
+		 * the block map that this extent covers so that other
+		 * threads can work on the rest of the AG.
 		 */
 		agno = XFS_FSB_TO_AGNO(mp, irec.br_startblock);
 		agbno = XFS_FSB_TO_AGBNO(mp, irec.br_startblock);
 		ebno = agbno + irec.br_blockcount;
-		if (agno != locked_agno) {
-			if (locked_agno != -1)
-				pthread_mutex_unlock(&ag_locks[locked_agno].lock);
-			pthread_mutex_lock(&ag_locks[agno].lock);
-			locked_agno = agno;
-		}
+		lock_bmap_ext(agno, agbno, irec.br_blockcount);
+		locked_agno = agno;
+		locked_agbno = agbno;
 
 		for (b = irec.br_startblock;
 		     agbno < ebno;
@@ -595,6 +595,9 @@ _("illegal state %d in block map %" PRIu64 "\n"),
 			 * We're not yet updating the block usage information.
 			 */
 			*tot += irec.br_blockcount;
+			unlock_bmap_ext(agno, locked_agbno,
+					irec.br_blockcount);
+			locked_agno = -1;
 			continue;
 		}
 
@@ -624,8 +627,13 @@ _("illegal state %d in block map %" PRIu64 "\n"),
 				break;
 			}
 		}
+		unlock_bmap_ext(agno, locked_agbno, irec.br_blockcount);
+		locked_agno = -1;
+
 		if (collect_rmaps) { /* && !check_dups */
+			pthread_mutex_lock(&ag_locks[agno].lock);
 			error = rmap_add_rec(mp, ino, whichfork, &irec);
+			pthread_mutex_unlock(&ag_locks[agno].lock);
 			if (error)
 				do_error(
 _("couldn't add reverse mapping\n")
@@ -636,7 +644,8 @@ _("couldn't add reverse mapping\n")
 	error = 0;
 done:
 	if (locked_agno != -1)
-		pthread_mutex_unlock(&ag_locks[locked_agno].lock);
+		unlock_bmap_ext(locked_agno, locked_agbno,
+				irec.br_blockcount);
 
 	if (i != *numrecs) {
 		ASSERT(i < *numrecs);
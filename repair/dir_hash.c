@@ -0,0 +1,340 @@
+// SPDX-License-Identifier: GPL-2.0
+
+#include "libxfs.h"
+#include "err_protos.h"
+#include "dir_hash.h"
+
+/*
+ * Directory entry tables for phase 6.  This is kept apart from the rest of
+ * phase 6 so that dir_hash_bench can drive it without a filesystem.
+ */
+
+#define DIR_HASH_MIN_SHIFT	4
+/* keep a thread's table across directories unless it got this big */
+#define DIR_HASH_KEEP_ENTS	(1U << 16)
+
+static pthread_key_t		dir_hash_key;
+
+static inline uint32_t
+dir_hash_name_bucket(
+	struct dir_hash_tab	*hashtab,
+	xfs_dahash_t		hash)
+{
+	return (hash * 2654435761U) >> (32 - hashtab->shift);
+}
+
+/*
+ * Entries are added in address order, so using the low bits of the address
+ * keeps the inserts close together in the table.
+ */
+static inline uint32_t
+dir_hash_addr_bucket(
+	struct dir_hash_tab	*hashtab,
+	xfs_dir2_dataptr_t	addr)
+{
+	return addr & ((1U << hashtab->shift) - 1);
+}
+
+static inline uint32_t
+dir_hash_next_slot(
+	struct dir_hash_tab	*hashtab,
+	uint32_t		slot)
+{
+	return (slot + 1) & ((1U << hashtab->shift) - 1);
+}
+
+struct dir_hash_ent *
+dir_hash_lookup(
+	struct dir_hash_tab	*hashtab,
+	xfs_dir2_dataptr_t	addr)
+{
+	uint32_t		slot = dir_hash_addr_bucket(hashtab, addr);
+	struct dir_hash_slot	*hs;
+
+	while ((hs = &hashtab->byaddr[slot])->idx != 0) {
+		if (hs->key == addr)
+			return &hashtab->ents[hs->idx - 1];
+		slot = dir_hash_next_slot(hashtab, slot);
+	}
+	return NULL;
+}
+
+static void
+dir_hash_insert_slot(
+	struct dir_hash_tab	*hashtab,
+	struct dir_hash_slot	*table,
+	uint32_t		slot,
+	uint32_t		key,
+	uint32_t		idx)
+{
+	while (table[slot].idx != 0)
+		slot = dir_hash_next_slot(hashtab, slot);
+	table[slot].key = key;
+	table[slot].idx = idx + 1;
+}
+
+/* Size the index tables for 1 << shift slots and reindex all the entries. */
+static void
+dir_hash_resize(
+	struct dir_hash_tab	*hashtab,
+	unsigned int		shift)
+{
+	uint32_t		nr_slots = 1U << shift;
+	size_t			len = nr_slots * sizeof(struct dir_hash_slot);
+	uint32_t		i;
+
+	if (nr_slots > hashtab->max_slots) {
+		free(hashtab->byhash);
+		free(hashtab->byaddr);
+		hashtab->byhash = malloc(len);
+		hashtab->byaddr = malloc(len);
+		if (!hashtab->byhash || !hashtab->byaddr)
+			do_error(
+	_("malloc failed in dir_hash_resize (%zu bytes)\n"), len);
+		hashtab->max_slots = nr_slots;
+	}
+	hashtab->shift = shift;
+	memset(hashtab->byhash, 0, len);
+	memset(hashtab->byaddr, 0, len);
+
+	for (i = 0; i < hashtab->nr_ents; i++) {
+		struct dir_hash_ent	*p = &hashtab->ents[i];
+
+		dir_hash_insert_slot(hashtab, hashtab->byaddr,
+				dir_hash_addr_bucket(hashtab, p->address),
+				p->address, i);
+		if (!p->junkit)
+			dir_hash_insert_slot(hashtab, hashtab->byhash,
+					dir_hash_name_bucket(hashtab,
+						p->hashval),
+					p->hashval, i);
+	}
+}
+
+/*
+ * Add an entry whose name hashes to @hash; the hash is ignored for junked
+ * names.  Returns 0 if the name already exists (ie. a duplicate)
+ */
+int
+dir_hash_add_hashed(
+	struct dir_hash_tab	*hashtab,
+	uint32_t		addr,
+	xfs_ino_t		inum,
+	int			namelen,
+	unsigned char		*name,
+	uint8_t			ftype,
+	xfs_dahash_t		hash)
+{
+	struct dir_hash_ent	*p;
+	struct dir_hash_slot	*hs;
+	uint32_t		slot;
+	uint32_t		idx;
+	int			dup;
+	short			junk;
+
+	junk = name[0] == '/';
+	dup = 0;
+
+	/* keep the index tables at most half full */
+	if ((hashtab->nr_ents + 1) * 2 > (1U << hashtab->shift))
+		dir_hash_resize(hashtab, hashtab->shift + 1);
+
+	if (!junk) {
+		/*
+		 * search hash table for existing name.
+		 */
+		slot = dir_hash_name_bucket(hashtab, hash);
+		while ((hs = &hashtab->byhash[slot])->idx != 0) {
+			p = &hashtab->ents[hs->idx - 1];
+			if (hs->key == hash && p->namelen == namelen &&
+			    memcmp(dir_hash_name(hashtab, p), name,
+					namelen) == 0) {
+				dup = 1;
+				junk = 1;
+				break;
+			}
+			slot = dir_hash_next_slot(hashtab, slot);
+		}
+	}
+
+	if (dir_hash_lookup(hashtab, addr)) {
+		do_warn(_("duplicate addrs %u in directory!\n"), addr);
+		return 0;
+	}
+
+	if (hashtab->nr_ents == hashtab->max_ents) {
+		uint32_t	n = max(hashtab->max_ents * 2, 64U);
+
+		p = realloc(hashtab->ents, n * sizeof(*p));
+		if (!p)
+			do_error(
+	_("malloc failed in dir_hash_add (%zu bytes)\n"),
+				n * sizeof(*p));
+		hashtab->ents = p;
+		hashtab->max_ents = n;
+	}
+	if (hashtab->names_len + namelen > hashtab->max_names) {
+		size_t		n = max(hashtab->max_names * 2, (size_t)4096);
+		unsigned char	*names;
+
+		names = realloc(hashtab->names, n);
+		if (!names)
+			do_error(
+	_("malloc failed in dir_hash_add (%zu bytes)\n"), n);
+		hashtab->names = names;
+		hashtab->max_names = n;
+	}
+
+	/* Keep our own copy of the name for later use. */
+	idx = hashtab->nr_ents++;
+	p = &hashtab->ents[idx];
+	p->name_off = hashtab->names_len;
+	memcpy(hashtab->names + hashtab->names_len, name, namelen);
+	hashtab->names_len += namelen;
+	p->namelen = namelen;
+	p->ftype = ftype;
+	p->address = addr;
+	p->inum = inum;
+	p->seen = 0;
+	hashtab->nr_unseen++;
+
+	dir_hash_insert_slot(hashtab, hashtab->byaddr,
+			dir_hash_addr_bucket(hashtab, addr), addr, idx);
+	if (!(p->junkit = junk)) {
+		p->hashval = hash;
+		dir_hash_insert_slot(hashtab, hashtab->byhash,
+				dir_hash_name_bucket(hashtab, hash), hash,
+				idx);
+	} else {
+		p->hashval = 0;
+	}
+	return !dup;
+}
+
+/* Mark an existing directory hashtable entry as junk. */
+void
+dir_hash_junkit(
+	struct dir_hash_tab	*hashtab,
+	xfs_dir2_dataptr_t	addr)
+{
+	struct dir_hash_ent	*p;
+
+	p = dir_hash_lookup(hashtab, addr);
+	assert(p != NULL);
+
+	p->junkit = 1;
+	dir_hash_name(hashtab, p)[0] = '/';
+}
+
+static void
+dir_hash_free(
+	void			*arg)
+{
+	struct dir_hash_tab	*hashtab = arg;
+
+	free(hashtab->ents);
+	free(hashtab->names);
+	free(hashtab->byhash);
+	free(hashtab->byaddr);
+	free(hashtab);
+}
+
+/*
+ * Done with this directory.  The table stays with the thread for the next
+ * directory, unless it grew big enough that we'd rather give the memory back.
+ */
+void
+dir_hash_done(
+	struct dir_hash_tab	*hashtab)
+{
+	if (hashtab->max_ents <= DIR_HASH_KEEP_ENTS)
+		return;
+	pthread_setspecific(dir_hash_key, NULL);
+	dir_hash_free(hashtab);
+}
+
+/*
+ * Set up a directory hash index structure based on the size of the directory
+ * we are about to try to repair. The size passed in is the size of the data
+ * segment of the directory in bytes, so we don't really know exactly how many
+ * entries are in it. Hence assume an entry size of around 64 bytes - that's a
+ * name length of 40+ bytes so should cover a most situations with really large
+ * directories.  The index tables grow if we guessed low.
+ */
+struct dir_hash_tab *
+dir_hash_init(
+	xfs_fsize_t		size)
+{
+	struct dir_hash_tab	*hashtab;
+	unsigned int		shift = DIR_HASH_MIN_SHIFT;
+
+	hashtab = pthread_getspecific(dir_hash_key);
+	if (!hashtab) {
+		hashtab = calloc(1, sizeof(struct dir_hash_tab));
+		if (!hashtab)
+			do_error(_("calloc failed in dir_hash_init\n"));
+		pthread_setspecific(dir_hash_key, hashtab);
+	}
+
+	while (shift < 30 && (1ULL << shift) < (size / 64) * 2)
+		shift++;
+	hashtab->nr_ents = 0;
+	hashtab->names_len = 0;
+	hashtab->nr_unseen = 0;
+	dir_hash_resize(hashtab, shift);
+	return hashtab;
+}
+
+int
+dir_hash_see(
+	struct dir_hash_tab	*hashtab,
+	xfs_dahash_t		hash,
+	xfs_dir2_dataptr_t	addr)
+{
+	struct dir_hash_ent	*p;
+
+	p = dir_hash_lookup(hashtab, addr);
+	if (!p)
+		return DIR_HASH_CK_NODATA;
+	if (p->seen)
+		return DIR_HASH_CK_DUPLEAF;
+	if (p->junkit == 0 && p->hashval != hash)
+		return DIR_HASH_CK_BADHASH;
+	p->seen = 1;
+	hashtab->nr_unseen--;
+	return DIR_HASH_CK_OK;
+}
+
+void
+dir_hash_update_ftype(
+	struct dir_hash_tab	*hashtab,
+	xfs_dir2_dataptr_t	addr,
+	uint8_t			ftype)
+{
+	struct dir_hash_ent	*p;
+
+	p = dir_hash_lookup(hashtab, addr);
+	if (!p)
+		return;
+	p->ftype = ftype;
+}
+
+/* Create the per-thread table key before the first directory is checked. */
+void
+dir_hash_setup(void)
+{
+	if (pthread_key_create(&dir_hash_key, dir_hash_free))
+		do_error(_("cannot create directory hash table key\n"));
+}
+
+/* Free this thread's table and the key once all directories are done. */
+void
+dir_hash_teardown(void)
+{
+	struct dir_hash_tab	*hashtab;
+
+	hashtab = pthread_getspecific(dir_hash_key);
+	if (hashtab)
+		dir_hash_free(hashtab);
+	pthread_key_delete(dir_hash_key);
+}
@@ -0,0 +1,80 @@
+// SPDX-License-Identifier: GPL-2.0
+#ifndef _XFS_REPAIR_DIR_HASH_H_
+#define _XFS_REPAIR_DIR_HASH_H_
+
+/*
+ * Data structures and routines to keep track of directory entries
+ * and whether their leaf entry has been seen. Also used for name
+ * duplicate checking and rebuilding step if required.
+ *
+ * Entries live in one array in the order they were added, and their names
+ * are packed into a separate name arena.  Two open addressing tables of
+ * entry indices find entries by name hash and by data address.  Each thread
+ * keeps its table and just resets it for the next directory, so checking a
+ * directory doesn't do an allocation per entry.
+ */
+struct dir_hash_ent {
+	xfs_dahash_t		hashval;	/* hash value of name */
+	uint32_t		address;	/* offset of data entry */
+	xfs_ino_t		inum;		/* inode num of entry */
+	uint32_t		name_off;	/* offset of name in the arena */
+	uint8_t			namelen;
+	uint8_t			ftype;
+	uint8_t			junkit;		/* name starts with / */
+	uint8_t			seen;		/* have seen leaf entry */
+};
+
+/* Index table slot; the key is kept here to avoid looking at the entry. */
+struct dir_hash_slot {
+	uint32_t		key;		/* name hash or address */
+	uint32_t		idx;		/* entry index + 1, 0 if free */
+};
+
+struct dir_hash_tab {
+	struct dir_hash_ent	*ents;		/* entries, in order added */
+	uint32_t		nr_ents;
+	uint32_t		max_ents;
+	unsigned char		*names;		/* name arena */
+	size_t			names_len;
+	size_t			max_names;
+	struct dir_hash_slot	*byhash;	/* by name hash */
+	struct dir_hash_slot	*byaddr;	/* by data address */
+	unsigned int		shift;		/* log2 of slots in use */
+	uint32_t		max_slots;	/* slots allocated */
+	uint32_t		nr_unseen;	/* entries not seen in a leaf */
+};
+
+static inline unsigned char *
+dir_hash_name(
+	struct dir_hash_tab	*hashtab,
+	struct dir_hash_ent	*p)
+{
+	return hashtab->names + p->name_off;
+}
+
+#define	DIR_HASH_CK_OK		0
+#define	DIR_HASH_CK_DUPLEAF	1
+#define	DIR_HASH_CK_BADHASH	2
+#define	DIR_HASH_CK_NODATA	3
+#define	DIR_HASH_CK_NOLEAF	4
+#define	DIR_HASH_CK_BADSTALE	5
+#define	DIR_HASH_CK_TOTAL	6
+
+void dir_hash_setup(void);
+void dir_hash_teardown(void);
+
+struct dir_hash_tab *dir_hash_init(xfs_fsize_t size);
+void dir_hash_done(struct dir_hash_tab *hashtab);
+
+struct dir_hash_ent *dir_hash_lookup(struct dir_hash_tab *hashtab,
+		xfs_dir2_dataptr_t addr);
+int dir_hash_add_hashed(struct dir_hash_tab *hashtab, uint32_t addr,
+		xfs_ino_t inum, int namelen, unsigned char *name,
+		uint8_t ftype, xfs_dahash_t hash);
+void dir_hash_junkit(struct dir_hash_tab *hashtab, xfs_dir2_dataptr_t addr);
+int dir_hash_see(struct dir_hash_tab *hashtab, xfs_dahash_t hash,
+		xfs_dir2_dataptr_t addr);
+void dir_hash_update_ftype(struct dir_hash_tab *hashtab,
+		xfs_dir2_dataptr_t addr, uint8_t ftype);
+
+#endif /* _XFS_REPAIR_DIR_HASH_H_ */
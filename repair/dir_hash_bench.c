@@ -0,0 +1,221 @@
+// SPDX-License-Identifier: GPL-2.0
+
+#include "libxfs.h"
+#include <sys/resource.h>
+#include "err_protos.h"
+#include "dir_hash.h"
+
+/*
+ * Benchmark for the phase 6 directory entry tables.
+ *
+ * Builds synthetic directories in memory and drives them the way phase 6
+ * does: add every data entry in address order, then look each one up by
+ * address in hash order as the leaf entries are checked, then reset the
+ * table for the next directory.  Each step is timed separately.
+ *
+ * Build with "make -C repair dir_hash_bench"; it isn't built or installed by
+ * default.  For example, one directory of 20 million names:
+ *
+ *	repair/dir_hash_bench -d 1 -n 20000000
+ */
+
+static void
+bench_vlog(
+	char const	*msg,
+	va_list		args)
+{
+	fprintf(stderr, "%s: ", progname);
+	vfprintf(stderr, msg, args);
+}
+
+void
+do_error(char const *msg, ...)
+{
+	va_list		args;
+
+	va_start(args, msg);
+	bench_vlog(msg, args);
+	va_end(args);
+	exit(1);
+}
+
+void
+do_abort(char const *msg, ...)
+{
+	va_list		args;
+
+	va_start(args, msg);
+	bench_vlog(msg, args);
+	va_end(args);
+	abort();
+}
+
+void
+do_warn(char const *msg, ...)
+{
+	va_list		args;
+
+	va_start(args, msg);
+	bench_vlog(msg, args);
+	va_end(args);
+}
+
+void
+do_log(char const *msg, ...)
+{
+	va_list		args;
+
+	va_start(args, msg);
+	vfprintf(stderr, msg, args);
+	va_end(args);
+}
+
+static uint64_t
+bench_now_ns(void)
+{
+	struct timespec		ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+/* Make up a name like a machine generated object id. */
+static int
+bench_name(
+	unsigned char		*buf,
+	unsigned int		namelen,
+	uint64_t		seed)
+{
+	static const char	hex[] = "0123456789abcdef";
+	uint64_t		x = seed * 0x9E3779B97F4A7C15ULL + 1;
+	unsigned int		i;
+
+	for (i = 0; i < namelen; i++) {
+		if ((i & 15) == 0)
+			x ^= x >> 29, x *= 0xBF58476D1CE4E5B9ULL, x ^= x >> 32;
+		buf[i] = hex[(x >> ((i & 15) * 4)) & 15];
+	}
+	return namelen;
+}
+
+/* Pick a stride that visits every entry once, in scattered order. */
+static uint64_t
+bench_stride(
+	uint64_t		nr)
+{
+	uint64_t		a = 2654435761ULL % nr;
+	uint64_t		x, y;
+
+	for (;; a++) {
+		for (x = a, y = nr; y; ) {
+			uint64_t	t = x % y;
+
+			x = y;
+			y = t;
+		}
+		if (x == 1)
+			return a;
+	}
+}
+
+static void
+usage(void)
+{
+	fprintf(stderr,
+_("Usage: %s [-d dirs] [-n names per dir] [-l name length]\n"),
+		progname);
+	exit(1);
+}
+
+int
+main(
+	int			argc,
+	char			**argv)
+{
+	struct dir_hash_tab	*hashtab;
+	struct rusage		ru;
+	unsigned char		name[MAXNAMELEN];
+	xfs_dahash_t		*hashes;
+	uint64_t		nr_dirs = 1;
+	uint64_t		nr_names = 1000000;
+	unsigned int		namelen = 32;
+	uint64_t		add_ns = 0, see_ns = 0, reset_ns = 0;
+	uint64_t		start, stride;
+	uint64_t		d, i, j;
+	int			c;
+
+	progname = basename(argv[0]);
+	while ((c = getopt(argc, argv, "d:n:l:")) != EOF) {
+		switch (c) {
+		case 'd':
+			nr_dirs = strtoull(optarg, NULL, 0);
+			break;
+		case 'n':
+			nr_names = strtoull(optarg, NULL, 0);
+			break;
+		case 'l':
+			namelen = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			usage();
+		}
+	}
+	if (!nr_dirs || !nr_names || nr_names > UINT32_MAX / 8 ||
+	    !namelen || namelen >= MAXNAMELEN)
+		usage();
+
+	hashes = malloc(nr_names * sizeof(xfs_dahash_t));
+	if (!hashes)
+		do_error(_("cannot allocate %llu name hashes\n"),
+				(unsigned long long)nr_names);
+	stride = bench_stride(nr_names);
+
+	dir_hash_setup();
+	for (d = 0; d < nr_dirs; d++) {
+		start = bench_now_ns();
+		hashtab = dir_hash_init(nr_names * 64);
+		for (i = 0; i < nr_names; i++) {
+			bench_name(name, namelen, d * nr_names + i);
+			hashes[i] = libxfs_da_hashname(name, namelen);
+			/* data entries are 8 byte aligned, about 48 bytes */
+			if (!dir_hash_add_hashed(hashtab, i * 6, i + 128,
+					namelen, name, XFS_DIR3_FT_REG_FILE,
+					hashes[i]))
+				do_error(_("duplicate name in directory %llu\n"),
+						(unsigned long long)d);
+		}
+		add_ns += bench_now_ns() - start;
+
+		start = bench_now_ns();
+		for (i = 0, j = 0; i < nr_names; i++) {
+			if (dir_hash_see(hashtab, hashes[j], j * 6) !=
+					DIR_HASH_CK_OK)
+				do_error(_("lookup failed in directory %llu\n"),
+						(unsigned long long)d);
+			j = (j + stride) % nr_names;
+		}
+		if (hashtab->nr_unseen)
+			do_error(_("entries not seen in directory %llu\n"),
+					(unsigned long long)d);
+		see_ns += bench_now_ns() - start;
+
+		start = bench_now_ns();
+		dir_hash_done(hashtab);
+		reset_ns += bench_now_ns() - start;
+	}
+	dir_hash_teardown();
+	free(hashes);
+
+	getrusage(RUSAGE_SELF, &ru);
+	printf(_("%llu dirs x %llu names of %u bytes\n"),
+			(unsigned long long)nr_dirs,
+			(unsigned long long)nr_names, namelen);
+	printf(_("add:    %8.3fs  %6.1f ns/name\n"), add_ns / 1e9,
+			(double)add_ns / (nr_dirs * nr_names));
+	printf(_("lookup: %8.3fs  %6.1f ns/name\n"), see_ns / 1e9,
+			(double)see_ns / (nr_dirs * nr_names));
+	printf(_("reset:  %8.3fs  %6.1f ns/dir\n"), reset_ns / 1e9,
+			(double)reset_ns / nr_dirs);
+	printf(_("maxrss: %ld KiB\n"), ru.ru_maxrss);
+	return 0;
+}
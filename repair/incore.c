@@ -24,7 +24,43 @@
 static int states[16] =
 	{0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15};
 
-static struct btree_root	**ag_bmap;
+/*
+ * Each AG's map is split into fixed size block ranges ("groups"), each with
+ * its own btree and lock, so that threads claiming blocks in different parts
+ * of a busy AG don't serialise on a single per-AG lock.  Every group btree
+ * starts with a record at the first block of the group and, except for the
+ * last group, ends with a sentinel record at the first block of the next
+ * group.  The sentinel never compares equal to a real state, so extents are
+ * never merged across group boundaries and lookups never run off the end of
+ * a group.
+ */
+#define BMAP_GROUP_MIN_SHIFT	16	/* at least 64k blocks per group */
+#define BMAP_GROUPS_MAX_SHIFT	6	/* at most 64 groups per AG */
+
+struct bmap_group {
+	pthread_mutex_t		lock __attribute__((__aligned__(64)));
+	struct btree_root	*root;
+};
+
+static struct bmap_group	**ag_bmap;
+static unsigned int		bmap_group_shift;
+static unsigned int		bmap_nr_groups;
+static int			bmap_sentinel = XR_E_BAD_STATE;
+
+static inline unsigned int
+bmap_group_index(
+	xfs_agblock_t		agbno)
+{
+	return min(agbno >> bmap_group_shift, bmap_nr_groups - 1);
+}
+
+static inline struct btree_root *
+bmap_root(
+	xfs_agnumber_t		agno,
+	xfs_agblock_t		agbno)
+{
+	return ag_bmap[agno][bmap_group_index(agbno)].root;
+}
 
 static void
 update_bmap(
@@ -129,7 +165,20 @@ set_bmap_ext(
 	xfs_extlen_t		blen,
 	int			state)
 {
-	update_bmap(ag_bmap[agno], agbno, blen, &states[state]);
+	/* split the update at group boundaries */
+	while (blen > 0) {
+		xfs_agblock_t	gend;
+		xfs_extlen_t	len = blen;
+
+		if (bmap_group_index(agbno) < bmap_nr_groups - 1) {
+			gend = (bmap_group_index(agbno) + 1) << bmap_group_shift;
+			len = min(blen, gend - agbno);
+		}
+		update_bmap(bmap_root(agno, agbno), agbno, len,
+				&states[state]);
+		agbno += len;
+		blen -= len;
+	}
 }
 
 int
@@ -139,23 +188,24 @@ get_bmap_ext(
 	xfs_agblock_t		maxbno,
 	xfs_extlen_t		*blen)
 {
+	struct btree_root	*bmap = bmap_root(agno, agbno);
 	int			*statep;
 	unsigned long		key;
 
-	statep = btree_find(ag_bmap[agno], agbno, &key);
+	statep = btree_find(bmap, agbno, &key);
 	if (!statep)
 		return -1;
 
 	if (key == agbno) {
 		if (blen) {
-			if (!btree_peek_next(ag_bmap[agno], &key))
+			if (!btree_peek_next(bmap, &key))
 				return -1;
 			*blen = min(maxbno, key) - agbno;
 		}
 		return *statep;
 	}
 
-	statep = btree_peek_prev(ag_bmap[agno], NULL);
+	statep = btree_peek_prev(bmap, NULL);
 	if (!statep)
 		return -1;
 	if (blen)
@@ -164,6 +214,39 @@ get_bmap_ext(
 	return *statep;
 }
 
+/*
+ * Lock the part of the block map covering @blen blocks at @agbno.  Groups are
+ * always locked in ascending order, so callers must not hold more than one
+ * range at a time.
+ */
+void
+lock_bmap_ext(
+	xfs_agnumber_t		agno,
+	xfs_agblock_t		agbno,
+	xfs_extlen_t		blen)
+{
+	unsigned int		first = bmap_group_index(agbno);
+	unsigned int		last = bmap_group_index(agbno + max(blen, 1U) - 1);
+	unsigned int		i;
+
+	for (i = first; i <= last; i++)
+		pthread_mutex_lock(&ag_bmap[agno][i].lock);
+}
+
+void
+unlock_bmap_ext(
+	xfs_agnumber_t		agno,
+	xfs_agblock_t		agbno,
+	xfs_extlen_t		blen)
+{
+	unsigned int		first = bmap_group_index(agbno);
+	unsigned int		last = bmap_group_index(agbno + max(blen, 1U) - 1);
+	unsigned int		i;
+
+	for (i = last + 1; i > first; i--)
+		pthread_mutex_unlock(&ag_bmap[agno][i - 1].lock);
+}
+
 static uint64_t		*rt_bmap;
 static size_t		rt_bmap_size;
 
@@ -229,12 +312,51 @@ free_rt_bmap(xfs_mount_t *mp)
 }
 
 
+/*
+ * We always insert an item for the first block having a given state.  So the
+ * layout of each AG is:
+ *
+ *	block 0..ag_hdr_block-1:	XR_E_INUSE_FS
+ *	ag_hdr_block..ag_size:		XR_E_UNKNOWN
+ *	ag_size...			XR_E_BAD_STATE
+ *
+ * and each group gets the part of that layout that falls within it.
+ */
+static void
+reset_bmap_group(
+	struct btree_root	*bmap,
+	xfs_agblock_t		gstart,
+	xfs_agblock_t		gend,
+	xfs_agblock_t		ag_hdr_block,
+	xfs_agblock_t		ag_size,
+	bool			last)
+{
+	int			state;
+
+	if (gstart < ag_hdr_block)
+		state = XR_E_INUSE_FS;
+	else if (gstart < ag_size)
+		state = XR_E_UNKNOWN;
+	else
+		state = XR_E_BAD_STATE;
+
+	btree_clear(bmap);
+	btree_insert(bmap, gstart, &states[state]);
+	if (ag_hdr_block > gstart && ag_hdr_block < gend)
+		btree_insert(bmap, ag_hdr_block, &states[XR_E_UNKNOWN]);
+	if (ag_size > gstart && (ag_size < gend || last))
+		btree_insert(bmap, ag_size, &states[XR_E_BAD_STATE]);
+	if (!last)
+		btree_insert(bmap, gend, &bmap_sentinel);
+}
+
 void
 reset_bmaps(xfs_mount_t *mp)
 {
 	xfs_agnumber_t	agno;
 	xfs_agblock_t	ag_size;
 	int		ag_hdr_block;
+	unsigned int	i;
 
 	ag_hdr_block = howmany(4 * mp->m_sb.sb_sectsize, mp->m_sb.sb_blocksize);
 	ag_size = mp->m_sb.sb_agblocks;
@@ -243,25 +365,21 @@ reset_bmaps(xfs_mount_t *mp)
 		if (agno == mp->m_sb.sb_agcount - 1)
 			ag_size = (xfs_extlen_t)(mp->m_sb.sb_dblocks -
 				   (xfs_rfsblock_t)mp->m_sb.sb_agblocks * agno);
+		for (i = 0; i < bmap_nr_groups; i++) {
+			bool	last = i == bmap_nr_groups - 1;
+
 #ifdef BTREE_STATS
-		if (btree_find(ag_bmap[agno], 0, NULL)) {
-			printf("ag_bmap[%d] btree stats:\n", i);
-			btree_print_stats(ag_bmap[agno], stdout);
-		}
+			if (btree_find(ag_bmap[agno][i].root, 0, NULL)) {
+				printf("ag_bmap[%d][%u] btree stats:\n", agno, i);
+				btree_print_stats(ag_bmap[agno][i].root, stdout);
+			}
 #endif
-		/*
-		 * We always insert an item for the first block having a
-		 * given state.  So the code below means:
-		 *
-		 *	block 0..ag_hdr_block-1:	XR_E_INUSE_FS
-		 *	ag_hdr_block..ag_size:		XR_E_UNKNOWN
-		 *	ag_size...			XR_E_BAD_STATE
-		 */
-		btree_clear(ag_bmap[agno]);
-		btree_insert(ag_bmap[agno], 0, &states[XR_E_INUSE_FS]);
-		btree_insert(ag_bmap[agno],
-				ag_hdr_block, &states[XR_E_UNKNOWN]);
-		btree_insert(ag_bmap[agno], ag_size, &states[XR_E_BAD_STATE]);
+			reset_bmap_group(ag_bmap[agno][i].root,
+					i << bmap_group_shift,
+					last ? mp->m_sb.sb_agblocks :
+					       (i + 1) << bmap_group_shift,
+					ag_hdr_block, ag_size, last);
+		}
 	}
 
 	if (mp->m_sb.sb_logstart != 0) {
@@ -277,8 +395,16 @@ void
 init_bmaps(xfs_mount_t *mp)
 {
 	xfs_agnumber_t i;
+	unsigned int	j;
+	int		shift;
+
+	/* split each AG into at most 64 groups of at least 64k blocks */
+	shift = libxfs_highbit32(mp->m_sb.sb_agblocks - 1) + 1 -
+			BMAP_GROUPS_MAX_SHIFT;
+	bmap_group_shift = max(shift, BMAP_GROUP_MIN_SHIFT);
+	bmap_nr_groups = howmany(mp->m_sb.sb_agblocks, 1U << bmap_group_shift);
 
-	ag_bmap = calloc(mp->m_sb.sb_agcount, sizeof(struct btree_root *));
+	ag_bmap = calloc(mp->m_sb.sb_agcount, sizeof(struct bmap_group *));
 	if (!ag_bmap)
 		do_error(_("couldn't allocate block map btree roots\n"));
 
@@ -287,7 +413,14 @@ init_bmaps(xfs_mount_t *mp)
 		do_error(_("couldn't allocate block map locks\n"));
 
 	for (i = 0; i < mp->m_sb.sb_agcount; i++)  {
-		btree_init(&ag_bmap[i]);
+		ag_bmap[i] = memalign(__alignof__(struct bmap_group),
+				bmap_nr_groups * sizeof(struct bmap_group));
+		if (!ag_bmap[i])
+			do_error(_("couldn't allocate block map btree roots\n"));
+		for (j = 0; j < bmap_nr_groups; j++) {
+			btree_init(&ag_bmap[i][j].root);
+			pthread_mutex_init(&ag_bmap[i][j].lock, NULL);
+		}
 		pthread_mutex_init(&ag_locks[i].lock, NULL);
 	}
 	pthread_mutex_init(&rt_lock.lock, NULL);
@@ -300,9 +433,15 @@ void
 free_bmaps(xfs_mount_t *mp)
 {
 	xfs_agnumber_t i;
+	unsigned int	j;
 
-	for (i = 0; i < mp->m_sb.sb_agcount; i++)
-		btree_destroy(ag_bmap[i]);
+	for (i = 0; i < mp->m_sb.sb_agcount; i++) {
+		for (j = 0; j < bmap_nr_groups; j++) {
+			btree_destroy(ag_bmap[i][j].root);
+			pthread_mutex_destroy(&ag_bmap[i][j].lock);
+		}
+		free(ag_bmap[i]);
+	}
 	free(ag_bmap);
 	ag_bmap = NULL;
 
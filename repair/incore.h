@@ -27,6 +27,10 @@ void		set_bmap_ext(xfs_agnumber_t agno, xfs_agblock_t agbno,
 			     xfs_extlen_t blen, int state);
 int		get_bmap_ext(xfs_agnumber_t agno, xfs_agblock_t agbno,
 			     xfs_agblock_t maxbno, xfs_extlen_t *blen);
+void		lock_bmap_ext(xfs_agnumber_t agno, xfs_agblock_t agbno,
+			      xfs_extlen_t blen);
+void		unlock_bmap_ext(xfs_agnumber_t agno, xfs_agblock_t agbno,
+			       xfs_extlen_t blen);
 
 void		set_rtbmap(xfs_rtblock_t bno, int state);
 int		get_rtbmap(xfs_rtblock_t bno);
@@ -45,28 +49,21 @@ get_bmap(xfs_agnumber_t agno, xfs_agblock_t agbno)
 
 /*
  * extent tree definitions
- * right now, there are 3 trees per AG, a bno tree, a bcnt tree
- * and a tree for dup extents.  If the code is modified in the
- * future to use an extent tree instead of a bitmask for tracking
- * fs blocks, then we could lose the dup extent tree if we labelled
- * each extent with the inode that owned it.
+ * right now, there is a tree for dup extents per AG, and phase 5
+ * builds an index of free extents in bno and bcnt order.  If the
+ * code is modified in the future to use an extent tree instead of
+ * a bitmask for tracking fs blocks, then we could lose the dup
+ * extent tree if we labelled each extent with the inode that owned
+ * it.
  */
 
 typedef unsigned char extent_state_t;
 
-typedef struct extent_tree_node  {
-	avlnode_t		avl_node;
+/* a free space extent, see the free extent index in incore_ext.c */
+struct free_extent {
 	xfs_agblock_t		ex_startblock;	/* starting block (agbno) */
 	xfs_extlen_t		ex_blockcount;	/* number of blocks in extent */
-	extent_state_t		ex_state;	/* see state flags below */
-
-	struct extent_tree_node		*next;	/* for bcnt extent lists */
-	struct extent_tree_node		*last;	/* for bcnt extent list anchors */
-#if 0
-	xfs_ino_t		ex_inode;	/* owner, NULL if free or  */
-						/*	multiply allocated */
-#endif
-} extent_tree_node_t;
+};
 
 typedef struct rt_extent_tree_node  {
 	avlnode_t		avl_node;
@@ -105,49 +102,23 @@ typedef struct rt_extent_tree_node  {
 #define set_written(state)	(state) &= XR_E_WRITTEN
 
 /*
- * bno extent tree functions
+ * free extent index functions
  */
-void
-add_bno_extent(xfs_agnumber_t agno, xfs_agblock_t startblock,
-		xfs_extlen_t blockcount);
-
-extent_tree_node_t *
-findfirst_bno_extent(xfs_agnumber_t agno);
-
-extent_tree_node_t *
-find_bno_extent(xfs_agnumber_t agno, xfs_agblock_t agbno);
-
-extent_tree_node_t *
-findfirst_bno_extent(xfs_agnumber_t agno);
-
-#define findnext_bno_extent(exent_ptr)	\
-		((extent_tree_node_t *) ((exent_ptr)->avl_node.avl_nextino))
-
-void
-get_bno_extent(xfs_agnumber_t agno, extent_tree_node_t *ext);
-
-/*
- * bcnt tree functions
- */
-void
-add_bcnt_extent(xfs_agnumber_t agno, xfs_agblock_t startblock,
-		xfs_extlen_t blockcount);
-
-extent_tree_node_t *
-findfirst_bcnt_extent(xfs_agnumber_t agno);
-
-extent_tree_node_t *
-find_bcnt_extent(xfs_agnumber_t agno, xfs_agblock_t agbno);
-
-extent_tree_node_t *
-findbiggest_bcnt_extent(xfs_agnumber_t agno);
-
-extent_tree_node_t *
-findnext_bcnt_extent(xfs_agnumber_t agno, extent_tree_node_t *ext);
+void		add_free_extent(xfs_agnumber_t agno, xfs_agblock_t startblock,
+			xfs_extlen_t blockcount);
+void		index_free_extents(xfs_agnumber_t agno);
+void		release_free_extents(xfs_agnumber_t agno);
 
-extent_tree_node_t *
-get_bcnt_extent(xfs_agnumber_t agno, xfs_agblock_t startblock,
-		xfs_extlen_t blockcount);
+struct free_extent *findfirst_bno_extent(xfs_agnumber_t agno,
+			unsigned int *cursor);
+struct free_extent *findnext_bno_extent(xfs_agnumber_t agno,
+			unsigned int *cursor);
+struct free_extent *findfirst_bcnt_extent(xfs_agnumber_t agno,
+			unsigned int *cursor);
+struct free_extent *findnext_bcnt_extent(xfs_agnumber_t agno,
+			unsigned int *cursor);
+struct free_extent *findbiggest_bcnt_extent(xfs_agnumber_t agno);
+void		trim_first_bcnt_extent(xfs_agnumber_t agno, xfs_extlen_t len);
 
 /*
  * duplicate extent tree functions
@@ -167,17 +138,10 @@ int		search_rt_dup_extent(xfs_mount_t	*mp,
  * extent/tree recyling and deletion routines
  */
 
-/*
- * return an extent node to the extent node free list
- */
-void		release_extent_tree_node(extent_tree_node_t *node);
-
 /*
  * recycle all the nodes in the per-AG tree
  */
 void		release_dup_extent_tree(xfs_agnumber_t agno);
-void		release_agbno_extent_tree(xfs_agnumber_t agno);
-void		release_agbcnt_extent_tree(xfs_agnumber_t agno);
 
 /*
  * realtime duplicate extent tree - this one actually frees the memory
@@ -24,12 +24,13 @@
  * as the inode tree code for convenience.  The bitmaps
  * and bitmap operators are mostly macros defined in incore.h.
  * There are one of everything per AG except for extent
- * trees.  There's one duplicate extent tree, one bno and
- * one bcnt extent tree per AG.  Not all of the above exist
- * through all phases.  The duplicate extent tree gets trashed
- * at the end of phase 4.  The bno/bcnt trees don't appear until
- * phase 5.  The uncertain inode list goes away at the end of
- * phase 3.  The inode tree and bno/bnct trees go away after phase 5.
+ * trees.  There's one duplicate extent tree and one free
+ * extent index (by bno and by bcnt) per AG.  Not all of the
+ * above exist through all phases.  The duplicate extent tree
+ * gets trashed at the end of phase 4.  The free extent index
+ * doesn't appear until phase 5.  The uncertain inode list goes
+ * away at the end of phase 3.  The inode tree and free extent
+ * index go away after phase 5.
  */
 
 static avl64tree_desc_t	*rt_ext_tree_ptr;	/* dup extent tree for rt */
@@ -38,18 +39,6 @@ static pthread_mutex_t	rt_ext_tree_lock;
 static struct btree_root **dup_extent_trees;	/* per ag dup extent trees */
 static pthread_mutex_t *dup_extent_tree_locks;
 
-static avltree_desc_t	**extent_bno_ptrs;	/*
-						 * array of extent tree ptrs
-						 * one per ag for free extents
-						 * sorted by starting block
-						 * number
-						 */
-static avltree_desc_t	**extent_bcnt_ptrs;	/*
-						 * array of extent tree ptrs
-						 * one per ag for free extents
-						 * sorted by size
-						 */
-
 /*
  * duplicate extent tree functions
  */
@@ -108,425 +97,225 @@ out:
 
 
 /*
- * extent tree stuff is avl trees of duplicate extents,
- * sorted in order by block number.  there is one tree per ag.
+ * Free space extents for phase 5.  Each AG gets a pair of packed arrays that
+ * are built once from the block map: one sorted by block number and one
+ * sorted by size (and then by block number), which are the orders the bnobt
+ * and cntbt are rebuilt in.
+ *
+ * The only change made to the extents after they have been indexed is to
+ * allocate blocks for the new btrees from the front of the smallest extent.
+ * What's left of that extent is smaller still, so it stays at the front of
+ * the size index and keeps its place in the block number index, and neither
+ * array ever has to be reordered.  Used up extents are left in the block
+ * number index with a zero length and skipped over.
  */
+struct free_extent_index {
+	struct free_extent	*bno;		/* sorted by block number */
+	struct free_extent	*bcnt;		/* sorted by size */
+	unsigned int		nr;		/* records in bno */
+	unsigned int		max;		/* records allocated in bno */
+	unsigned int		bcnt_first;	/* first live record in bcnt */
+	unsigned int		nr_live;	/* extents still free */
+	uint64_t		nr_blocks;	/* blocks still free */
+};
 
-static extent_tree_node_t *
-mk_extent_tree_nodes(xfs_agblock_t new_startblock,
-	xfs_extlen_t new_blockcount, extent_state_t new_state)
-{
-	extent_tree_node_t *new;
-
-	new = malloc(sizeof(*new));
-	if (!new)
-		do_error(_("couldn't allocate new extent descriptor.\n"));
-
-	new->avl_node.avl_nextino = NULL;
-	new->ex_startblock = new_startblock;
-	new->ex_blockcount = new_blockcount;
-	new->ex_state = new_state;
-	new->next = NULL;
-	new->last = NULL;
-
-	return new;
-}
-
-void
-release_extent_tree_node(extent_tree_node_t *node)
-{
-	free(node);
-}
+static struct free_extent_index	*free_extents;	/* one per AG */
 
 /*
- * routines to recycle all nodes in a tree.  it walks the tree
- * and puts all nodes back on the free list so the nodes can be
- * reused.  the duplicate and bno/bcnt extent trees for each AG
- * are recycled after they're no longer needed to save memory
+ * Add a free extent to an AG.  Extents must be added in increasing block
+ * number order, and index_free_extents() must be called before the size
+ * order can be walked.
  */
-static void
-release_extent_tree(avltree_desc_t *tree)
+void
+add_free_extent(
+	xfs_agnumber_t		agno,
+	xfs_agblock_t		startblock,
+	xfs_extlen_t		blockcount)
 {
-	extent_tree_node_t	*ext;
-	extent_tree_node_t	*tmp;
-	extent_tree_node_t	*lext;
-	extent_tree_node_t	*ltmp;
-
-	if (tree->avl_firstino == NULL)
-		return;
+	struct free_extent_index *fx = &free_extents[agno];
 
-	ext = (extent_tree_node_t *) tree->avl_firstino;
+	ASSERT(fx->bcnt == NULL);
+	ASSERT(fx->nr == 0 || startblock >= fx->bno[fx->nr - 1].ex_startblock +
+					fx->bno[fx->nr - 1].ex_blockcount);
 
-	while (ext != NULL)  {
-		tmp = (extent_tree_node_t *) ext->avl_node.avl_nextino;
+	if (fx->nr == fx->max) {
+		struct free_extent	*bno;
+		unsigned int		max = max(fx->max * 2, 64U);
 
-		/*
-		 * ext->next is guaranteed to be set only in bcnt trees
-		 */
-		if (ext->next != NULL)  {
-			lext = ext->next;
-			while (lext != NULL)  {
-				ltmp = lext->next;
-				release_extent_tree_node(lext);
-				lext = ltmp;
-			}
-		}
-
-		release_extent_tree_node(ext);
-		ext = tmp;
+		bno = realloc(fx->bno, max * sizeof(struct free_extent));
+		if (!bno)
+			do_error(_("couldn't allocate free extent index\n"));
+		fx->bno = bno;
+		fx->max = max;
 	}
 
-	tree->avl_root = tree->avl_firstino = NULL;
-
-	return;
+	fx->bno[fx->nr].ex_startblock = startblock;
+	fx->bno[fx->nr].ex_blockcount = blockcount;
+	fx->nr++;
+	fx->nr_live++;
+	fx->nr_blocks += blockcount;
 }
 
-/*
- * top-level (visible) routines
- */
-void
-release_agbno_extent_tree(xfs_agnumber_t agno)
+static int
+free_extent_bcnt_cmp(
+	const void		*a,
+	const void		*b)
 {
-	release_extent_tree(extent_bno_ptrs[agno]);
+	const struct free_extent *ea = a;
+	const struct free_extent *eb = b;
 
-	return;
+	if (ea->ex_blockcount != eb->ex_blockcount)
+		return ea->ex_blockcount < eb->ex_blockcount ? -1 : 1;
+	if (ea->ex_startblock != eb->ex_startblock)
+		return ea->ex_startblock < eb->ex_startblock ? -1 : 1;
+	return 0;
 }
 
+/* Build the size index once all the free extents have been added. */
 void
-release_agbcnt_extent_tree(xfs_agnumber_t agno)
+index_free_extents(
+	xfs_agnumber_t		agno)
 {
-	release_extent_tree(extent_bcnt_ptrs[agno]);
+	struct free_extent_index *fx = &free_extents[agno];
 
-	return;
+	ASSERT(fx->bcnt == NULL);
+
+	fx->bcnt = malloc(max(fx->nr, 1U) * sizeof(struct free_extent));
+	if (!fx->bcnt)
+		do_error(_("couldn't allocate free extent index\n"));
+	memcpy(fx->bcnt, fx->bno, fx->nr * sizeof(struct free_extent));
+	qsort(fx->bcnt, fx->nr, sizeof(struct free_extent),
+			free_extent_bcnt_cmp);
+	fx->bcnt_first = 0;
 }
 
 /*
- * the next 4 routines manage the trees of free extents -- 2 trees
- * per AG.  The first tree is sorted by block number.  The second
- * tree is sorted by extent size.  This is the bno tree.
+ * Walk the free extents in block number order.  Start the walk with
+ * findfirst_bno_extent() and pass the same cursor to findnext_bno_extent().
  */
-void
-add_bno_extent(xfs_agnumber_t agno, xfs_agblock_t startblock,
-		xfs_extlen_t blockcount)
+struct free_extent *
+findnext_bno_extent(
+	xfs_agnumber_t		agno,
+	unsigned int		*cursor)
 {
-	extent_tree_node_t *ext;
-
-	ASSERT(extent_bno_ptrs != NULL);
-	ASSERT(extent_bno_ptrs[agno] != NULL);
+	struct free_extent_index *fx = &free_extents[agno];
 
-	ext = mk_extent_tree_nodes(startblock, blockcount, XR_E_FREE);
+	while (*cursor < fx->nr) {
+		struct free_extent *ext = &fx->bno[(*cursor)++];
 
-	if (avl_insert(extent_bno_ptrs[agno], (avlnode_t *) ext) == NULL)  {
-		do_error(_("duplicate bno extent range\n"));
+		if (ext->ex_blockcount)
+			return ext;
 	}
+	return NULL;
 }
 
-extent_tree_node_t *
-findfirst_bno_extent(xfs_agnumber_t agno)
-{
-	ASSERT(extent_bno_ptrs != NULL);
-	ASSERT(extent_bno_ptrs[agno] != NULL);
-
-	return((extent_tree_node_t *) extent_bno_ptrs[agno]->avl_firstino);
-}
-
-extent_tree_node_t *
-find_bno_extent(xfs_agnumber_t agno, xfs_agblock_t startblock)
+struct free_extent *
+findfirst_bno_extent(
+	xfs_agnumber_t		agno,
+	unsigned int		*cursor)
 {
-	ASSERT(extent_bno_ptrs != NULL);
-	ASSERT(extent_bno_ptrs[agno] != NULL);
-
-	return((extent_tree_node_t *) avl_find(extent_bno_ptrs[agno],
-						startblock));
+	*cursor = 0;
+	return findnext_bno_extent(agno, cursor);
 }
 
-/*
- * delete a node that's in the tree (pointer obtained by a find routine)
- */
-void
-get_bno_extent(xfs_agnumber_t agno, extent_tree_node_t *ext)
+/* Walk the free extents from smallest to largest. */
+struct free_extent *
+findnext_bcnt_extent(
+	xfs_agnumber_t		agno,
+	unsigned int		*cursor)
 {
-	ASSERT(extent_bno_ptrs != NULL);
-	ASSERT(extent_bno_ptrs[agno] != NULL);
+	struct free_extent_index *fx = &free_extents[agno];
 
-	avl_delete(extent_bno_ptrs[agno], &ext->avl_node);
+	ASSERT(fx->bcnt != NULL);
 
-	return;
+	if (*cursor >= fx->nr)
+		return NULL;
+	return &fx->bcnt[(*cursor)++];
 }
 
-/*
- * the next 4 routines manage the trees of free extents -- 2 trees
- * per AG.  The first tree is sorted by block number.  The second
- * tree is sorted by extent size.  This is the bcnt tree.
- */
-void
-add_bcnt_extent(xfs_agnumber_t agno, xfs_agblock_t startblock,
-		xfs_extlen_t blockcount)
+/* Returns the smallest free extent; @cursor may be NULL. */
+struct free_extent *
+findfirst_bcnt_extent(
+	xfs_agnumber_t		agno,
+	unsigned int		*cursor)
 {
-	extent_tree_node_t *ext, *prev, *current, *top;
-	xfs_agblock_t		tmp_startblock;
-	xfs_extlen_t		tmp_blockcount;
-	extent_state_t		tmp_state;
-
-	ASSERT(extent_bcnt_ptrs != NULL);
-	ASSERT(extent_bcnt_ptrs[agno] != NULL);
-
-	ext = mk_extent_tree_nodes(startblock, blockcount, XR_E_FREE);
-
-	ASSERT(ext->next == NULL);
-
-#ifdef XR_BCNT_TRACE
-	fprintf(stderr, "adding bcnt: agno = %d, start = %u, count = %u\n",
-			agno, startblock, blockcount);
-#endif
-	if ((current = (extent_tree_node_t *) avl_find(extent_bcnt_ptrs[agno],
-							blockcount)) != NULL)  {
-		/*
-		 * avl tree code doesn't handle dups so insert
-		 * onto linked list in increasing startblock order
-		 *
-		 * when called from mk_incore_fstree,
-		 * startblock is in increasing order.
-		 * current is an "anchor" node.
-		 * quick check if the new ext goes to the end.
-		 * if so, append at the end, using the last field
-		 * of the "anchor".
-		 */
-		ASSERT(current->last != NULL);
-		if (startblock > current->last->ex_startblock) {
-			current->last->next = ext;
-			current->last = ext;
-			return;
-		}
-
-		/*
-		 * scan, to find the proper location for new entry.
-		 * this scan is *very* expensive and gets worse with
-		 * with increasing entries.
-		 */
-		top = prev = current;
-		while (current != NULL &&
-				startblock > current->ex_startblock)  {
-			prev = current;
-			current = current->next;
-		}
-
-		if (top == current)  {
-			ASSERT(top == prev);
-			/*
-			 * new entry should be ahead of current.
-			 * to keep the avl tree intact,
-			 * swap the values of to-be-inserted element
-			 * and the values of the head of the list.
-			 * then insert as the 2nd element on the list.
-			 *
-			 * see the comment in get_bcnt_extent()
-			 * as to why we have to do this.
-			 */
-			tmp_startblock = top->ex_startblock;
-			tmp_blockcount = top->ex_blockcount;
-			tmp_state = top->ex_state;
-
-			top->ex_startblock = ext->ex_startblock;
-			top->ex_blockcount = ext->ex_blockcount;
-			top->ex_state = ext->ex_state;
-
-			ext->ex_startblock = tmp_startblock;
-			ext->ex_blockcount = tmp_blockcount;
-			ext->ex_state = tmp_state;
-
-			current = top->next;
-			prev = top;
-		}
+	struct free_extent_index *fx = &free_extents[agno];
+	unsigned int		pos = fx->bcnt_first;
 
-		prev->next = ext;
-		ext->next = current;
-
-		return;
-	}
-
-	if (avl_insert(extent_bcnt_ptrs[agno], (avlnode_t *) ext) == NULL)  {
-		do_error(_(":  duplicate bno extent range\n"));
-	}
-
-	ext->last = ext;	/* ext is an "anchor" node */
-
-	return;
+	if (!cursor)
+		cursor = &pos;
+	*cursor = fx->bcnt_first;
+	return findnext_bcnt_extent(agno, cursor);
 }
 
-extent_tree_node_t *
-findfirst_bcnt_extent(xfs_agnumber_t agno)
+struct free_extent *
+findbiggest_bcnt_extent(
+	xfs_agnumber_t		agno)
 {
-	ASSERT(extent_bcnt_ptrs != NULL);
-	ASSERT(extent_bcnt_ptrs[agno] != NULL);
+	struct free_extent_index *fx = &free_extents[agno];
 
-	return((extent_tree_node_t *) extent_bcnt_ptrs[agno]->avl_firstino);
-}
+	ASSERT(fx->bcnt != NULL);
 
-extent_tree_node_t *
-findbiggest_bcnt_extent(xfs_agnumber_t agno)
-{
-	ASSERT(extent_bcnt_ptrs != NULL);
-	ASSERT(extent_bcnt_ptrs[agno] != NULL);
-
-	return((extent_tree_node_t *) avl_lastino(extent_bcnt_ptrs[agno]->avl_root));
+	if (fx->bcnt_first >= fx->nr)
+		return NULL;
+	return &fx->bcnt[fx->nr - 1];
 }
 
-extent_tree_node_t *
-findnext_bcnt_extent(xfs_agnumber_t agno, extent_tree_node_t *ext)
+static int
+free_extent_bno_cmp(
+	const void		*key,
+	const void		*b)
 {
-	avlnode_t *nextino;
+	xfs_agblock_t		agbno = *(const xfs_agblock_t *)key;
+	const struct free_extent *eb = b;
 
-	if (ext->next != NULL)  {
-		ASSERT(ext->ex_blockcount == ext->next->ex_blockcount);
-		ASSERT(ext->ex_startblock < ext->next->ex_startblock);
-		return(ext->next);
-	} else  {
-		/*
-		 * have to look at the top of the list to get the
-		 * correct avl_nextino pointer since that pointer
-		 * is maintained and altered by the AVL code.
-		 */
-		nextino = avl_find(extent_bcnt_ptrs[agno], ext->ex_blockcount);
-		ASSERT(nextino != NULL);
-		if (nextino->avl_nextino != NULL)  {
-			ASSERT(ext->ex_blockcount < ((extent_tree_node_t *)
-					nextino->avl_nextino)->ex_blockcount);
-		}
-		return((extent_tree_node_t *) nextino->avl_nextino);
-	}
+	if (agbno != eb->ex_startblock)
+		return agbno < eb->ex_startblock ? -1 : 1;
+	return 0;
 }
 
-/*
- * this is meant to be called after you walk the bno tree to
- * determine exactly which extent you want (so you'll know the
- * desired value for startblock when you call this routine).
- */
-extent_tree_node_t *
-get_bcnt_extent(xfs_agnumber_t agno, xfs_agblock_t startblock,
-		xfs_extlen_t blockcount)
+/* Take @len blocks from the start of the smallest free extent. */
+void
+trim_first_bcnt_extent(
+	xfs_agnumber_t		agno,
+	xfs_extlen_t		len)
 {
-	extent_tree_node_t	*ext, *prev, *top;
-	xfs_agblock_t		tmp_startblock;
-	xfs_extlen_t		tmp_blockcount;
-	extent_state_t		tmp_state;
+	struct free_extent_index *fx = &free_extents[agno];
+	struct free_extent	*ext;
+	struct free_extent	*bno_ext;
 
-	prev = NULL;
-	ASSERT(extent_bcnt_ptrs != NULL);
-	ASSERT(extent_bcnt_ptrs[agno] != NULL);
+	ASSERT(fx->bcnt != NULL);
+	ASSERT(fx->bcnt_first < fx->nr);
 
-	if ((ext = (extent_tree_node_t *) avl_find(extent_bcnt_ptrs[agno],
-							blockcount)) == NULL)
-		return(NULL);
+	ext = &fx->bcnt[fx->bcnt_first];
+	ASSERT(len > 0 && len <= ext->ex_blockcount);
 
-	top = ext;
+	bno_ext = bsearch(&ext->ex_startblock, fx->bno, fx->nr,
+			sizeof(struct free_extent), free_extent_bno_cmp);
+	ASSERT(bno_ext != NULL);
 
-	if (ext->next != NULL)  {
-		/*
-		 * pull it off the list
-		 */
-		while (ext != NULL && startblock != ext->ex_startblock)  {
-			prev = ext;
-			ext = ext->next;
-		}
-		ASSERT(ext != NULL);
-		if (ext == top)  {
-			/*
-			 * this node is linked into the tree so we
-			 * swap the core values so we can delete
-			 * the next item on the list instead of
-			 * the head of the list.  This is because
-			 * the rest of the tree undoubtedly has
-			 * pointers to the piece of memory that
-			 * is the head of the list so pulling
-			 * the item out of the list and hence
-			 * the avl tree would be a bad idea.
-			 *
-			 * (cheaper than the alternative, a tree
-			 * delete of this node followed by a tree
-			 * insert of the next node on the list).
-			 */
-			tmp_startblock = ext->next->ex_startblock;
-			tmp_blockcount = ext->next->ex_blockcount;
-			tmp_state = ext->next->ex_state;
-
-			ext->next->ex_startblock = ext->ex_startblock;
-			ext->next->ex_blockcount = ext->ex_blockcount;
-			ext->next->ex_state = ext->ex_state;
-
-			ext->ex_startblock = tmp_startblock;
-			ext->ex_blockcount = tmp_blockcount;
-			ext->ex_state = tmp_state;
-
-			ext = ext->next;
-			prev = top;
-		}
-		/*
-		 * now, a simple list deletion
-		 */
-		prev->next = ext->next;
-		ext->next = NULL;
-	} else  {
-		/*
-		 * no list, just one node.  simply delete
-		 */
-		avl_delete(extent_bcnt_ptrs[agno], &ext->avl_node);
+	ext->ex_startblock += len;
+	ext->ex_blockcount -= len;
+	*bno_ext = *ext;
+	if (ext->ex_blockcount == 0) {
+		fx->bcnt_first++;
+		fx->nr_live--;
 	}
-
-	ASSERT(ext->ex_startblock == startblock);
-	ASSERT(ext->ex_blockcount == blockcount);
-	return(ext);
+	fx->nr_blocks -= len;
 }
 
-static uintptr_t
-avl_ext_start(avlnode_t *node)
-{
-	return((uintptr_t)
-		((extent_tree_node_t *) node)->ex_startblock);
-}
-
-static uintptr_t
-avl_ext_end(avlnode_t *node)
-{
-	return((uintptr_t) (
-		((extent_tree_node_t *) node)->ex_startblock +
-		((extent_tree_node_t *) node)->ex_blockcount));
-}
-
-/*
- * convert size to an address for the AVL tree code -- the bigger the size,
- * the lower the address so the biggest extent will be first in the tree
- */
-static uintptr_t
-avl_ext_bcnt_start(avlnode_t *node)
+/* Free the free space index for an AG once its btrees have been rebuilt. */
+void
+release_free_extents(
+	xfs_agnumber_t		agno)
 {
-/*
-	return((uintptr_t) (BCNT_ADDR(((extent_tree_node_t *)
-						node)->ex_blockcount)));
-*/
-	return((uintptr_t) ((extent_tree_node_t *)node)->ex_blockcount);
-}
+	struct free_extent_index *fx = &free_extents[agno];
 
-static uintptr_t
-avl_ext_bcnt_end(avlnode_t *node)
-{
-/*
-	return((uintptr_t) (BCNT_ADDR(((extent_tree_node_t *)
-						node)->ex_blockcount)));
-*/
-	return((uintptr_t) ((extent_tree_node_t *)node)->ex_blockcount);
+	free(fx->bno);
+	free(fx->bcnt);
+	memset(fx, 0, sizeof(struct free_extent_index));
 }
 
-static avlops_t avl_extent_bcnt_tree_ops = {
-	avl_ext_bcnt_start,
-	avl_ext_bcnt_end
-};
-
-static avlops_t avl_extent_tree_ops = {
-	avl_ext_start,
-	avl_ext_end
-};
-
 /*
  * for real-time extents -- have to dup code since realtime extent
  * startblocks can be 64-bit values.
@@ -735,32 +524,13 @@ incore_ext_init(xfs_mount_t *mp)
 	if (!dup_extent_tree_locks)
 		do_error(_("couldn't malloc dup extent tree descriptor table\n"));
 
-	if ((extent_bno_ptrs = malloc(agcount *
-					sizeof(avltree_desc_t *))) == NULL)
-		do_error(
-	_("couldn't malloc free by-bno extent tree descriptor table\n"));
-
-	if ((extent_bcnt_ptrs = malloc(agcount *
-					sizeof(avltree_desc_t *))) == NULL)
-		do_error(
-	_("couldn't malloc free by-bcnt extent tree descriptor table\n"));
-
-	for (i = 0; i < agcount; i++)  {
-		if ((extent_bno_ptrs[i] =
-				malloc(sizeof(avltree_desc_t))) == NULL)
-			do_error(
-			_("couldn't malloc bno extent tree descriptor\n"));
-		if ((extent_bcnt_ptrs[i] =
-				malloc(sizeof(avltree_desc_t))) == NULL)
-			do_error(
-			_("couldn't malloc bcnt extent tree descriptor\n"));
-	}
+	free_extents = calloc(agcount, sizeof(struct free_extent_index));
+	if (!free_extents)
+		do_error(_("couldn't malloc free extent index table\n"));
 
 	for (i = 0; i < agcount; i++)  {
 		btree_init(&dup_extent_trees[i]);
 		pthread_mutex_init(&dup_extent_tree_locks[i], NULL);
-		avl_init_tree(extent_bno_ptrs[i], &avl_extent_tree_ops);
-		avl_init_tree(extent_bcnt_ptrs[i], &avl_extent_bcnt_tree_ops);
 	}
 
 	if ((rt_ext_tree_ptr = malloc(sizeof(avl64tree_desc_t))) == NULL)
@@ -779,71 +549,35 @@ incore_ext_teardown(xfs_mount_t *mp)
 
 	for (i = 0; i < mp->m_sb.sb_agcount; i++)  {
 		btree_destroy(dup_extent_trees[i]);
-		free(extent_bno_ptrs[i]);
-		free(extent_bcnt_ptrs[i]);
+		release_free_extents(i);
 	}
 
 	free(dup_extent_trees);
-	free(extent_bcnt_ptrs);
-	free(extent_bno_ptrs);
+	free(free_extents);
 
 	dup_extent_trees = NULL;
-	extent_bcnt_ptrs = NULL;
-	extent_bno_ptrs = NULL;
-}
-
-static int
-count_extents(xfs_agnumber_t agno, avltree_desc_t *tree, int whichtree)
-{
-	extent_tree_node_t *node;
-	int i = 0;
-
-	node = (extent_tree_node_t *) tree->avl_firstino;
-
-	while (node != NULL)  {
-		i++;
-		if (whichtree)
-			node = findnext_bcnt_extent(agno, node);
-		else
-			node = findnext_bno_extent(node);
-	}
-
-	return(i);
+	free_extents = NULL;
 }
 
 int
 count_bno_extents_blocks(xfs_agnumber_t agno, uint *numblocks)
 {
-	uint64_t nblocks;
-	extent_tree_node_t *node;
-	int i = 0;
-
 	ASSERT(agno < glob_agcount);
 
-	nblocks = 0;
-
-	node = (extent_tree_node_t *) extent_bno_ptrs[agno]->avl_firstino;
-
-	while (node != NULL) {
-		nblocks += node->ex_blockcount;
-		i++;
-		node = findnext_bno_extent(node);
-	}
-
-	*numblocks = nblocks;
-	return(i);
+	*numblocks = free_extents[agno].nr_blocks;
+	return free_extents[agno].nr_live;
 }
 
 int
 count_bno_extents(xfs_agnumber_t agno)
 {
 	ASSERT(agno < glob_agcount);
-	return(count_extents(agno, extent_bno_ptrs[agno], 0));
+	return free_extents[agno].nr_live;
 }
 
 int
 count_bcnt_extents(xfs_agnumber_t agno)
 {
 	ASSERT(agno < glob_agcount);
-	return(count_extents(agno, extent_bcnt_ptrs[agno], 1));
+	return free_extents[agno].nr - free_extents[agno].bcnt_first;
 }
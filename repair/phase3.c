@@ -17,6 +17,7 @@
 #include "progress.h"
 #include "bmap.h"
 #include "threads.h"
+#include "telemetry.h"
 
 static void
 process_agi_unlinked(
@@ -62,6 +63,9 @@ process_ag_func(
 	xfs_agnumber_t 		agno,
 	void			*arg)
 {
+	struct telemetry_work	tw;
+
+	telemetry_ag_start(&tw);
 	/*
 	 * turn on directory processing (inode discovery) and
 	 * attribute processing (extra_attr_check)
@@ -71,6 +75,7 @@ process_ag_func(
 	process_aginodes(wq->wq_ctx, arg, agno, 1, 0, 1);
 	blkmap_free_final();
 	cleanup_inode_prefetch(arg);
+	telemetry_ag_end(agno, &tw);
 }
 
 static void
@@ -20,6 +20,7 @@
 #include "progress.h"
 #include "slab.h"
 #include "rmap.h"
+#include "telemetry.h"
 
 bool collect_rmaps;
 
@@ -126,11 +127,15 @@ process_ag_func(
 	xfs_agnumber_t 		agno,
 	void			*arg)
 {
+	struct telemetry_work	tw;
+
+	telemetry_ag_start(&tw);
 	wait_for_inode_prefetch(arg);
 	do_log(_("        - agno = %d\n"), agno);
 	process_aginodes(wq->wq_ctx, arg, agno, 0, 1, 0);
 	blkmap_free_final();
 	cleanup_inode_prefetch(arg);
+	telemetry_ag_end(agno, &tw);
 
 	/*
 	 * now recycle the per-AG duplicate extent records
@@ -21,6 +21,7 @@
 #include "rmap.h"
 #include "bulkload.h"
 #include "agbtree.h"
+#include "telemetry.h"
 
 static uint64_t	*sb_icount_ag;		/* allocated inodes per ag */
 static uint64_t	*sb_ifree_ag;		/* free inodes per ag */
@@ -90,15 +91,14 @@ mk_incore_fstree(
 			if (in_extent)  {
 				/*
 				 * free extent ends here, add extent to the
-				 * 2 incore extent (avl-to-be-B+) trees
+				 * incore free extent index
 				 */
 				in_extent = 0;
 #if defined(XR_BLD_FREE_TRACE) && defined(XR_BLD_ADD_EXTENT)
 				fprintf(stderr, "adding extent %u [%u %u]\n",
 					agno, extent_start, extent_len);
 #endif
-				add_bno_extent(agno, extent_start, extent_len);
-				add_bcnt_extent(agno, extent_start, extent_len);
+				add_free_extent(agno, extent_start, extent_len);
 				*num_freeblocks += extent_len;
 			}
 		}
@@ -111,10 +111,10 @@ mk_incore_fstree(
 		fprintf(stderr, "adding extent %u [%u %u]\n",
 			agno, extent_start, extent_len);
 #endif
-		add_bno_extent(agno, extent_start, extent_len);
-		add_bcnt_extent(agno, extent_start, extent_len);
+		add_free_extent(agno, extent_start, extent_len);
 		*num_freeblocks += extent_len;
 	}
+	index_free_extents(agno);
 
 	return(num_extents);
 }
@@ -219,7 +219,7 @@ build_agf_agfl(
 	struct bt_rebuild	*btr_refc,
 	struct bitmap		*lost_blocks)
 {
-	struct extent_tree_node	*ext_ptr;
+	struct free_extent	*ext_ptr;
 	struct xfs_buf		*agf_buf, *agfl_buf;
 	unsigned int		agfl_idx;
 	struct xfs_agfl		*agfl;
@@ -454,7 +454,7 @@ phase5_func(
 		do_log(_("        - agno = %d\n"), agno);
 
 	/*
-	 * build up incore bno and bcnt extent btrees
+	 * build up the incore free extent index
 	 */
 	num_extents = mk_incore_fstree(mp, agno, &num_freeblocks);
 
@@ -581,11 +581,9 @@ _("unable to rebuild AG %u.  Not enough free space in on-disk AG.\n"),
 		finish_rebuild(mp, &btr_refc, lost_blocks);
 
 	/*
-	 * release the incore per-AG bno/bcnt trees so the extent nodes
-	 * can be recycled
+	 * release the incore per-AG free extent index
 	 */
-	release_agbno_extent_tree(agno);
-	release_agbcnt_extent_tree(agno);
+	release_free_extents(agno);
 	PROG_RPT_INC(prog_rpt_done[agno], 1);
 }
 
@@ -681,8 +679,13 @@ phase5(xfs_mount_t *mp)
 	if (error)
 		do_error(_("cannot alloc lost block bitmap\n"));
 
-	for_each_perag(mp, agno, pag)
+	for_each_perag(mp, agno, pag) {
+		struct telemetry_work	tw;
+
+		telemetry_ag_start(&tw);
 		phase5_func(mp, pag, lost_blocks);
+		telemetry_ag_end(agno, &tw);
+	}
 
 	print_final_rpt();
 
@@ -729,6 +732,9 @@ _("unable to add AG %u reverse-mapping data to btree.\n"), agno);
 		do_error(_("Unable to reinsert lost blocks into filesystem.\n"));
 	bitmap_free(&lost_blocks);
 
+	/* The rmap slabs are done growing, give back what they left behind. */
+	slab_cache_purge();
+
 	bad_ino_btree = 0;
 
 }
@@ -13,11 +13,13 @@
 #include "agheader.h"
 #include "incore.h"
 #include "dir2.h"
+#include "dir_hash.h"
 #include "protos.h"
 #include "err_protos.h"
 #include "dinode.h"
 #include "progress.h"
 #include "versions.h"
+#include "telemetry.h"
 
 static struct cred		zerocr;
 static struct fsxattr 		zerofsx;
@@ -61,36 +63,6 @@ add_dotdot_update(
 	list_add(&dir->list, &dotdot_update_list);
 }
 
-/*
- * Data structures and routines to keep track of directory entries
- * and whether their leaf entry has been seen. Also used for name
- * duplicate checking and rebuilding step if required.
- */
-struct dir_hash_ent {
-	struct dir_hash_ent	*nextbyhash;	/* next in name bucket */
-	struct dir_hash_ent	*nextbyorder;	/* next in order added */
-	xfs_dahash_t		hashval;	/* hash value of name */
-	uint32_t		address;	/* offset of data entry */
-	xfs_ino_t		inum;		/* inode num of entry */
-	short			junkit;		/* name starts with / */
-	short			seen;		/* have seen leaf entry */
-	struct xfs_name		name;
-	unsigned char		namebuf[];
-};
-
-struct dir_hash_tab {
-	int			size;		/* size of hash tables */
-	struct dir_hash_ent	*first;		/* ptr to first added entry */
-	struct dir_hash_ent	*last;		/* ptr to last added entry */
-	struct dir_hash_ent	**byhash;	/* ptr to name hash buckets */
-#define HT_UNSEEN		1
-	struct radix_tree_root	byaddr;
-};
-
-#define	DIR_HASH_TAB_SIZE(n)	\
-	(sizeof(struct dir_hash_tab) + (sizeof(struct dir_hash_ent *) * (n)))
-#define	DIR_HASH_FUNC(t,a)	((a) % (t)->size)
-
 /*
  * Track the contents of the freespace table in a directory.
  */
@@ -105,14 +77,6 @@ typedef struct freetab {
 #define	FREETAB_SIZE(n)	\
 	(offsetof(freetab_t, ents) + (sizeof(struct freetab_ent) * (n)))
 
-#define	DIR_HASH_CK_OK		0
-#define	DIR_HASH_CK_DUPLEAF	1
-#define	DIR_HASH_CK_BADHASH	2
-#define	DIR_HASH_CK_NODATA	3
-#define	DIR_HASH_CK_NOLEAF	4
-#define	DIR_HASH_CK_BADSTALE	5
-#define	DIR_HASH_CK_TOTAL	6
-
 /*
  * Need to handle CRC and validation errors specially here. If there is a
  * validator error, re-read without the verifier so that we get a buffer we can
@@ -164,92 +128,16 @@ dir_hash_add(
 	uint8_t			ftype)
 {
 	xfs_dahash_t		hash = 0;
-	int			byhash = 0;
-	struct dir_hash_ent	*p;
-	int			dup;
-	short			junk;
 	struct xfs_name		xname;
-	int			error;
 
 	xname.name = name;
 	xname.len = namelen;
 	xname.type = ftype;
 
-	junk = name[0] == '/';
-	dup = 0;
-
-	if (!junk) {
+	if (name[0] != '/')
 		hash = libxfs_dir2_hashname(mp, &xname);
-		byhash = DIR_HASH_FUNC(hashtab, hash);
-
-		/*
-		 * search hash bucket for existing name.
-		 */
-		for (p = hashtab->byhash[byhash]; p; p = p->nextbyhash) {
-			if (p->hashval == hash && p->name.len == namelen) {
-				if (memcmp(p->name.name, name, namelen) == 0) {
-					dup = 1;
-					junk = 1;
-					break;
-				}
-			}
-		}
-	}
-
-	/*
-	 * Allocate enough space for the hash entry and the name in a single
-	 * allocation so we can store our own copy of the name for later use.
-	 */
-	p = calloc(1, sizeof(*p) + namelen + 1);
-	if (!p)
-		do_error(_("malloc failed in dir_hash_add (%zu bytes)\n"),
-			sizeof(*p));
-
-	error = radix_tree_insert(&hashtab->byaddr, addr, p);
-	if (error == EEXIST) {
-		do_warn(_("duplicate addrs %u in directory!\n"), addr);
-		free(p);
-		return 0;
-	}
-	radix_tree_tag_set(&hashtab->byaddr, addr, HT_UNSEEN);
-
-	if (hashtab->last)
-		hashtab->last->nextbyorder = p;
-	else
-		hashtab->first = p;
-	p->nextbyorder = NULL;
-	hashtab->last = p;
-
-	if (!(p->junkit = junk)) {
-		p->hashval = hash;
-		p->nextbyhash = hashtab->byhash[byhash];
-		hashtab->byhash[byhash] = p;
-	}
-	p->address = addr;
-	p->inum = inum;
-	p->seen = 0;
-
-	/* Set up the name in the region trailing the hash entry. */
-	memcpy(p->namebuf, name, namelen);
-	p->name.name = p->namebuf;
-	p->name.len = namelen;
-	p->name.type = ftype;
-	return !dup;
-}
-
-/* Mark an existing directory hashtable entry as junk. */
-static void
-dir_hash_junkit(
-	struct dir_hash_tab	*hashtab,
-	xfs_dir2_dataptr_t	addr)
-{
-	struct dir_hash_ent	*p;
-
-	p = radix_tree_lookup(&hashtab->byaddr, addr);
-	assert(p != NULL);
-
-	p->junkit = 1;
-	p->namebuf[0] = '/';
+	return dir_hash_add_hashed(hashtab, addr, inum, namelen, name, ftype,
+			hash);
 }
 
 static int
@@ -271,8 +159,7 @@ dir_hash_check(
 		done = 1;
 	}
 
-	if (seeval == DIR_HASH_CK_OK &&
-	    radix_tree_tagged(&hashtab->byaddr, HT_UNSEEN))
+	if (seeval == DIR_HASH_CK_OK && hashtab->nr_unseen > 0)
 		seeval = DIR_HASH_CK_NOLEAF;
 	if (seeval == DIR_HASH_CK_OK)
 		return 0;
@@ -285,96 +172,6 @@ dir_hash_check(
 	return 1;
 }
 
-static void
-dir_hash_done(
-	struct dir_hash_tab	*hashtab)
-{
-	int			i;
-	struct dir_hash_ent	*n;
-	struct dir_hash_ent	*p;
-
-	for (i = 0; i < hashtab->size; i++) {
-		for (p = hashtab->byhash[i]; p; p = n) {
-			n = p->nextbyhash;
-			radix_tree_delete(&hashtab->byaddr, p->address);
-			free(p);
-		}
-	}
-	free(hashtab);
-}
-
-/*
- * Create a directory hash index structure based on the size of the directory we
- * are about to try to repair. The size passed in is the size of the data
- * segment of the directory in bytes, so we don't really know exactly how many
- * entries are in it. Hence assume an entry size of around 64 bytes - that's a
- * name length of 40+ bytes so should cover a most situations with really large
- * directories.
- */
-static struct dir_hash_tab *
-dir_hash_init(
-	xfs_fsize_t		size)
-{
-	struct dir_hash_tab	*hashtab = NULL;
-	int			hsize;
-
-	hsize = size / 64;
-	if (hsize < 16)
-		hsize = 16;
-
-	/*
-	 * Try to allocate as large a hash table as possible. Failure to
-	 * allocate isn't fatal, it will just result in slower performance as we
-	 * reduce the size of the table.
-	 */
-	while (hsize >= 16) {
-		hashtab = calloc(DIR_HASH_TAB_SIZE(hsize), 1);
-		if (hashtab)
-			break;
-		hsize /= 2;
-	}
-	if (!hashtab)
-		do_error(_("calloc failed in dir_hash_init\n"));
-	hashtab->size = hsize;
-	hashtab->byhash = (struct dir_hash_ent **)((char *)hashtab +
-		sizeof(struct dir_hash_tab));
-	INIT_RADIX_TREE(&hashtab->byaddr, 0);
-	return hashtab;
-}
-
-static int
-dir_hash_see(
-	struct dir_hash_tab	*hashtab,
-	xfs_dahash_t		hash,
-	xfs_dir2_dataptr_t	addr)
-{
-	struct dir_hash_ent	*p;
-
-	p = radix_tree_lookup(&hashtab->byaddr, addr);
-	if (!p)
-		return DIR_HASH_CK_NODATA;
-	if (!radix_tree_tag_get(&hashtab->byaddr, addr, HT_UNSEEN))
-		return DIR_HASH_CK_DUPLEAF;
-	if (p->junkit == 0 && p->hashval != hash)
-		return DIR_HASH_CK_BADHASH;
-	radix_tree_tag_clear(&hashtab->byaddr, addr, HT_UNSEEN);
-	return DIR_HASH_CK_OK;
-}
-
-static void
-dir_hash_update_ftype(
-	struct dir_hash_tab	*hashtab,
-	xfs_dir2_dataptr_t	addr,
-	uint8_t			ftype)
-{
-	struct dir_hash_ent	*p;
-
-	p = radix_tree_lookup(&hashtab->byaddr, addr);
-	if (!p)
-		return;
-	p->name.type = ftype;
-}
-
 /*
  * checks to make sure leafs match a data entry, and that the stale
  * count is valid.
@@ -1243,6 +1040,8 @@ longform_dir2_rebuild(
 	xfs_fileoff_t		lastblock;
 	struct xfs_inode	pip;
 	struct dir_hash_ent	*p;
+	struct xfs_name		xname;
+	uint32_t		i;
 	int			done = 0;
 
 	/*
@@ -1315,15 +1114,19 @@ longform_dir2_rebuild(
 
 	/* go through the hash list and re-add the inodes */
 
-	for (p = hashtab->first; p; p = p->nextbyorder) {
+	for (i = 0; i < hashtab->nr_ents; i++) {
+		p = &hashtab->ents[i];
 		if (p->junkit)
 			continue;
-		if (p->name.name[0] == '/' || (p->name.name[0] == '.' &&
-				(p->name.len == 1 || (p->name.len == 2 &&
-						p->name.name[1] == '.'))))
+		xname.name = dir_hash_name(hashtab, p);
+		xname.len = p->namelen;
+		xname.type = p->ftype;
+		if (xname.name[0] == '/' || (xname.name[0] == '.' &&
+				(xname.len == 1 || (xname.len == 2 &&
+						xname.name[1] == '.'))))
 			continue;
 
-		nres = XFS_CREATE_SPACE_RES(mp, p->name.len);
+		nres = XFS_CREATE_SPACE_RES(mp, xname.len);
 		error = -libxfs_trans_alloc(mp, &M_RES(mp)->tr_create,
 					    nres, 0, 0, &tp);
 		if (error)
@@ -1331,7 +1134,7 @@ longform_dir2_rebuild(
 
 		libxfs_trans_ijoin(tp, ip, 0);
 
-		error = -libxfs_dir_createname(tp, ip, &p->name, p->inum,
+		error = -libxfs_dir_createname(tp, ip, &xname, p->inum,
 						nres);
 		if (error) {
 			do_warn(
@@ -1437,6 +1240,313 @@ _("fixing ftype mismatch (%d/%d) in directory/child inode %" PRIu64 "/%" PRIu64
 	dir_hash_update_ftype(hashtab, addr, ino_ftype);
 }
 
+/*
+ * Checking the data blocks of a huge directory is mostly reading and
+ * verifying the blocks, walking the entries, hashing the names and looking up
+ * the inodes they point to, and none of that depends on what the other
+ * blocks hold.  So for big directories, when the main pass reaches a block
+ * that hasn't been scanned, a set of worker threads does that for the next
+ * window of data blocks while the main pass waits.  The main pass then only
+ * has to do the parts that need the whole directory: duplicate names, link
+ * counts and fixing things up.
+ *
+ * The workers release the buffers they read, so the main pass gets each block
+ * again from the cache.  A cache hit doesn't verify the block again, so the
+ * read and CRC errors the workers saw are handed over with the entries.
+ */
+#define DIR_SCAN_MIN_BLOCKS	1024		/* smaller dirs stay serial */
+#define DIR_SCAN_MAX_WORKERS	16
+#define DIR_SCAN_CHUNK		16		/* data blocks per work item */
+#define DIR_SCAN_WINDOW_BYTES	(8U << 20)	/* data blocks per window */
+
+/* An entry that the main pass will look at, in data block order. */
+struct dir_scan_ent {
+	xfs_dir2_dataptr_t	addr;
+	xfs_dahash_t		hashval;
+	struct ino_tree_node	*irec;		/* NULL if no such inode */
+};
+
+struct dir_scan_blk {
+	xfs_dablk_t		da_bno;
+	int			error;		/* from dir_read_buf */
+	int			crc_error;
+	uint32_t		first_ent;	/* in the chunk's array */
+	uint32_t		nr_ents;
+};
+
+struct dir_scan_chunk {
+	struct dir_scan_ent	*ents;
+	uint32_t		nr_ents;
+	uint32_t		max_ents;
+};
+
+struct dir_scan {
+	struct xfs_mount	*mp;
+	struct xfs_inode	*ip;
+	unsigned int		nr_workers;
+	struct dir_scan_blk	*blks;
+	unsigned int		nr_blks;
+	unsigned int		max_blks;
+	unsigned int		cur;		/* block the main pass is on */
+	struct dir_scan_chunk	*chunks;
+};
+
+static void
+dir_scan_add_ent(
+	struct dir_scan_chunk	*chunk,
+	xfs_dir2_dataptr_t	addr,
+	xfs_dahash_t		hashval,
+	struct ino_tree_node	*irec)
+{
+	struct dir_scan_ent	*e;
+
+	if (chunk->nr_ents == chunk->max_ents) {
+		uint32_t	n = max(chunk->max_ents * 2, 1024U);
+
+		e = realloc(chunk->ents, n * sizeof(*e));
+		if (!e)
+			do_error(_("malloc failed in %s (%zu bytes)\n"),
+				__func__, n * sizeof(*e));
+		chunk->ents = e;
+		chunk->max_ents = n;
+	}
+	e = &chunk->ents[chunk->nr_ents++];
+	e->addr = addr;
+	e->hashval = hashval;
+	e->irec = irec;
+}
+
+/*
+ * Walk the entries of a data block, hashing the names and finding the inode
+ * records.  Anything that looks wrong is left for the main pass to find and
+ * report, so we just throw away what we have for this block.
+ */
+static void
+dir_scan_block(
+	struct dir_scan		*scan,
+	struct dir_scan_chunk	*chunk,
+	struct dir_scan_blk	*sb,
+	struct xfs_buf		*bp)
+{
+	struct xfs_mount	*mp = scan->mp;
+	struct xfs_dir2_data_hdr *d = bp->b_addr;
+	char			*ptr;
+	char			*endptr;
+	xfs_dir2_db_t		db;
+
+	sb->first_ent = chunk->nr_ents;
+	ptr = (char *)d + mp->m_dir_geo->data_entry_offset;
+	endptr = (char *)d + mp->m_dir_geo->blksize;
+	db = xfs_dir2_da_to_db(mp->m_dir_geo, sb->da_bno);
+
+	while (ptr < endptr) {
+		xfs_dir2_data_unused_t	*dup = (xfs_dir2_data_unused_t *)ptr;
+		xfs_dir2_data_entry_t	*dep = (xfs_dir2_data_entry_t *)ptr;
+		struct xfs_name		xname;
+		xfs_ino_t		inum;
+		int			len;
+
+		if (be16_to_cpu(dup->freetag) == XFS_DIR2_DATA_FREE_TAG) {
+			len = be16_to_cpu(dup->length);
+			if (len == 0 || ptr + len > endptr)
+				goto bad;
+			ptr += len;
+			continue;
+		}
+
+		len = libxfs_dir2_data_entsize(mp, dep->namelen);
+		if (ptr + len > endptr)
+			goto bad;
+		if (dep->namelen > 0 && dep->name[0] != '/') {
+			xname.name = dep->name;
+			xname.len = dep->namelen;
+			xname.type = libxfs_dir2_data_get_ftype(mp, dep);
+			inum = be64_to_cpu(dep->inumber);
+			dir_scan_add_ent(chunk,
+				xfs_dir2_db_off_to_dataptr(mp->m_dir_geo, db,
+						ptr - (char *)d),
+				libxfs_dir2_hashname(mp, &xname),
+				find_inode_rec(mp, XFS_INO_TO_AGNO(mp, inum),
+						XFS_INO_TO_AGINO(mp, inum)));
+		}
+		ptr += len;
+	}
+	sb->nr_ents = chunk->nr_ents - sb->first_ent;
+	return;
+bad:
+	chunk->nr_ents = sb->first_ent;
+	sb->nr_ents = 0;
+}
+
+static void
+dir_scan_worker(
+	struct workqueue	*wq,
+	uint32_t		index,
+	void			*arg)
+{
+	struct dir_scan		*scan = arg;
+	struct dir_scan_chunk	*chunk = &scan->chunks[index];
+	unsigned int		first = index * DIR_SCAN_CHUNK;
+	unsigned int		last;
+	unsigned int		i;
+
+	last = min(first + DIR_SCAN_CHUNK, scan->nr_blks);
+	chunk->nr_ents = 0;
+	for (i = first; i < last; i++) {
+		struct dir_scan_blk	*sb = &scan->blks[i];
+		struct xfs_buf		*bp;
+
+		sb->crc_error = 0;
+		sb->nr_ents = 0;
+		sb->error = dir_read_buf(scan->ip, sb->da_bno, &bp,
+				&xfs_dir3_data_buf_ops, &sb->crc_error);
+		if (sb->error)
+			continue;
+		dir_scan_block(scan, chunk, sb, bp);
+		libxfs_buf_relse(bp);
+	}
+}
+
+/*
+ * Read and scan the data blocks from @da_bno onwards, stepping through the
+ * block map the same way longform_dir2_entry_check does.  We wait for the
+ * workers because the main pass may change the block map once it goes on.
+ */
+static void
+dir_scan_fill(
+	struct dir_scan		*scan,
+	xfs_dablk_t		da_bno)
+{
+	struct xfs_da_geometry	*geo = scan->mp->m_dir_geo;
+	struct workqueue	wq;
+	xfs_fileoff_t		next_da_bno = da_bno;
+	unsigned int		i;
+
+	scan->nr_blks = 0;
+	scan->cur = 0;
+	while (scan->nr_blks < scan->max_blks) {
+		scan->blks[scan->nr_blks++].da_bno = next_da_bno;
+
+		next_da_bno += geo->fsbcount - 1;
+		if (bmap_next_offset(scan->ip, &next_da_bno) ||
+		    next_da_bno == NULLFILEOFF || next_da_bno >= geo->leafblk)
+			break;
+	}
+
+	create_work_queue(&wq, scan->mp, scan->nr_workers);
+	for (i = 0; i < howmany(scan->nr_blks, DIR_SCAN_CHUNK); i++)
+		queue_work(&wq, dir_scan_worker, i, scan);
+	destroy_work_queue(&wq);
+}
+
+/* Set up a parallel scan if @ip is a big enough leaf or node directory. */
+static struct dir_scan *
+dir_scan_alloc(
+	struct xfs_mount	*mp,
+	struct xfs_inode	*ip)
+{
+	struct dir_scan		*scan;
+	unsigned int		nr_workers;
+
+	nr_workers = min(platform_nproc(), DIR_SCAN_MAX_WORKERS);
+	if (nr_workers < 2 ||
+	    ip->i_disk_size / mp->m_dir_geo->blksize < DIR_SCAN_MIN_BLOCKS)
+		return NULL;
+
+	scan = calloc(1, sizeof(struct dir_scan));
+	if (!scan)
+		return NULL;
+	scan->mp = mp;
+	scan->ip = ip;
+	scan->nr_workers = nr_workers;
+	scan->max_blks = max(DIR_SCAN_WINDOW_BYTES / mp->m_dir_geo->blksize,
+			nr_workers * DIR_SCAN_CHUNK);
+	scan->blks = calloc(scan->max_blks, sizeof(struct dir_scan_blk));
+	scan->chunks = calloc(howmany(scan->max_blks, DIR_SCAN_CHUNK),
+			sizeof(struct dir_scan_chunk));
+	if (!scan->blks || !scan->chunks) {
+		free(scan->blks);
+		free(scan->chunks);
+		free(scan);
+		return NULL;
+	}
+	return scan;
+}
+
+static void
+dir_scan_free(
+	struct dir_scan		*scan)
+{
+	unsigned int		i;
+
+	if (!scan)
+		return;
+	for (i = 0; i < howmany(scan->max_blks, DIR_SCAN_CHUNK); i++)
+		free(scan->chunks[i].ents);
+	free(scan->chunks);
+	free(scan->blks);
+	free(scan);
+}
+
+/*
+ * Get data block @da_bno for the main pass, scanning the next window first if
+ * the block isn't in this one.  The caller owns the buffer, just as with
+ * dir_read_buf.
+ */
+static int
+dir_scan_read(
+	struct dir_scan		*scan,
+	struct xfs_inode	*ip,
+	xfs_dablk_t		da_bno,
+	struct xfs_buf		**bpp,
+	const struct xfs_buf_ops *ops,
+	int			*crc_error)
+{
+	struct dir_scan_blk	*sb;
+	int			crc = 0;
+	int			error;
+
+	if (!scan)
+		return dir_read_buf(ip, da_bno, bpp, ops, crc_error);
+
+	while (scan->cur < scan->nr_blks &&
+	       scan->blks[scan->cur].da_bno < da_bno)
+		scan->cur++;
+	if (scan->cur == scan->nr_blks ||
+	    scan->blks[scan->cur].da_bno != da_bno)
+		dir_scan_fill(scan, da_bno);
+
+	sb = &scan->blks[scan->cur];
+	if (sb->error)
+		return sb->error;
+
+	/*
+	 * If the block fell out of the cache it is verified again, so don't
+	 * count the same bad CRC twice.
+	 */
+	error = dir_read_buf(ip, da_bno, bpp, ops, &crc);
+	if (error)
+		return error;
+	*crc_error += sb->crc_error | crc;
+	return 0;
+}
+
+/* Entries the scan found in the block the main pass is on, if any. */
+static struct dir_scan_ent *
+dir_scan_ents(
+	struct dir_scan		*scan,
+	uint32_t		*nr_ents)
+{
+	struct dir_scan_blk	*sb;
+
+	*nr_ents = 0;
+	if (!scan)
+		return NULL;
+	sb = &scan->blks[scan->cur];
+	*nr_ents = sb->nr_ents;
+	return &scan->chunks[scan->cur / DIR_SCAN_CHUNK].ents[sb->first_ent];
+}
+
 /*
  * process a data block, also checks for .. entry
  * and corrects it to match what we think .. should be
@@ -1453,7 +1563,8 @@ longform_dir2_entry_check_data(
 	struct dir_hash_tab	*hashtab,
 	freetab_t		**freetabp,
 	xfs_dablk_t		da_bno,
-	bool			isblock)
+	bool			isblock,
+	struct dir_scan		*scan)
 {
 	xfs_dir2_dataptr_t	addr;
 	xfs_dir2_leaf_entry_t	*blp;
@@ -1481,6 +1592,10 @@ longform_dir2_entry_check_data(
 	char			*ptr;
 	xfs_trans_t		*tp;
 	int			wantmagic;
+	struct dir_scan_ent	*se;
+	struct dir_scan_ent	*se_end;
+	uint32_t		nr_se;
+	int			added;
 	struct xfs_da_args	da = {
 		.dp = ip,
 		.geo = mp->m_dir_geo,
@@ -1616,6 +1731,8 @@ longform_dir2_entry_check_data(
 	}
 	lastfree = 0;
 	ptr = (char *)d + mp->m_dir_geo->data_entry_offset;
+	se = dir_scan_ents(scan, &nr_se);
+	se_end = se + nr_se;
 	/*
 	 * look at each entry.  reference inode pointed to by each
 	 * entry in the incore inode tree.
@@ -1674,8 +1791,14 @@ longform_dir2_entry_check_data(
 		fname[dep->namelen] = '\0';
 		ASSERT(inum != NULLFSINO);
 
-		irec = find_inode_rec(mp, XFS_INO_TO_AGNO(mp, inum),
-					XFS_INO_TO_AGINO(mp, inum));
+		/* use what the scan found for this entry, if anything */
+		while (se < se_end && se->addr < addr)
+			se++;
+		if (se < se_end && se->addr == addr)
+			irec = se->irec;
+		else
+			irec = find_inode_rec(mp, XFS_INO_TO_AGNO(mp, inum),
+						XFS_INO_TO_AGINO(mp, inum));
 		if (irec == NULL)  {
 			nbad++;
 			if (entry_junked(
@@ -1732,8 +1855,16 @@ longform_dir2_entry_check_data(
 		/*
 		 * check for duplicate names in directory.
 		 */
-		if (!dir_hash_add(mp, hashtab, addr, inum, dep->namelen,
-				dep->name, libxfs_dir2_data_get_ftype(mp, dep))) {
+		if (se < se_end && se->addr == addr)
+			added = dir_hash_add_hashed(hashtab, addr, inum,
+					dep->namelen, dep->name,
+					libxfs_dir2_data_get_ftype(mp, dep),
+					se->hashval);
+		else
+			added = dir_hash_add(mp, hashtab, addr, inum,
+					dep->namelen, dep->name,
+					libxfs_dir2_data_get_ftype(mp, dep));
+		if (!added) {
 			nbad++;
 			if (entry_junked(
 	_("entry \"%s\" (ino %" PRIu64 ") in dir %" PRIu64 " is a duplicate name, "),
@@ -2253,6 +2384,7 @@ longform_dir2_entry_check(
 	int			seeval;
 	int			fixit = 0;
 	struct xfs_da_args	args;
+	struct dir_scan		*scan = NULL;
 
 	*need_dot = 1;
 	freetab = malloc(FREETAB_SIZE(ip->i_disk_size / mp->m_dir_geo->blksize));
@@ -2274,6 +2406,8 @@ longform_dir2_entry_check(
 	args.geo = mp->m_dir_geo;
 	libxfs_dir2_isblock(&args, &isblock);
 	libxfs_dir2_isleaf(&args, &isleaf);
+	if (!isblock)
+		scan = dir_scan_alloc(mp, ip);
 
 	/* check directory "data" blocks (ie. name/inode pairs) */
 	for (da_bno = 0, next_da_bno = 0;
@@ -2301,7 +2435,7 @@ longform_dir2_entry_check(
 		else
 			ops = &xfs_dir3_data_buf_ops;
 
-		error = dir_read_buf(ip, da_bno, &bp, ops, &fixit);
+		error = dir_scan_read(scan, ip, da_bno, &bp, ops, &fixit);
 		if (error) {
 			do_warn(
 	_("can't read data block %u for directory inode %" PRIu64 " error %d\n"),
@@ -2338,13 +2472,15 @@ longform_dir2_entry_check(
 
 		longform_dir2_entry_check_data(mp, ip, num_illegal, need_dot,
 				irec, ino_offset, bp, hashtab,
-				&freetab, da_bno, isblock);
+				&freetab, da_bno, isblock, scan);
 		if (isblock)
 			break;
 
 		libxfs_buf_relse(bp);
 		bp = NULL;
 	}
+	dir_scan_free(scan);
+	scan = NULL;
 	fixit |= (*num_illegal != 0) || dir2_is_badino(ino) || *need_dot;
 
 	if (!dotdot_update) {
@@ -2371,6 +2507,7 @@ longform_dir2_entry_check(
 		}
 	}
 out_fix:
+	dir_scan_free(scan);
 	if (bp)
 		libxfs_buf_relse(bp);
 
@@ -3111,6 +3248,26 @@ check_for_orphaned_inodes(
 	}
 }
 
+/*
+ * Directory inode chunks from all the AGs being traversed go on one work
+ * stealing queue, so that threads that run out of directories in a small AG
+ * help out with a big one instead of sitting idle.  Each AG counts its
+ * outstanding chunks so that it can limit how far ahead of the processing it
+ * queues work (and so how far ahead inode prefetch runs), and so that it can
+ * wait for all of them to be done.
+ */
+#define DIR_AG_MAX_QUEUED	1000
+#define DIR_QUEUE_BATCH		32
+
+struct dir_ag_work {
+	pthread_mutex_t		lock;
+	pthread_cond_t		wait;
+	unsigned int		queued;
+};
+
+static struct workqueue		dir_wq;
+static struct dir_ag_work	*dir_ag_work;
+
 static void
 do_dir_inode(
 	struct workqueue	*wq,
@@ -3118,12 +3275,39 @@ do_dir_inode(
 	void			*arg)
 {
 	struct ino_tree_node	*irec = arg;
+	struct dir_ag_work	*dw = &dir_ag_work[agno];
+	struct telemetry_work	tw;
 	int			i;
 
+	telemetry_ag_start(&tw);
 	for (i = 0; i < XFS_INODES_PER_CHUNK; i++)  {
 		if (inode_isadir(irec, i))
 			process_dir_inode(wq->wq_ctx, agno, irec, i);
 	}
+	telemetry_ag_end(agno, &tw);
+
+	pthread_mutex_lock(&dw->lock);
+	if (--dw->queued == 0 ||
+	    dw->queued == DIR_AG_MAX_QUEUED - DIR_QUEUE_BATCH)
+		pthread_cond_broadcast(&dw->wait);
+	pthread_mutex_unlock(&dw->lock);
+}
+
+static void
+queue_dir_inodes(
+	xfs_agnumber_t		agno,
+	void			**irecs,
+	unsigned int		nr)
+{
+	struct dir_ag_work	*dw = &dir_ag_work[agno];
+
+	pthread_mutex_lock(&dw->lock);
+	while (dw->queued + nr > DIR_AG_MAX_QUEUED)
+		pthread_cond_wait(&dw->wait, &dw->lock);
+	dw->queued += nr;
+	pthread_mutex_unlock(&dw->lock);
+
+	queue_work_batch(&dir_wq, do_dir_inode, agno, irecs, nr);
 }
 
 static void
@@ -3134,22 +3318,15 @@ traverse_function(
 {
 	struct ino_tree_node	*irec;
 	prefetch_args_t		*pf_args = arg;
-	struct workqueue	lwq;
-	struct xfs_mount	*mp = wq->wq_ctx;
+	struct dir_ag_work	*dw = &dir_ag_work[agno];
+	void			*batch[DIR_QUEUE_BATCH];
+	unsigned int		nr = 0;
 
 	wait_for_inode_prefetch(pf_args);
 
 	if (verbose)
 		do_log(_("        - agno = %d\n"), agno);
 
-	/*
-	 * The more AGs we have in flight at once, the fewer processing threads
-	 * per AG. This means we don't overwhelm the machine with hundreds of
-	 * threads when we start acting on lots of AGs at once. We just want
-	 * enough that we can keep multiple CPUs busy across multiple AGs.
-	 */
-	workqueue_create_bound(&lwq, mp, ag_stride, 1000);
-
 	for (irec = findfirst_inode_rec(agno); irec; irec = next_ino_rec(irec)) {
 		if (irec->ino_isa_dir == 0)
 			continue;
@@ -3167,9 +3344,19 @@ traverse_function(
 #endif
 		}
 
-		queue_work(&lwq, do_dir_inode, agno, irec);
+		batch[nr++] = irec;
+		if (nr == DIR_QUEUE_BATCH) {
+			queue_dir_inodes(agno, batch, nr);
+			nr = 0;
+		}
 	}
-	destroy_work_queue(&lwq);
+	if (nr)
+		queue_dir_inodes(agno, batch, nr);
+
+	pthread_mutex_lock(&dw->lock);
+	while (dw->queued > 0)
+		pthread_cond_wait(&dw->wait, &dw->lock);
+	pthread_mutex_unlock(&dw->lock);
 	cleanup_inode_prefetch(pf_args);
 }
 
@@ -3197,7 +3384,32 @@ static void
 traverse_ags(
 	struct xfs_mount	*mp)
 {
+	xfs_agnumber_t		agno;
+
+	dir_ag_work = calloc(mp->m_sb.sb_agcount, sizeof(struct dir_ag_work));
+	if (!dir_ag_work)
+		do_error(_("cannot allocate directory work tracking\n"));
+	for (agno = 0; agno < mp->m_sb.sb_agcount; agno++) {
+		pthread_mutex_init(&dir_ag_work[agno].lock, NULL);
+		pthread_cond_init(&dir_ag_work[agno].wait, NULL);
+	}
+
+	/*
+	 * Keep about as many threads as the old per-AG queues had in total:
+	 * ag_stride for each AG being traversed.  Without ag_stride everything
+	 * runs in the traversal thread.
+	 */
+	create_work_queue_stealing(&dir_wq, mp,
+			ag_stride ? thread_count * ag_stride : 0);
 	do_inode_prefetch(mp, ag_stride, traverse_function, false, true);
+	destroy_work_queue(&dir_wq);
+
+	for (agno = 0; agno < mp->m_sb.sb_agcount; agno++) {
+		pthread_mutex_destroy(&dir_ag_work[agno].lock);
+		pthread_cond_destroy(&dir_ag_work[agno].wait);
+	}
+	free(dir_ag_work);
+	dir_ag_work = NULL;
 }
 
 void
@@ -3212,6 +3424,8 @@ phase6(xfs_mount_t *mp)
 
 	do_log(_("Phase 6 - check inode connectivity...\n"));
 
+	dir_hash_setup();
+
 	incore_ext_teardown(mp);
 
 	add_ino_ex_data(mp);
@@ -3292,6 +3506,8 @@ _("        - resetting contents of realtime bitmap and summary inodes\n"));
 	 */
 	update_missing_dotdot_entries(mp);
 
+	dir_hash_teardown();
+
 	do_log(_("        - traversal finished ...\n"));
 	do_log(_("        - moving disconnected inodes to %s ...\n"),
 		ORPHANAGE);
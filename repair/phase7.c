@@ -16,6 +16,7 @@
 #include "progress.h"
 #include "threads.h"
 #include "quotacheck.h"
+#include "telemetry.h"
 
 static void
 update_inode_nlinks(
@@ -82,8 +83,136 @@ update_inode_nlinks(
 }
 
 /*
- * for each ag, look at each inode 1 at a time. If the number of
- * links is bad, reset it, log the inode core, commit the transaction
+ * Link count fixes are batched up per inode cluster.  Each cluster buffer is
+ * read once, every bad link count in it is patched directly in the ondisk
+ * inode, and the buffer is written back once, instead of running a
+ * transaction for every inode.  v1 inodes still go through the transaction
+ * path, since they have to be converted to v2 to take a new link count.
+ */
+struct nlink_fix {
+	xfs_agino_t		agino;
+	uint32_t		nlinks;
+	bool			v1;		/* needs a transaction */
+};
+
+struct nlink_batch {
+	xfs_agnumber_t		agno;
+	xfs_agino_t		cluster_agino;	/* first inode of the cluster */
+	unsigned int		nr;
+	struct nlink_fix	*fixes;		/* inodes_per_cluster entries */
+};
+
+static void
+flush_nlink_batch(
+	struct xfs_mount	*mp,
+	struct nlink_batch	*nb)
+{
+	struct xfs_dinode	*dip;
+	struct xfs_buf		*bp;
+	xfs_ino_t		ino;
+	unsigned int		i;
+	uint32_t		nlinks;
+	bool			dirty = false;
+
+	if (nb->nr == 0)
+		return;
+
+	bp = get_agino_buf(mp, nb->agno, nb->fixes[0].agino, &dip);
+	if (!bp) {
+		ino = XFS_AGINO_TO_INO(mp, nb->agno, nb->fixes[0].agino);
+		if (!no_modify)
+			do_error(
+	_("couldn't map inode %" PRIu64 ", err = %d\n"),
+				ino, EIO);
+		do_warn(
+	_("couldn't map inode %" PRIu64 ", err = %d, can't compare link counts\n"),
+			ino, EIO);
+		nb->nr = 0;
+		return;
+	}
+
+	for (i = 0; i < nb->nr; i++) {
+		struct nlink_fix	*nf = &nb->fixes[i];
+
+		ino = XFS_AGINO_TO_INO(mp, nb->agno, nf->agino);
+		dip = xfs_make_iptr(mp, bp, nf->agino - nb->cluster_agino);
+		nf->v1 = dip->di_version == 1;
+		if (nf->v1) {
+			if (!no_modify)
+				continue;
+			nlinks = be16_to_cpu(dip->di_onlink);
+		} else {
+			nlinks = be32_to_cpu(dip->di_nlink);
+		}
+
+		/* compare and set links if they differ.  */
+		if (nlinks == nf->nlinks)
+			continue;
+		if (no_modify) {
+			do_warn(
+	_("would have reset inode %" PRIu64 " nlinks from %u to %u\n"),
+				ino, nlinks, nf->nlinks);
+			continue;
+		}
+		do_warn(
+	_("resetting inode %" PRIu64 " nlinks from %u to %u\n"),
+			ino, nlinks, nf->nlinks);
+		dip->di_nlink = cpu_to_be32(nf->nlinks);
+		if (dip->di_version >= 3)
+			be64_add_cpu(&dip->di_changecount, 1);
+		libxfs_dinode_calc_crc(mp, dip);
+		dirty = true;
+	}
+
+	if (dirty)
+		libxfs_buf_mark_dirty(bp);
+	libxfs_buf_relse(bp);
+
+	/* v1 inodes were skipped above, fix them the slow way */
+	for (i = 0; i < nb->nr; i++) {
+		struct nlink_fix	*nf = &nb->fixes[i];
+
+		if (nf->v1 && !no_modify)
+			update_inode_nlinks(mp,
+				XFS_AGINO_TO_INO(mp, nb->agno, nf->agino),
+				nf->nlinks);
+	}
+	nb->nr = 0;
+}
+
+/*
+ * Large AGs are split into runs of inode records so that one huge AG doesn't
+ * hold up the end of the phase.  Runs always start on a cluster boundary so
+ * that no two of them patch the same cluster buffer.
+ */
+#define NLINK_WORK_RECS		4096
+
+/* Runs of an AG that haven't finished, plus one while we're queueing. */
+struct nlink_ag {
+	unsigned int		pending;
+};
+
+struct nlink_work {
+	ino_tree_node_t		*first;		/* first inode record */
+	unsigned int		nr_recs;
+	struct nlink_ag		*ag;
+};
+
+/* Drop a pending run; whoever drops the last one reports the AG done. */
+static void
+nlink_ag_put(
+	struct nlink_ag		*na,
+	xfs_agnumber_t		agno)
+{
+	if (uatomic_sub_return(&na->pending, 1) == 0) {
+		PROG_RPT_INC(prog_rpt_done[agno], 1);
+		free(na);
+	}
+}
+
+/*
+ * for each run of inode records, look at each inode 1 at a time.  If the
+ * number of links is bad, queue it up for the cluster buffer's batch.
  */
 static void
 do_link_updates(
@@ -92,17 +221,29 @@ do_link_updates(
 	void			*arg)
 {
 	struct xfs_mount	*mp = wq->wq_ctx;
+	struct nlink_work	*nw = arg;
+	struct nlink_batch	nb = { .agno = agno };
+	struct telemetry_work	tw;
 	ino_tree_node_t		*irec;
+	unsigned int		i;
 	int			j;
 	uint32_t		nrefs;
 
-	for (irec = findfirst_inode_rec(agno); irec;
-	     irec = next_ino_rec(irec)) {
+	telemetry_ag_start(&tw);
+	nb.fixes = malloc(M_IGEO(mp)->inodes_per_cluster *
+			sizeof(struct nlink_fix));
+	if (!nb.fixes)
+		do_error(_("could not allocate link count batch\n"));
+
+	for (i = 0, irec = nw->first; i < nw->nr_recs;
+	     i++, irec = next_ino_rec(irec)) {
 		xfs_ino_t	ino;
 
 		ino = XFS_AGINO_TO_INO(mp, agno, irec->ino_startnum);
 
 		for (j = 0; j < XFS_INODES_PER_CHUNK; j++)  {
+			xfs_agino_t	agino = irec->ino_startnum + j;
+
 			ASSERT(is_inode_confirmed(irec, j));
 
 			if (is_inode_free(irec, j))
@@ -113,13 +254,70 @@ do_link_updates(
 			nrefs = num_inode_references(irec, j);
 			ASSERT(no_modify || nrefs > 0);
 
-			if (get_inode_disk_nlinks(irec, j) != nrefs)
-				update_inode_nlinks(wq->wq_ctx, ino + j, nrefs);
+			if (get_inode_disk_nlinks(irec, j) != nrefs) {
+				xfs_agino_t	cluster_agino;
+
+				cluster_agino = agino &
+					~(M_IGEO(mp)->inodes_per_cluster - 1);
+				if (nb.cluster_agino != cluster_agino)
+					flush_nlink_batch(mp, &nb);
+				nb.cluster_agino = cluster_agino;
+				nb.fixes[nb.nr].agino = agino;
+				nb.fixes[nb.nr].nlinks = nrefs;
+				nb.nr++;
+			}
 			quotacheck_adjust(mp, ino + j);
 		}
 	}
+	flush_nlink_batch(mp, &nb);
+	free(nb.fixes);
+	telemetry_ag_end(agno, &tw);
 
-	PROG_RPT_INC(prog_rpt_done[agno], 1);
+	nlink_ag_put(nw->ag, agno);
+	free(nw);
+}
+
+/* Queue the inode records of an AG in runs of about NLINK_WORK_RECS. */
+static void
+queue_link_updates(
+	struct xfs_mount	*mp,
+	struct workqueue	*wq,
+	xfs_agnumber_t		agno)
+{
+	struct nlink_work	*nw = NULL;
+	struct nlink_ag		*na;
+	ino_tree_node_t		*irec;
+
+	na = calloc(1, sizeof(struct nlink_ag));
+	if (!na)
+		do_error(_("could not allocate link count work item\n"));
+	na->pending = 1;
+
+	for (irec = findfirst_inode_rec(agno); irec;
+	     irec = next_ino_rec(irec)) {
+		if (nw && nw->nr_recs >= NLINK_WORK_RECS &&
+		    (irec->ino_startnum &
+		     (M_IGEO(mp)->inodes_per_cluster - 1)) == 0) {
+			uatomic_inc(&na->pending);
+			queue_work(wq, do_link_updates, agno, nw);
+			nw = NULL;
+		}
+		if (!nw) {
+			nw = calloc(1, sizeof(struct nlink_work));
+			if (!nw)
+				do_error(
+	_("could not allocate link count work item\n"));
+			nw->first = irec;
+			nw->ag = na;
+		}
+		nw->nr_recs++;
+	}
+
+	if (nw) {
+		uatomic_inc(&na->pending);
+		queue_work(wq, do_link_updates, agno, nw);
+	}
+	nlink_ag_put(na, agno);
 }
 
 void
@@ -144,7 +342,7 @@ phase7(
 	create_work_queue(&wq, mp, scan_threads);
 
 	for (agno = 0; agno < mp->m_sb.sb_agcount; agno++)
-		queue_work(&wq, do_link_updates, agno, NULL);
+		queue_link_updates(mp, &wq, agno);
 
 	destroy_work_queue(&wq);
 
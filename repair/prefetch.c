@@ -27,12 +27,12 @@ int do_prefetch = 1;
  */
 
 static xfs_mount_t	*mp;
-static int 		mp_fd;
+static dev_t		mp_dev;
 static int		pf_max_bytes;
-static int		pf_max_bbs;
-static int		pf_max_fsbs;
-static int		pf_batch_bytes;
+static int		pf_def_max_bytes;
 static int		pf_batch_fsbs;
+static struct prefetch_stats *pf_ag_stats;
+static pthread_mutex_t	pf_ag_stats_lock = PTHREAD_MUTEX_INITIALIZER;
 
 static void		pf_read_inode_dirs(prefetch_args_t *, struct xfs_buf *);
 
@@ -72,6 +72,31 @@ static void		pf_read_inode_dirs(prefetch_args_t *, struct xfs_buf *);
 
 #define IO_THRESHOLD	(MAX_BUFS * 2)
 
+/*
+ * Adaptive read-ahead.
+ *
+ * Every PF_ADAPT_READS reads, each AG's prefetcher re-evaluates how it reads:
+ *
+ *  - The largest hole we read over rather than issuing a separate I/O is the
+ *    number of bytes the device can transfer in the time it takes to do one
+ *    small read, i.e. average small read latency times large read bandwidth.
+ *    Spinning disks end up reading through big holes, SSDs don't.
+ *
+ *  - If less than a quarter of what we read ends up in buffers, the largest
+ *    single read is halved; if more than three quarters does, it is doubled.
+ *
+ *  - The read-ahead window (in inode clusters) shrinks if the buffer cache hit
+ *    rate collapses while we are far ahead of the processing threads, because
+ *    that means we are evicting buffers before anyone uses them.  It grows if
+ *    the processing threads have nearly caught up with us.
+ */
+#define PF_ADAPT_READS		32
+#define PF_MIN_READ_BYTES	0x10000
+#define PF_SMALL_READ_BYTES	0x10000
+#define PF_LARGE_READ_BYTES	0x40000
+#define PF_THRASH_HIT_PCT	30
+#define PF_MIN_RA_WINDOW	32
+
 typedef enum pf_which {
 	PF_PRIMARY,
 	PF_SECONDARY,
@@ -464,6 +489,204 @@ pf_read_inode_dirs(
 		libxfs_buf_set_priority(bp, B_DIR_INODE);
 }
 
+static inline uint64_t
+pf_now_ns(void)
+{
+	struct timespec		ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+static inline uint64_t
+pf_ewma(
+	uint64_t		avg,
+	uint64_t		sample)
+{
+	if (!avg)
+		return sample;
+	return (avg * 7 + sample) / 8;
+}
+
+/*
+ * Grow or shrink the read-ahead window.  The window is enforced by the
+ * ra_count semaphore, so we shrink it by taking tokens away from the queuing
+ * thread (if they're free right now) and grow it by giving them back.
+ */
+static void
+pf_set_ra_window(
+	prefetch_args_t		*args,
+	int			window)
+{
+	window = max(window, min(PF_MIN_RA_WINDOW, args->ra_max));
+	window = min(window, args->ra_max);
+
+	while (args->ra_window < window && args->ra_held > 0) {
+		sem_post(&args->ra_count);
+		args->ra_held--;
+		args->ra_window++;
+	}
+	while (args->ra_window > window && sem_trywait(&args->ra_count) == 0) {
+		args->ra_held++;
+		args->ra_window--;
+	}
+}
+
+/*
+ * Re-tune read sizing and read-ahead depth from what we've observed since the
+ * last adjustment.  Must be called with the lock held.
+ */
+static void
+pf_adapt(
+	prefetch_args_t		*args)
+{
+	unsigned long long	hits, misses;
+	unsigned long long	dhits, dmisses;
+	unsigned int		useful_pct;
+	int			ra_free;
+	int			lag;
+
+	/* read over holes that cost less to transfer than a seek */
+	if (args->read_lat_ns && args->read_bw) {
+		uint64_t	gap;
+
+		gap = args->read_lat_ns * args->read_bw / NSEC_PER_SEC;
+		gap = max(gap, (uint64_t)mp->m_sb.sb_blocksize);
+		args->batch_bytes = min(gap, (uint64_t)pf_max_bytes);
+	}
+
+	/* shrink reads that are mostly holes, grow reads that aren't */
+	if (args->adapt_bytes_read) {
+		useful_pct = args->adapt_bytes_useful * 100 /
+				args->adapt_bytes_read;
+		if (useful_pct < 25)
+			args->max_bytes = max(args->max_bytes / 2,
+					      PF_MIN_READ_BYTES);
+		else if (useful_pct > 75)
+			args->max_bytes = min(args->max_bytes * 2,
+					      pf_max_bytes);
+	}
+
+	/* back off if we're pushing buffers out before they get used */
+	cache_get_stats(libxfs_bcache, &hits, &misses);
+	dhits = hits - args->cache_hits;
+	dmisses = misses - args->cache_misses;
+	args->cache_hits = hits;
+	args->cache_misses = misses;
+
+	sem_getvalue(&args->ra_count, &ra_free);
+	lag = args->ra_window - ra_free;
+	if (dhits + dmisses > 0 &&
+	    dhits * 100 / (dhits + dmisses) < PF_THRASH_HIT_PCT &&
+	    lag > args->ra_window / 2)
+		pf_set_ra_window(args, args->ra_window / 2);
+	else if (lag < args->ra_window / 4)
+		pf_set_ra_window(args, args->ra_window * 2);
+
+	pftrace("AG %d adapt: max_bytes %d batch_bytes %d ra_window %d lag %d",
+		args->agno, args->max_bytes, args->batch_bytes,
+		args->ra_window, lag);
+
+	args->adapt_reads = 0;
+	args->adapt_bytes_read = 0;
+	args->adapt_bytes_useful = 0;
+}
+
+/*
+ * Record the outcome of a read.  Must be called with the lock held.
+ */
+static void
+pf_account_read(
+	prefetch_args_t		*args,
+	uint64_t		bytes,
+	uint64_t		useful,
+	uint64_t		ns)
+{
+	args->stats.nr_reads++;
+	args->stats.bytes_read += bytes;
+	args->stats.bytes_useful += useful;
+	args->adapt_bytes_read += bytes;
+	args->adapt_bytes_useful += useful;
+
+	if (ns) {
+		if (bytes <= PF_SMALL_READ_BYTES)
+			args->read_lat_ns = pf_ewma(args->read_lat_ns, ns);
+		else if (bytes >= PF_LARGE_READ_BYTES)
+			args->read_bw = pf_ewma(args->read_bw,
+					bytes * NSEC_PER_SEC / ns);
+	}
+
+	if (++args->adapt_reads >= PF_ADAPT_READS)
+		pf_adapt(args);
+}
+
+/*
+ * Wait for one buffer read by pf_batch_read_async and hand it to the cache.
+ * Returns the number of bytes read into the buffer.
+ */
+static uint64_t
+pf_reap_buf(
+	prefetch_args_t		*args,
+	pf_which_t		which,
+	struct xfs_buf_ioq	*ioq,
+	unsigned int		num)
+{
+	struct xfs_buf		*bp;
+	uint64_t		useful = 0;
+
+	bp = libxfs_buf_ioq_reap(ioq, true);
+	if (!bp)
+		return 0;
+
+	if (bp->b_error) {
+		/* leave it for the processing threads to read and report */
+		bp->b_error = 0;
+	} else {
+		useful = BBTOB(bp->b_length);
+		if (B_IS_INODE(libxfs_buf_priority(bp)))
+			pf_read_inode_dirs(args, bp);
+		else if (which == PF_META_ONLY)
+			libxfs_buf_set_priority(bp, B_DIR_META_H);
+		else if (which == PF_PRIMARY && num == 1)
+			libxfs_buf_set_priority(bp, B_DIR_META_S);
+	}
+	pftrace("putbuf %c %p (%llu) in AG %d",
+		B_IS_INODE(libxfs_buf_priority(bp)) ? 'I' : 'M',
+		bp, (long long)xfs_buf_daddr(bp), args->agno);
+	libxfs_buf_relse(bp);
+	return useful;
+}
+
+/*
+ * Read a batch of buffers that are too far apart to read in one go by putting
+ * them all in flight at once, instead of reading the few that are close
+ * together and coming back for the rest.  Returns the number of bytes read.
+ */
+static uint64_t
+pf_batch_read_async(
+	prefetch_args_t		*args,
+	pf_which_t		which,
+	struct xfs_buf_ioq	*ioq,
+	struct xfs_buf		**bplist,
+	unsigned int		num)
+{
+	uint64_t		useful = 0;
+	unsigned int		i;
+	int			error;
+
+	for (i = 0; i < num; i++) {
+		while ((error = libxfs_buf_ioq_submit(ioq, bplist[i],
+						NULL)) == -EAGAIN)
+			useful += pf_reap_buf(args, which, ioq, num);
+		if (error)
+			libxfs_buf_relse(bplist[i]);
+	}
+	while (libxfs_buf_ioq_inflight(ioq) > 0)
+		useful += pf_reap_buf(args, which, ioq, num);
+
+	return useful;
+}
+
 /*
  * pf_batch_read must be called with the lock locked.
  */
@@ -471,7 +694,8 @@ static void
 pf_batch_read(
 	prefetch_args_t		*args,
 	pf_which_t		which,
-	void			*buf)
+	void			*buf,
+	struct xfs_buf_ioq	*ioq)
 {
 	struct xfs_buf		*bplist[MAX_BUFS];
 	unsigned int		num;
@@ -481,18 +705,25 @@ pf_batch_read(
 	int			inode_bufs;
 	unsigned long		fsbno = 0;
 	unsigned long		max_fsbno;
+	unsigned long		max_fsbs;
+	uint64_t		start_ns;
+	uint64_t		read_ns;
+	uint64_t		bytes;
+	uint64_t		useful;
+	bool			sparse;
 	char			*pbuf;
 
 	for (;;) {
 		num = 0;
+		max_fsbs = args->max_bytes >> mp->m_sb.sb_blocklog;
 		if (which == PF_SECONDARY) {
 			bplist[0] = btree_find(args->io_queue, 0, &fsbno);
-			max_fsbno = min(fsbno + pf_max_fsbs,
+			max_fsbno = min(fsbno + max_fsbs,
 							args->last_bno_read);
 		} else {
 			bplist[0] = btree_find(args->io_queue,
 						args->last_bno_read, &fsbno);
-			max_fsbno = fsbno + pf_max_fsbs;
+			max_fsbno = fsbno + max_fsbs;
 		}
 		while (bplist[num] && num < MAX_BUFS && fsbno < max_fsbno) {
 			/*
@@ -526,12 +757,14 @@ pf_batch_read(
 		first_off = LIBXFS_BBTOOFF64(xfs_buf_daddr(bplist[0]));
 		last_off = LIBXFS_BBTOOFF64(xfs_buf_daddr(bplist[num-1])) +
 			BBTOB(bplist[num-1]->b_length);
-		while (num > 1 && last_off - first_off > pf_max_bytes) {
+		while (num > 1 && last_off - first_off > args->max_bytes) {
 			num--;
 			last_off = LIBXFS_BBTOOFF64(xfs_buf_daddr(bplist[num-1])) +
 				BBTOB(bplist[num-1]->b_length);
 		}
-		if (num < ((last_off - first_off) >> (mp->m_sb.sb_blocklog + 3))) {
+		sparse = num < ((last_off - first_off) >>
+				(mp->m_sb.sb_blocklog + 3));
+		if (sparse && !ioq) {
 			/*
 			 * not enough blocks for one big read, so determine
 			 * the number of blocks that are close enough.
@@ -540,7 +773,7 @@ pf_batch_read(
 			for (i = 1; i < num; i++) {
 				next_off = LIBXFS_BBTOOFF64(xfs_buf_daddr(bplist[i])) +
 						BBTOB(bplist[i]->b_length);
-				if (next_off - last_off > pf_batch_bytes)
+				if (next_off - last_off > args->batch_bytes)
 					break;
 				last_off = next_off;
 			}
@@ -572,10 +805,23 @@ pf_batch_read(
 #endif
 		pthread_mutex_unlock(&args->lock);
 
+		if (sparse && ioq) {
+			useful = pf_batch_read_async(args, which, ioq, bplist,
+					num);
+			bytes = useful;
+			read_ns = 0;
+			goto account;
+		}
+
 		/*
 		 * now read the data and put into the xfs_but_t's
 		 */
-		len = pread(mp_fd, buf, (int)(last_off - first_off), first_off);
+		bytes = last_off - first_off;
+		start_ns = pf_now_ns();
+		len = libxfs_device_pread(mp_dev, buf,
+				(int)(last_off - first_off), first_off);
+		read_ns = pf_now_ns() - start_ns;
+		useful = 0;
 
 		/*
 		 * Check the last buffer on the list to see if we need to
@@ -586,6 +832,7 @@ pf_batch_read(
 		if ((bplist[num - 1]->b_flags & LIBXFS_B_DISCONTIG)) {
 			libxfs_readbufr_map(mp->m_ddev_targp, bplist[num - 1], 0);
 			bplist[num - 1]->b_flags |= LIBXFS_B_UNCHECKED;
+			useful += BBTOB(bplist[num - 1]->b_length);
 			libxfs_buf_relse(bplist[num - 1]);
 			num--;
 		}
@@ -605,6 +852,7 @@ pf_batch_read(
 				bplist[i]->b_flags |= (LIBXFS_B_UPTODATE |
 						       LIBXFS_B_UNCHECKED);
 				len -= size;
+				useful += size;
 				if (B_IS_INODE(libxfs_buf_priority(bplist[i])))
 					pf_read_inode_dirs(args, bplist[i]);
 				else if (which == PF_META_ONLY)
@@ -623,7 +871,9 @@ pf_batch_read(
 				args->agno);
 			libxfs_buf_relse(bplist[i]);
 		}
+account:
 		pthread_mutex_lock(&args->lock);
+		pf_account_read(args, bytes, useful, read_ns);
 		if (which != PF_SECONDARY) {
 			pftrace("inode_bufs_queued for AG %d = %d", args->agno,
 				args->inode_bufs_queued);
@@ -638,12 +888,12 @@ pf_batch_read(
 				pftrace("reading metadata bufs from primary queue for AG %d",
 					args->agno);
 
-				pf_batch_read(args, PF_META_ONLY, buf);
+				pf_batch_read(args, PF_META_ONLY, buf, ioq);
 
 				pftrace("reading bufs from secondary queue for AG %d",
 					args->agno);
 
-				pf_batch_read(args, PF_SECONDARY, buf);
+				pf_batch_read(args, PF_SECONDARY, buf, ioq);
 			}
 		}
 	}
@@ -654,12 +904,22 @@ pf_io_worker(
 	void			*param)
 {
 	prefetch_args_t		*args = param;
+	struct xfs_buf_ioq	*ioq = NULL;
 	void			*buf = memalign(libxfs_device_alignment(),
 						pf_max_bytes);
 
 	if (buf == NULL)
 		return NULL;
 
+	/*
+	 * With io_uring we can keep a whole batch of scattered reads in
+	 * flight from this thread.  Without it, stick to one read at a time;
+	 * there are already several of us reading each AG.
+	 */
+	if (libxfs_buf_ioq_alloc(mp->m_ddev_targp, MAX_BUFS,
+				LIBXFS_BUF_IOQ_RING_ONLY, &ioq))
+		ioq = NULL;
+
 	rcu_register_thread();
 	pthread_mutex_lock(&args->lock);
 	while (!args->queuing_done || !btree_is_empty(args->io_queue)) {
@@ -670,8 +930,8 @@ pf_io_worker(
 
 		pftrace("starting prefetch I/O for AG %d", args->agno);
 
-		pf_batch_read(args, PF_PRIMARY, buf);
-		pf_batch_read(args, PF_SECONDARY, buf);
+		pf_batch_read(args, PF_PRIMARY, buf, ioq);
+		pf_batch_read(args, PF_SECONDARY, buf, ioq);
 
 		pftrace("ran out of bufs to prefetch for AG %d", args->agno);
 
@@ -680,6 +940,8 @@ pf_io_worker(
 	}
 	pthread_mutex_unlock(&args->lock);
 
+	if (ioq)
+		libxfs_buf_ioq_free(ioq);
 	free(buf);
 
 	pftrace("finished prefetch I/O for AG %d", args->agno);
@@ -783,9 +1045,16 @@ pf_queuing_worker(
 			 * Start processing as well, in case everything so
 			 * far was already prefetched and the queue is empty.
 			 */
+			uint64_t	start_ns = pf_now_ns();
+
 			pf_start_io_workers(args);
 			pf_start_processing(args);
 			sem_wait(&args->ra_count);
+
+			pthread_mutex_lock(&args->lock);
+			args->stats.stalls++;
+			args->stats.stall_ns += pf_now_ns() - start_ns;
+			pthread_mutex_unlock(&args->lock);
 		}
 
 		num_inos = 0;
@@ -876,12 +1145,14 @@ init_prefetch(
 	xfs_mount_t		*pmp)
 {
 	mp = pmp;
-	mp_fd = libxfs_device_to_fd(mp->m_ddev_targp->bt_bdev);
-	pf_max_bytes = sysconf(_SC_PAGE_SIZE) << 7;
-	pf_max_bbs = pf_max_bytes >> BBSHIFT;
-	pf_max_fsbs = pf_max_bytes >> mp->m_sb.sb_blocklog;
-	pf_batch_bytes = DEF_BATCH_BYTES;
+	mp_dev = mp->m_ddev_targp->bt_bdev;
+	pf_def_max_bytes = sysconf(_SC_PAGE_SIZE) << 7;
+	pf_max_bytes = sysconf(_SC_PAGE_SIZE) << 9;
 	pf_batch_fsbs = DEF_BATCH_BYTES >> (mp->m_sb.sb_blocklog + 1);
+
+	pf_ag_stats = calloc(mp->m_sb.sb_agcount, sizeof(struct prefetch_stats));
+	if (!pf_ag_stats)
+		do_error(_("failed to allocate prefetch statistics\n"));
 }
 
 prefetch_args_t *
@@ -919,7 +1190,18 @@ start_inode_prefetch(
 		max_queue = max_queue * igeo->blocks_per_cluster /
 				igeo->ialloc_blks;
 
-	sem_init(&args->ra_count, 0, max_queue);
+	/*
+	 * Start with the traditional read-ahead depth, but allow it to grow to
+	 * twice that if the processing threads keep up and the cache isn't
+	 * thrashing.
+	 */
+	args->ra_window = max_queue;
+	args->ra_max = max_queue * 2;
+	args->ra_held = args->ra_max - args->ra_window;
+	args->max_bytes = pf_def_max_bytes;
+	args->batch_bytes = DEF_BATCH_BYTES;
+	cache_get_stats(libxfs_bcache, &args->cache_hits, &args->cache_misses);
+	sem_init(&args->ra_count, 0, args->ra_window);
 
 	if (!prev_args) {
 		if (!pf_create_prefetch_thread(args))
@@ -1096,6 +1378,51 @@ wait_for_inode_prefetch(
 	pthread_mutex_unlock(&args->lock);
 }
 
+/* Fold this pass's statistics into the per-AG totals. */
+static void
+pf_report_stats(
+	prefetch_args_t		*args)
+{
+	struct prefetch_stats	*ps = &args->stats;
+	struct prefetch_stats	*tot = &pf_ag_stats[args->agno];
+
+	pthread_mutex_lock(&pf_ag_stats_lock);
+	tot->nr_reads += ps->nr_reads;
+	tot->bytes_read += ps->bytes_read;
+	tot->bytes_useful += ps->bytes_useful;
+	tot->stalls += ps->stalls;
+	tot->stall_ns += ps->stall_ns;
+	pthread_mutex_unlock(&pf_ag_stats_lock);
+
+	if (verbose < 2 || !ps->bytes_read)
+		return;
+
+	do_log(
+_("        - agno = %d prefetch: %" PRIu64 " reads, %" PRIu64 " KiB read, %" PRIu64 "%% useful, %" PRIu64 " stalls (%" PRIu64 " ms)\n"),
+		args->agno, ps->nr_reads, ps->bytes_read >> 10,
+		ps->bytes_useful * 100 / ps->bytes_read, ps->stalls,
+		ps->stall_ns / 1000000);
+}
+
+/*
+ * Return the prefetch statistics accumulated for an AG over every prefetch
+ * pass so far.  Phases 3 and 4 prefetch several AGs at once and the telemetry
+ * code samples the totals from another thread, so take the stats lock.
+ */
+void
+prefetch_get_ag_stats(
+	xfs_agnumber_t		agno,
+	struct prefetch_stats	*stats)
+{
+	if (!pf_ag_stats || agno >= mp->m_sb.sb_agcount) {
+		memset(stats, 0, sizeof(*stats));
+		return;
+	}
+	pthread_mutex_lock(&pf_ag_stats_lock);
+	*stats = pf_ag_stats[agno];
+	pthread_mutex_unlock(&pf_ag_stats_lock);
+}
+
 void
 cleanup_inode_prefetch(
 	prefetch_args_t		*args)
@@ -1112,6 +1439,8 @@ cleanup_inode_prefetch(
 
 	ASSERT(args->next_args == NULL);
 
+	pf_report_stats(args);
+
 	pthread_mutex_destroy(&args->lock);
 	pthread_cond_destroy(&args->start_reading);
 	pthread_cond_destroy(&args->start_processing);
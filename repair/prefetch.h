@@ -12,6 +12,15 @@ extern int 	do_prefetch;
 
 #define PF_THREAD_COUNT	4
 
+/* Per-AG prefetch statistics. */
+struct prefetch_stats {
+	uint64_t		nr_reads;	/* read calls issued */
+	uint64_t		bytes_read;	/* bytes read from disk */
+	uint64_t		bytes_useful;	/* bytes that landed in buffers */
+	uint64_t		stalls;		/* waits for processing */
+	uint64_t		stall_ns;	/* time spent waiting */
+};
+
 typedef struct prefetch_args {
 	pthread_mutex_t		lock;
 	pthread_t		queuing_thread;
@@ -29,6 +38,21 @@ typedef struct prefetch_args {
 	volatile xfs_fsblock_t	last_bno_read;
 	sem_t			ra_count;
 	struct prefetch_args	*next_args;
+
+	/* adaptive read-ahead state, protected by lock */
+	int			ra_window;	/* clusters we may run ahead */
+	int			ra_max;		/* upper bound on ra_window */
+	int			ra_held;	/* ra_count tokens withheld */
+	int			max_bytes;	/* largest single read */
+	int			batch_bytes;	/* largest hole to read over */
+	unsigned int		adapt_reads;	/* reads since last adjustment */
+	uint64_t		adapt_bytes_read;
+	uint64_t		adapt_bytes_useful;
+	unsigned long long	cache_hits;	/* cache stats at last adjustment */
+	unsigned long long	cache_misses;
+	uint64_t		read_lat_ns;	/* average small read latency */
+	uint64_t		read_bw;	/* average large read bytes/sec */
+	struct prefetch_stats	stats;
 } prefetch_args_t;
 
 
@@ -60,6 +84,11 @@ void
 cleanup_inode_prefetch(
 	prefetch_args_t		*args);
 
+void
+prefetch_get_ag_stats(
+	xfs_agnumber_t		agno,
+	struct prefetch_stats	*stats);
+
 
 #ifdef XR_PF_TRACE
 void	pftrace_init(void);
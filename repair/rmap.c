@@ -13,6 +13,7 @@
 #include "slab.h"
 #include "rmap.h"
 #include "libfrog/bitmap.h"
+#include "threads.h"
 
 #undef RMAP_DEBUG
 
@@ -29,6 +30,7 @@ struct xfs_ag_rmap {
 	int		ar_flcount;		/* agfl entries from leftover */
 						/* agbt allocations */
 	struct xfs_rmap_irec	ar_last_rmap;	/* last rmap seen */
+	xfs_extlen_t	ar_max_len;		/* longest rmap in ar_rmaps */
 	struct xfs_slab	*ar_refcount_items;	/* refcount items, p4-5 */
 };
 
@@ -109,6 +111,17 @@ rmaps_free(
 	}
 	free(ag_rmaps);
 	ag_rmaps = NULL;
+	slab_cache_purge();
+}
+
+/* Add a finished rmap to the AG's main list. */
+static int
+rmap_add_ag_rmap(
+	struct xfs_ag_rmap	*ag_rmap,
+	struct xfs_rmap_irec	*rmap)
+{
+	ag_rmap->ar_max_len = max(ag_rmap->ar_max_len, rmap->rm_blockcount);
+	return slab_add(ag_rmap->ar_rmaps, rmap);
 }
 
 /*
@@ -179,7 +192,7 @@ rmap_add_rec(
 	else if (rmaps_are_mergeable(last_rmap, &rmap))
 		last_rmap->rm_blockcount += rmap.rm_blockcount;
 	else {
-		error = slab_add(ag_rmaps[agno].ar_rmaps, last_rmap);
+		error = rmap_add_ag_rmap(&ag_rmaps[agno], last_rmap);
 		if (error)
 			return error;
 		*last_rmap = rmap;
@@ -197,7 +210,7 @@ rmap_finish_collecting_fork_recs(
 	if (!rmap_needs_work(mp) ||
 	    ag_rmaps[agno].ar_last_rmap.rm_owner == XFS_RMAP_OWN_UNKNOWN)
 		return 0;
-	return slab_add(ag_rmaps[agno].ar_rmaps, &ag_rmaps[agno].ar_last_rmap);
+	return rmap_add_ag_rmap(&ag_rmaps[agno], &ag_rmaps[agno].ar_last_rmap);
 }
 
 /* add a raw rmap; these will be merged later */
@@ -303,14 +316,14 @@ rmap_fold_raw_recs(
 			rec = pop_slab_cursor(cur);
 			continue;
 		}
-		error = slab_add(ag_rmaps[agno].ar_rmaps, prev);
+		error = rmap_add_ag_rmap(&ag_rmaps[agno], prev);
 		if (error)
 			goto err;
 		prev = rec;
 		rec = pop_slab_cursor(cur);
 	}
 	if (prev) {
-		error = slab_add(ag_rmaps[agno].ar_rmaps, prev);
+		error = rmap_add_ag_rmap(&ag_rmaps[agno], prev);
 		if (error)
 			goto err;
 	}
@@ -746,31 +759,90 @@ _("Insufficient memory while recreating refcount tree."));
 /*
  * Transform a pile of physical block mapping observations into refcount data
  * for eventual rebuilding of the btrees.
+ *
+ * Large AGs are split into block ranges that are processed in parallel.  Each
+ * range only looks at the parts of the rmaps that fall inside it, so its
+ * refcount runs end at the range boundary, and runs that continue across a
+ * boundary with the same number of owners are joined up afterwards.
  */
+#define REFCOUNT_PART_MIN_RMAPS	(1U << 20)	/* rmaps per range */
+#define REFCOUNT_MAX_PARTS	64U
+
+/* A run of blocks with the same number of owners. */
+struct refcount_run {
+	xfs_agblock_t		agbno;
+	xfs_extlen_t		len;
+	size_t			nr_rmaps;
+};
+
+struct refcount_part {
+	struct xfs_mount	*mp;
+	xfs_agnumber_t		agno;
+	xfs_agblock_t		start;		/* first block of the range */
+	xfs_agblock_t		end;		/* block after the range */
+	struct xfs_slab		*runs;		/* refcount_run */
+	int			error;
+};
+
 #define RMAP_END(r)	((r)->rm_startblock + (r)->rm_blockcount)
-int
-compute_refcounts(
-	struct xfs_mount		*mp,
-	xfs_agnumber_t		agno)
+#define RSTART(p, r)	max((r)->rm_startblock, (p)->start)
+#define REND(p, r)	min(RMAP_END(r), (p)->end)
+
+/* Return the next rmap that isn't entirely before the range. */
+static struct xfs_rmap_irec *
+refcount_peek_rmap(
+	struct refcount_part	*rp,
+	struct xfs_slab_cursor	*cur)
 {
+	struct xfs_rmap_irec	*rmap;
+
+	while ((rmap = peek_slab_cursor(cur)) != NULL &&
+	       RMAP_END(rmap) <= rp->start)
+		advance_slab_cursor(cur);
+	return rmap;
+}
+
+static int
+refcount_add_run(
+	struct refcount_part	*rp,
+	xfs_agblock_t		agbno,
+	xfs_extlen_t		len,
+	size_t			nr_rmaps)
+{
+	struct refcount_run	run = {
+		.agbno		= agbno,
+		.len		= len,
+		.nr_rmaps	= nr_rmaps,
+	};
+
+	return slab_add(rp->runs, &run);
+}
+
+static int
+compute_refcount_range(
+	struct refcount_part	*rp)
+{
+	struct xfs_ag_rmap	*ag_rmap = &ag_rmaps[rp->agno];
+	struct xfs_rmap_irec	low = { 0 };
+	struct xfs_rmap_irec	high = { 0 };
 	struct xfs_bag		*stack_top = NULL;
-	struct xfs_slab		*rmaps;
 	struct xfs_slab_cursor	*rmaps_cur;
 	struct xfs_rmap_irec	*array_cur;
 	struct xfs_rmap_irec	*rmap;
 	xfs_agblock_t		sbno;	/* first bno of this rmap set */
 	xfs_agblock_t		cbno;	/* first bno of this refcount set */
 	xfs_agblock_t		nbno;	/* next bno where rmap set changes */
-	size_t			n, idx;
+	size_t			idx;
 	size_t			old_stack_nr;
 	int			error;
 
-	if (!xfs_has_reflink(mp))
-		return 0;
-
-	rmaps = ag_rmaps[agno].ar_rmaps;
-
-	error = init_slab_cursor(rmaps, rmap_compare, &rmaps_cur);
+	/* Rmaps that cross into the range start at most max_len before it. */
+	if (rp->start > ag_rmap->ar_max_len)
+		low.rm_startblock = rp->start - ag_rmap->ar_max_len;
+	high.rm_startblock = rp->end;
+	error = init_slab_cursor_range(ag_rmap->ar_rmaps, rmap_compare,
+			low.rm_startblock ? &low : NULL,
+			rp->end != NULLAGBLOCK ? &high : NULL, &rmaps_cur);
 	if (error)
 		return error;
 
@@ -779,29 +851,28 @@ compute_refcounts(
 		goto err;
 
 	/* While there are rmaps to be processed... */
-	n = 0;
-	while (n < slab_count(rmaps)) {
-		array_cur = peek_slab_cursor(rmaps_cur);
-		sbno = cbno = array_cur->rm_startblock;
+	array_cur = refcount_peek_rmap(rp, rmaps_cur);
+	while (array_cur) {
+		sbno = cbno = RSTART(rp, array_cur);
 		/* Push all rmaps with pblk == sbno onto the stack */
 		for (;
-		     array_cur && array_cur->rm_startblock == sbno;
-		     array_cur = peek_slab_cursor(rmaps_cur)) {
-			advance_slab_cursor(rmaps_cur); n++;
-			rmap_dump("push0", agno, array_cur);
+		     array_cur && RSTART(rp, array_cur) == sbno;
+		     array_cur = refcount_peek_rmap(rp, rmaps_cur)) {
+			advance_slab_cursor(rmaps_cur);
+			rmap_dump("push0", rp->agno, array_cur);
 			error = bag_add(stack_top, array_cur);
 			if (error)
 				goto err;
 		}
-		mark_inode_rl(mp, stack_top);
+		mark_inode_rl(rp->mp, stack_top);
 
 		/* Set nbno to the bno of the next refcount change */
-		if (n < slab_count(rmaps) && array_cur)
-			nbno = array_cur->rm_startblock;
+		if (array_cur)
+			nbno = RSTART(rp, array_cur);
 		else
 			nbno = NULLAGBLOCK;
 		foreach_bag_ptr(stack_top, idx, rmap) {
-			nbno = min(nbno, RMAP_END(rmap));
+			nbno = min(nbno, REND(rp, rmap));
 		}
 
 		/* Emit reverse mappings, if needed */
@@ -812,9 +883,9 @@ compute_refcounts(
 		while (bag_count(stack_top)) {
 			/* Pop all rmaps that end at nbno */
 			foreach_bag_ptr_reverse(stack_top, idx, rmap) {
-				if (RMAP_END(rmap) != nbno)
+				if (REND(rp, rmap) != nbno)
 					continue;
-				rmap_dump("pop", agno, rmap);
+				rmap_dump("pop", rp->agno, rmap);
 				error = bag_remove(stack_top, idx);
 				if (error)
 					goto err;
@@ -822,23 +893,25 @@ compute_refcounts(
 
 			/* Push array items that start at nbno */
 			for (;
-			     array_cur && array_cur->rm_startblock == nbno;
-			     array_cur = peek_slab_cursor(rmaps_cur)) {
-				advance_slab_cursor(rmaps_cur); n++;
-				rmap_dump("push1", agno, array_cur);
+			     array_cur && RSTART(rp, array_cur) == nbno;
+			     array_cur = refcount_peek_rmap(rp, rmaps_cur)) {
+				advance_slab_cursor(rmaps_cur);
+				rmap_dump("push1", rp->agno, array_cur);
 				error = bag_add(stack_top, array_cur);
 				if (error)
 					goto err;
 			}
-			mark_inode_rl(mp, stack_top);
+			mark_inode_rl(rp->mp, stack_top);
 
 			/* Emit refcount if necessary */
 			ASSERT(nbno > cbno);
 			if (bag_count(stack_top) != old_stack_nr) {
 				if (old_stack_nr > 1) {
-					refcount_emit(mp, agno, cbno,
-						      nbno - cbno,
-						      old_stack_nr);
+					error = refcount_add_run(rp, cbno,
+							nbno - cbno,
+							old_stack_nr);
+					if (error)
+						goto err;
 				}
 				cbno = nbno;
 			}
@@ -850,12 +923,12 @@ compute_refcounts(
 			sbno = nbno;
 
 			/* Set nbno to the bno of the next refcount change */
-			if (n < slab_count(rmaps))
-				nbno = array_cur->rm_startblock;
+			if (array_cur)
+				nbno = RSTART(rp, array_cur);
 			else
 				nbno = NULLAGBLOCK;
 			foreach_bag_ptr(stack_top, idx, rmap) {
-				nbno = min(nbno, RMAP_END(rmap));
+				nbno = min(nbno, REND(rp, rmap));
 			}
 
 			/* Emit reverse mappings, if needed */
@@ -868,8 +941,121 @@ err:
 
 	return error;
 }
+#undef REND
+#undef RSTART
 #undef RMAP_END
 
+static void
+compute_refcount_range_worker(
+	struct workqueue	*wq,
+	xfs_agnumber_t		idx,
+	void			*arg)
+{
+	struct refcount_part	*rp = arg;
+
+	rp += idx;
+	rp->error = compute_refcount_range(rp);
+}
+
+/* Split the AG into block ranges with about the same number of rmaps. */
+static unsigned int
+refcount_split_ag(
+	struct xfs_mount	*mp,
+	xfs_agnumber_t		agno,
+	xfs_agblock_t		*bounds)
+{
+	struct xfs_slab		*rmaps = ag_rmaps[agno].ar_rmaps;
+	struct xfs_rmap_irec	keys[REFCOUNT_MAX_PARTS - 1];
+	unsigned int		nr_parts;
+	size_t			nr_keys;
+	size_t			i;
+
+	/* Phase 4 already runs one thread per AG. */
+	nr_parts = min(slab_count(rmaps) / REFCOUNT_PART_MIN_RMAPS,
+			(size_t)(platform_nproc() / mp->m_sb.sb_agcount));
+	nr_parts = min(nr_parts, REFCOUNT_MAX_PARTS);
+
+	bounds[0] = 0;
+	nr_keys = slab_split_keys(rmaps, rmap_compare, nr_parts, keys);
+	nr_parts = 1;
+	for (i = 0; i < nr_keys; i++) {
+		if (keys[i].rm_startblock > bounds[nr_parts - 1])
+			bounds[nr_parts++] = keys[i].rm_startblock;
+	}
+	bounds[nr_parts] = NULLAGBLOCK;
+	return nr_parts;
+}
+
+int
+compute_refcounts(
+	struct xfs_mount		*mp,
+	xfs_agnumber_t		agno)
+{
+	struct refcount_part	parts[REFCOUNT_MAX_PARTS] = { };
+	xfs_agblock_t		bounds[REFCOUNT_MAX_PARTS + 1];
+	struct refcount_run	prev = { .len = 0 };
+	struct refcount_run	*run;
+	unsigned int		nr_parts;
+	unsigned int		i;
+	int			error = 0;
+
+	if (!xfs_has_reflink(mp))
+		return 0;
+
+	nr_parts = refcount_split_ag(mp, agno, bounds);
+	for (i = 0; i < nr_parts; i++) {
+		parts[i].mp = mp;
+		parts[i].agno = agno;
+		parts[i].start = bounds[i];
+		parts[i].end = bounds[i + 1];
+		error = init_slab(&parts[i].runs, sizeof(struct refcount_run));
+		if (error)
+			goto out;
+	}
+
+	if (nr_parts == 1) {
+		parts[0].error = compute_refcount_range(&parts[0]);
+	} else {
+		struct workqueue	wq;
+
+		create_work_queue(&wq, mp, nr_parts);
+		for (i = 0; i < nr_parts; i++)
+			queue_work(&wq, compute_refcount_range_worker, i,
+					parts);
+		destroy_work_queue(&wq);
+	}
+
+	/* Join the runs that were cut at range boundaries. */
+	for (i = 0; i < nr_parts; i++) {
+		struct xfs_slab_cursor	*cur;
+
+		error = parts[i].error;
+		if (error)
+			goto out;
+		error = init_slab_cursor(parts[i].runs, NULL, &cur);
+		if (error)
+			goto out;
+		while ((run = pop_slab_cursor(cur)) != NULL) {
+			if (prev.len && prev.agbno + prev.len == run->agbno &&
+			    prev.nr_rmaps == run->nr_rmaps) {
+				prev.len += run->len;
+				continue;
+			}
+			if (prev.len)
+				refcount_emit(mp, agno, prev.agbno, prev.len,
+						prev.nr_rmaps);
+			prev = *run;
+		}
+		free_slab_cursor(&cur);
+	}
+	if (prev.len)
+		refcount_emit(mp, agno, prev.agbno, prev.len, prev.nr_rmaps);
+out:
+	for (i = 0; i < nr_parts; i++)
+		free_slab(&parts[i].runs);
+	return error;
+}
+
 /*
  * Return the number of rmap objects for an AG.
  */
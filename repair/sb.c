@@ -129,7 +129,8 @@ __find_secondary_sb(
 			done = 1;
 		}
 
-		if (!done && (bsize = read(x.dfd, sb, BSIZE)) <= 0)  {
+		if (!done &&
+		    (bsize = libxfs_device_pread(x.ddev, sb, BSIZE, off)) <= 0)  {
 			done = 1;
 		}
 
@@ -580,7 +581,7 @@ get_sb(xfs_sb_t *sbp, xfs_off_t off, int size, xfs_agnumber_t agno)
 		return(XR_EOF);
 	}
 
-	if ((rval = read(x.dfd, buf, size)) != size)  {
+	if ((rval = libxfs_device_pread(x.ddev, buf, size, off)) != size)  {
 		error = errno;
 		do_warn(
 	_("superblock read failed, offset %" PRId64 ", size %d, ag %u, rval %d\n"),
@@ -19,6 +19,7 @@
 #include "threads.h"
 #include "slab.h"
 #include "rmap.h"
+#include "telemetry.h"
 
 static xfs_mount_t	*mp = NULL;
 
@@ -337,7 +338,7 @@ _("bad back (left) sibling pointer (saw %llu should be NULL (0))\n"
 		agno = XFS_FSB_TO_AGNO(mp, bno);
 		agbno = XFS_FSB_TO_AGBNO(mp, bno);
 
-		pthread_mutex_lock(&ag_locks[agno].lock);
+		lock_bmap_ext(agno, agbno, 1);
 		state = get_bmap(agno, agbno);
 		switch (state) {
 		case XR_E_INUSE1:
@@ -390,7 +391,7 @@ _("bad state %d, inode %" PRIu64 " bmap block 0x%" PRIx64 "\n"),
 				state, ino, bno);
 			break;
 		}
-		pthread_mutex_unlock(&ag_locks[agno].lock);
+		unlock_bmap_ext(agno, agbno, 1);
 	} else  {
 		/*
 		 * attribute fork for realtime files is in the regular
@@ -2592,7 +2593,9 @@ scan_ag(
 	int		status;
 	char		*objname = NULL;
 	int		error;
+	struct telemetry_work tw;
 
+	telemetry_ag_start(&tw);
 	sb = (struct xfs_sb *)calloc(BBTOB(XFS_FSS_TO_BB(mp, 1)), 1);
 	if (!sb) {
 		do_error(_("can't allocate memory for superblock\n"));
@@ -2723,6 +2726,7 @@ scan_ag(
 		libxfs_buf_relse(sbbuf);
 	free(sb);
 	PROG_RPT_INC(prog_rpt_done[agno], 1);
+	telemetry_ag_end(agno, &tw);
 
 #ifdef XR_INODE_TRACE
 	print_inode_list(i);
@@ -2737,6 +2741,7 @@ out_free_sbbuf:
 	libxfs_buf_relse(sbbuf);
 out_free_sb:
 	free(sb);
+	telemetry_ag_end(agno, &tw);
 
 	if (objname)
 		do_error(_("can't get %s for ag %d\n"), objname, agno);
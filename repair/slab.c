@@ -4,6 +4,7 @@
  * Author: Darrick J. Wong <darrick.wong@oracle.com>
  */
 #include "libxfs.h"
+#include <sys/mman.h>
 #include "slab.h"
 
 #undef SLAB_DEBUG
@@ -40,13 +41,44 @@
 #define MIN_SLAB_NR		4096
 /* and cannot be larger than 128M */
 #define MAX_SLAB_SIZE		(128 * 1048576)
+/*
+ * Spilled slabs are kept smaller, since sorting a slab needs a temporary
+ * buffer of the same size in memory.
+ */
+#define MAX_SPILL_SLAB_SIZE	(16 * 1048576)
+/* Keep at most this much freed slab memory around for reuse */
+#define MAX_SLAB_CACHE_SIZE	(256 * 1048576)
 struct xfs_slab_hdr {
 	size_t			sh_nr;
 	size_t			sh_inuse;	/* items in use */
 	struct xfs_slab_hdr	*sh_next;	/* next slab hdr */
+	size_t			sh_len;		/* bytes allocated */
+	bool			sh_spilled;	/* mapped from a temp file */
 						/* objects follow */
 };
 
+/*
+ * Slab backing store.  By default slabs live in anonymous memory.  If a
+ * spill directory has been set, then once the slabs in memory add up to
+ * the memory limit, new slabs are mapped from unlinked files in that
+ * directory instead.  The kernel can then write them back and drop them
+ * from memory like any other file pages, so the slabs can grow well past
+ * the amount of memory repair is allowed to use.
+ */
+static const char	*slab_spill_dir;
+static size_t		slab_mem_limit;
+static size_t		slab_mem_bytes;		/* slabs in memory */
+static size_t		slab_spill_bytes;	/* slabs in temp files */
+static pthread_mutex_t	slab_mem_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Freed in-memory slabs are kept on a list and handed out again to the next
+ * slab that needs one, since the rmap code frees and rebuilds slabs of much
+ * the same size for every AG.  Cached slabs still count as in memory.
+ */
+static struct xfs_slab_hdr	*slab_cache;
+static size_t			slab_cache_bytes;
+
 struct xfs_slab {
 	size_t			s_item_sz;	/* item size */
 	size_t			s_nr_slabs;	/* # of slabs */
@@ -61,10 +93,17 @@ struct xfs_slab {
  * returns objects in increasing order (if you've previously sorted the
  * slabs with qsort_slab()).  If compare_fn == NULL, it returns slab items
  * in order.
+ *
+ * Sorted cursors merge the slabs through a binary min-heap of the per-slab
+ * cursors, so taking an item costs O(log slabs) comparisons instead of a
+ * scan of every slab.  Each per-slab cursor stops at the number of items
+ * its slab held when the cursor was created.
  */
 struct xfs_slab_hdr_cursor {
 	struct xfs_slab_hdr	*hdr;		/* a slab header */
 	size_t			loc;		/* where we are in the slab */
+	size_t			end;		/* stop before this item */
+	void			*item;		/* item at loc */
 };
 
 typedef int (*xfs_slab_compare_fn)(const void *, const void *);
@@ -74,6 +113,8 @@ struct xfs_slab_cursor {
 	struct xfs_slab			*slab;		/* pointer to the slab */
 	struct xfs_slab_hdr_cursor	*last_hcur;	/* last header we took from */
 	xfs_slab_compare_fn		compare_fn;	/* compare items */
+	size_t				nr_heap;	/* # of cursors in heap */
+	struct xfs_slab_hdr_cursor	**heap;		/* merge heap */
 	struct xfs_slab_hdr_cursor	hcur[0];	/* per-slab cursors */
 };
 
@@ -89,6 +130,183 @@ struct xfs_bag {
 };
 #define BAG_END(bag)	(&(bag)->bg_ptrs[(bag)->bg_nr])
 
+/*
+ * Spill slabs to temporary files in @dir once more than @mem_limit bytes of
+ * slabs are in memory.
+ */
+void
+slab_set_spill(
+	const char		*dir,
+	size_t			mem_limit)
+{
+	slab_spill_dir = dir;
+	slab_mem_limit = mem_limit;
+}
+
+/* Report how many bytes of slabs are in memory and in temp files. */
+void
+slab_mem_usage(
+	size_t			*in_memory,
+	size_t			*spilled)
+{
+	pthread_mutex_lock(&slab_mem_lock);
+	*in_memory = slab_mem_bytes;
+	*spilled = slab_spill_bytes;
+	pthread_mutex_unlock(&slab_mem_lock);
+}
+
+static void *
+slab_map_spill_file(
+	size_t			len)
+{
+	void			*p;
+	int			fd = -1;
+	int			error;
+
+#ifdef O_TMPFILE
+	fd = open(slab_spill_dir, O_TMPFILE | O_RDWR | O_EXCL, 0600);
+#endif
+	if (fd < 0) {
+		char		*path;
+
+		if (asprintf(&path, "%s/xfs_repair.XXXXXX", slab_spill_dir) < 0)
+			return NULL;
+		fd = mkstemp(path);
+		if (fd >= 0)
+			unlink(path);
+		free(path);
+		if (fd < 0)
+			return NULL;
+	}
+
+	/*
+	 * Allocate the space up front, running out of space in the spill
+	 * directory later on would get us a SIGBUS.
+	 */
+	error = posix_fallocate(fd, 0, len);
+	if (error) {
+		close(fd);
+		errno = error;
+		return NULL;
+	}
+
+	p = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (p == MAP_FAILED)
+		return NULL;
+	return p;
+}
+
+static struct xfs_slab_hdr *
+slab_alloc_hdr(
+	struct xfs_slab		*slab,
+	size_t			nr)
+{
+	struct xfs_slab_hdr	*hdr;
+	struct xfs_slab_hdr	**hpp;
+	struct xfs_slab_hdr	**best = NULL;
+	size_t			len;
+	bool			spill = false;
+
+	/*
+	 * Reuse the smallest cached slab that is big enough, as long as it
+	 * isn't so big that a later, larger slab would have wanted it.
+	 */
+	len = sizeof(struct xfs_slab_hdr) + (nr * slab->s_item_sz);
+	pthread_mutex_lock(&slab_mem_lock);
+	for (hpp = &slab_cache; *hpp; hpp = &(*hpp)->sh_next) {
+		if ((*hpp)->sh_len >= len && (*hpp)->sh_len / 4 <= len &&
+		    (!best || (*hpp)->sh_len < (*best)->sh_len))
+			best = hpp;
+	}
+	if (best) {
+		hdr = *best;
+		*best = hdr->sh_next;
+		slab_cache_bytes -= hdr->sh_len;
+		pthread_mutex_unlock(&slab_mem_lock);
+
+		hdr->sh_nr = (hdr->sh_len - sizeof(struct xfs_slab_hdr)) /
+				slab->s_item_sz;
+		hdr->sh_inuse = 0;
+		hdr->sh_next = NULL;
+		return hdr;
+	}
+	pthread_mutex_unlock(&slab_mem_lock);
+
+	if (slab_spill_dir) {
+		pthread_mutex_lock(&slab_mem_lock);
+		len = sizeof(struct xfs_slab_hdr) + (nr * slab->s_item_sz);
+		spill = slab_mem_bytes + len > slab_mem_limit;
+		pthread_mutex_unlock(&slab_mem_lock);
+	}
+
+	if (spill && nr * slab->s_item_sz > MAX_SPILL_SLAB_SIZE)
+		nr = MAX_SPILL_SLAB_SIZE / slab->s_item_sz;
+	len = sizeof(struct xfs_slab_hdr) + (nr * slab->s_item_sz);
+
+	if (spill)
+		hdr = slab_map_spill_file(len);
+	else
+		hdr = malloc(len);
+	if (!hdr)
+		return NULL;
+
+	hdr->sh_nr = nr;
+	hdr->sh_inuse = 0;
+	hdr->sh_next = NULL;
+	hdr->sh_len = len;
+	hdr->sh_spilled = spill;
+
+	pthread_mutex_lock(&slab_mem_lock);
+	if (spill)
+		slab_spill_bytes += len;
+	else
+		slab_mem_bytes += len;
+	pthread_mutex_unlock(&slab_mem_lock);
+	return hdr;
+}
+
+static void
+slab_free_hdr(
+	struct xfs_slab_hdr	*hdr)
+{
+	pthread_mutex_lock(&slab_mem_lock);
+	if (!hdr->sh_spilled &&
+	    slab_cache_bytes + hdr->sh_len <= MAX_SLAB_CACHE_SIZE) {
+		hdr->sh_next = slab_cache;
+		slab_cache = hdr;
+		slab_cache_bytes += hdr->sh_len;
+		pthread_mutex_unlock(&slab_mem_lock);
+		return;
+	}
+	if (hdr->sh_spilled)
+		slab_spill_bytes -= hdr->sh_len;
+	else
+		slab_mem_bytes -= hdr->sh_len;
+	pthread_mutex_unlock(&slab_mem_lock);
+
+	if (hdr->sh_spilled)
+		munmap(hdr, hdr->sh_len);
+	else
+		free(hdr);
+}
+
+/* Release the memory of all cached slabs. */
+void
+slab_cache_purge(void)
+{
+	struct xfs_slab_hdr	*hdr;
+
+	pthread_mutex_lock(&slab_mem_lock);
+	while ((hdr = slab_cache) != NULL) {
+		slab_cache = hdr->sh_next;
+		slab_cache_bytes -= hdr->sh_len;
+		slab_mem_bytes -= hdr->sh_len;
+		free(hdr);
+	}
+	pthread_mutex_unlock(&slab_mem_lock);
+}
+
 /*
  * Create a slab to hold some objects of a particular size.
  */
@@ -126,7 +344,7 @@ free_slab(
 	hdr = ptr->s_first;
 	while (hdr) {
 		nhdr = hdr->sh_next;
-		free(hdr);
+		slab_free_hdr(hdr);
 		hdr = nhdr;
 	}
 	free(ptr);
@@ -165,12 +383,9 @@ slab_add(
 		n = (hdr ? hdr->sh_nr * 2 : MIN_SLAB_NR);
 		if (n * slab->s_item_sz > MAX_SLAB_SIZE)
 			n = MAX_SLAB_SIZE / slab->s_item_sz;
-		hdr = malloc(sizeof(struct xfs_slab_hdr) + (n * slab->s_item_sz));
+		hdr = slab_alloc_hdr(slab, n);
 		if (!hdr)
 			return -ENOMEM;
-		hdr->sh_nr = n;
-		hdr->sh_inuse = 0;
-		hdr->sh_next = NULL;
 		if (slab->s_last)
 			slab->s_last->sh_next = hdr;
 		if (!slab->s_first)
@@ -247,17 +462,87 @@ qsort_slab(
 	destroy_work_queue(&wq);
 }
 
+/* Is the current item of @a ordered before the current item of @b? */
+static inline bool
+slab_hcur_before(
+	struct xfs_slab_cursor		*cur,
+	struct xfs_slab_hdr_cursor	*a,
+	struct xfs_slab_hdr_cursor	*b)
+{
+	int				diff;
+
+	diff = cur->compare_fn(a->item, b->item);
+	if (diff)
+		return diff < 0;
+	/* equal items come out in slab order */
+	return a < b;
+}
+
+static void
+slab_heap_sift_down(
+	struct xfs_slab_cursor		*cur,
+	size_t				i)
+{
+	struct xfs_slab_hdr_cursor	**heap = cur->heap;
+	struct xfs_slab_hdr_cursor	*hcur = heap[i];
+
+	for (;;) {
+		size_t			child = 2 * i + 1;
+
+		if (child >= cur->nr_heap)
+			break;
+		if (child + 1 < cur->nr_heap &&
+		    slab_hcur_before(cur, heap[child + 1], heap[child]))
+			child++;
+		if (!slab_hcur_before(cur, heap[child], hcur))
+			break;
+		heap[i] = heap[child];
+		i = child;
+	}
+	heap[i] = hcur;
+}
+
+/* Find the first item in a sorted slab that is not less than @key. */
+static size_t
+slab_lower_bound(
+	struct xfs_slab			*slab,
+	struct xfs_slab_hdr		*hdr,
+	xfs_slab_compare_fn		compare_fn,
+	const void			*key)
+{
+	size_t				lo = 0;
+	size_t				hi = hdr->sh_inuse;
+
+	while (lo < hi) {
+		size_t			mid = lo + (hi - lo) / 2;
+
+		if (compare_fn(slab_ptr(slab, hdr, mid), key) < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
 /*
- * init_slab_cursor() -- Create a slab cursor to iterate the slab items.
+ * init_slab_cursor_range() -- Create a slab cursor to iterate the slab items
+ * that are not less than @low and less than @high, in ascending order.
  *
- * @slab: The slab.
- * @compare_fn: If specified, use this function to return items in ascending order.
+ * @slab: The slab, which must have been sorted with qsort_slab().
+ * @compare_fn: The function the slab was sorted with.
+ * @low: Start at the first item not less than this; NULL for the first item.
+ * @high: Stop before the first item not less than this; NULL for no limit.
  * @cur: The new cursor.
+ *
+ * Several range cursors covering adjacent ranges can be used to split one
+ * sorted slab between threads; see slab_split_keys().
  */
 int
-init_slab_cursor(
+init_slab_cursor_range(
 	struct xfs_slab		*slab,
 	int (*compare_fn)(const void *, const void *),
+	const void		*low,
+	const void		*high,
 	struct xfs_slab_cursor	**cur)
 {
 	struct xfs_slab_cursor	*c;
@@ -265,25 +550,64 @@ init_slab_cursor(
 	struct xfs_slab_hdr	*hdr;
 
 	c = malloc(sizeof(struct xfs_slab_cursor) +
-		   (sizeof(struct xfs_slab_hdr_cursor) * slab->s_nr_slabs));
+		   ((sizeof(struct xfs_slab_hdr_cursor) +
+		     sizeof(struct xfs_slab_hdr_cursor *)) * slab->s_nr_slabs));
 	if (!c)
 		return -ENOMEM;
 	c->nr = slab->s_nr_slabs;
 	c->slab = slab;
 	c->compare_fn = compare_fn;
 	c->last_hcur = NULL;
-	hcur = (struct xfs_slab_hdr_cursor *)(c + 1);
+	c->nr_heap = 0;
+	c->heap = (struct xfs_slab_hdr_cursor **)&c->hcur[c->nr];
+	hcur = &c->hcur[0];
 	hdr = slab->s_first;
 	while (hdr) {
 		hcur->hdr = hdr;
 		hcur->loc = 0;
+		hcur->end = hdr->sh_inuse;
+		if (compare_fn && low)
+			hcur->loc = slab_lower_bound(slab, hdr, compare_fn,
+					low);
+		if (compare_fn && high)
+			hcur->end = slab_lower_bound(slab, hdr, compare_fn,
+					high);
+		if (compare_fn && hcur->loc < hcur->end) {
+			hcur->item = slab_ptr(slab, hdr, hcur->loc);
+			c->heap[c->nr_heap++] = hcur;
+		}
 		hcur++;
 		hdr = hdr->sh_next;
 	}
+
+	if (compare_fn) {
+		size_t		i;
+
+		for (i = c->nr_heap / 2; i > 0; i--)
+			slab_heap_sift_down(c, i - 1);
+	} else {
+		c->last_hcur = &c->hcur[0];
+	}
 	*cur = c;
 	return 0;
 }
 
+/*
+ * init_slab_cursor() -- Create a slab cursor to iterate the slab items.
+ *
+ * @slab: The slab.
+ * @compare_fn: If specified, use this function to return items in ascending order.
+ * @cur: The new cursor.
+ */
+int
+init_slab_cursor(
+	struct xfs_slab		*slab,
+	int (*compare_fn)(const void *, const void *),
+	struct xfs_slab_cursor	**cur)
+{
+	return init_slab_cursor_range(slab, compare_fn, NULL, NULL, cur);
+}
+
 /*
  * Free the slab cursor.
  */
@@ -306,39 +630,25 @@ peek_slab_cursor(
 	struct xfs_slab_cursor	*cur)
 {
 	struct xfs_slab_hdr_cursor	*hcur;
-	void			*p = NULL;
-	void			*q;
-	size_t			i;
-
-	cur->last_hcur = NULL;
 
 	/* no compare function; inorder traversal */
 	if (!cur->compare_fn) {
-		if (!cur->last_hcur)
-			cur->last_hcur = &cur->hcur[0];
 		hcur = cur->last_hcur;
-		while (hcur < &cur->hcur[cur->nr] &&
-			hcur->loc >= hcur->hdr->sh_inuse)
+		while (hcur < &cur->hcur[cur->nr] && hcur->loc >= hcur->end)
 			hcur++;
+		cur->last_hcur = hcur;
 		if (hcur == &cur->hcur[cur->nr])
 			return NULL;
-		p = slab_ptr(cur->slab, hcur->hdr, hcur->loc);
-		cur->last_hcur = hcur;
-		return p;
+		return slab_ptr(cur->slab, hcur->hdr, hcur->loc);
 	}
 
 	/* otherwise return things in increasing order */
-	for (i = 0, hcur = &cur->hcur[i]; i < cur->nr; i++, hcur++) {
-		if (hcur->loc >= hcur->hdr->sh_inuse)
-			continue;
-		q = slab_ptr(cur->slab, hcur->hdr, hcur->loc);
-		if (!p || cur->compare_fn(p, q) > 0) {
-			p = q;
-			cur->last_hcur = hcur;
-		}
+	if (cur->nr_heap == 0) {
+		cur->last_hcur = NULL;
+		return NULL;
 	}
-
-	return p;
+	cur->last_hcur = cur->heap[0];
+	return cur->heap[0]->item;
 }
 
 /*
@@ -348,8 +658,22 @@ void
 advance_slab_cursor(
 	struct xfs_slab_cursor	*cur)
 {
-	ASSERT(cur->last_hcur);
-	cur->last_hcur->loc++;
+	struct xfs_slab_hdr_cursor	*hcur = cur->last_hcur;
+
+	ASSERT(hcur);
+	hcur->loc++;
+	if (!cur->compare_fn)
+		return;
+
+	ASSERT(hcur == cur->heap[0]);
+	if (hcur->loc < hcur->end) {
+		hcur->item = slab_ptr(cur->slab, hcur->hdr, hcur->loc);
+	} else {
+		cur->heap[0] = cur->heap[--cur->nr_heap];
+		if (cur->nr_heap == 0)
+			return;
+	}
+	slab_heap_sift_down(cur, 0);
 }
 
 /*
@@ -367,6 +691,64 @@ pop_slab_cursor(
 	return p;
 }
 
+/*
+ * Pick up to @nr_parts - 1 keys that split a sorted slab into @nr_parts
+ * ranges of roughly the same number of items, and copy them in ascending
+ * order to @keys.  The keys are sampled from every slab, so they need not
+ * be exact.  Returns the number of keys; duplicates are left out.
+ */
+size_t
+slab_split_keys(
+	struct xfs_slab		*slab,
+	int (*compare_fn)(const void *, const void *),
+	size_t			nr_parts,
+	void			*keys)
+{
+	struct xfs_slab_hdr	*hdr;
+	char			*samples;
+	char			*k = keys;
+	size_t			nr_samples = 0;
+	size_t			max_samples;
+	size_t			nr_keys = 0;
+	size_t			i;
+
+	if (nr_parts < 2 || slab->s_nr_items == 0)
+		return 0;
+
+	/* Take samples from each slab in proportion to its size. */
+	max_samples = min(nr_parts * 16, slab->s_nr_items);
+	samples = malloc((max_samples + slab->s_nr_slabs) * slab->s_item_sz);
+	if (!samples)
+		return 0;
+	for (hdr = slab->s_first; hdr; hdr = hdr->sh_next) {
+		size_t		n;
+
+		if (hdr->sh_inuse == 0)
+			continue;
+		n = howmany(hdr->sh_inuse * max_samples, slab->s_nr_items);
+		for (i = 0; i < n; i++) {
+			memcpy(samples + nr_samples * slab->s_item_sz,
+				slab_ptr(slab, hdr, (i * hdr->sh_inuse) / n),
+				slab->s_item_sz);
+			nr_samples++;
+		}
+	}
+	qsort(samples, nr_samples, slab->s_item_sz, compare_fn);
+
+	for (i = 1; i < nr_parts; i++) {
+		char		*p;
+
+		p = samples + ((i * nr_samples) / nr_parts) * slab->s_item_sz;
+		if (nr_keys > 0 && compare_fn(k - slab->s_item_sz, p) >= 0)
+			continue;
+		memcpy(k, p, slab->s_item_sz);
+		k += slab->s_item_sz;
+		nr_keys++;
+	}
+	free(samples);
+	return nr_keys;
+}
+
 /*
  * Return the number of items in the slab.
  */
@@ -9,6 +9,10 @@
 struct xfs_slab;
 struct xfs_slab_cursor;
 
+extern void slab_set_spill(const char *dir, size_t mem_limit);
+extern void slab_mem_usage(size_t *in_memory, size_t *spilled);
+extern void slab_cache_purge(void);
+
 extern int init_slab(struct xfs_slab **, size_t);
 extern void free_slab(struct xfs_slab **);
 
@@ -18,6 +22,11 @@ extern size_t slab_count(struct xfs_slab *);
 
 extern int init_slab_cursor(struct xfs_slab *,
 	int (*)(const void *, const void *), struct xfs_slab_cursor **);
+extern int init_slab_cursor_range(struct xfs_slab *,
+	int (*)(const void *, const void *), const void *, const void *,
+	struct xfs_slab_cursor **);
+extern size_t slab_split_keys(struct xfs_slab *,
+	int (*)(const void *, const void *), size_t, void *);
 extern void free_slab_cursor(struct xfs_slab_cursor **);
 
 extern void *peek_slab_cursor(struct xfs_slab_cursor *);
@@ -0,0 +1,444 @@
+// SPDX-License-Identifier: GPL-2.0
+
+#include "libxfs.h"
+#include <sys/resource.h>
+#include "globals.h"
+#include "err_protos.h"
+#include "prefetch.h"
+#include "slab.h"
+#include "telemetry.h"
+
+/*
+ * Repair telemetry.
+ *
+ * The run is cut into windows at the end of each phase.  Each window counts
+ * the I/O that libxfs reports through its accounting hook, both in total and
+ * for the AG that the disk address falls in, and the per-AG work functions
+ * add up how long they ran and how much CPU they used.  Everything else (CPU
+ * usage, buffer cache hits, prefetch stalls, memory) is sampled when a window
+ * opens and closes.  Buffer cache hit rate and peak memory are only reported
+ * for a whole phase, because the AGs of a phase share one cache and one heap.
+ *
+ * The JSON is written from an atexit handler so that a repair that dies in
+ * the middle of a phase still tells us how far it got.
+ */
+
+#define TM_MAX_WINDOWS		9	/* phases 0-7 and the exit window */
+
+/* Counters that are bumped while the window is open. */
+struct tm_counters {
+	atomic64_t		read_ios;
+	atomic64_t		read_bytes;
+	atomic64_t		write_ios;
+	atomic64_t		write_bytes;
+	atomic64_t		buf_waits;
+	atomic64_t		buf_wait_ns;
+	atomic64_t		work_ns;
+	atomic64_t		cpu_ns;
+};
+
+struct tm_window {
+	int			phase;		/* -1 for the exit window */
+
+	struct tm_counters	io;
+	struct tm_counters	*ags;
+	struct prefetch_stats	*ag_pf;		/* deltas, at close */
+
+	uint64_t		start_ns;
+	uint64_t		wall_ns;
+	struct timeval		utime;
+	struct timeval		stime;
+
+	struct cache		*cache;
+	unsigned long long	cache_hits;
+	unsigned long long	cache_misses;
+
+	struct prefetch_stats	pf;		/* all AGs, at close */
+	unsigned long		peak_rss;	/* kB */
+	size_t			slab_mem;
+	size_t			slab_spilled;
+};
+
+bool			telemetry_enabled;
+
+static FILE		*tm_fp;
+static struct tm_window	tm_windows[TM_MAX_WINDOWS];
+static int		tm_cur;
+static int		tm_last_phase = -1;
+static uint64_t		tm_start_ns;
+
+static dev_t		tm_ddev;
+static xfs_daddr_t	tm_ag_bbs;
+static xfs_agnumber_t	tm_agcount;
+static struct prefetch_stats *tm_pf_base;
+static bool		tm_hwm_reset;
+
+static const char *tm_phase_names[] = {
+	"initialize",
+	"find and verify superblock",
+	"check log and scan AG headers",
+	"process inodes",
+	"check for duplicate blocks",
+	"rebuild AG headers and trees",
+	"check inode connectivity",
+	"verify and correct link counts",
+};
+
+static inline uint64_t
+tm_clock_ns(
+	clockid_t		clock)
+{
+	struct timespec		ts;
+
+	clock_gettime(clock, &ts);
+	return (uint64_t)ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+static void
+tm_io_account(
+	dev_t			dev,
+	xfs_daddr_t		daddr,
+	uint64_t		val,
+	enum libxfs_io_type	type)
+{
+	struct tm_window	*win = &tm_windows[uatomic_read(&tm_cur)];
+	struct tm_counters	*cs[2] = { &win->io, NULL };
+	int			i;
+
+	if (win->ags && dev == tm_ddev && daddr >= 0 &&
+	    daddr / tm_ag_bbs < tm_agcount)
+		cs[1] = &win->ags[daddr / tm_ag_bbs];
+
+	for (i = 0; i < 2 && cs[i]; i++) {
+		switch (type) {
+		case LIBXFS_IO_READ:
+			atomic64_inc(&cs[i]->read_ios);
+			atomic64_add(val, &cs[i]->read_bytes);
+			break;
+		case LIBXFS_IO_WRITE:
+			atomic64_inc(&cs[i]->write_ios);
+			atomic64_add(val, &cs[i]->write_bytes);
+			break;
+		case LIBXFS_IO_WAIT:
+			atomic64_inc(&cs[i]->buf_waits);
+			atomic64_add(val, &cs[i]->buf_wait_ns);
+			break;
+		}
+	}
+}
+
+/* Peak resident set size since the last reset, in kB. */
+static unsigned long
+tm_peak_rss(void)
+{
+	unsigned long		hwm = 0;
+	char			line[128];
+	FILE			*fp;
+
+	fp = fopen("/proc/self/status", "r");
+	if (fp) {
+		while (fgets(line, sizeof(line), fp)) {
+			if (sscanf(line, "VmHWM: %lu kB", &hwm) == 1)
+				break;
+		}
+		fclose(fp);
+	}
+	if (!hwm) {
+		struct rusage	ru;
+
+		if (!getrusage(RUSAGE_SELF, &ru))
+			hwm = ru.ru_maxrss;
+	}
+	return hwm;
+}
+
+/* Start the next phase's peak memory from the current RSS. */
+static void
+tm_reset_peak_rss(void)
+{
+	int			fd;
+
+	fd = open("/proc/self/clear_refs", O_WRONLY);
+	if (fd < 0) {
+		tm_hwm_reset = false;
+		return;
+	}
+	tm_hwm_reset = write(fd, "5", 1) == 1;
+	close(fd);
+}
+
+static void
+tm_window_open(
+	struct tm_window	*win)
+{
+	struct rusage		ru;
+	xfs_agnumber_t		agno;
+
+	win->start_ns = tm_clock_ns(CLOCK_MONOTONIC);
+	if (!getrusage(RUSAGE_SELF, &ru)) {
+		win->utime = ru.ru_utime;
+		win->stime = ru.ru_stime;
+	}
+	win->cache = libxfs_bcache;
+	if (win->cache)
+		cache_get_stats(win->cache, &win->cache_hits,
+				&win->cache_misses);
+	for (agno = 0; agno < tm_agcount; agno++)
+		prefetch_get_ag_stats(agno, &tm_pf_base[agno]);
+	tm_reset_peak_rss();
+}
+
+static void
+tm_window_close(
+	struct tm_window	*win,
+	int			phase)
+{
+	struct rusage		ru;
+	unsigned long long	hits = 0;
+	unsigned long long	misses = 0;
+	xfs_agnumber_t		agno;
+
+	win->phase = phase;
+	win->wall_ns = tm_clock_ns(CLOCK_MONOTONIC) - win->start_ns;
+	if (!getrusage(RUSAGE_SELF, &ru)) {
+		timersub(&ru.ru_utime, &win->utime, &win->utime);
+		timersub(&ru.ru_stime, &win->stime, &win->stime);
+	}
+
+	/* repair replaces the buffer cache once it knows the geometry */
+	if (libxfs_bcache) {
+		cache_get_stats(libxfs_bcache, &hits, &misses);
+		if (win->cache == libxfs_bcache) {
+			hits -= win->cache_hits;
+			misses -= win->cache_misses;
+		}
+	}
+	win->cache_hits = hits;
+	win->cache_misses = misses;
+
+	for (agno = 0; win->ag_pf && agno < tm_agcount; agno++) {
+		struct prefetch_stats	*pf = &win->ag_pf[agno];
+		struct prefetch_stats	*base = &tm_pf_base[agno];
+
+		prefetch_get_ag_stats(agno, pf);
+		pf->nr_reads -= base->nr_reads;
+		pf->bytes_read -= base->bytes_read;
+		pf->bytes_useful -= base->bytes_useful;
+		pf->stalls -= base->stalls;
+		pf->stall_ns -= base->stall_ns;
+
+		win->pf.nr_reads += pf->nr_reads;
+		win->pf.bytes_read += pf->bytes_read;
+		win->pf.bytes_useful += pf->bytes_useful;
+		win->pf.stalls += pf->stalls;
+		win->pf.stall_ns += pf->stall_ns;
+	}
+
+	win->peak_rss = tm_peak_rss();
+	slab_mem_usage(&win->slab_mem, &win->slab_spilled);
+}
+
+static void
+tm_window_alloc_ags(
+	struct tm_window	*win)
+{
+	win->ags = calloc(tm_agcount, sizeof(struct tm_counters));
+	win->ag_pf = calloc(tm_agcount, sizeof(struct prefetch_stats));
+	if (!win->ags || !win->ag_pf)
+		do_error(_("couldn't allocate telemetry AG counters\n"));
+}
+
+static void
+tm_print_counters(
+	struct tm_counters	*c)
+{
+	fprintf(tm_fp,
+"\"read_ios\": %" PRId64 ", \"read_bytes\": %" PRId64 ", "
+"\"write_ios\": %" PRId64 ", \"write_bytes\": %" PRId64 ", "
+"\"buffer_waits\": %" PRId64 ", \"buffer_wait_s\": %.6f",
+		atomic64_read(&c->read_ios), atomic64_read(&c->read_bytes),
+		atomic64_read(&c->write_ios), atomic64_read(&c->write_bytes),
+		atomic64_read(&c->buf_waits),
+		atomic64_read(&c->buf_wait_ns) / 1e9);
+}
+
+static void
+tm_print_window(
+	struct tm_window	*win,
+	bool			last)
+{
+	unsigned long long	lookups = win->cache_hits + win->cache_misses;
+	xfs_agnumber_t		agno;
+
+	fprintf(tm_fp, "    {\n");
+	if (win->phase >= 0)
+		fprintf(tm_fp, "      \"phase\": %d, \"name\": \"%s\",\n",
+				win->phase, tm_phase_names[win->phase]);
+	else
+		fprintf(tm_fp, "      \"phase\": null, \"name\": \"%s\",\n",
+				tm_last_phase == 7 && !no_modify ?
+					"flush and unmount" : "exit");
+	fprintf(tm_fp,
+"      \"wall_s\": %.6f, \"user_s\": %.6f, \"sys_s\": %.6f,\n",
+		win->wall_ns / 1e9,
+		win->utime.tv_sec + win->utime.tv_usec / 1e6,
+		win->stime.tv_sec + win->stime.tv_usec / 1e6);
+	fprintf(tm_fp, "      ");
+	tm_print_counters(&win->io);
+	fprintf(tm_fp, ",\n");
+	fprintf(tm_fp,
+"      \"cache_hits\": %llu, \"cache_misses\": %llu, \"cache_hit_rate\": %.4f,\n",
+		win->cache_hits, win->cache_misses,
+		lookups ? (double)win->cache_hits / lookups : 0.0);
+	fprintf(tm_fp,
+"      \"prefetch_reads\": %" PRIu64 ", \"prefetch_bytes\": %" PRIu64 ", "
+"\"prefetch_stalls\": %" PRIu64 ", \"prefetch_stall_s\": %.6f,\n",
+		win->pf.nr_reads, win->pf.bytes_read, win->pf.stalls,
+		win->pf.stall_ns / 1e9);
+	fprintf(tm_fp,
+"      \"peak_rss_bytes\": %llu, \"slab_bytes\": %zu, \"slab_spilled_bytes\": %zu",
+		(unsigned long long)win->peak_rss << 10, win->slab_mem,
+		win->slab_spilled);
+
+	if (win->ags) {
+		fprintf(tm_fp, ",\n      \"ags\": [\n");
+		for (agno = 0; agno < tm_agcount; agno++) {
+			struct tm_counters	*c = &win->ags[agno];
+			struct prefetch_stats	*pf = &win->ag_pf[agno];
+
+			fprintf(tm_fp,
+"        {\"agno\": %u, \"work_s\": %.6f, \"cpu_s\": %.6f, ",
+				agno, atomic64_read(&c->work_ns) / 1e9,
+				atomic64_read(&c->cpu_ns) / 1e9);
+			tm_print_counters(c);
+			fprintf(tm_fp,
+", \"prefetch_stalls\": %" PRIu64 ", \"prefetch_stall_s\": %.6f}%s\n",
+				pf->stalls, pf->stall_ns / 1e9,
+				agno + 1 < tm_agcount ? "," : "");
+		}
+		fprintf(tm_fp, "      ]");
+	}
+	fprintf(tm_fp, "\n    }%s\n", last ? "" : ",");
+}
+
+static void
+tm_write(void)
+{
+	struct tm_window	*win = &tm_windows[tm_cur];
+	unsigned long		peak_rss = 0;
+	int			i;
+
+	if (!tm_fp)
+		return;
+
+	/* whatever ran after the last phase ended */
+	tm_window_close(win, -1);
+	for (i = 0; i <= tm_cur; i++)
+		peak_rss = max(peak_rss, tm_windows[i].peak_rss);
+
+	fprintf(tm_fp, "{\n");
+	fprintf(tm_fp, "  \"version\": 1,\n");
+	fprintf(tm_fp, "  \"program\": \"%s\", \"xfsprogs\": \"%s\",\n",
+			progname, VERSION);
+	fprintf(tm_fp, "  \"device\": \"");
+	for (i = 0; fs_name && fs_name[i]; i++) {
+		if (fs_name[i] == '"' || fs_name[i] == '\\')
+			fputc('\\', tm_fp);
+		fputc(fs_name[i], tm_fp);
+	}
+	fprintf(tm_fp, "\",\n");
+	fprintf(tm_fp, "  \"no_modify\": %s, \"agcount\": %u,\n",
+			no_modify ? "true" : "false", tm_agcount);
+	fprintf(tm_fp, "  \"last_phase\": %d, \"peak_rss_per_phase\": %s,\n",
+			tm_last_phase, tm_hwm_reset ? "true" : "false");
+	fprintf(tm_fp, "  \"wall_s\": %.6f, \"peak_rss_bytes\": %llu,\n",
+			(tm_clock_ns(CLOCK_MONOTONIC) - tm_start_ns) / 1e9,
+			(unsigned long long)peak_rss << 10);
+	fprintf(tm_fp, "  \"phases\": [\n");
+	for (i = 0; i <= tm_cur; i++)
+		tm_print_window(&tm_windows[i], i == tm_cur);
+	fprintf(tm_fp, "  ]\n}\n");
+
+	if (fclose(tm_fp))
+		fprintf(stderr, _("%s: couldn't write telemetry: %s\n"),
+				progname, strerror(errno));
+	tm_fp = NULL;
+}
+
+/* Open the telemetry file and start counting. */
+void
+telemetry_init(
+	const char		*path)
+{
+	tm_fp = fopen(path, "w");
+	if (!tm_fp)
+		do_abort(_("couldn't open telemetry file %s: %s\n"), path,
+				strerror(errno));
+	if (atexit(tm_write))
+		do_abort(_("couldn't register telemetry writer\n"));
+
+	tm_start_ns = tm_clock_ns(CLOCK_MONOTONIC);
+	tm_window_open(&tm_windows[0]);
+	libxfs_io_account_hook = tm_io_account;
+	telemetry_enabled = true;
+}
+
+/* Now that we know where the AGs are, break everything down by AG. */
+void
+telemetry_set_geometry(
+	struct xfs_mount	*mp)
+{
+	if (!telemetry_enabled)
+		return;
+
+	tm_ddev = mp->m_ddev_targp->bt_bdev;
+	tm_ag_bbs = XFS_FSB_TO_BB(mp, mp->m_sb.sb_agblocks);
+	tm_agcount = mp->m_sb.sb_agcount;
+	tm_pf_base = calloc(tm_agcount, sizeof(struct prefetch_stats));
+	if (!tm_pf_base)
+		do_error(_("couldn't allocate telemetry AG counters\n"));
+	tm_window_alloc_ags(&tm_windows[tm_cur]);
+}
+
+void
+telemetry_phase_end(
+	int			phase)
+{
+	struct tm_window	*next;
+
+	if (!telemetry_enabled || tm_cur + 1 >= TM_MAX_WINDOWS)
+		return;
+
+	tm_window_close(&tm_windows[tm_cur], phase);
+	tm_last_phase = phase;
+
+	next = &tm_windows[tm_cur + 1];
+	if (tm_agcount)
+		tm_window_alloc_ags(next);
+	tm_window_open(next);
+	uatomic_set(&tm_cur, tm_cur + 1);
+}
+
+void
+__telemetry_ag_start(
+	struct telemetry_work	*tw)
+{
+	tw->wall_ns = tm_clock_ns(CLOCK_MONOTONIC);
+	tw->cpu_ns = tm_clock_ns(CLOCK_THREAD_CPUTIME_ID);
+}
+
+void
+__telemetry_ag_end(
+	xfs_agnumber_t		agno,
+	struct telemetry_work	*tw)
+{
+	struct tm_window	*win = &tm_windows[uatomic_read(&tm_cur)];
+
+	if (!win->ags || agno >= tm_agcount)
+		return;
+
+	atomic64_add(tm_clock_ns(CLOCK_MONOTONIC) - tw->wall_ns,
+			&win->ags[agno].work_ns);
+	atomic64_add(tm_clock_ns(CLOCK_THREAD_CPUTIME_ID) - tw->cpu_ns,
+			&win->ags[agno].cpu_ns);
+}
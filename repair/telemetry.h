@@ -0,0 +1,43 @@
+// SPDX-License-Identifier: GPL-2.0
+#ifndef _XFS_REPAIR_TELEMETRY_H_
+#define _XFS_REPAIR_TELEMETRY_H_
+
+/*
+ * Repair telemetry.  When enabled with -o telemetry=file, every phase records
+ * wall and CPU time, I/O, buffer cache and prefetch behaviour and peak memory,
+ * with per-AG breakdowns, and the lot is written to the file as JSON when
+ * xfs_repair exits.
+ */
+
+/* Start time of one piece of per-AG work. */
+struct telemetry_work {
+	uint64_t		wall_ns;
+	uint64_t		cpu_ns;
+};
+
+extern bool	telemetry_enabled;
+
+void telemetry_init(const char *path);
+void telemetry_set_geometry(struct xfs_mount *mp);
+void telemetry_phase_end(int phase);
+void __telemetry_ag_start(struct telemetry_work *tw);
+void __telemetry_ag_end(xfs_agnumber_t agno, struct telemetry_work *tw);
+
+static inline void
+telemetry_ag_start(
+	struct telemetry_work	*tw)
+{
+	if (telemetry_enabled)
+		__telemetry_ag_start(tw);
+}
+
+static inline void
+telemetry_ag_end(
+	xfs_agnumber_t		agno,
+	struct telemetry_work	*tw)
+{
+	if (telemetry_enabled)
+		__telemetry_ag_end(agno, tw);
+}
+
+#endif /* _XFS_REPAIR_TELEMETRY_H_ */
@@ -37,6 +37,20 @@ create_work_queue(
 				err, strerror(err));
 }
 
+void
+create_work_queue_stealing(
+	struct workqueue	*wq,
+	struct xfs_mount	*mp,
+	unsigned int		nworkers)
+{
+	int			err;
+
+	err = -workqueue_create_stealing(wq, mp, nworkers);
+	if (err)
+		do_error(_("cannot create worker threads, error = [%d] %s\n"),
+				err, strerror(err));
+}
+
 void
 queue_work(
 	struct workqueue	*wq,
@@ -52,6 +66,22 @@ queue_work(
 				err, strerror(err));
 }
 
+void
+queue_work_batch(
+	struct workqueue	*wq,
+	workqueue_func_t	func,
+	xfs_agnumber_t		agno,
+	void			**args,
+	unsigned int		nr)
+{
+	int			err;
+
+	err = -workqueue_add_batch(wq, func, agno, args, nr);
+	if (err)
+		do_error(_("cannot allocate worker item, error = [%d] %s\n"),
+				err, strerror(err));
+}
+
 void
 destroy_work_queue(
 	struct workqueue	*wq)
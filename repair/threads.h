@@ -13,6 +13,12 @@ create_work_queue(
 	struct xfs_mount	*mp,
 	unsigned int		nworkers);
 
+void
+create_work_queue_stealing(
+	struct workqueue	*wq,
+	struct xfs_mount	*mp,
+	unsigned int		nworkers);
+
 void
 queue_work(
 	struct workqueue	*wq,
@@ -20,6 +26,14 @@ queue_work(
 	xfs_agnumber_t 		agno,
 	void			*arg);
 
+void
+queue_work_batch(
+	struct workqueue	*wq,
+	workqueue_func_t	func,
+	xfs_agnumber_t 		agno,
+	void			**args,
+	unsigned int		nr);
+
 void
 destroy_work_queue(
 	struct workqueue	*wq);
@@ -26,6 +26,7 @@
 #include "libfrog/platform.h"
 #include "bulkload.h"
 #include "quotacheck.h"
+#include "telemetry.h"
 
 /*
  * option tables for getsubopt calls
@@ -44,6 +45,8 @@ enum o_opt_nums {
 	BLOAD_LEAF_SLACK,
 	BLOAD_NODE_SLACK,
 	NOQUOTA,
+	SPILL_DIR,
+	TELEMETRY,
 	O_MAX_OPTS,
 };
 
@@ -57,6 +60,8 @@ static char *o_opts[] = {
 	[BLOAD_LEAF_SLACK]	= "debug_bload_leaf_slack",
 	[BLOAD_NODE_SLACK]	= "debug_bload_node_slack",
 	[NOQUOTA]		= "noquota",
+	[SPILL_DIR]		= "spill_dir",
+	[TELEMETRY]		= "telemetry",
 	[O_MAX_OPTS]		= NULL,
 };
 
@@ -84,6 +89,8 @@ static int	bhash_option_used;
 static long	max_mem_specified;	/* in megabytes */
 static int	phase2_threads = 32;
 static bool	report_corrected;
+static char	*spill_dir;
+static char	*telemetry_file;
 
 static void
 usage(void)
@@ -289,6 +296,22 @@ process_args(int argc, char **argv)
 				case NOQUOTA:
 					quotacheck_skip();
 					break;
+				case SPILL_DIR:
+					if (!val)
+						do_abort(
+		_("-o spill_dir requires a parameter\n"));
+					if (access(val, W_OK | X_OK))
+						do_abort(
+		_("cannot use %s for spill files: %s\n"),
+							val, strerror(errno));
+					spill_dir = val;
+					break;
+				case TELEMETRY:
+					if (!val)
+						do_abort(
+		_("-o telemetry requires a parameter\n"));
+					telemetry_file = val;
+					break;
 				default:
 					unknown('o', val);
 					break;
@@ -943,10 +966,43 @@ unlock:
 	pthread_mutex_unlock(&wb_mutex);
 }
 
+/* Report how much memory we're using, and how much of it is slabs. */
+static void
+report_mem_usage(
+	int			phase)
+{
+	struct rusage		ru;
+	unsigned long		size;
+	unsigned long		resident = 0;
+	size_t			slab_mem;
+	size_t			slab_spilled;
+	FILE			*fp;
+
+	fp = fopen("/proc/self/statm", "r");
+	if (fp) {
+		if (fscanf(fp, "%lu %lu", &size, &resident) != 2)
+			resident = 0;
+		fclose(fp);
+	}
+	resident = resident * sysconf(_SC_PAGESIZE) >> 20;
+	if (getrusage(RUSAGE_SELF, &ru))
+		ru.ru_maxrss = 0;
+	slab_mem_usage(&slab_mem, &slab_spilled);
+
+	do_log(
+_("        - phase %d memory: %luMB resident, %luMB peak, slabs %zuMB in memory, %zuMB spilled\n"),
+		phase, resident, (unsigned long)ru.ru_maxrss >> 10,
+		slab_mem >> 20, slab_spilled >> 20);
+}
+
 static inline void
 phase_end(int phase)
 {
 	timestamp(PHASE_END, phase, NULL);
+	telemetry_phase_end(phase);
+
+	if (verbose && phase > 0)
+		report_mem_usage(phase);
 
 	/* Fail if someone injected an post-phase error. */
 	if (fail_after_phase && phase == fail_after_phase)
@@ -977,6 +1033,8 @@ main(int argc, char **argv)
 	setbuf(stdout, NULL);
 
 	process_args(argc, argv);
+	if (telemetry_file)
+		telemetry_init(telemetry_file);
 	xfs_init(&x);
 
 	msgbuf = malloc(DURATION_BUF_SIZE);
@@ -1192,6 +1250,22 @@ main(int argc, char **argv)
 		}
 
 		max_mem -= mem_used;
+
+		/*
+		 * If slabs can be spilled to disk, give them a quarter of
+		 * what's left and the buffer cache the rest.
+		 */
+		if (spill_dir) {
+			unsigned long	slab_mem = max_mem / 4;
+
+			slab_set_spill(spill_dir, (size_t)slab_mem << 10);
+			max_mem -= slab_mem;
+			if (verbose)
+				do_log(
+	_("        - slabs spill to %s after %luMB\n"),
+					spill_dir, slab_mem >> 10);
+		}
+
 		if (max_mem >= (1 << 30))
 			max_mem = 1 << 30;
 		libxfs_bhash_size = max_mem / (HASH_CACHE_RATIO *
@@ -1203,8 +1277,11 @@ main(int argc, char **argv)
 			do_log(_("        - block cache size set to %d entries\n"),
 				libxfs_bhash_size * HASH_CACHE_RATIO);
 
-		libxfs_bcache = cache_init(0, libxfs_bhash_size,
+		libxfs_bcache = cache_init(CACHE_SHARDED, libxfs_bhash_size,
 						&libxfs_bcache_operations);
+	} else if (spill_dir) {
+		/* no memory budget, so spill every slab */
+		slab_set_spill(spill_dir, 0);
 	}
 
 	/*
@@ -1229,6 +1306,8 @@ main(int argc, char **argv)
 		return(1);
 	}
 
+	telemetry_set_geometry(mp);
+
 	/* make sure the per-ag freespace maps are ok so we can mount the fs */
 	phase2(mp, phase2_threads);
 	phase_end(2);
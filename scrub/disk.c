@@ -335,6 +335,23 @@ disk_simulate_read_error(
 	return 0;
 }
 
+/*
+ * Can we verify this disk by issuing plain direct reads asynchronously?  Not
+ * if we're going to use SCSI VERIFY, and not if the debug knobs want to fake
+ * errors or skip the IO, since that happens in disk_read_verify.
+ */
+bool
+disk_can_verify_async(
+	struct disk		*disk)
+{
+	if (disk->d_flags & DISK_FLAG_SCSI_VERIFY)
+		return false;
+	if (debug && (getenv("XFS_SCRUB_DISK_ERROR_INTERVAL") ||
+		      getenv("XFS_SCRUB_DISK_VERIFY_SKIP")))
+		return false;
+	return true;
+}
+
 /* Read-verify an extent of a disk device. */
 ssize_t
 disk_read_verify(
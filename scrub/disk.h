@@ -23,5 +23,6 @@ struct disk *disk_open(const char *pathname);
 int disk_close(struct disk *disk);
 ssize_t disk_read_verify(struct disk *disk, void *buf, uint64_t startblock,
 		uint64_t blockcount);
+bool disk_can_verify_async(struct disk *disk);
 
 #endif /* XFS_SCRUB_DISK_H_ */
@@ -26,6 +26,7 @@
 #include "disk.h"
 #include "scrub.h"
 #include "repair.h"
+#include "throttle.h"
 #include "libfrog/fsgeom.h"
 
 /* Phase 1: Find filesystem geometry (and clean up after) */
@@ -51,6 +52,8 @@ scrub_cleanup(
 	int			error;
 
 	action_lists_free(&ctx->action_lists);
+	throttle_free(ctx->meta_throttle);
+	ctx->meta_throttle = NULL;
 	if (ctx->fshandle)
 		free_handle(ctx->fshandle, ctx->fshandle_len);
 	if (ctx->rtdev)
@@ -182,6 +185,20 @@ _("Unable to find realtime device path."));
 		fflush(stdout);
 	}
 
+	/*
+	 * Scrub calls don't have a size, so only the number in flight and the
+	 * pause between calls can be adjusted to meet a latency target.
+	 */
+	if (throttle_latency_ms) {
+		error = throttle_alloc(scrub_nproc(ctx), 0, 0,
+				&ctx->meta_throttle);
+		if (error) {
+			str_liberror(ctx, error,
+					_("creating metadata scrub throttle"));
+			return error;
+		}
+	}
+
 	if (ctx->fsinfo.fs_log) {
 		ctx->logdev = disk_open(ctx->fsinfo.fs_log);
 		if (!ctx->logdev) {
@@ -27,21 +27,95 @@
  *
  * Identify potential data block extents with GETFSMAP, then feed those
  * extents to the read-verify pool to get the verify commands batched,
- * issued, and (if there are problems) reported back to us.  If there
+ * issued, and (if there are problems) reported back to us.  We collect all
+ * the data and realtime extents before verifying any of them, merging any
+ * that are less than a stripe apart, so that the pool can give each disk
+ * head one long sequential stream to read.  If there
  * are errors, we'll record the bad regions and (if available) use rmap
  * to tell us if metadata are now corrupt.  Otherwise, we'll scan the
  * whole directory tree looking for files that overlap the bad regions
  * and report the paths of the now corrupt files.
+ *
+ * If the user gave us a state file, we only verify a window of the data
+ * and realtime devices per run.  The window starts wherever the last run
+ * stopped and walks GETFSMAP in physical order until it has covered the
+ * requested fraction of the allocated space or used up its time budget,
+ * wrapping around to the start of the data device if need be.  The end of
+ * the window is saved once all of its reads have finished, so successive
+ * runs cover the whole filesystem.  The bad block bitmaps only ever hold
+ * errors from the current window.
  */
 
 /* Verify disk blocks with GETFSMAP */
 
+/* The log device only holds the log, so we never read-verify it. */
+#define VERIFY_WINDOW_MAX_DEVS	2
+
+/*
+ * Names of the devices in the state file, in walk order.  Device numbers can
+ * change across reboots, but the uuid already says which filesystem it is.
+ */
+static const char *verify_window_roles[VERIFY_WINDOW_MAX_DEVS] = {
+	"data",
+	"rt",
+};
+
+/* Check the time budget at least this often, in bytes. */
+#define VERIFY_WINDOW_CHUNK	(33554432ULL)
+
+/*
+ * Always merge extents that are this close together, and never merge extents
+ * that are further apart than the max, however wide the stripe is.
+ */
+#define MEDIA_MERGE_MIN_GAP	(65536ULL)
+#define MEDIA_MERGE_MAX_GAP	(1048576ULL)
+
+/* Physically sorted extents waiting to be verified. */
+struct media_extents {
+	struct read_verify_extent	*ext;
+	size_t				nr;
+	size_t				size;
+	bool				unsorted;
+};
+
+/* One run's worth of a partial media scan. */
+struct verify_window {
+	/* Devices in the order we walk them. */
+	dev_t			devs[VERIFY_WINDOW_MAX_DEVS];
+	unsigned int		nr_devs;
+
+	/* Where this run started. */
+	unsigned int		start_dev;
+	uint64_t		start_phys;	/* bytes */
+
+	/* How far we've gotten. */
+	unsigned int		cur_dev;
+	uint64_t		cur_phys;	/* bytes */
+
+	/* Part of the current device that's in the window. */
+	uint64_t		lo;		/* bytes */
+	uint64_t		hi;		/* bytes, exclusive */
+
+	uint64_t		budget_bytes;	/* zero means no limit */
+	uint64_t		scheduled;	/* bytes */
+	uint64_t		deadline_ns;	/* zero means no limit */
+	unsigned long long	passes;		/* full passes completed */
+	bool			stopped;
+};
+
 struct media_verify_state {
 	struct read_verify_pool	*rvp_data;
 	struct read_verify_pool	*rvp_log;
 	struct read_verify_pool	*rvp_realtime;
 	struct bitmap		*d_bad;		/* bytes */
 	struct bitmap		*r_bad;		/* bytes */
+	struct verify_window	*win;		/* partial scan, if any */
+
+	/* Extents gathered up for sorted verification. */
+	struct media_extents	*d_ext;		/* one per AG */
+	struct media_extents	r_ext;
+	struct media_extents	d_sorted;
+	uint64_t		merge_gap;	/* bytes */
 };
 
 /* Find the fd for a given device identifier. */
@@ -499,19 +573,11 @@ report_all_media_errors(
 	return scrub_scan_all_inodes(ctx, report_inode_loss, vs);
 }
 
-/* Schedule a read-verify of a (data block) extent. */
-static int
-check_rmap(
-	struct scrub_ctx		*ctx,
-	struct fsmap			*map,
-	void				*arg)
+/* Should we read-verify this space mapping? */
+static bool
+want_media_verify(
+	struct fsmap			*map)
 {
-	struct media_verify_state	*vs = arg;
-	struct read_verify_pool		*rvp;
-	int				ret;
-
-	rvp = dev_to_pool(ctx, vs, map->fmr_device);
-
 	dbg_printf("rmap dev %d:%d phys %"PRIu64" owner %"PRId64
 			" offset %"PRIu64" len %"PRIu64" flags 0x%x\n",
 			major(map->fmr_device), minor(map->fmr_device),
@@ -532,13 +598,26 @@ check_rmap(
 	 */
 	if (map->fmr_flags & (FMR_OF_PREALLOC | FMR_OF_ATTR_FORK |
 			      FMR_OF_EXTENT_MAP | FMR_OF_SPECIAL_OWNER))
-		return 0;
+		return false;
 
 	/* XXX: Filter out directory data blocks. */
 
-	/* Schedule the read verify command for (eventual) running. */
-	ret = read_verify_schedule_io(rvp, map->fmr_physical, map->fmr_length,
-			vs);
+	return true;
+}
+
+/* Schedule the read verify command for (eventual) running. */
+static int
+schedule_media_verify(
+	struct scrub_ctx		*ctx,
+	struct media_verify_state	*vs,
+	dev_t				dev,
+	uint64_t			start,
+	uint64_t			length)
+{
+	int				ret;
+
+	ret = read_verify_schedule_io(dev_to_pool(ctx, vs, dev), start,
+			length, vs);
 	if (ret) {
 		str_liberror(ctx, ret, _("scheduling media verify command"));
 		return ret;
@@ -547,6 +626,560 @@ check_rmap(
 	return 0;
 }
 
+/*
+ * Add an extent to a list, merging it with the last one if they're close
+ * enough together.
+ */
+static int
+media_extents_add(
+	struct media_extents		*me,
+	uint64_t			start,
+	uint64_t			length,
+	uint64_t			merge_gap)
+{
+	struct read_verify_extent	*last;
+	struct read_verify_extent	*p;
+	size_t				new_size;
+
+	if (me->nr > 0) {
+		last = &me->ext[me->nr - 1];
+		if (start < last->start) {
+			me->unsorted = true;
+		} else if (!me->unsorted &&
+			   start <= last->start + last->length + merge_gap) {
+			last->length = max(last->start + last->length,
+					start + length) - last->start;
+			return 0;
+		}
+	}
+
+	if (me->nr == me->size) {
+		new_size = max(me->size * 2, (size_t)1024);
+		p = realloc(me->ext, new_size * sizeof(*p));
+		if (!p)
+			return errno;
+		me->ext = p;
+		me->size = new_size;
+	}
+
+	me->ext[me->nr].start = start;
+	me->ext[me->nr].length = length;
+	me->nr++;
+	return 0;
+}
+
+static void
+media_extents_free(
+	struct media_extents		*me)
+{
+	free(me->ext);
+	memset(me, 0, sizeof(*me));
+}
+
+static int
+media_extent_cmp(
+	const void			*a,
+	const void			*b)
+{
+	const struct read_verify_extent	*ea = a;
+	const struct read_verify_extent	*eb = b;
+
+	if (ea->start < eb->start)
+		return -1;
+	return ea->start > eb->start;
+}
+
+/* Sort a list (if need be) and merge extents that are close together. */
+static void
+media_extents_merge(
+	struct media_extents		*me,
+	uint64_t			merge_gap)
+{
+	struct read_verify_extent	*last;
+	struct read_verify_extent	*p;
+	size_t				i;
+
+	if (me->nr == 0)
+		return;
+	if (me->unsorted)
+		qsort(me->ext, me->nr, sizeof(*me->ext), media_extent_cmp);
+	me->unsorted = false;
+
+	last = me->ext;
+	for (i = 1, p = me->ext + 1; i < me->nr; i++, p++) {
+		if (p->start <= last->start + last->length + merge_gap) {
+			last->length = max(last->start + last->length,
+					p->start + p->length) - last->start;
+		} else {
+			*(++last) = *p;
+		}
+	}
+	me->nr = last - me->ext + 1;
+}
+
+/* Remember a (data block) extent for sorted verification. */
+static int
+collect_rmap(
+	struct scrub_ctx		*ctx,
+	struct fsmap			*map,
+	void				*arg)
+{
+	struct media_verify_state	*vs = arg;
+	struct media_extents		*me;
+	uint64_t			bperag;
+	int				ret;
+
+	if (!want_media_verify(map))
+		return 0;
+
+	/*
+	 * Each AG is walked by a single thread and has its own list.  Nothing
+	 * on the log device ever needs verifying, but just in case...
+	 */
+	if (map->fmr_device == ctx->fsinfo.fs_datadev) {
+		bperag = (uint64_t)ctx->mnt.fsgeom.agblocks *
+			 ctx->mnt.fsgeom.blocksize;
+		me = &vs->d_ext[map->fmr_physical / bperag];
+	} else if (map->fmr_device == ctx->fsinfo.fs_rtdev) {
+		me = &vs->r_ext;
+	} else {
+		return schedule_media_verify(ctx, vs, map->fmr_device,
+				map->fmr_physical, map->fmr_length);
+	}
+
+	ret = media_extents_add(me, map->fmr_physical, map->fmr_length,
+			vs->merge_gap);
+	if (ret)
+		str_liberror(ctx, ret, _("recording media verify extent"));
+	return ret;
+}
+
+/*
+ * Gather up the data and realtime extents, then hand them to the verifiers
+ * in physical order.  GETFSMAP returns each AG's mappings in order and the
+ * AGs don't overlap, so gluing the AG lists together in AG order gets us a
+ * sorted list of the whole data device without having to sort it.
+ */
+static int
+scan_sorted_extents(
+	struct scrub_ctx		*ctx,
+	struct media_verify_state	*vs)
+{
+	struct media_extents		*me;
+	xfs_agnumber_t			agno;
+	uint64_t			swidth;
+	size_t				nr = 0;
+	int				ret;
+
+	swidth = (uint64_t)ctx->mnt.fsgeom.swidth * ctx->mnt.fsgeom.blocksize;
+	vs->merge_gap = min(max(swidth, MEDIA_MERGE_MIN_GAP),
+			MEDIA_MERGE_MAX_GAP);
+
+	vs->d_ext = calloc(ctx->mnt.fsgeom.agcount,
+			sizeof(struct media_extents));
+	if (!vs->d_ext) {
+		ret = errno;
+		str_liberror(ctx, ret, _("allocating media verify extents"));
+		return ret;
+	}
+
+	ret = scrub_scan_all_spacemaps(ctx, collect_rmap, vs);
+	if (ret)
+		goto out_free;
+
+	for (agno = 0; agno < ctx->mnt.fsgeom.agcount; agno++) {
+		me = &vs->d_ext[agno];
+		if (me->unsorted)
+			media_extents_merge(me, vs->merge_gap);
+		nr += me->nr;
+	}
+
+	vs->d_sorted.ext = malloc(max(nr, (size_t)1) *
+			sizeof(struct read_verify_extent));
+	if (!vs->d_sorted.ext) {
+		ret = errno;
+		str_liberror(ctx, ret, _("allocating media verify extents"));
+		goto out_free;
+	}
+	vs->d_sorted.size = max(nr, (size_t)1);
+	for (agno = 0; agno < ctx->mnt.fsgeom.agcount; agno++) {
+		me = &vs->d_ext[agno];
+		memcpy(vs->d_sorted.ext + vs->d_sorted.nr, me->ext,
+				me->nr * sizeof(struct read_verify_extent));
+		vs->d_sorted.nr += me->nr;
+		media_extents_free(me);
+	}
+	free(vs->d_ext);
+	vs->d_ext = NULL;
+
+	/* Merge across AG boundaries. */
+	media_extents_merge(&vs->d_sorted, vs->merge_gap);
+	media_extents_merge(&vs->r_ext, vs->merge_gap);
+
+	ret = read_verify_schedule_sorted(vs->rvp_data, vs->d_sorted.ext,
+			vs->d_sorted.nr, vs);
+	if (ret) {
+		str_liberror(ctx, ret, _("scheduling media verify command"));
+		return ret;
+	}
+
+	if (vs->rvp_realtime) {
+		ret = read_verify_schedule_sorted(vs->rvp_realtime,
+				vs->r_ext.ext, vs->r_ext.nr, vs);
+		if (ret) {
+			str_liberror(ctx, ret,
+					_("scheduling media verify command"));
+			return ret;
+		}
+	}
+
+	return 0;
+
+out_free:
+	for (agno = 0; agno < ctx->mnt.fsgeom.agcount; agno++)
+		media_extents_free(&vs->d_ext[agno]);
+	free(vs->d_ext);
+	vs->d_ext = NULL;
+	return ret;
+}
+
+static inline uint64_t
+verify_window_now(void)
+{
+	struct timespec			ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+/*
+ * Schedule a read-verify of the part of a (data block) extent that falls in
+ * the window, and stop the walk once the window is full.
+ */
+static int
+check_window_rmap(
+	struct scrub_ctx		*ctx,
+	struct fsmap			*map,
+	void				*arg)
+{
+	struct media_verify_state	*vs = arg;
+	struct verify_window		*win = vs->win;
+	uint64_t			start;
+	uint64_t			end;
+	uint64_t			len;
+	uint64_t			left;
+	int				ret;
+
+	/* GETFSMAP can hand us mappings that straddle the keys. */
+	start = max((uint64_t)map->fmr_physical, win->lo);
+	end = min((uint64_t)(map->fmr_physical + map->fmr_length), win->hi);
+	if (end <= start)
+		return 0;
+
+	if (!want_media_verify(map)) {
+		win->cur_phys = end;
+		return 0;
+	}
+
+	while (start < end) {
+		if (win->deadline_ns &&
+		    verify_window_now() >= win->deadline_ns) {
+			win->stopped = true;
+			return ECANCELED;
+		}
+
+		len = min(end - start, VERIFY_WINDOW_CHUNK);
+		if (win->budget_bytes) {
+			left = win->budget_bytes - win->scheduled;
+			if (len >= left) {
+				len = left - (left % ctx->mnt.fsgeom.blocksize);
+				win->stopped = true;
+			}
+		}
+
+		if (len > 0) {
+			ret = schedule_media_verify(ctx, vs, map->fmr_device,
+					start, len);
+			if (ret)
+				return ret;
+			win->scheduled += len;
+			start += len;
+		}
+
+		win->cur_phys = start;
+		if (win->stopped)
+			return ECANCELED;
+	}
+
+	return 0;
+}
+
+/*
+ * Walk the space mappings from where the last run stopped until the window
+ * is full, wrapping around at the end of the last device.  When we're done,
+ * the window cursor points to where the next run should start.
+ */
+static int
+scan_verify_window(
+	struct scrub_ctx		*ctx,
+	struct media_verify_state	*vs)
+{
+	struct fsmap			keys[2];
+	struct verify_window		*win = vs->win;
+	unsigned int			d = win->start_dev;
+	bool				wrapped = false;
+	int				ret;
+
+	win->lo = win->start_phys;
+	for (;;) {
+		win->cur_dev = d;
+		win->cur_phys = win->lo;
+		if (wrapped && d == win->start_dev)
+			win->hi = win->start_phys;
+		else
+			win->hi = ULLONG_MAX;
+
+		if (win->lo < win->hi) {
+			memset(keys, 0, sizeof(struct fsmap) * 2);
+			keys->fmr_device = win->devs[d];
+			keys->fmr_physical = win->lo;
+			(keys + 1)->fmr_device = win->devs[d];
+			(keys + 1)->fmr_physical = win->hi - 1;
+			(keys + 1)->fmr_owner = ULLONG_MAX;
+			(keys + 1)->fmr_offset = ULLONG_MAX;
+			(keys + 1)->fmr_flags = UINT_MAX;
+
+			ret = scrub_iterate_fsmap(ctx, keys, check_window_rmap,
+					vs);
+			if (win->stopped)
+				return 0;
+			if (ret) {
+				char	descr[DESCR_BUFSZ];
+
+				snprintf(descr, DESCR_BUFSZ,
+						_("dev %d:%d fsmap"),
+						major(win->devs[d]),
+						minor(win->devs[d]));
+				str_liberror(ctx, ret, descr);
+				return ret;
+			}
+			if (scrub_excessive_errors(ctx))
+				return 0;
+		}
+
+		/* Back where we started, so we covered everything. */
+		if (wrapped && d == win->start_dev)
+			break;
+
+		win->lo = 0;
+		if (++d == win->nr_devs) {
+			d = 0;
+			wrapped = true;
+			win->passes++;
+		}
+	}
+
+	win->cur_dev = win->start_dev;
+	win->cur_phys = win->start_phys;
+	return 0;
+}
+
+/* Render the filesystem uuid for the state file. */
+static void
+verify_window_uuid(
+	struct scrub_ctx		*ctx,
+	char				*buf)
+{
+	unsigned int			i;
+
+	for (i = 0; i < sizeof(ctx->mnt.fsgeom.uuid); i++)
+		sprintf(buf + (i * 2), "%02x", ctx->mnt.fsgeom.uuid[i]);
+}
+
+/*
+ * Figure out where this run's window starts from the state file.  If there
+ * isn't one, or it's for a different filesystem, start at the beginning.
+ */
+static int
+load_verify_window(
+	struct scrub_ctx		*ctx,
+	struct verify_window		*win)
+{
+	char				uuid[33];
+	char				want_uuid[33];
+	char				role[8];
+	FILE				*fp;
+	unsigned long long		physical;
+	unsigned long long		passes;
+	unsigned int			i;
+	int				nr;
+
+	fp = fopen(verify_state_file, "r");
+	if (!fp) {
+		if (errno == ENOENT)
+			return 0;
+		str_errno(ctx, verify_state_file);
+		return errno;
+	}
+	nr = fscanf(fp, "uuid %32s device %7s physical %llu passes %llu",
+			uuid, role, &physical, &passes);
+	fclose(fp);
+
+	if (nr != 4) {
+		str_info(ctx, verify_state_file,
+_("Could not parse media scan state; starting over."));
+		return 0;
+	}
+
+	verify_window_uuid(ctx, want_uuid);
+	if (strcmp(uuid, want_uuid)) {
+		str_info(ctx, verify_state_file,
+_("Media scan state is for a different filesystem; starting over."));
+		return 0;
+	}
+
+	for (i = 0; i < win->nr_devs; i++) {
+		if (!strcmp(role, verify_window_roles[i]))
+			break;
+	}
+	if (i == win->nr_devs) {
+		str_info(ctx, verify_state_file,
+_("Media scan state is for a different device; starting over."));
+		return 0;
+	}
+
+	win->start_dev = i;
+	win->start_phys = physical;
+	win->passes = passes;
+	return 0;
+}
+
+/* Remember where the next run should start. */
+static int
+save_verify_window(
+	struct scrub_ctx		*ctx,
+	struct verify_window		*win)
+{
+	char				tmpfile[PATH_MAX];
+	char				uuid[33];
+	FILE				*fp;
+	int				ret;
+
+	ret = snprintf(tmpfile, PATH_MAX, "%s.tmp", verify_state_file);
+	if (ret < 0 || ret >= PATH_MAX) {
+		str_liberror(ctx, ENAMETOOLONG, verify_state_file);
+		return ENAMETOOLONG;
+	}
+
+	fp = fopen(tmpfile, "w");
+	if (!fp)
+		goto out_errno;
+
+	verify_window_uuid(ctx, uuid);
+	fprintf(fp, "uuid %s\ndevice %s\nphysical %llu\npasses %llu\n",
+			uuid, verify_window_roles[win->cur_dev],
+			(unsigned long long)win->cur_phys, win->passes);
+	if (fflush(fp) || fsync(fileno(fp))) {
+		fclose(fp);
+		goto out_unlink;
+	}
+	if (fclose(fp))
+		goto out_unlink;
+	if (rename(tmpfile, verify_state_file))
+		goto out_unlink;
+	return 0;
+
+out_unlink:
+	ret = errno;
+	unlink(tmpfile);
+	errno = ret;
+out_errno:
+	ret = errno;
+	str_errno(ctx, verify_state_file);
+	return ret;
+}
+
+/* Set up a partial media scan. */
+static int
+setup_verify_window(
+	struct scrub_ctx		*ctx,
+	struct media_verify_state	*vs)
+{
+	struct verify_window		*win;
+	unsigned long long		d_blocks;
+	unsigned long long		d_bfree;
+	unsigned long long		r_blocks;
+	unsigned long long		r_bfree;
+	unsigned long long		dontcare;
+	int				ret;
+
+	win = calloc(1, sizeof(struct verify_window));
+	if (!win) {
+		ret = errno;
+		str_errno(ctx, _("allocating media scan window"));
+		return ret;
+	}
+
+	win->devs[win->nr_devs++] = ctx->fsinfo.fs_datadev;
+	if (ctx->fsinfo.fs_rt)
+		win->devs[win->nr_devs++] = ctx->fsinfo.fs_rtdev;
+
+	if (verify_fraction) {
+		ret = scrub_scan_estimate_blocks(ctx, &d_blocks, &d_bfree,
+				&r_blocks, &r_bfree, &dontcare);
+		if (ret) {
+			str_liberror(ctx, ret, _("estimating verify work"));
+			goto out_win;
+		}
+		win->budget_bytes = cvt_off_fsb_to_b(&ctx->mnt,
+				(d_blocks - d_bfree) + (r_blocks - r_bfree));
+		win->budget_bytes = max(win->budget_bytes * verify_fraction /
+				100, (uint64_t)ctx->mnt.fsgeom.blocksize);
+	}
+	if (verify_budget)
+		win->deadline_ns = verify_window_now() +
+				(uint64_t)verify_budget * NSEC_PER_SEC;
+
+	ret = load_verify_window(ctx, win);
+	if (ret)
+		goto out_win;
+
+	vs->win = win;
+	return 0;
+out_win:
+	free(win);
+	return ret;
+}
+
+/* Save the end of the window and tell the user how far we got. */
+static int
+finish_verify_window(
+	struct scrub_ctx		*ctx,
+	struct verify_window		*win,
+	unsigned long long		passes)
+{
+	int				ret;
+
+	ret = save_verify_window(ctx, win);
+	if (ret)
+		return ret;
+
+	if (verbose) {
+		if (win->passes > passes)
+			fprintf(stdout,
+_("%s: finished media scan pass %llu.\n"),
+					ctx->mntpoint, win->passes);
+		fprintf(stdout,
+_("%s: next media scan starts at dev %d:%d offset %llu.\n"),
+				ctx->mntpoint,
+				major(win->devs[win->cur_dev]),
+				minor(win->devs[win->cur_dev]),
+				(unsigned long long)win->cur_phys);
+		fflush(stdout);
+	}
+	return 0;
+}
+
 /* Wait for read/verify actions to finish, then return # bytes checked. */
 static int
 clean_pool(
@@ -615,12 +1248,20 @@ phase6_func(
 	struct scrub_ctx		*ctx)
 {
 	struct media_verify_state	vs = { NULL };
+	unsigned long long		passes = 0;
 	int				ret, ret2, ret3;
 
+	if (verify_state_file) {
+		ret = setup_verify_window(ctx, &vs);
+		if (ret)
+			return ret;
+		passes = vs.win->passes;
+	}
+
 	ret = -bitmap_alloc(&vs.d_bad);
 	if (ret) {
 		str_liberror(ctx, ret, _("creating datadev badblock bitmap"));
-		return ret;
+		goto out_win;
 	}
 
 	ret = -bitmap_alloc(&vs.r_bad);
@@ -656,7 +1297,10 @@ phase6_func(
 			goto out_logpool;
 		}
 	}
-	ret = scrub_scan_all_spacemaps(ctx, check_rmap, &vs);
+	if (vs.win)
+		ret = scan_verify_window(ctx, &vs);
+	else
+		ret = scan_sorted_extents(ctx, &vs);
 	if (ret)
 		goto out_rtpool;
 
@@ -672,20 +1316,28 @@ phase6_func(
 	if (ret3)
 		str_liberror(ctx, ret3, _("flushing rtdev verify pool"));
 
+	media_extents_free(&vs.d_sorted);
+	media_extents_free(&vs.r_ext);
+
 	/*
-	 * If the verify flush didn't work or we found no bad blocks, we're
-	 * done!  No errors detected.
+	 * If the verify flush didn't work, we're done.  If we found bad
+	 * blocks, scan the whole dir tree to see what matches the bad extents.
 	 */
 	if (ret || ret2 || ret3)
 		goto out_rbad;
-	if (bitmap_empty(vs.d_bad) && bitmap_empty(vs.r_bad))
-		goto out_rbad;
+	if (!bitmap_empty(vs.d_bad) || !bitmap_empty(vs.r_bad)) {
+		ret = report_all_media_errors(ctx, &vs);
+		if (ret)
+			goto out_rbad;
+	}
 
-	/* Scan the whole dir tree to see what matches the bad extents. */
-	ret = report_all_media_errors(ctx, &vs);
+	/* Every read in the window finished, so move the cursor along. */
+	if (vs.win && !scrub_excessive_errors(ctx))
+		ret = finish_verify_window(ctx, vs.win, passes);
 
 	bitmap_free(&vs.r_bad);
 	bitmap_free(&vs.d_bad);
+	free(vs.win);
 	return ret;
 
 out_rtpool:
@@ -705,6 +1357,10 @@ out_rbad:
 	bitmap_free(&vs.r_bad);
 out_dbad:
 	bitmap_free(&vs.d_bad);
+out_win:
+	media_extents_free(&vs.d_sorted);
+	media_extents_free(&vs.r_ext);
+	free(vs.win);
 	return ret;
 }
 
@@ -732,6 +1388,8 @@ phase6_estimate(
 
 	*items = cvt_off_fsb_to_b(&ctx->mnt,
 			(d_blocks - d_bfree) + (r_blocks - r_bfree));
+	if (verify_fraction)
+		*items = *items * verify_fraction / 100;
 	*nr_threads = disk_heads(ctx->datadev);
 	*rshift = 20;
 	return 0;
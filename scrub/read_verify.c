@@ -7,15 +7,17 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <sys/statvfs.h>
+#include <sys/mman.h>
 #include "libfrog/ptvar.h"
 #include "libfrog/workqueue.h"
 #include "libfrog/paths.h"
+#include "libfrog/iouring.h"
 #include "xfs_scrub.h"
 #include "common.h"
-#include "counter.h"
 #include "disk.h"
 #include "read_verify.h"
 #include "progress.h"
+#include "throttle.h"
 
 /*
  * Read Verify Pool
@@ -25,6 +27,28 @@
  * pool worker.  Adjacent (or nearly adjacent) requests can be combined
  * to reduce overhead when free space fragmentation is high.  The thread
  * pool takes care of issuing multiple IOs to the device, if possible.
+ *
+ * If the kernel supports io_uring, each pool thread cuts its requests into
+ * smaller reads and keeps a number of them in flight at once, each with its
+ * own buffer from a per-thread pool, so that fast devices see a deep queue
+ * without needing a thread per IO.  A request is not finished until the last
+ * of its reads completes, which may happen while the thread is busy with a
+ * later request, or when the pool is flushed.  Any read that fails or comes
+ * back short is done over again synchronously so that we can single-step
+ * through it and find the bad blocks exactly as before.  Without io_uring
+ * (or for SCSI VERIFY) every read is synchronous, with one per thread.
+ *
+ * If the user set a latency target or bandwidth limit, every read has to get
+ * past a throttle shared by all the threads, which may also shrink the reads.
+ * Throttled threads submit each async read right away and wait for all of
+ * their reads before picking up the next request, so that a thread sitting
+ * idle never holds on to reads that another thread is waiting for.
+ *
+ * Callers that can gather up every extent ahead of time can instead hand
+ * the pool a physically sorted list.  The list is cut into one contiguous
+ * shard per verifier thread, so that each thread (and hopefully each disk
+ * head) streams through its own part of the disk in order instead of
+ * taking turns with the other threads.
  */
 
 /*
@@ -49,22 +73,67 @@ rvp_io_max_size(void)
 /* Tolerate 64k holes in adjacent read verify requests. */
 #define RVP_IO_BATCH_LOCALITY	(65536)
 
+/*
+ * Split combined requests larger than this so that a big contiguous file is
+ * spread over all the verifier threads instead of being read by just one.
+ */
+#define RVP_MAX_REQUEST_SIZE	(RVP_IO_MAX_SIZE)
+
+/* Size of each asynchronous read. */
+#define RVP_ASYNC_IO_SIZE	(1048576)
+
+/* Default number of asynchronous reads in flight per disk. */
+#define RVP_DEFAULT_QUEUE_DEPTH	(32)
+
+/*
+ * Don't let the submitters queue up more than this many requests per thread,
+ * so that a partial media scan stops soon after its time budget runs out.
+ */
+#define RVP_MAX_QUEUED_PER_THREAD	(2)
+
 struct read_verify {
 	void			*io_end_arg;
 	struct disk		*io_disk;
 	uint64_t		io_start;	/* bytes */
 	uint64_t		io_length;	/* bytes */
+	unsigned int		io_inflight;	/* async reads not yet reaped */
+};
+
+/* One asynchronous read covering part of a read verify request. */
+struct read_verify_slot {
+	struct read_verify	*rv;
+	struct read_verify_slot	*next;		/* free list */
+	void			*buf;
+	uint64_t		start;		/* bytes */
+	uint64_t		length;		/* bytes */
+	uint64_t		issue_ns;	/* throttle start time */
+};
+
+/* Per-thread verifier state. */
+struct read_verify_thread {
+	struct iouring		*ring;
+	struct read_verify_slot	*slots;
+	struct read_verify_slot	*free_slots;
+	void			*bufs;
+	size_t			bufs_len;
+	bool			setup_done;
+	uint64_t		verified;	/* bytes */
 };
 
 struct read_verify_pool {
 	struct workqueue	wq;		/* thread pool */
 	struct scrub_ctx	*ctx;		/* scrub context */
-	void			*readbuf;	/* read buffer */
-	struct ptcounter	*verified_bytes;
+	void			*readbuf;	/* sync read buffer */
+	struct ptvar		*rvthreads;	/* per-thread verifier state */
 	struct ptvar		*rvstate;	/* combines read requests */
 	struct disk		*disk;		/* which disk? */
+	struct throttle		*throttle;	/* latency/bandwidth limits */
 	read_verify_ioerr_fn_t	ioerr_fn;	/* io error callback */
 	size_t			miniosz;	/* minimum io size, bytes */
+	size_t			async_iosz;	/* async read size, bytes */
+	unsigned int		verifier_threads;
+	unsigned int		queue_depth;	/* async reads per thread */
+	bool			async;		/* use io_uring? */
 
 	/*
 	 * Store a runtime error code here so that we can stop the pool and
@@ -73,6 +142,21 @@ struct read_verify_pool {
 	int			runtime_error;
 };
 
+/* Can we issue asynchronous reads to this disk? */
+static bool
+read_verify_can_async(
+	struct disk			*disk)
+{
+	struct iouring			*ring;
+
+	if (!disk_can_verify_async(disk))
+		return false;
+	if (iouring_alloc(1, &ring))
+		return false;
+	iouring_free(ring);
+	return true;
+}
+
 /*
  * Create a thread pool to run read verifiers.
  *
@@ -81,6 +165,10 @@ struct read_verify_pool {
  * @ioerr_fn will be called when IO errors occur.
  * @submitter_threads is the number of threads that may be sending verify
  * requests at any given time.
+ *
+ * The number of reads in flight to the disk can be set with
+ * verify_queue_depth.  With io_uring that many reads are spread over
+ * disk_heads() threads; without it, that many threads are started.
  */
 int
 read_verify_pool_alloc(
@@ -93,6 +181,7 @@ read_verify_pool_alloc(
 {
 	struct read_verify_pool		*rvp;
 	unsigned int			verifier_threads = disk_heads(disk);
+	unsigned int			queue_depth;
 	int				ret;
 
 	/*
@@ -112,19 +201,52 @@ read_verify_pool_alloc(
 			rvp_io_max_size());
 	if (ret)
 		goto out_free;
-	ret = ptcounter_alloc(verifier_threads, &rvp->verified_bytes);
+
+	rvp->async = read_verify_can_async(disk);
+	if (verify_queue_depth)
+		queue_depth = verify_queue_depth;
+	else if (rvp->async && !bg_mode)
+		queue_depth = RVP_DEFAULT_QUEUE_DEPTH;
+	else
+		queue_depth = verifier_threads;
+	if (rvp->async) {
+		rvp->queue_depth = howmany(queue_depth, verifier_threads);
+		rvp->async_iosz = min(rvp_io_max_size(), RVP_ASYNC_IO_SIZE);
+		rvp->async_iosz -= rvp->async_iosz % miniosz;
+		if (rvp->async_iosz < miniosz)
+			rvp->async_iosz = miniosz;
+	} else {
+		verifier_threads = queue_depth;
+	}
+
+	if (throttle_wanted()) {
+		ret = throttle_alloc(queue_depth, miniosz,
+				rvp->async ? rvp->async_iosz : rvp_io_max_size(),
+				&rvp->throttle);
+		if (ret)
+			goto out_buf;
+	}
+
+	/*
+	 * Requests run inline in the submitting threads if there's only one
+	 * verifier, and the pool flush finishes off everyone's async reads.
+	 */
+	ret = -ptvar_alloc(verifier_threads + submitter_threads + 1,
+			sizeof(struct read_verify_thread), &rvp->rvthreads);
 	if (ret)
-		goto out_buf;
+		goto out_throttle;
 	rvp->miniosz = miniosz;
+	rvp->verifier_threads = verifier_threads;
 	rvp->ctx = ctx;
 	rvp->disk = disk;
 	rvp->ioerr_fn = ioerr_fn;
 	ret = -ptvar_alloc(submitter_threads, sizeof(struct read_verify),
 			&rvp->rvstate);
 	if (ret)
-		goto out_counter;
-	ret = -workqueue_create(&rvp->wq, (struct xfs_mount *)rvp,
-			verifier_threads == 1 ? 0 : verifier_threads);
+		goto out_rvthreads;
+	ret = -workqueue_create_bound(&rvp->wq, (struct xfs_mount *)rvp,
+			verifier_threads == 1 ? 0 : verifier_threads,
+			verifier_threads * RVP_MAX_QUEUED_PER_THREAD);
 	if (ret)
 		goto out_rvstate;
 	*prvp = rvp;
@@ -132,8 +254,10 @@ read_verify_pool_alloc(
 
 out_rvstate:
 	ptvar_free(rvp->rvstate);
-out_counter:
-	ptcounter_free(rvp->verified_bytes);
+out_rvthreads:
+	ptvar_free(rvp->rvthreads);
+out_throttle:
+	throttle_free(rvp->throttle);
 out_buf:
 	free(rvp->readbuf);
 out_free:
@@ -141,6 +265,92 @@ out_free:
 	return ret;
 }
 
+/* Set up a thread's async reads the first time it verifies something. */
+static int
+read_verify_thread_setup(
+	struct read_verify_pool		*rvp,
+	struct read_verify_thread	*rvt)
+{
+	unsigned int			i;
+	int				ret;
+
+	if (rvt->setup_done)
+		return rvt->ring ? 0 : -EOPNOTSUPP;
+	rvt->setup_done = true;
+
+	rvt->slots = calloc(rvp->queue_depth, sizeof(struct read_verify_slot));
+	if (!rvt->slots)
+		return -errno;
+	rvt->bufs_len = rvp->queue_depth * rvp->async_iosz;
+	ret = posix_memalign(&rvt->bufs, page_size, rvt->bufs_len);
+	if (ret) {
+		rvt->bufs = NULL;
+		goto out_slots;
+	}
+	ret = iouring_alloc(rvp->queue_depth, &rvt->ring);
+	if (ret)
+		goto out_bufs;
+
+	/* Keep the read buffers in memory if we can. */
+	mlock(rvt->bufs, rvt->bufs_len);
+
+	for (i = 0; i < rvp->queue_depth; i++) {
+		struct read_verify_slot	*slot = &rvt->slots[i];
+
+		slot->buf = (char *)rvt->bufs + i * rvp->async_iosz;
+		slot->next = rvt->free_slots;
+		rvt->free_slots = slot;
+	}
+	return 0;
+
+out_bufs:
+	free(rvt->bufs);
+	rvt->bufs = NULL;
+out_slots:
+	free(rvt->slots);
+	rvt->slots = NULL;
+	rvt->ring = NULL;
+	return ret;
+}
+
+static int
+read_verify_thread_free(
+	struct ptvar			*ptv,
+	void				*data,
+	void				*foreach_arg)
+{
+	struct read_verify_thread	*rvt = data;
+
+	if (!rvt->ring)
+		return 0;
+	iouring_free(rvt->ring);
+	munlock(rvt->bufs, rvt->bufs_len);
+	free(rvt->bufs);
+	free(rvt->slots);
+	rvt->ring = NULL;
+	return 0;
+}
+
+static int read_verify_reap(struct read_verify_pool *rvp,
+		struct read_verify_thread *rvt, bool wait);
+
+/* Wait for a thread's async reads to finish. */
+static int
+read_verify_thread_drain(
+	struct ptvar			*ptv,
+	void				*data,
+	void				*foreach_arg)
+{
+	struct read_verify_pool		*rvp = foreach_arg;
+	struct read_verify_thread	*rvt = data;
+
+	while (rvt->ring && iouring_inflight(rvt->ring) > 0) {
+		if (read_verify_reap(rvp, rvt, true) < 0)
+			break;
+	}
+	return 0;
+}
+
 /* Abort all verification work. */
 void
 read_verify_pool_abort(
@@ -149,6 +359,7 @@ read_verify_pool_abort(
 	if (!rvp->runtime_error)
 		rvp->runtime_error = ECANCELED;
 	workqueue_terminate(&rvp->wq);
+	ptvar_foreach(rvp->rvthreads, read_verify_thread_drain, rvp);
 }
 
 /* Finish up any read verification work. */
@@ -156,7 +367,11 @@ int
 read_verify_pool_flush(
 	struct read_verify_pool		*rvp)
 {
-	return -workqueue_terminate(&rvp->wq);
+	int				ret;
+
+	ret = -workqueue_terminate(&rvp->wq);
+	ptvar_foreach(rvp->rvthreads, read_verify_thread_drain, rvp);
+	return ret;
 }
 
 /* Finish up any read verification work and tear it down. */
@@ -165,43 +380,46 @@ read_verify_pool_destroy(
 	struct read_verify_pool		*rvp)
 {
 	workqueue_destroy(&rvp->wq);
+	ptvar_foreach(rvp->rvthreads, read_verify_thread_free, NULL);
 	ptvar_free(rvp->rvstate);
-	ptcounter_free(rvp->verified_bytes);
+	ptvar_free(rvp->rvthreads);
+	throttle_free(rvp->throttle);
 	free(rvp->readbuf);
 	free(rvp);
 }
 
 /*
- * Issue a read-verify IO in big batches.
+ * Synchronously read-verify @rv, starting with IOs of @io_max_size bytes and
+ * cutting down to single blocks if we hit errors.  Each read waits for
+ * @throttle, if one is given.  Returns the number of bytes that were read
+ * successfully.
  */
-static void
-read_verify(
-	struct workqueue		*wq,
-	xfs_agnumber_t			agno,
-	void				*arg)
+static unsigned long long
+read_verify_sync(
+	struct read_verify_pool		*rvp,
+	struct read_verify		*rv,
+	ssize_t				io_max_size,
+	struct throttle			*throttle)
 {
-	struct read_verify		*rv = arg;
-	struct read_verify_pool		*rvp;
 	unsigned long long		verified = 0;
-	ssize_t				io_max_size;
+	uint64_t			start_ns;
 	ssize_t				sz;
 	ssize_t				len;
 	int				read_error;
-	int				ret;
-
-	rvp = (struct read_verify_pool *)wq->wq_ctx;
-	if (rvp->runtime_error)
-		return;
-
-	io_max_size = rvp_io_max_size();
 
 	while (rv->io_length > 0) {
 		read_error = 0;
 		len = min(rv->io_length, io_max_size);
+		if (throttle && io_max_size > rvp->miniosz)
+			len = min(len, (ssize_t)throttle_iosz(throttle));
 		dbg_printf("diskverify %d %"PRIu64" %zu\n", rvp->disk->d_fd,
 				rv->io_start, len);
+		if (throttle)
+			throttle_start(throttle, len, false, &start_ns);
 		sz = disk_read_verify(rvp->disk, rvp->readbuf, rv->io_start,
 				len);
+		if (throttle)
+			throttle_done(throttle, start_ns);
 		if (sz == len && io_max_size < rvp->miniosz) {
 			/*
 			 * If the verify request was 100% successful and less
@@ -218,7 +436,7 @@ read_verify(
 			/* Runtime error, bail out... */
 			if (read_error != EIO && read_error != EILSEQ) {
 				rvp->runtime_error = read_error;
-				return;
+				return verified;
 			}
 
 			/*
@@ -272,10 +490,266 @@ read_verify(
 		background_sleep();
 	}
 
+	return verified;
+}
+
+/* Deal with a completed async read. */
+static void
+read_verify_complete(
+	struct read_verify_pool		*rvp,
+	struct read_verify_thread	*rvt,
+	struct read_verify_slot		*slot,
+	int				res)
+{
+	struct read_verify		*rv = slot->rv;
+	struct read_verify		retry = {
+		.io_end_arg		= rv->io_end_arg,
+		.io_disk		= rv->io_disk,
+		.io_start		= slot->start,
+		.io_length		= slot->length,
+	};
+
+	if (res == slot->length) {
+		progress_add(res);
+		rvt->verified += res;
+		background_sleep();
+		return;
+	}
+
+	/* Runtime error, bail out... */
+	if (res < 0 && res != -EIO && res != -EILSEQ) {
+		rvp->runtime_error = -res;
+		return;
+	}
+
+	/*
+	 * The read failed or came up short.  Go over it again one block at a
+	 * time to find out exactly which blocks are bad.
+	 */
+	dbg_printf("ASYNC %s %d @ %"PRIu64" %"PRIu64" res %d\n",
+			res < 0 ? "IOERR" : "SHORT", rvp->disk->d_fd,
+			slot->start, slot->length, res);
+	rvt->verified += read_verify_sync(rvp, &retry, rvp->miniosz, NULL);
+}
+
+/*
+ * Reap one async read, waiting for it if @wait is set.  Returns 1 if a read
+ * was reaped, 0 if not, or a negative errno.
+ */
+static int
+read_verify_reap(
+	struct read_verify_pool		*rvp,
+	struct read_verify_thread	*rvt,
+	bool				wait)
+{
+	struct read_verify_slot		*slot;
+	struct read_verify		*rv;
+	void				*data;
+	int				res;
+	int				ret;
+
+	ret = iouring_reap(rvt->ring, wait, &data, &res);
+	if (ret < 0) {
+		rvp->runtime_error = -ret;
+		return ret;
+	}
+	if (ret == 0)
+		return 0;
+
+	slot = data;
+	rv = slot->rv;
+	if (rvp->throttle)
+		throttle_done(rvp->throttle, slot->issue_ns);
+	if (!rvp->runtime_error)
+		read_verify_complete(rvp, rvt, slot, res);
+
+	slot->rv = NULL;
+	slot->next = rvt->free_slots;
+	rvt->free_slots = slot;
+	if (--rv->io_inflight == 0 && rv->io_length == 0)
+		free(rv);
+	return 1;
+}
+
+/*
+ * Cut @rv into reads and send them to the disk, waiting for earlier reads
+ * to finish when we run out of buffers.  @rv is freed by whoever reaps the
+ * last of its reads.
+ */
+static void
+read_verify_async(
+	struct read_verify_pool		*rvp,
+	struct read_verify_thread	*rvt,
+	struct read_verify		*rv)
+{
+	struct read_verify_slot		*slot;
+	uint64_t			len;
+	int				ret;
+
+	while (rv->io_length > 0 && !rvp->runtime_error) {
+		slot = rvt->free_slots;
+		if (!slot) {
+			ret = iouring_submit(rvt->ring, 0);
+			if (ret) {
+				rvp->runtime_error = -ret;
+				break;
+			}
+			read_verify_reap(rvp, rvt, true);
+			continue;
+		}
+
+		len = min(rv->io_length, (uint64_t)rvp->async_iosz);
+		if (rvp->throttle) {
+			len = min(len, (uint64_t)throttle_iosz(rvp->throttle));
+
+			/*
+			 * Don't wait on other threads while we have reads of
+			 * our own that could be reaped instead.
+			 */
+			ret = throttle_start(rvp->throttle, len,
+					iouring_inflight(rvt->ring) > 0,
+					&slot->issue_ns);
+			if (ret == EAGAIN) {
+				read_verify_reap(rvp, rvt, true);
+				continue;
+			}
+		}
+
+		dbg_printf("diskverify async %d %"PRIu64" %"PRIu64"\n",
+				rvp->disk->d_fd, rv->io_start, len);
+		ret = iouring_prep_read(rvt->ring, rvp->disk->d_fd, slot->buf,
+				len, rv->io_start, slot);
+		if (ret) {
+			if (rvp->throttle)
+				throttle_done(rvp->throttle, slot->issue_ns);
+			rvp->runtime_error = -ret;
+			break;
+		}
+		rvt->free_slots = slot->next;
+		slot->rv = rv;
+		slot->start = rv->io_start;
+		slot->length = len;
+		rv->io_inflight++;
+		rv->io_start += len;
+		rv->io_length -= len;
+
+		if (rvp->throttle) {
+			ret = iouring_submit(rvt->ring, 0);
+			if (ret) {
+				rvp->runtime_error = -ret;
+				break;
+			}
+		}
+	}
+
+	/* Give up on whatever we didn't send if something broke. */
+	rv->io_length = 0;
+
+	ret = iouring_submit(rvt->ring, 0);
+	if (ret && !rvp->runtime_error)
+		rvp->runtime_error = -ret;
+	if (rv->io_inflight == 0)
+		free(rv);
+
+	/* Pick up anything that's already done. */
+	while (read_verify_reap(rvp, rvt, false) > 0)
+		;
+
+	/* Throttled threads must not sit on reads while idle. */
+	if (rvp->throttle)
+		read_verify_thread_drain(NULL, rvt, rvp);
+}
+
+/* Verify @rv and free it. */
+static void
+read_verify_one(
+	struct read_verify_pool		*rvp,
+	struct read_verify		*rv)
+{
+	struct read_verify_thread	*rvt;
+	int				ret;
+
+	rvt = ptvar_get(rvp->rvthreads, &ret);
+	if (ret) {
+		rvp->runtime_error = -ret;
+		free(rv);
+		return;
+	}
+
+	if (rvp->async && read_verify_thread_setup(rvp, rvt) == 0) {
+		read_verify_async(rvp, rvt, rv);
+		return;
+	}
+
+	rvt->verified += read_verify_sync(rvp, rv, rvp_io_max_size(),
+			rvp->throttle);
 	free(rv);
-	ret = ptcounter_add(rvp->verified_bytes, verified);
-	if (ret)
-		rvp->runtime_error = ret;
+}
+
+/*
+ * Issue a read-verify IO in big batches.
+ */
+static void
+read_verify(
+	struct workqueue		*wq,
+	xfs_agnumber_t			agno,
+	void				*arg)
+{
+	struct read_verify		*rv = arg;
+	struct read_verify_pool		*rvp;
+
+	rvp = (struct read_verify_pool *)wq->wq_ctx;
+	if (rvp->runtime_error) {
+		free(rv);
+		return;
+	}
+
+	read_verify_one(rvp, rv);
+}
+
+/* One verifier thread's share of a sorted extent list. */
+struct read_verify_shard {
+	struct read_verify_extent	*extents;
+	uint64_t			skip;	/* bytes of the first extent */
+	uint64_t			length;	/* bytes */
+	void				*end_arg;
+};
+
+/* Verify a shard of a sorted extent list, in order. */
+static void
+read_verify_shard(
+	struct workqueue		*wq,
+	xfs_agnumber_t			agno,
+	void				*arg)
+{
+	struct read_verify_shard	*shard = arg;
+	struct read_verify_extent	*ext = shard->extents;
+	struct read_verify_pool		*rvp;
+	struct read_verify		*rv;
+	uint64_t			skip = shard->skip;
+	uint64_t			length = shard->length;
+
+	rvp = (struct read_verify_pool *)wq->wq_ctx;
+	while (length > 0 && !rvp->runtime_error) {
+		rv = calloc(1, sizeof(struct read_verify));
+		if (!rv) {
+			rvp->runtime_error = errno;
+			break;
+		}
+		rv->io_end_arg = shard->end_arg;
+		rv->io_disk = rvp->disk;
+		rv->io_start = ext->start + skip;
+		rv->io_length = min(ext->length - skip, length);
+		length -= rv->io_length;
+		skip = 0;
+		ext++;
+
+		dbg_printf("verify fd %d start %"PRIu64" len %"PRIu64"\n",
+				rvp->disk->d_fd, rv->io_start, rv->io_length);
+		read_verify_one(rvp, rv);
+	}
+
+	free(shard);
 }
 
 /* Queue a read verify request. */
@@ -370,6 +844,85 @@ read_verify_schedule_io(
 		rv->io_end_arg = end_arg;
 	}
 
+	/* Send off the front of the stashed IO if it's gotten too big. */
+	while (rv->io_length > RVP_MAX_REQUEST_SIZE) {
+		struct read_verify	piece = *rv;
+
+		piece.io_length = RVP_MAX_REQUEST_SIZE;
+		ret = read_verify_queue(rvp, &piece);
+		if (ret)
+			return ret;
+		rv->io_start += RVP_MAX_REQUEST_SIZE;
+		rv->io_length -= RVP_MAX_REQUEST_SIZE;
+	}
+
+	return 0;
+}
+
+/*
+ * Verify a list of @nr extents that are sorted by physical address and do
+ * not overlap.  The list is split into a contiguous shard for each verifier
+ * thread with about the same number of bytes in each, and must not be freed
+ * until the pool has been flushed.
+ */
+int
+read_verify_schedule_sorted(
+	struct read_verify_pool		*rvp,
+	struct read_verify_extent	*extents,
+	size_t				nr,
+	void				*end_arg)
+{
+	struct read_verify_shard	*shard;
+	uint64_t			total = 0;
+	uint64_t			per_shard;
+	uint64_t			skip = 0;
+	uint64_t			left;
+	size_t				i = 0;
+	int				ret;
+
+	assert(rvp->readbuf);
+
+	if (rvp->runtime_error)
+		return rvp->runtime_error;
+
+	for (i = 0; i < nr; i++)
+		total += extents[i].length;
+	if (total == 0)
+		return 0;
+	per_shard = roundup(howmany(total, rvp->verifier_threads),
+			rvp->miniosz);
+
+	i = 0;
+	while (total > 0) {
+		shard = malloc(sizeof(struct read_verify_shard));
+		if (!shard) {
+			rvp->runtime_error = errno;
+			return errno;
+		}
+		shard->extents = &extents[i];
+		shard->skip = skip;
+		shard->length = min(per_shard, total);
+		shard->end_arg = end_arg;
+		total -= shard->length;
+
+		/* Find where the next shard starts. */
+		for (left = shard->length; left > 0; i++) {
+			if (extents[i].length - skip > left) {
+				skip += left;
+				break;
+			}
+			left -= extents[i].length - skip;
+			skip = 0;
+		}
+
+		ret = -workqueue_add(&rvp->wq, read_verify_shard, 0, shard);
+		if (ret) {
+			free(shard);
+			rvp->runtime_error = ret;
+			return ret;
+		}
+	}
+
 	return 0;
 }
 
@@ -399,11 +952,26 @@ read_verify_force_io(
 	return -ptvar_foreach(rvp->rvstate, force_one_io, rvp);
 }
 
+static int
+read_verify_thread_bytes(
+	struct ptvar			*ptv,
+	void				*data,
+	void				*foreach_arg)
+{
+	struct read_verify_thread	*rvt = data;
+	uint64_t			*bytes_checked = foreach_arg;
+
+	*bytes_checked += rvt->verified;
+	return 0;
+}
+
 /* How many bytes has this process verified? */
 int
 read_verify_bytes(
 	struct read_verify_pool		*rvp,
 	uint64_t			*bytes_checked)
 {
-	return ptcounter_value(rvp->verified_bytes, bytes_checked);
+	*bytes_checked = 0;
+	return -ptvar_foreach(rvp->rvthreads, read_verify_thread_bytes,
+			bytes_checked);
 }
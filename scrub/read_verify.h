@@ -25,6 +25,15 @@ void read_verify_pool_destroy(struct read_verify_pool *rvp);
 
 int read_verify_schedule_io(struct read_verify_pool *rvp, uint64_t start,
 		uint64_t length, void *end_arg);
+
+/* A range of the disk to verify, for read_verify_schedule_sorted. */
+struct read_verify_extent {
+	uint64_t		start;		/* bytes */
+	uint64_t		length;		/* bytes */
+};
+
+int read_verify_schedule_sorted(struct read_verify_pool *rvp,
+		struct read_verify_extent *extents, size_t nr, void *end_arg);
 int read_verify_force_io(struct read_verify_pool *rvp);
 int read_verify_bytes(struct read_verify_pool *rvp, uint64_t *bytes);
 
@@ -21,6 +21,7 @@
 #include "xfs_errortag.h"
 #include "repair.h"
 #include "descr.h"
+#include "throttle.h"
 
 /* Online scrub and repair wrappers. */
 
@@ -127,6 +128,7 @@ xfs_check_metadata(
 	bool				is_inode)
 {
 	DEFINE_DESCR(dsc, ctx, format_scrub_descr);
+	uint64_t			start_ns;
 	unsigned int			tries = 0;
 	int				error;
 
@@ -136,7 +138,11 @@ xfs_check_metadata(
 
 	dbg_printf("check %s flags %xh\n", descr_render(&dsc), meta->sm_flags);
 retry:
+	if (ctx->meta_throttle)
+		throttle_start(ctx->meta_throttle, 0, false, &start_ns);
 	error = -xfrog_scrub_metadata(xfdp, meta);
+	if (ctx->meta_throttle)
+		throttle_done(ctx->meta_throttle, start_ns);
 	if (debug_tweak_on("XFS_SCRUB_FORCE_REPAIR") && !error)
 		meta->sm_flags |= XFS_SCRUB_OFLAG_CORRUPT;
 	switch (error) {
@@ -0,0 +1,251 @@
+// SPDX-License-Identifier: GPL-2.0+
+/*
+ * Copyright (C) 2026 Oracle.  All Rights Reserved.
+ */
+#include "xfs.h"
+#include <stdint.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/statvfs.h>
+#include "libfrog/paths.h"
+#include "xfs_scrub.h"
+#include "common.h"
+#include "throttle.h"
+
+/*
+ * IO Throttling
+ *
+ * Background mode (-b) slows scrub down by a fixed amount no matter what the
+ * storage is doing.  A throttle instead watches how long each IO (or scrub
+ * call) takes and adjusts how much we throw at the storage to keep that
+ * latency under a target.  When the average latency over a round of IOs is
+ * over the target we halve the number of IOs in flight; once we're down to
+ * one, we halve the IO size; once that's at the minimum, we start pausing
+ * before each IO.  When the latency is comfortably under the target we undo
+ * those steps in reverse order, one step per round.  The pause never gets
+ * longer than a few IOs' worth of time, so if the storage can't meet the
+ * target at all we slow down a lot but still finish.
+ *
+ * Separately, a bandwidth limit spaces out the start of each IO so that the
+ * bytes we ask for never get ahead of the limit.
+ */
+
+/* Size of the first IOs when we have a latency target. */
+#define THROTTLE_START_IOSZ	(131072)
+
+/* Shortest and longest pause between IOs. */
+#define THROTTLE_MIN_DELAY	(100 * NSEC_PER_USEC)
+#define THROTTLE_MAX_DELAY	(NSEC_PER_SEC)
+
+/* Don't pause for more than this many times the average IO latency. */
+#define THROTTLE_MAX_DELAY_RATIO	(8)
+
+struct throttle {
+	pthread_mutex_t		lock;
+	pthread_cond_t		wait;
+
+	uint64_t		target_ns;	/* latency target */
+	uint64_t		bytes_per_sec;	/* bandwidth limit */
+
+	unsigned int		max_inflight;
+	unsigned int		limit;		/* IOs allowed in flight */
+	unsigned int		inflight;
+	size_t			min_iosz;
+	size_t			max_iosz;
+	size_t			iosz;		/* current IO size */
+	uint64_t		delay_ns;	/* pause before each IO */
+
+	uint64_t		avg_ns;		/* moving average latency */
+	unsigned int		samples;	/* IOs this round */
+	uint64_t		next_ns;	/* bandwidth clock */
+};
+
+static inline uint64_t
+throttle_now(void)
+{
+	struct timespec		ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+/* Did the user ask for throttling? */
+bool
+throttle_wanted(void)
+{
+	return throttle_latency_ms > 0 || throttle_bandwidth_mb > 0;
+}
+
+/*
+ * Create a throttle for up to @max_inflight concurrent IOs of between
+ * @min_iosz and @max_iosz bytes.  The IO size is only adjusted in multiples
+ * of @min_iosz; pass zero for both if the IO size can't be changed.
+ */
+int
+throttle_alloc(
+	unsigned int		max_inflight,
+	size_t			min_iosz,
+	size_t			max_iosz,
+	struct throttle		**tp)
+{
+	struct throttle		*t;
+
+	t = calloc(1, sizeof(struct throttle));
+	if (!t)
+		return errno;
+
+	pthread_mutex_init(&t->lock, NULL);
+	pthread_cond_init(&t->wait, NULL);
+	t->target_ns = (uint64_t)throttle_latency_ms * 1000 * NSEC_PER_USEC;
+	t->bytes_per_sec = (uint64_t)throttle_bandwidth_mb << 20;
+	t->max_inflight = max(max_inflight, 1U);
+	t->min_iosz = min_iosz;
+	t->max_iosz = max_iosz;
+
+	/* Start gently if we have to meet a latency target. */
+	if (t->target_ns) {
+		t->limit = 1;
+		t->iosz = min(max_iosz, max(min_iosz,
+				(size_t)THROTTLE_START_IOSZ));
+		if (min_iosz)
+			t->iosz -= t->iosz % min_iosz;
+	} else {
+		t->limit = t->max_inflight;
+		t->iosz = max_iosz;
+	}
+
+	*tp = t;
+	return 0;
+}
+
+void
+throttle_free(
+	struct throttle		*t)
+{
+	if (!t)
+		return;
+	pthread_cond_destroy(&t->wait);
+	pthread_mutex_destroy(&t->lock);
+	free(t);
+}
+
+/* Back off or speed up depending on the latency of the last round. */
+static void
+throttle_adjust(
+	struct throttle		*t)
+{
+	if (t->avg_ns > t->target_ns) {
+		if (t->limit > 1) {
+			t->limit /= 2;
+		} else if (t->iosz > t->min_iosz) {
+			t->iosz = max(t->iosz / 2, t->min_iosz);
+			t->iosz -= t->iosz % t->min_iosz;
+		} else {
+			t->delay_ns = max(t->delay_ns * 2,
+					(uint64_t)THROTTLE_MIN_DELAY);
+			t->delay_ns = min(t->delay_ns,
+					t->avg_ns * THROTTLE_MAX_DELAY_RATIO);
+			t->delay_ns = min(t->delay_ns,
+					(uint64_t)THROTTLE_MAX_DELAY);
+		}
+	} else if (t->avg_ns < t->target_ns * 3 / 4) {
+		if (t->delay_ns) {
+			t->delay_ns /= 2;
+			if (t->delay_ns < THROTTLE_MIN_DELAY)
+				t->delay_ns = 0;
+		} else if (t->iosz < t->max_iosz) {
+			t->iosz = min(t->iosz * 2, t->max_iosz);
+		} else if (t->limit < t->max_inflight) {
+			t->limit++;
+		}
+	}
+
+	dbg_printf("throttle %p: avg %lluus limit %u iosz %zu delay %lluus\n",
+			t, (unsigned long long)(t->avg_ns / NSEC_PER_USEC),
+			t->limit, t->iosz,
+			(unsigned long long)(t->delay_ns / NSEC_PER_USEC));
+}
+
+/*
+ * Wait until we're allowed to start an IO of @bytes bytes, and return the
+ * time it started in @start_ns.  If @nowait is set and too many IOs are
+ * already in flight, return EAGAIN instead of waiting for one to finish.
+ */
+int
+throttle_start(
+	struct throttle		*t,
+	uint64_t		bytes,
+	bool			nowait,
+	uint64_t		*start_ns)
+{
+	struct timespec		ts;
+	uint64_t		now;
+	uint64_t		wake;
+
+	pthread_mutex_lock(&t->lock);
+	while (t->inflight >= t->limit) {
+		if (nowait) {
+			pthread_mutex_unlock(&t->lock);
+			return EAGAIN;
+		}
+		pthread_cond_wait(&t->wait, &t->lock);
+	}
+	t->inflight++;
+
+	now = throttle_now();
+	wake = now + t->delay_ns;
+	if (t->bytes_per_sec && bytes) {
+		t->next_ns = max(t->next_ns, now);
+		wake = max(wake, t->next_ns);
+		t->next_ns += bytes * NSEC_PER_SEC / t->bytes_per_sec;
+	}
+	pthread_mutex_unlock(&t->lock);
+
+	if (wake > now) {
+		ts.tv_sec = wake / NSEC_PER_SEC;
+		ts.tv_nsec = wake % NSEC_PER_SEC;
+		while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts,
+				NULL) == EINTR)
+			;
+	}
+
+	*start_ns = throttle_now();
+	return 0;
+}
+
+/* Record the completion of an IO that started at @start_ns. */
+void
+throttle_done(
+	struct throttle		*t,
+	uint64_t		start_ns)
+{
+	uint64_t		sample = throttle_now() - start_ns;
+
+	pthread_mutex_lock(&t->lock);
+	t->inflight--;
+	pthread_cond_signal(&t->wait);
+
+	if (t->target_ns) {
+		t->avg_ns = t->avg_ns ? (t->avg_ns * 7 + sample) / 8 : sample;
+		if (++t->samples >= t->limit) {
+			throttle_adjust(t);
+			t->samples = 0;
+			pthread_cond_broadcast(&t->wait);
+		}
+	}
+	pthread_mutex_unlock(&t->lock);
+}
+
+/* How big should the next IO be? */
+size_t
+throttle_iosz(
+	struct throttle		*t)
+{
+	size_t			iosz;
+
+	pthread_mutex_lock(&t->lock);
+	iosz = t->iosz;
+	pthread_mutex_unlock(&t->lock);
+	return iosz;
+}
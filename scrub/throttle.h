@@ -0,0 +1,20 @@
+// SPDX-License-Identifier: GPL-2.0+
+/*
+ * Copyright (C) 2026 Oracle.  All Rights Reserved.
+ */
+#ifndef XFS_SCRUB_THROTTLE_H_
+#define XFS_SCRUB_THROTTLE_H_
+
+struct throttle;
+
+bool throttle_wanted(void);
+int throttle_alloc(unsigned int max_inflight, size_t min_iosz,
+		size_t max_iosz, struct throttle **tp);
+void throttle_free(struct throttle *t);
+
+int throttle_start(struct throttle *t, uint64_t bytes, bool nowait,
+		uint64_t *start_ns);
+void throttle_done(struct throttle *t, uint64_t start_ns);
+size_t throttle_iosz(struct throttle *t);
+
+#endif /* XFS_SCRUB_THROTTLE_H_ */
@@ -6,10 +6,12 @@
 #include "xfs.h"
 #include <stdint.h>
 #include <stdlib.h>
+#include <pthread.h>
 #include <dirent.h>
 #include <sys/types.h>
 #include <sys/statvfs.h>
 #include <strings.h>
+#include <unicode/uchar.h>
 #include <unicode/uclean.h>
 #include <unicode/ustring.h>
 #include <unicode/unorm2.h>
@@ -54,6 +56,19 @@
  * due to invisible control characters.
  *
  * In other words, skel = remove_invisible(nfd(remap_confusables(nfd(name)))).
+ *
+ * Most names are plain printable ASCII, which NFKC leaves alone and which
+ * contain nothing that name_entry_examine complains about.  The confusable
+ * mapping works one code point at a time, and none of the printable ASCII
+ * characters map to combining marks that the final NFD could reorder, so the
+ * skeleton of such a name is the skeletons of its characters strung together.
+ * We ask libicu for those once at load time and build the skeletons of ASCII
+ * names ourselves.  Note that the skeleton is not a case fold: "Makefile" and
+ * "makefile" are not confusable, but "l0g" and "I0g" are.
+ *
+ * Everything else goes through libicu, but the results are remembered in a
+ * small cache shared by all threads, so a name that shows up in many
+ * directories is only normalized and skeletonized once in a while.
  */
 
 struct name_entry {
@@ -69,6 +84,9 @@ struct name_entry {
 
 	xfs_ino_t		ino;
 
+	/* Name is all printable ASCII */
+	bool			ascii;
+
 	/* Raw dirent name */
 	size_t			namelen;
 	char			name[0];
@@ -88,6 +106,40 @@ struct unicrash {
 #define UNICRASH_SZ(nr)		(sizeof(struct unicrash) + \
 				 (nr * sizeof(struct name_entry *)))
 
+/* Skeletons of each printable ASCII character. */
+#define ASCII_SKEL_FIRST	(0x20)
+#define ASCII_SKEL_LAST		(0x7E)
+#define ASCII_SKEL_MAXLEN	(4)
+
+struct ascii_skel {
+	UChar			str[ASCII_SKEL_MAXLEN];
+	uint8_t			len;
+};
+
+static struct ascii_skel	ascii_skels[ASCII_SKEL_LAST - ASCII_SKEL_FIRST + 1];
+static bool			ascii_skels_ok;
+
+/* Remembered normalized forms and skeletons of non-ASCII names. */
+#define SKEL_CACHE_SLOTS	(4096)
+
+/* Don't bother caching names that normalize into something huge. */
+#define SKEL_CACHE_MAXLEN	(1024)
+
+struct skel_cache_entry {
+	size_t			namelen;
+	size_t			normstrlen;
+	size_t			skelstrlen;
+
+	/* normstr, then skelstr, then the raw name */
+	UChar			strs[0];
+};
+#define SKEL_CACHE_ENTRY_SZ(nl, nsl, ssl) \
+				(sizeof(struct skel_cache_entry) + \
+				 ((nsl) + (ssl)) * sizeof(UChar) + (nl))
+
+static pthread_mutex_t		skel_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct skel_cache_entry	*skel_cache[SKEL_CACHE_SLOTS];
+
 /* Things to complain about in Unicode naming. */
 
 /*
@@ -145,12 +197,192 @@ is_utf8_locale(void)
 	return answer;
 }
 
+/* Adapt the dirhash function from libxfs, avoid linking with libxfs. */
+
+#define rol32(x, y)		(((x) << (y)) | ((x) >> (32 - (y))))
+
 /*
- * Generate normalized form and skeleton of the name.  If this fails, just
- * forget everything and return false; this is an advisory checker.
+ * Implement a simple hash on a character string.
+ * Rotate the hash value by 7 bits, then XOR each character in.
+ * This is implemented with some source-level loop unrolling.
+ */
+static xfs_dahash_t
+unicrash_hashbytes(
+	const uint8_t		*name,
+	size_t			namelen)
+{
+	xfs_dahash_t		hash;
+
+	/*
+	 * Do four characters at a time as long as we can.
+	 */
+	for (hash = 0; namelen >= 4; namelen -= 4, name += 4)
+		hash = (name[0] << 21) ^ (name[1] << 14) ^ (name[2] << 7) ^
+		       (name[3] << 0) ^ rol32(hash, 7 * 4);
+
+	/*
+	 * Now do the rest of the characters.
+	 */
+	switch (namelen) {
+	case 3:
+		return (name[0] << 14) ^ (name[1] << 7) ^ (name[2] << 0) ^
+		       rol32(hash, 7 * 3);
+	case 2:
+		return (name[0] << 7) ^ (name[1] << 0) ^ rol32(hash, 7 * 2);
+	case 1:
+		return (name[0] << 0) ^ rol32(hash, 7 * 1);
+	default: /* case 0: */
+		return hash;
+	}
+}
+
+static xfs_dahash_t
+name_entry_hash(
+	struct name_entry	*entry)
+{
+	return unicrash_hashbytes((uint8_t *)entry->skelstr,
+			entry->skelstrlen * sizeof(UChar));
+}
+
+#define ONES64			(0x0101010101010101ULL)
+#define HIGHS64			(0x8080808080808080ULL)
+
+/* Does any byte in this word have a value less than @n (at most 128)? */
+static inline bool
+word_has_less(
+	uint64_t		w,
+	uint8_t			n)
+{
+	return ((w - ONES64 * n) & ~w & HIGHS64) != 0;
+}
+
+/* Does any byte in this word have the value @n? */
+static inline bool
+word_has_byte(
+	uint64_t		w,
+	uint8_t			n)
+{
+	return word_has_less(w ^ (ONES64 * n), 1);
+}
+
+/*
+ * Is this name entirely printable ASCII?  Names are usually short but
+ * machine-generated names often aren't, so check eight bytes at a time.
  */
 static bool
-name_entry_compute_checknames(
+name_is_printable_ascii(
+	const char		*name,
+	size_t			namelen)
+{
+	uint64_t		w;
+	size_t			i;
+
+	for (i = 0; i + sizeof(w) <= namelen; i += sizeof(w)) {
+		memcpy(&w, name + i, sizeof(w));
+		if ((w & HIGHS64) ||
+		    word_has_less(w, ASCII_SKEL_FIRST) ||
+		    word_has_byte(w, ASCII_SKEL_LAST + 1))
+			return false;
+	}
+
+	for (; i < namelen; i++) {
+		uint8_t		c = name[i];
+
+		if (c < ASCII_SKEL_FIRST || c > ASCII_SKEL_LAST)
+			return false;
+	}
+
+	return true;
+}
+
+/*
+ * Remove control/formatting characters from a skeleton.  Returns the new
+ * length of the skeleton.
+ */
+static int32_t
+skel_remove_invisible(
+	UChar			*skelstr,
+	int32_t			skelstrlen)
+{
+	UChar32			uchr;
+	int32_t			i, j;
+
+	for (i = 0, j = 0; i < skelstrlen; j = i) {
+		U16_NEXT_UNSAFE(skelstr, i, uchr);
+		if (!u_isIDIgnorable(uchr))
+			continue;
+		memmove(&skelstr[j], &skelstr[i],
+				(skelstrlen - i + 1) * sizeof(UChar));
+		skelstrlen -= (i - j);
+		i = j;
+	}
+
+	return skelstrlen;
+}
+
+/* Open a spoof checker that looks for everything. */
+static USpoofChecker *
+unicrash_spoof_open(void)
+{
+	USpoofChecker		*spoof;
+	UErrorCode		uerr = U_ZERO_ERROR;
+
+	spoof = uspoof_open(&uerr);
+	if (U_FAILURE(uerr))
+		return NULL;
+	uspoof_setChecks(spoof, USPOOF_ALL_CHECKS, &uerr);
+	if (U_FAILURE(uerr)) {
+		uspoof_close(spoof);
+		return NULL;
+	}
+	return spoof;
+}
+
+/*
+ * Generate normalized form and skeleton of a printable ASCII name without
+ * calling libicu.
+ */
+static bool
+name_entry_compute_ascii(
+	struct name_entry	*entry)
+{
+	const struct ascii_skel	*as;
+	UChar			*normstr;
+	UChar			*skelstr;
+	size_t			skelstrlen = 0;
+	size_t			i;
+
+	normstr = calloc(entry->namelen + 1, sizeof(UChar));
+	if (!normstr)
+		return false;
+	skelstr = calloc(entry->namelen * ASCII_SKEL_MAXLEN + 1, sizeof(UChar));
+	if (!skelstr) {
+		free(normstr);
+		return false;
+	}
+
+	for (i = 0; i < entry->namelen; i++) {
+		normstr[i] = (uint8_t)entry->name[i];
+		as = &ascii_skels[(uint8_t)entry->name[i] - ASCII_SKEL_FIRST];
+		memcpy(&skelstr[skelstrlen], as->str, as->len * sizeof(UChar));
+		skelstrlen += as->len;
+	}
+
+	entry->skelstr = skelstr;
+	entry->skelstrlen = skelstrlen;
+	entry->normstr = normstr;
+	entry->normstrlen = entry->namelen;
+	entry->ascii = true;
+	return true;
+}
+
+/*
+ * Generate normalized form and skeleton of the name with libicu.  If this
+ * fails, just forget everything and return false; this is an advisory
+ * checker.
+ */
+static bool
+name_entry_compute_icu(
 	struct unicrash		*uc,
 	struct name_entry	*entry)
 {
@@ -160,11 +392,16 @@ name_entry_compute_checknames(
 	int32_t			normstrlen;
 	int32_t			unistrlen;
 	int32_t			skelstrlen;
-	UChar32			uchr;
-	int32_t			i, j;
 
 	UErrorCode		uerr = U_ZERO_ERROR;
 
+	/* Only set up the spoof checker once we find a name that needs it. */
+	if (!uc->spoof) {
+		uc->spoof = unicrash_spoof_open();
+		if (!uc->spoof)
+			return false;
+	}
+
 	/* Convert bytestr to unistr for normalization */
 	u_strFromUTF8(NULL, 0, &unistrlen, entry->name, entry->namelen, &uerr);
 	if (uerr != U_BUFFER_OVERFLOW_ERROR)
@@ -206,19 +443,8 @@ name_entry_compute_checknames(
 	if (U_FAILURE(uerr))
 		goto out_skelstr;
 
-	/* Remove control/formatting characters from skeleton. */
-	for (i = 0, j = 0; i < skelstrlen; j = i) {
-		U16_NEXT_UNSAFE(skelstr, i, uchr);
-		if (!u_isIDIgnorable(uchr))
-			continue;
-		memmove(&skelstr[j], &skelstr[i],
-				(skelstrlen - i + 1) * sizeof(UChar));
-		skelstrlen -= (i - j);
-		i = j;
-	}
-
 	entry->skelstr = skelstr;
-	entry->skelstrlen = skelstrlen;
+	entry->skelstrlen = skel_remove_invisible(skelstr, skelstrlen);
 	entry->normstr = normstr;
 	entry->normstrlen = normstrlen;
 	free(unistr);
@@ -233,6 +459,110 @@ out_unistr:
 	return false;
 }
 
+static inline struct skel_cache_entry **
+skel_cache_slot(
+	struct name_entry	*entry)
+{
+	xfs_dahash_t		hash;
+
+	hash = unicrash_hashbytes((uint8_t *)entry->name, entry->namelen);
+	return &skel_cache[hash % SKEL_CACHE_SLOTS];
+}
+
+/* Have we already normalized and skeletonized this name? */
+static bool
+skel_cache_lookup(
+	struct name_entry	*entry)
+{
+	struct skel_cache_entry	*sce;
+	UChar			*normstr;
+	UChar			*skelstr;
+	const char		*name;
+	bool			ret = false;
+
+	pthread_mutex_lock(&skel_cache_lock);
+	sce = *skel_cache_slot(entry);
+	if (!sce || sce->namelen != entry->namelen)
+		goto out_unlock;
+	name = (const char *)&sce->strs[sce->normstrlen + sce->skelstrlen];
+	if (memcmp(name, entry->name, entry->namelen))
+		goto out_unlock;
+
+	normstr = calloc(sce->normstrlen + 1, sizeof(UChar));
+	if (!normstr)
+		goto out_unlock;
+	skelstr = calloc(sce->skelstrlen + 1, sizeof(UChar));
+	if (!skelstr) {
+		free(normstr);
+		goto out_unlock;
+	}
+	memcpy(normstr, sce->strs, sce->normstrlen * sizeof(UChar));
+	memcpy(skelstr, &sce->strs[sce->normstrlen],
+			sce->skelstrlen * sizeof(UChar));
+
+	entry->normstr = normstr;
+	entry->normstrlen = sce->normstrlen;
+	entry->skelstr = skelstr;
+	entry->skelstrlen = sce->skelstrlen;
+	ret = true;
+out_unlock:
+	pthread_mutex_unlock(&skel_cache_lock);
+	return ret;
+}
+
+/* Remember the normalized form and skeleton of this name. */
+static void
+skel_cache_insert(
+	struct name_entry	*entry)
+{
+	struct skel_cache_entry	**slot;
+	struct skel_cache_entry	*sce;
+	struct skel_cache_entry	*old;
+
+	if (entry->normstrlen + entry->skelstrlen > SKEL_CACHE_MAXLEN)
+		return;
+
+	sce = malloc(SKEL_CACHE_ENTRY_SZ(entry->namelen, entry->normstrlen,
+				entry->skelstrlen));
+	if (!sce)
+		return;
+	sce->namelen = entry->namelen;
+	sce->normstrlen = entry->normstrlen;
+	sce->skelstrlen = entry->skelstrlen;
+	memcpy(sce->strs, entry->normstr, entry->normstrlen * sizeof(UChar));
+	memcpy(&sce->strs[entry->normstrlen], entry->skelstr,
+			entry->skelstrlen * sizeof(UChar));
+	memcpy(&sce->strs[entry->normstrlen + entry->skelstrlen], entry->name,
+			entry->namelen);
+
+	slot = skel_cache_slot(entry);
+	pthread_mutex_lock(&skel_cache_lock);
+	old = *slot;
+	*slot = sce;
+	pthread_mutex_unlock(&skel_cache_lock);
+	free(old);
+}
+
+/* Generate normalized form and skeleton of the name. */
+static bool
+name_entry_compute_checknames(
+	struct unicrash		*uc,
+	struct name_entry	*entry)
+{
+	if (ascii_skels_ok &&
+	    name_is_printable_ascii(entry->name, entry->namelen))
+		return name_entry_compute_ascii(entry);
+
+	if (skel_cache_lookup(entry))
+		return true;
+
+	if (!name_entry_compute_icu(uc, entry))
+		return false;
+
+	skel_cache_insert(entry);
+	return true;
+}
+
 /* Create a new name entry, returns false if we could not succeed. */
 static bool
 name_entry_create(
@@ -276,49 +606,6 @@ name_entry_free(
 	free(entry);
 }
 
-/* Adapt the dirhash function from libxfs, avoid linking with libxfs. */
-
-#define rol32(x, y)		(((x) << (y)) | ((x) >> (32 - (y))))
-
-/*
- * Implement a simple hash on a character string.
- * Rotate the hash value by 7 bits, then XOR each character in.
- * This is implemented with some source-level loop unrolling.
- */
-static xfs_dahash_t
-name_entry_hash(
-	struct name_entry	*entry)
-{
-	uint8_t			*name;
-	size_t			namelen;
-	xfs_dahash_t		hash;
-
-	name = (uint8_t *)entry->skelstr;
-	namelen = entry->skelstrlen * sizeof(UChar);
-
-	/*
-	 * Do four characters at a time as long as we can.
-	 */
-	for (hash = 0; namelen >= 4; namelen -= 4, name += 4)
-		hash = (name[0] << 21) ^ (name[1] << 14) ^ (name[2] << 7) ^
-		       (name[3] << 0) ^ rol32(hash, 7 * 4);
-
-	/*
-	 * Now do the rest of the characters.
-	 */
-	switch (namelen) {
-	case 3:
-		return (name[0] << 14) ^ (name[1] << 7) ^ (name[2] << 0) ^
-		       rol32(hash, 7 * 3);
-	case 2:
-		return (name[0] << 7) ^ (name[1] << 0) ^ rol32(hash, 7 * 2);
-	case 1:
-		return (name[0] << 0) ^ rol32(hash, 7 * 1);
-	default: /* case 0: */
-		return hash;
-	}
-}
-
 /*
  * Check a name for suspicious elements that have appeared in filename
  * spoofing attacks.  This includes names that mixed directions or contain
@@ -410,18 +697,10 @@ unicrash_init(
 	p->normalizer = unorm2_getNFKCInstance(&uerr);
 	if (U_FAILURE(uerr))
 		goto out_free;
-	p->spoof = uspoof_open(&uerr);
-	if (U_FAILURE(uerr))
-		goto out_free;
-	uspoof_setChecks(p->spoof, USPOOF_ALL_CHECKS, &uerr);
-	if (U_FAILURE(uerr))
-		goto out_spoof;
 	p->is_only_root_writeable = is_only_root_writeable;
 	*ucp = p;
 
 	return 0;
-out_spoof:
-	uspoof_close(p->spoof);
 out_free:
 	free(p);
 	return ENOMEM;
@@ -489,7 +768,8 @@ unicrash_free(
 	if (!uc)
 		return;
 
-	uspoof_close(uc->spoof);
+	if (uc->spoof)
+		uspoof_close(uc->spoof);
 	for (i = 0; i < uc->nr_buckets; i++) {
 		for (ne = uc->buckets[i]; ne != NULL; ne = x) {
 			x = ne->next;
@@ -680,7 +960,9 @@ __unicrash_check_name(
 	if (!name_entry_create(uc, name, ino, &new_entry))
 		return 0;
 
-	name_entry_examine(new_entry, &badflags);
+	/* Printable ASCII has nothing for examine to complain about. */
+	if (!new_entry->ascii)
+		name_entry_examine(new_entry, &badflags);
 	unicrash_add(uc, new_entry, &badflags, &dup_entry);
 	if (badflags)
 		unicrash_complain(uc, dsc, namedescr, new_entry, badflags,
@@ -738,6 +1020,52 @@ unicrash_check_fs_label(
 			label, 0);
 }
 
+/*
+ * Compute the skeleton of each printable ASCII character.  If any of them
+ * can't be strung together with the others, leave the fast path turned off.
+ */
+static void
+ascii_skels_init(void)
+{
+	UChar			skelstr[ASCII_SKEL_MAXLEN + 1];
+	USpoofChecker		*spoof;
+	int32_t			skelstrlen;
+	int32_t			i;
+	UChar			c;
+
+	spoof = unicrash_spoof_open();
+	if (!spoof)
+		return;
+
+	for (c = ASCII_SKEL_FIRST; c <= ASCII_SKEL_LAST; c++) {
+		struct ascii_skel	*as = &ascii_skels[c - ASCII_SKEL_FIRST];
+		UErrorCode		uerr = U_ZERO_ERROR;
+
+		skelstrlen = uspoof_getSkeleton(spoof, 0, &c, 1, skelstr,
+				ASCII_SKEL_MAXLEN + 1, &uerr);
+		if (U_FAILURE(uerr) || skelstrlen > ASCII_SKEL_MAXLEN)
+			goto out_spoof;
+		skelstrlen = skel_remove_invisible(skelstr, skelstrlen);
+
+		/*
+		 * Surrogates and combining marks could interact with the
+		 * characters next to them.
+		 */
+		for (i = 0; i < skelstrlen; i++) {
+			if (U16_IS_SURROGATE(skelstr[i]) ||
+			    u_getCombiningClass(skelstr[i]) != 0)
+				goto out_spoof;
+		}
+
+		memcpy(as->str, skelstr, skelstrlen * sizeof(UChar));
+		as->len = skelstrlen;
+	}
+
+	ascii_skels_ok = true;
+out_spoof:
+	uspoof_close(spoof);
+}
+
 /* Load libicu and initialize it. */
 bool
 unicrash_load(void)
@@ -745,12 +1073,22 @@ unicrash_load(void)
 	UErrorCode		uerr = U_ZERO_ERROR;
 
 	u_init(&uerr);
-	return U_FAILURE(uerr);
+	if (U_FAILURE(uerr))
+		return true;
+
+	ascii_skels_init();
+	return false;
 }
 
 /* Unload libicu once we're done with it. */
 void
 unicrash_unload(void)
 {
+	unsigned int		i;
+
+	for (i = 0; i < SKEL_CACHE_SLOTS; i++) {
+		free(skel_cache[i]);
+		skel_cache[i] = NULL;
+	}
 	u_cleanup();
 }
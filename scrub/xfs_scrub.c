@@ -135,6 +135,24 @@ unsigned int			bg_mode;
 /* Number of threads we're allowed to use. */
 unsigned int			force_nr_threads;
 
+/* Number of media verification reads to keep in flight per disk. */
+unsigned int			verify_queue_depth;
+
+/* Keep IO latency under this many milliseconds; zero means no target. */
+unsigned int			throttle_latency_ms;
+
+/* Don't read more than this many MiB per second; zero means no limit. */
+unsigned int			throttle_bandwidth_mb;
+
+/* Percentage of the allocated space to verify per run; zero means all. */
+unsigned int			verify_fraction;
+
+/* Seconds of media verification per run; zero means no limit. */
+unsigned int			verify_budget;
+
+/* Where to remember how far the last partial media scan got. */
+char				*verify_state_file;
+
 /* Verbosity; higher values print more information. */
 bool				verbose;
 
@@ -176,6 +194,7 @@ usage(void)
 	fprintf(stderr, _("  -k           Do not FITRIM the free space.\n"));
 	fprintf(stderr, _("  -m path      Path to /etc/mtab.\n"));
 	fprintf(stderr, _("  -n           Dry run.  Do not modify anything.\n"));
+	fprintf(stderr, _("  -o subopts   Tuning options, refer to man page.\n"));
 	fprintf(stderr, _("  -T           Display timing/usage information.\n"));
 	fprintf(stderr, _("  -v           Verbose output.\n"));
 	fprintf(stderr, _("  -V           Print version.\n"));
@@ -184,6 +203,119 @@ usage(void)
 	exit(SCRUB_RET_SYNTAX);
 }
 
+/*
+ * -o: tuning options
+ */
+enum o_opt_nums {
+	VERIFY_DEPTH = 0,
+	LATENCY_TARGET,
+	BANDWIDTH,
+	VERIFY_FRACTION,
+	VERIFY_BUDGET,
+	VERIFY_STATE,
+	O_MAX_OPTS,
+};
+
+static char *o_opts[] = {
+	[VERIFY_DEPTH]		= "verify_depth",
+	[LATENCY_TARGET]	= "latency_target",
+	[BANDWIDTH]		= "bandwidth",
+	[VERIFY_FRACTION]	= "verify_fraction",
+	[VERIFY_BUDGET]		= "verify_budget",
+	[VERIFY_STATE]		= "verify_state",
+	[O_MAX_OPTS]		= NULL,
+};
+
+static void
+parse_subopts(
+	char			*opts)
+{
+	char			*val;
+
+	while (*opts != '\0') {
+		switch (getsubopt(&opts, o_opts, &val)) {
+		case VERIFY_DEPTH:
+			if (!val) {
+				fprintf(stderr,
+	_("-o verify_depth requires a parameter\n"));
+				usage();
+			}
+			verify_queue_depth = cvt_u32(val, 10);
+			if (errno || verify_queue_depth == 0) {
+				fprintf(stderr,
+	_("Bad verify queue depth \"%s\".\n"), val);
+				usage();
+			}
+			break;
+		case LATENCY_TARGET:
+			if (!val) {
+				fprintf(stderr,
+	_("-o latency_target requires a parameter\n"));
+				usage();
+			}
+			throttle_latency_ms = cvt_u32(val, 10);
+			if (errno || throttle_latency_ms == 0) {
+				fprintf(stderr,
+	_("Bad latency target \"%s\".\n"), val);
+				usage();
+			}
+			break;
+		case BANDWIDTH:
+			if (!val) {
+				fprintf(stderr,
+	_("-o bandwidth requires a parameter\n"));
+				usage();
+			}
+			throttle_bandwidth_mb = cvt_u32(val, 10);
+			if (errno || throttle_bandwidth_mb == 0) {
+				fprintf(stderr,
+	_("Bad bandwidth limit \"%s\".\n"), val);
+				usage();
+			}
+			break;
+		case VERIFY_FRACTION:
+			if (!val) {
+				fprintf(stderr,
+	_("-o verify_fraction requires a parameter\n"));
+				usage();
+			}
+			verify_fraction = cvt_u32(val, 10);
+			if (errno || verify_fraction == 0 ||
+			    verify_fraction > 100) {
+				fprintf(stderr,
+	_("Bad verify fraction \"%s\".\n"), val);
+				usage();
+			}
+			break;
+		case VERIFY_BUDGET:
+			if (!val) {
+				fprintf(stderr,
+	_("-o verify_budget requires a parameter\n"));
+				usage();
+			}
+			verify_budget = cvt_u32(val, 10);
+			if (errno || verify_budget == 0) {
+				fprintf(stderr,
+	_("Bad verify time budget \"%s\".\n"), val);
+				usage();
+			}
+			break;
+		case VERIFY_STATE:
+			if (!val || !*val) {
+				fprintf(stderr,
+	_("-o verify_state requires a parameter\n"));
+				usage();
+			}
+			verify_state_file = val;
+			break;
+		default:
+			fprintf(stderr, _("Unknown suboption \"%s\".\n"),
+					val);
+			usage();
+		}
+	}
+}
+
 #ifndef RUSAGE_BOTH
 # define RUSAGE_BOTH		(-2)
 #endif
@@ -632,7 +764,7 @@ main(
 	pthread_mutex_init(&ctx.lock, NULL);
 	ctx.mode = SCRUB_MODE_REPAIR;
 	ctx.error_action = ERRORS_CONTINUE;
-	while ((c = getopt(argc, argv, "a:bC:de:km:nTvxV")) != EOF) {
+	while ((c = getopt(argc, argv, "a:bC:de:km:no:TvxV")) != EOF) {
 		switch (c) {
 		case 'a':
 			ctx.max_errors = cvt_u64(optarg, 10);
@@ -682,6 +814,9 @@ main(
 		case 'n':
 			ctx.mode = SCRUB_MODE_DRY_RUN;
 			break;
+		case 'o':
+			parse_subopts(optarg);
+			break;
 		case 'T':
 			display_rusage = true;
 			break;
@@ -726,6 +861,13 @@ main(
 	if (optind != argc - 1)
 		usage();
 
+	/* Partial media scans have to remember where they stopped. */
+	if ((verify_fraction || verify_budget) && !verify_state_file) {
+		fprintf(stderr,
+	_("-o verify_fraction and verify_budget require -o verify_state.\n"));
+		usage();
+	}
+
 	ctx.mntpoint = argv[optind];
 
 	stdout_isatty = isatty(STDOUT_FILENO);
@@ -14,6 +14,12 @@ extern char *progname;
 
 extern unsigned int		force_nr_threads;
 extern unsigned int		bg_mode;
+extern unsigned int		verify_queue_depth;
+extern unsigned int		throttle_latency_ms;
+extern unsigned int		throttle_bandwidth_mb;
+extern unsigned int		verify_fraction;
+extern unsigned int		verify_budget;
+extern char			*verify_state_file;
 extern unsigned int		debug;
 extern bool			verbose;
 extern long			page_size;
@@ -60,6 +66,9 @@ struct scrub_ctx {
 	/* Number of threads for metadata scrubbing */
 	unsigned int		nr_io_threads;
 
+	/* Latency throttle for metadata scrub calls, if requested */
+	struct throttle		*meta_throttle;
+
 	/* XFS specific geometry */
 	struct fs_path		fsinfo;
 	void			*fshandle;